@@ -107,7 +107,7 @@ i7_blob_set_progress(I7Blob *self, double fraction, GCancellable *cancel_target)
 	gtk_stack_set_visible_child_name(GTK_STACK(self), PAGE_PROGRESS);
 
 	if (cancel_target != NULL) {
-		self->cancel_target = g_object_ref(cancel_target);
+		g_set_object(&self->cancel_target, cancel_target);
 		gtk_widget_show(GTK_WIDGET(self->cancel));
 		gtk_widget_set_sensitive(GTK_WIDGET(self->cancel), TRUE);
 	} else {
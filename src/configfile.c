@@ -13,6 +13,7 @@
 
 #include "app.h"
 #include "configfile.h"
+#include "elastic.h"
 #include "story.h"
 
 /* ---------  Events from now on:   ------------ */
@@ -22,6 +23,7 @@ on_config_font_set_changed(GSettings *settings, const char *key)
 {
 	/* update application to reflect new value */
 	I7App *theapp = I7_APP(g_application_get_default());
+	elastic_clear_width_cache();
 	i7_app_update_css(theapp);
 	GList *windows = gtk_application_get_windows(GTK_APPLICATION(theapp));
 	for (GList *iter = windows; iter != NULL; iter = iter->next) {
@@ -37,6 +39,7 @@ on_config_custom_font_changed(GSettings *settings, const char *key)
 	I7App *theapp = I7_APP(g_application_get_default());
 	GSettings *prefs = i7_app_get_prefs(theapp);
 	if(g_settings_get_enum(prefs, PREFS_FONT_SET) == FONT_CUSTOM) {
+		elastic_clear_width_cache();
 		i7_app_update_css(theapp);
 		GList *windows = gtk_application_get_windows(GTK_APPLICATION(theapp));
 		for (GList *iter = windows; iter != NULL; iter = iter->next) {
@@ -51,6 +54,7 @@ on_config_docs_font_size_changed(GSettings *settings, const char *key)
 {
 	/* update application to reflect new value */
 	I7App *theapp = I7_APP(g_application_get_default());
+	elastic_clear_width_cache();
 	i7_app_update_css(theapp);
 	GList *windows = gtk_application_get_windows(GTK_APPLICATION(theapp));
 	for (GList *iter = windows; iter != NULL; iter = iter->next) {
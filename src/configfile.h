@@ -80,6 +80,10 @@ typedef enum {
 
 #define PREFS_SKEIN_HORIZONTAL_SPACING  "horizontal-spacing"
 #define PREFS_SKEIN_VERTICAL_SPACING    "vertical-spacing"
+#define PREFS_SKEIN_VIRTUALIZED_RENDERING "virtualized-rendering"
+#define PREFS_SKEIN_BINARY_CACHE        "binary-cache"
+#define PREFS_SKEIN_REPLAY_SAVE_STATES  "replay-save-states"
+#define PREFS_SKEIN_REPLAY_JOBS         "replay-jobs"
 
 #define PREFS_SYSTEM_UI_FONT        "font-name"
 #define PREFS_SYSTEM_DOCUMENT_FONT  "document-font-name"
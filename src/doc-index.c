@@ -0,0 +1,374 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * SPDX-FileCopyrightText: Philip Chimento <philip.chimento@gmail.com>
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <gio/gio.h>
+#include <glib.h>
+
+#include "doc-index.h"
+
+/* An inverted index of the documentation text, generated at build time by
+ src/generate-doc-index.py and compiled into the resources uncompressed, so
+ that it is used in place without parsing or copying.
+
+ All integers are 32-bit little-endian. The file starts with a header:
+   "I7DI", version, number of docs, number of terms, and the offsets of the
+   doc table, term table, postings and string pool.
+ Doc table: for each doc, flags (1 = example, 2 = recipe book) and the string
+   offsets of its page basename, anchor, section, title, sort string, example
+   title and body text, followed by the body's length in characters.
+ Term table: for each term, sorted by bytes, the string offset of the term,
+   the offset of its postings, and the number of postings.
+ Postings: for each doc the term occurs in, in increasing order, the
+   difference from the previous doc number and the character offset of the
+   term's first occurrence in the body, both as LEB128 varints.
+ String pool: nul-terminated UTF-8 strings; 0xffffffff means no string.
+
+ Terms are runs of ASCII letters and digits, lowercased. */
+
+#define DOC_INDEX_MAGIC "I7DI"
+#define DOC_INDEX_VERSION 1
+#define HEADER_SIZE 32
+#define DOC_RECORD_SIZE (9 * 4)
+#define TERM_RECORD_SIZE (3 * 4)
+#define NO_STRING 0xffffffff
+
+enum {
+	DOC_FLAG_EXAMPLE = 1 << 0,
+	DOC_FLAG_RECIPE_BOOK = 1 << 1,
+};
+
+struct _I7DocIndex {
+	GBytes *bytes;
+	unsigned n_docs;
+	unsigned n_terms;
+	const uint8_t *docs;
+	const uint8_t *terms;
+	const uint8_t *postings;
+	const uint8_t *postings_end;
+	const char *strings;
+	size_t strings_size;
+};
+
+static uint32_t
+read_u32(const uint8_t *data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return GUINT32_FROM_LE(value);
+}
+
+static const char *
+get_string(I7DocIndex *self, uint32_t offset)
+{
+	if(offset == NO_STRING)
+		return NULL;
+	return self->strings + offset;
+}
+
+static const char *
+get_term(I7DocIndex *self, unsigned term)
+{
+	return get_string(self, read_u32(self->terms + term * TERM_RECORD_SIZE));
+}
+
+static bool
+string_offset_is_valid(I7DocIndex *self, uint32_t offset)
+{
+	return offset == NO_STRING || offset < self->strings_size;
+}
+
+static gboolean
+invalid_data(GError **error, const char *message)
+{
+	g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		"Corrupt documentation index: %s", message);
+	return FALSE;
+}
+
+/* Check everything that is later read without bounds checks, except for the
+ postings, which are checked as they are decoded */
+static gboolean
+validate(I7DocIndex *self, const uint8_t *data, size_t size, GError **error)
+{
+	if(size < HEADER_SIZE || memcmp(data, DOC_INDEX_MAGIC, 4) != 0)
+		return invalid_data(error, "bad header");
+	if(read_u32(data + 4) != DOC_INDEX_VERSION)
+		return invalid_data(error, "unsupported version");
+
+	self->n_docs = read_u32(data + 8);
+	self->n_terms = read_u32(data + 12);
+	uint32_t docs_offset = read_u32(data + 16);
+	uint32_t terms_offset = read_u32(data + 20);
+	uint32_t postings_offset = read_u32(data + 24);
+	uint32_t strings_offset = read_u32(data + 28);
+	if(docs_offset < HEADER_SIZE
+		|| (uint64_t)docs_offset + (uint64_t)self->n_docs * DOC_RECORD_SIZE > terms_offset
+		|| (uint64_t)terms_offset + (uint64_t)self->n_terms * TERM_RECORD_SIZE > postings_offset
+		|| postings_offset > strings_offset
+		|| strings_offset > size)
+		return invalid_data(error, "bad table offsets");
+
+	self->docs = data + docs_offset;
+	self->terms = data + terms_offset;
+	self->postings = data + postings_offset;
+	self->postings_end = data + strings_offset;
+	self->strings = (const char *)(data + strings_offset);
+	self->strings_size = size - strings_offset;
+	if(self->strings_size > 0 && self->strings[self->strings_size - 1] != '\0')
+		return invalid_data(error, "unterminated string");
+
+	for(unsigned doc = 0; doc < self->n_docs; doc++) {
+		const uint8_t *record = self->docs + doc * DOC_RECORD_SIZE;
+		/* Seven strings after the flags; file and body are required */
+		for(unsigned field = 1; field <= 7; field++) {
+			if(!string_offset_is_valid(self, read_u32(record + field * 4)))
+				return invalid_data(error, "bad string offset");
+		}
+		if(read_u32(record + 4) == NO_STRING || read_u32(record + 28) == NO_STRING)
+			return invalid_data(error, "missing page or text");
+	}
+	for(unsigned term = 0; term < self->n_terms; term++) {
+		const uint8_t *record = self->terms + term * TERM_RECORD_SIZE;
+		if(read_u32(record) == NO_STRING || !string_offset_is_valid(self, read_u32(record)))
+			return invalid_data(error, "bad term");
+		if(read_u32(record + 4) > (size_t)(self->postings_end - self->postings))
+			return invalid_data(error, "bad postings offset");
+	}
+	return TRUE;
+}
+
+/*
+ * i7_doc_index_new:
+ * @bytes: the contents of an index generated by generate-doc-index.py
+ * @error: return location for an error
+ *
+ * Returns: (transfer full): an index that reads @bytes in place, or %NULL if
+ * @bytes isn't a valid index
+ */
+I7DocIndex *
+i7_doc_index_new(GBytes *bytes, GError **error)
+{
+	I7DocIndex *self = g_new0(I7DocIndex, 1);
+	self->bytes = g_bytes_ref(bytes);
+
+	size_t size;
+	const uint8_t *data = g_bytes_get_data(bytes, &size);
+	if(!validate(self, data, size, error)) {
+		i7_doc_index_free(self);
+		return NULL;
+	}
+	return self;
+}
+
+/*
+ * i7_doc_index_new_from_resource:
+ * @path: resource path of the index
+ * @error: return location for an error
+ *
+ * The resource must not be compressed, otherwise it is inflated into memory
+ * instead of being used in place from the program's data.
+ *
+ * Returns: (transfer full): an index, or %NULL on error
+ */
+I7DocIndex *
+i7_doc_index_new_from_resource(const char *path, GError **error)
+{
+	g_autoptr(GBytes) bytes = g_resources_lookup_data(path, G_RESOURCE_LOOKUP_FLAGS_NONE, error);
+	if(!bytes)
+		return NULL;
+	return i7_doc_index_new(bytes, error);
+}
+
+void
+i7_doc_index_free(I7DocIndex *self)
+{
+	g_bytes_unref(self->bytes);
+	g_free(self);
+}
+
+unsigned
+i7_doc_index_get_n_docs(I7DocIndex *self)
+{
+	return self->n_docs;
+}
+
+/* Fills in @text with the strings of @doc, which remain valid as long as the
+ index does */
+void
+i7_doc_index_get_doc(I7DocIndex *self, unsigned doc, I7DocText *text)
+{
+	g_return_if_fail(doc < self->n_docs);
+
+	const uint8_t *record = self->docs + doc * DOC_RECORD_SIZE;
+	uint32_t flags = read_u32(record);
+	text->is_example = flags & DOC_FLAG_EXAMPLE;
+	text->is_recipebook = flags & DOC_FLAG_RECIPE_BOOK;
+	text->file = get_string(self, read_u32(record + 4));
+	text->anchor = get_string(self, read_u32(record + 8));
+	text->section = get_string(self, read_u32(record + 12));
+	text->title = get_string(self, read_u32(record + 16));
+	text->sort = get_string(self, read_u32(record + 20));
+	text->example_title = get_string(self, read_u32(record + 24));
+	text->body = get_string(self, read_u32(record + 28));
+}
+
+static bool
+read_varint(const uint8_t **p, const uint8_t *end, unsigned *value)
+{
+	*value = 0;
+	for(unsigned shift = 0; shift < 32 && *p < end; shift += 7) {
+		uint8_t byte = *(*p)++;
+		*value |= (unsigned)(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+/* Lowers @offsets[doc] to the first occurrence of @term in each doc it occurs
+ in */
+static void
+add_postings(I7DocIndex *self, unsigned term, unsigned *offsets)
+{
+	const uint8_t *record = self->terms + term * TERM_RECORD_SIZE;
+	const uint8_t *p = self->postings + read_u32(record + 4);
+	unsigned n_postings = read_u32(record + 8);
+
+	unsigned doc = 0;
+	for(unsigned ix = 0; ix < n_postings; ix++) {
+		unsigned delta, offset;
+		if(!read_varint(&p, self->postings_end, &delta) || !read_varint(&p, self->postings_end, &offset)) {
+			g_warning("Corrupt postings for documentation search term '%s'", get_term(self, term));
+			return;
+		}
+		doc += delta;
+		if(doc >= self->n_docs) {
+			g_warning("Corrupt postings for documentation search term '%s'", get_term(self, term));
+			return;
+		}
+		offsets[doc] = MIN(offsets[doc], offset);
+	}
+}
+
+/* Returns the number of the first term not less than @token */
+static unsigned
+find_term(I7DocIndex *self, const char *token)
+{
+	unsigned lo = 0, hi = self->n_terms;
+	while(lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if(strcmp(get_term(self, mid), token) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Sets @offsets[doc] to where the first term that could contain @token occurs
+ in each doc, or G_MAXUINT if there is none. If @starts_term or @ends_term,
+ then the token is known to be at the start or end of a term. */
+static void
+find_token(I7DocIndex *self, const char *token, bool starts_term, bool ends_term, unsigned *offsets)
+{
+	for(unsigned doc = 0; doc < self->n_docs; doc++)
+		offsets[doc] = G_MAXUINT;
+
+	if(starts_term) {
+		/* Terms starting with the token are contiguous in sorted order */
+		for(unsigned term = find_term(self, token); term < self->n_terms; term++) {
+			const char *candidate = get_term(self, term);
+			if(!g_str_has_prefix(candidate, token))
+				break;
+			if(!ends_term || strcmp(candidate, token) == 0)
+				add_postings(self, term, offsets);
+			if(ends_term)
+				break;
+		}
+		return;
+	}
+
+	for(unsigned term = 0; term < self->n_terms; term++) {
+		const char *candidate = get_term(self, term);
+		if(ends_term? g_str_has_suffix(candidate, token) : strstr(candidate, token) != NULL)
+			add_postings(self, term, offsets);
+	}
+}
+
+/*
+ * i7_doc_index_find_candidates:
+ * @self: the index
+ * @search_text: the text being searched for
+ *
+ * Looks up which docs can contain @search_text, in any of the search
+ * algorithms and whether or not case is ignored; the caller still has to
+ * search the candidates' text. Every run of ASCII letters and digits in
+ * @search_text must occur within a term of a candidate.
+ *
+ * Returns: (transfer full) (element-type I7DocCandidate): the candidates, in
+ * order of their doc numbers
+ */
+GArray *
+i7_doc_index_find_candidates(I7DocIndex *self, const char *search_text)
+{
+	GArray *retval = g_array_new(FALSE, FALSE, sizeof(I7DocCandidate));
+	g_autofree unsigned *start_offsets = NULL;
+	g_autofree unsigned *token_offsets = g_new(unsigned, self->n_docs);
+
+	for(const char *p = search_text; *p != '\0'; ) {
+		if(!g_ascii_isalnum(*p)) {
+			p++;
+			continue;
+		}
+		const char *token_start = p;
+		while(g_ascii_isalnum(*p))
+			p++;
+		g_autofree char *token = g_ascii_strdown(token_start, p - token_start);
+
+		/* An ASCII character next to the token in the search text can't be
+		part of the same term. Other characters could match a letter when
+		ignoring case, so they prove nothing. */
+		bool starts_term = token_start > search_text && (unsigned char)token_start[-1] < 0x80;
+		bool ends_term = *p != '\0' && (unsigned char)*p < 0x80;
+		find_token(self, token, starts_term, ends_term, token_offsets);
+
+		if(start_offsets == NULL) {
+			/* A match starts this many characters before its first token,
+			unless there are non-ASCII characters in between, whose matches
+			may have a different length when ignoring case */
+			unsigned before = token_start - search_text;
+			for(const char *q = search_text; q < token_start; q++) {
+				if((unsigned char)*q >= 0x80)
+					before = G_MAXUINT;
+			}
+			start_offsets = g_steal_pointer(&token_offsets);
+			token_offsets = g_new(unsigned, self->n_docs);
+			for(unsigned doc = 0; doc < self->n_docs; doc++) {
+				if(start_offsets[doc] != G_MAXUINT)
+					start_offsets[doc] = start_offsets[doc] > before? start_offsets[doc] - before : 0;
+			}
+		} else {
+			for(unsigned doc = 0; doc < self->n_docs; doc++) {
+				if(token_offsets[doc] == G_MAXUINT)
+					start_offsets[doc] = G_MAXUINT;
+			}
+		}
+	}
+
+	for(unsigned doc = 0; doc < self->n_docs; doc++) {
+		/* With no tokens to look up, every doc is a candidate */
+		if(start_offsets && start_offsets[doc] == G_MAXUINT)
+			continue;
+		I7DocCandidate candidate = { doc, start_offsets? start_offsets[doc] : 0 };
+		g_array_append_val(retval, candidate);
+	}
+	return retval;
+}
@@ -0,0 +1,44 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * SPDX-FileCopyrightText: Philip Chimento <philip.chimento@gmail.com>
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include <stdbool.h>
+
+#include <glib.h>
+
+typedef struct _I7DocIndex I7DocIndex;
+
+/* One documentation page, or an example or code section within one. The
+ strings point into the index and are %NULL if not present. */
+typedef struct {
+	bool is_example;
+	bool is_recipebook;
+	const char *file; /* basename of the page */
+	const char *anchor;
+	const char *section;
+	const char *title;
+	const char *sort;
+	const char *example_title;
+	const char *body;
+} I7DocText;
+
+/* A documentation text that may contain a search string. A match can't start
+ before @start_offset, counted in characters. */
+typedef struct {
+	unsigned doc;
+	unsigned start_offset;
+} I7DocCandidate;
+
+I7DocIndex *i7_doc_index_new(GBytes *bytes, GError **error);
+I7DocIndex *i7_doc_index_new_from_resource(const char *path, GError **error);
+void i7_doc_index_free(I7DocIndex *self);
+unsigned i7_doc_index_get_n_docs(I7DocIndex *self);
+void i7_doc_index_get_doc(I7DocIndex *self, unsigned doc, I7DocText *text);
+GArray *i7_doc_index_find_candidates(I7DocIndex *self, const char *search_text);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(I7DocIndex, i7_doc_index_free)
@@ -33,6 +33,17 @@ enum {
 	PROP_FILE,
 };
 
+/* A section heading recognized in the source, one per row below the title in
+ the tree of headings */
+typedef struct {
+	int line; /* counted from 0 */
+	I7Heading depth;
+	char *text;
+	char *secnum;
+	char *sectitle;
+	GtkTreeIter iter; /* tree store iters persist while the row exists */
+} HeadingEntry;
+
 typedef struct {
 	/* The file this document refers to */
 	GFile *file;
@@ -48,6 +59,14 @@ typedef struct {
 	GtkTreeStore *headings;
 	GtkTreeModel *filter;
 	GtkTreePath *current_heading;
+	/* The headings in source order, so that an edit only has to rescan the
+	lines around it; and the range of lines waiting to be rescanned */
+	GArray *heading_index;
+	GRegex *heading_regex;
+	int indexed_lines;
+	GtkTextMark *headings_dirty_start;
+	GtkTextMark *headings_dirty_end;
+	unsigned headings_update_source;
 	/* App notification */
 	I7Toast *toast;
 } I7DocumentPrivate;
@@ -95,6 +114,14 @@ on_findbar_maybe_show_entire_source(I7SearchBar *search_bar, GtkTextIter *start,
 		i7_document_show_entire_source(self);
 }
 
+static void
+heading_entry_clear(HeadingEntry *entry)
+{
+	g_free(entry->text);
+	g_free(entry->secnum);
+	g_free(entry->sectitle);
+}
+
 static gboolean
 filter_depth(GtkTreeModel *model, GtkTreeIter *iter, I7Document *self)
 {
@@ -244,6 +271,11 @@ i7_document_init(I7Document *self)
 	g_object_ref(priv->filter);
 	gtk_tree_model_filter_set_visible_func(GTK_TREE_MODEL_FILTER(priv->filter), (GtkTreeModelFilterVisibleFunc)filter_depth, self, NULL);
 	priv->current_heading = gtk_tree_path_new_first();
+	priv->heading_index = g_array_new(FALSE, FALSE, sizeof(HeadingEntry));
+	g_array_set_clear_func(priv->heading_index, (GDestroyNotify)heading_entry_clear);
+	priv->heading_regex = g_regex_new("^(?P<level>volume|book|part|chapter|section)\\s+(?P<secnum>.*?)(\\s+-\\s+(?P<sectitle>.*))?$",
+		G_REGEX_OPTIMIZE | G_REGEX_CASELESS, 0, /* ignore error */ NULL);
+	g_assert(priv->heading_regex && "Failed to compile section heading regex");
 	priv->modified = FALSE;
 
 	create_document_actions(self);
@@ -302,6 +334,16 @@ i7_document_get_property(GObject *object, unsigned prop_id, GValue *value, GPara
 	}
 }
 
+static void
+i7_document_dispose(GObject *object)
+{
+	I7DocumentPrivate *priv = i7_document_get_instance_private(I7_DOCUMENT(object));
+
+	g_clear_handle_id(&priv->headings_update_source, g_source_remove);
+
+	G_OBJECT_CLASS(i7_document_parent_class)->dispose(object);
+}
+
 static void
 i7_document_finalize(GObject *object)
 {
@@ -320,6 +362,8 @@ i7_document_finalize(GObject *object)
 	}
 	g_object_unref(priv->headings);
 	gtk_tree_path_free(priv->current_heading);
+	g_array_free(priv->heading_index, TRUE);
+	g_regex_unref(priv->heading_regex);
 
 	G_OBJECT_CLASS(i7_document_parent_class)->finalize(object);
 }
@@ -347,6 +391,7 @@ i7_document_class_init(I7DocumentClass *klass)
 	GObjectClass *object_class = G_OBJECT_CLASS(klass);
 	object_class->set_property = i7_document_set_property;
 	object_class->get_property = i7_document_get_property;
+	object_class->dispose = i7_document_dispose;
 	object_class->finalize = i7_document_finalize;
 
 	/* Properties */
@@ -778,110 +823,127 @@ get_heading_from_string(gchar *text)
 	return retval;
 }
 
-/* Re-scan the source code and rebuild the tree model of headings for the
- * contents view */
-void
-i7_document_reindex_headings(I7Document *self)
+/* Append the headings on lines @first to @last (counted from 0) to @entries.
+ A heading must have a blank line before and after it, and the first line is
+ the title, so the first line that can be a heading is the third one. */
+static void
+scan_headings(I7Document *self, int first, int last, GArray *entries)
 {
 	I7DocumentPrivate *priv = i7_document_get_instance_private(self);
 	GtkTextBuffer *buffer = GTK_TEXT_BUFFER(priv->buffer);
-	GtkTreeStore *tree = priv->headings;
-	gtk_tree_store_clear(tree);
-	/* These keep track of where in the tree the last instance of that section type occurred */
-	GtkTreeIter title, volume, book, part, chapter, section, current;
-	/* These keep track of where to put the next encountered subsection */
-	gboolean volume_used = FALSE, book_used = FALSE, part_used = FALSE, chapter_used = FALSE;
-
-	GtkTextIter lastline, thisline, nextline, end;
-	gtk_text_buffer_get_start_iter(buffer, &lastline);
-	gtk_text_buffer_get_iter_at_line(buffer, &thisline, 1);
-	gtk_text_buffer_get_iter_at_line(buffer, &nextline, 2);
-	gchar *text = gtk_text_iter_get_text(&lastline, &thisline);
-	/* Include \n */
-	char *realtitle = I7_DOCUMENT_GET_CLASS(self)->extract_title(self, text);
-	g_free(text);
 
-	gtk_tree_store_append(tree, &title, NULL);
-	gtk_tree_store_set(tree, &title,
-		I7_HEADINGS_TITLE, realtitle,
-		I7_HEADINGS_LINE, 1,
-		I7_HEADINGS_DEPTH, -1,
-		I7_HEADINGS_BOLD, PANGO_WEIGHT_BOLD,
-		-1);
-	g_free(realtitle);
+	first = MAX(first, 2);
+	if(last < first)
+		return;
 
-	g_autoptr(GRegex) regex = g_regex_new("^(?P<level>volume|book|part|chapter|section)\\s+(?P<secnum>.*?)(\\s+-\\s+(?P<sectitle>.*))?$",
-		G_REGEX_OPTIMIZE | G_REGEX_CASELESS, 0, /* ignore error */ NULL);
-	g_assert(regex && "Failed to compile section heading regex");
+	GtkTextIter lastline, thisline, nextline, end;
+	gtk_text_buffer_get_iter_at_line(buffer, &lastline, first - 1);
+	if(gtk_text_iter_get_line(&lastline) != first - 1)
+		return;
+	thisline = lastline;
+	if(!gtk_text_iter_forward_line(&thisline))
+		return;
+	nextline = thisline;
 
-	while(gtk_text_iter_forward_lines(&lastline, 3)) {
-		/* Swap the iterators around using end as a temporary variable */
-		end = nextline;
-		nextline = lastline;
-		lastline = thisline;
-		thisline = end;
-		gtk_text_iter_forward_to_line_end(&end);
-
-		GMatchInfo *match = NULL;
-		text = NULL;
-		if(starts_blank_or_whitespace_line(&lastline)
-			&& starts_blank_or_whitespace_line(&nextline)
-			&& (text = gtk_text_iter_get_text(&thisline, &end))
-			&& g_regex_match(regex, text, 0, &match))
+	for(int line = first; line <= last && gtk_text_iter_forward_line(&nextline); line++) {
+		if(!gtk_text_iter_ends_line(&thisline)
+			&& starts_blank_or_whitespace_line(&lastline)
+			&& starts_blank_or_whitespace_line(&nextline))
 		{
-			gchar *level = g_match_info_fetch_named(match, "level");
-			int depth = get_heading_from_string(level);
-			g_free(level);
-			gchar *secnum = g_match_info_fetch_named(match, "secnum");
-			gchar *sectitle = g_match_info_fetch_named(match, "sectitle");
-			guint lineno = gtk_text_iter_get_line(&thisline) + 1;
-			/* Line numbers counted from 0 */
-
-			switch(depth) {
-				case I7_HEADING_VOLUME:
-					gtk_tree_store_append(tree, &volume, &title);
-					current = volume;
-					volume_used = TRUE;
-					book_used = part_used = chapter_used = FALSE;
-					break;
-				case I7_HEADING_BOOK:
-					gtk_tree_store_append(tree, &book, volume_used? &volume : &title);
-					current = book;
-					book_used = TRUE;
-					part_used = chapter_used = FALSE;
-					break;
-				case I7_HEADING_PART:
-					gtk_tree_store_append(tree, &part, book_used? &book : volume_used? &volume : &title);
-					current = part;
-					part_used = TRUE;
-					chapter_used = FALSE;
-					break;
-				case I7_HEADING_CHAPTER:
-					gtk_tree_store_append(tree, &chapter, part_used? &part : book_used? &book : volume_used? &volume : &title);
-					current = chapter;
-					chapter_used = TRUE;
-					break;
-				default: /* section */
-					gtk_tree_store_append(tree, &section, chapter_used? &chapter : part_used? &part : book_used? &book : volume_used? &volume : &title);
-					current = section;
+			end = thisline;
+			gtk_text_iter_forward_to_line_end(&end);
+			g_autofree char *text = gtk_text_iter_get_text(&thisline, &end);
+			g_autoptr(GMatchInfo) match = NULL;
+			if(g_regex_match(priv->heading_regex, text, 0, &match)) {
+				g_autofree char *level = g_match_info_fetch_named(match, "level");
+				HeadingEntry entry = {
+					.line = line,
+					.depth = get_heading_from_string(level),
+					.text = g_steal_pointer(&text),
+					.secnum = g_match_info_fetch_named(match, "secnum"),
+					.sectitle = g_match_info_fetch_named(match, "sectitle"),
+				};
+				g_array_append_val(entries, entry);
 			}
-
-			gtk_tree_store_set(tree, &current,
-				I7_HEADINGS_TITLE, text,
-				I7_HEADINGS_LINE, lineno,
-				I7_HEADINGS_DEPTH, depth,
-				I7_HEADINGS_SECTION_NUMBER, secnum,
-				I7_HEADINGS_SECTION_NAME, sectitle,
-				I7_HEADINGS_BOLD, PANGO_WEIGHT_NORMAL,
-				-1);
-			/* Do not free strings (?) */
 		}
 
-		if(text)
-			g_free(text);
-		if(match)
-			g_match_info_free(match);
+		lastline = thisline;
+		thisline = nextline;
 	}
+}
+
+static void
+set_heading_row(GtkTreeStore *tree, HeadingEntry *entry)
+{
+	gtk_tree_store_set(tree, &entry->iter,
+		I7_HEADINGS_TITLE, entry->text,
+		I7_HEADINGS_LINE, entry->line + 1,
+		I7_HEADINGS_DEPTH, entry->depth,
+		I7_HEADINGS_SECTION_NUMBER, entry->secnum,
+		I7_HEADINGS_SECTION_NAME, entry->sectitle,
+		I7_HEADINGS_BOLD, PANGO_WEIGHT_NORMAL,
+		-1);
+}
+
+/* Add rows for the entries in the heading index from @from onwards, none of
+ which may have a row yet. A heading goes below the nearest heading before it
+ that is shallower, or below the title if there is none. */
+static void
+insert_heading_rows(I7Document *self, unsigned from)
+{
+	I7DocumentPrivate *priv = i7_document_get_instance_private(self);
+	GtkTreeIter title;
+	g_assert(gtk_tree_model_get_iter_first(GTK_TREE_MODEL(priv->headings), &title));
+
+	/* Depths strictly increase towards the top of the stack */
+	HeadingEntry *stack[I7_HEADING_SECTION + 1];
+	unsigned n_stack = 0;
+	for(unsigned ix = 0; ix < priv->heading_index->len; ix++) {
+		HeadingEntry *entry = &g_array_index(priv->heading_index, HeadingEntry, ix);
+		while(n_stack > 0 && stack[n_stack - 1]->depth >= entry->depth)
+			n_stack--;
+		if(ix >= from) {
+			gtk_tree_store_append(priv->headings, &entry->iter, n_stack > 0? &stack[n_stack - 1]->iter : &title);
+			set_heading_row(priv->headings, entry);
+		}
+		stack[n_stack++] = entry;
+	}
+}
+
+/* Remove the rows of the entries in the heading index from @from onwards.
+ Going backwards means each row's children are already gone. */
+static void
+remove_heading_rows(I7Document *self, unsigned from)
+{
+	I7DocumentPrivate *priv = i7_document_get_instance_private(self);
+	for(unsigned ix = priv->heading_index->len; ix-- > from; )
+		gtk_tree_store_remove(priv->headings, &g_array_index(priv->heading_index, HeadingEntry, ix).iter);
+}
+
+static void
+update_title_row(I7Document *self)
+{
+	I7DocumentPrivate *priv = i7_document_get_instance_private(self);
+	GtkTextBuffer *buffer = GTK_TEXT_BUFFER(priv->buffer);
+
+	GtkTextIter start, end;
+	gtk_text_buffer_get_start_iter(buffer, &start);
+	gtk_text_buffer_get_iter_at_line(buffer, &end, 1);
+	/* Include \n */
+	g_autofree char *text = gtk_text_iter_get_text(&start, &end);
+	g_autofree char *realtitle = I7_DOCUMENT_GET_CLASS(self)->extract_title(self, text);
+
+	GtkTreeIter title;
+	g_assert(gtk_tree_model_get_iter_first(GTK_TREE_MODEL(priv->headings), &title));
+	gtk_tree_store_set(priv->headings, &title, I7_HEADINGS_TITLE, realtitle, -1);
+}
+
+static void
+update_contents_display(I7Document *self)
+{
+	I7DocumentPrivate *priv = i7_document_get_instance_private(self);
+	GtkTreeIter current;
+
 	i7_document_expand_headings_view(self);
 
 	/* Display appropriate messages in the contents view */
@@ -903,6 +965,201 @@ i7_document_reindex_headings(I7Document *self)
 	}
 }
 
+static void
+clear_headings_dirty_range(I7DocumentPrivate *priv)
+{
+	if(priv->headings_dirty_start) {
+		GtkTextBuffer *buffer = GTK_TEXT_BUFFER(priv->buffer);
+		gtk_text_buffer_delete_mark(buffer, priv->headings_dirty_start);
+		gtk_text_buffer_delete_mark(buffer, priv->headings_dirty_end);
+		priv->headings_dirty_start = priv->headings_dirty_end = NULL;
+	}
+}
+
+/* Re-scan the source code and rebuild the tree model of headings for the
+ * contents view */
+void
+i7_document_reindex_headings(I7Document *self)
+{
+	I7DocumentPrivate *priv = i7_document_get_instance_private(self);
+	GtkTextBuffer *buffer = GTK_TEXT_BUFFER(priv->buffer);
+	GtkTreeStore *tree = priv->headings;
+
+	g_clear_handle_id(&priv->headings_update_source, g_source_remove);
+	clear_headings_dirty_range(priv);
+	gtk_tree_store_clear(tree);
+	g_array_set_size(priv->heading_index, 0);
+
+	GtkTreeIter title;
+	gtk_tree_store_append(tree, &title, NULL);
+	gtk_tree_store_set(tree, &title,
+		I7_HEADINGS_LINE, 1,
+		I7_HEADINGS_DEPTH, -1,
+		I7_HEADINGS_BOLD, PANGO_WEIGHT_BOLD,
+		-1);
+	update_title_row(self);
+
+	priv->indexed_lines = gtk_text_buffer_get_line_count(buffer);
+	scan_headings(self, 0, priv->indexed_lines - 1, priv->heading_index);
+	insert_heading_rows(self, 0);
+
+	update_contents_display(self);
+}
+
+/* Returns the index of the first entry in @index on or after @line */
+static unsigned
+find_heading_entry(GArray *index, int line)
+{
+	unsigned lo = 0, hi = index->len;
+	while(lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if(g_array_index(index, HeadingEntry, mid).line < line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Rescan the lines around the dirty range and bring the tree of headings up
+ to date with as few changes to the tree store as possible */
+static void
+update_dirty_headings(I7Document *self)
+{
+	I7DocumentPrivate *priv = i7_document_get_instance_private(self);
+	GtkTextBuffer *buffer = GTK_TEXT_BUFFER(priv->buffer);
+	GArray *index = priv->heading_index;
+
+	/* Whether a line is a heading depends on the lines on either side of it */
+	GtkTextIter iter;
+	gtk_text_buffer_get_iter_at_mark(buffer, &iter, priv->headings_dirty_start);
+	int first = MAX(gtk_text_iter_get_line(&iter) - 1, 0);
+	gtk_text_buffer_get_iter_at_mark(buffer, &iter, priv->headings_dirty_end);
+	int last = gtk_text_iter_get_line(&iter) + 1;
+
+	/* Lines before @first kept their numbers; lines after @last moved by
+	@delta. Find the entries that were between them before the edit. */
+	int n_lines = gtk_text_buffer_get_line_count(buffer);
+	int delta = n_lines - priv->indexed_lines;
+	priv->indexed_lines = n_lines;
+	unsigned lo = find_heading_entry(index, first);
+	unsigned hi = MAX(lo, find_heading_entry(index, last - delta + 1));
+
+	g_autoptr(GArray) found = g_array_new(FALSE, FALSE, sizeof(HeadingEntry));
+	g_array_set_clear_func(found, (GDestroyNotify)heading_entry_clear);
+	scan_headings(self, first, last, found);
+
+	if(first == 0)
+		update_title_row(self);
+
+	/* If the same kinds of headings are in the same order, then the shape of
+	the tree doesn't change and only the rows' contents need updating */
+	bool same_shape = found->len == hi - lo;
+	for(unsigned ix = 0; same_shape && ix < found->len; ix++)
+		same_shape = g_array_index(found, HeadingEntry, ix).depth == g_array_index(index, HeadingEntry, lo + ix).depth;
+
+	if(same_shape) {
+		for(unsigned ix = 0; ix < found->len; ix++) {
+			HeadingEntry *entry = &g_array_index(index, HeadingEntry, lo + ix);
+			HeadingEntry *rescanned = &g_array_index(found, HeadingEntry, ix);
+			if(entry->line == rescanned->line && strcmp(entry->text, rescanned->text) == 0)
+				continue;
+			/* Swap, so that the old strings are freed along with @found */
+			rescanned->iter = entry->iter;
+			HeadingEntry temp = *entry;
+			*entry = *rescanned;
+			*rescanned = temp;
+			set_heading_row(priv->headings, entry);
+		}
+		if(delta != 0) {
+			for(unsigned ix = hi; ix < index->len; ix++) {
+				HeadingEntry *entry = &g_array_index(index, HeadingEntry, ix);
+				entry->line += delta;
+				gtk_tree_store_set(priv->headings, &entry->iter, I7_HEADINGS_LINE, entry->line + 1, -1);
+			}
+		}
+		return;
+	}
+
+	/* Otherwise, any heading after the first changed one may have a different
+	parent now, so put those rows back in the tree from there on */
+	remove_heading_rows(self, lo);
+	g_array_remove_range(index, lo, hi - lo);
+	for(unsigned ix = lo; ix < index->len; ix++)
+		g_array_index(index, HeadingEntry, ix).line += delta;
+	g_array_insert_vals(index, lo, found->data, found->len);
+	g_array_set_clear_func(found, NULL); /* strings now belong to the index */
+	insert_heading_rows(self, lo);
+
+	update_contents_display(self);
+}
+
+/*
+ * i7_document_update_headings:
+ * @self: the document
+ *
+ * Brings the tree of headings up to date with the edits made since the last
+ * update. This happens automatically in idle time after the source changes.
+ */
+void
+i7_document_update_headings(I7Document *self)
+{
+	I7DocumentPrivate *priv = i7_document_get_instance_private(self);
+
+	g_clear_handle_id(&priv->headings_update_source, g_source_remove);
+	if(!priv->headings_dirty_start)
+		return;
+	/* Nothing to update incrementally if the source was never indexed */
+	if(gtk_tree_model_iter_n_children(GTK_TREE_MODEL(priv->headings), NULL) == 0) {
+		i7_document_reindex_headings(self);
+		return;
+	}
+	update_dirty_headings(self);
+	clear_headings_dirty_range(priv);
+}
+
+static gboolean
+on_headings_update_idle(I7Document *self)
+{
+	I7DocumentPrivate *priv = i7_document_get_instance_private(self);
+	priv->headings_update_source = 0;
+	i7_document_update_headings(self);
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * i7_document_queue_headings_update:
+ * @self: the document
+ * @start: start of the edited text
+ * @end: end of the edited text
+ *
+ * Adds the lines from @start to @end to the ones to be rescanned for section
+ * headings, and schedules an update in idle time. Edits made before the update
+ * runs are coalesced.
+ */
+void
+i7_document_queue_headings_update(I7Document *self, GtkTextIter *start, GtkTextIter *end)
+{
+	I7DocumentPrivate *priv = i7_document_get_instance_private(self);
+	GtkTextBuffer *buffer = GTK_TEXT_BUFFER(priv->buffer);
+
+	if(!priv->headings_dirty_start) {
+		priv->headings_dirty_start = gtk_text_buffer_create_mark(buffer, NULL, start, TRUE);
+		priv->headings_dirty_end = gtk_text_buffer_create_mark(buffer, NULL, end, FALSE);
+	} else {
+		GtkTextIter iter;
+		gtk_text_buffer_get_iter_at_mark(buffer, &iter, priv->headings_dirty_start);
+		if(gtk_text_iter_compare(start, &iter) < 0)
+			gtk_text_buffer_move_mark(buffer, priv->headings_dirty_start, start);
+		gtk_text_buffer_get_iter_at_mark(buffer, &iter, priv->headings_dirty_end);
+		if(gtk_text_iter_compare(end, &iter) > 0)
+			gtk_text_buffer_move_mark(buffer, priv->headings_dirty_end, end);
+	}
+
+	if(!priv->headings_update_source)
+		priv->headings_update_source = g_idle_add((GSourceFunc)on_headings_update_idle, self);
+}
+
 void
 i7_document_show_heading(I7Document *self, GtkTreePath *path)
 {
@@ -1035,6 +1292,22 @@ get_current_line_number(GtkTextBuffer *buffer)
 	return (guint)(gtk_text_iter_get_line(&insert) + 1);
 }
 
+/* Returns the entry in the heading index of the last heading on or before
+ @line (counted from 1), or %NULL if the line is before the first heading */
+static HeadingEntry *
+get_heading_entry_for_line(I7Document *self, unsigned line)
+{
+	I7DocumentPrivate *priv = i7_document_get_instance_private(self);
+
+	/* Navigate by the headings as they are now, not as of the last idle */
+	i7_document_update_headings(self);
+
+	unsigned ix = find_heading_entry(priv->heading_index, (int)line);
+	if(ix == 0)
+		return NULL;
+	return &g_array_index(priv->heading_index, HeadingEntry, ix - 1);
+}
+
 GtkTreePath *
 i7_document_get_deeper_heading(I7Document *self)
 {
@@ -1042,59 +1315,48 @@ i7_document_get_deeper_heading(I7Document *self)
 	GtkTreeModel *headings = GTK_TREE_MODEL(priv->headings);
 
 	guint cur_line = get_current_line_number(GTK_TEXT_BUFFER(priv->buffer));
-	GtkTreeIter iter, next_iter;
+	HeadingEntry *entry = get_heading_entry_for_line(self, cur_line);
+
+	GtkTreeIter iter, child;
 	guint line = 0;
-	/* This perhaps won't deal quite as well with changes on the fly */
-	gtk_tree_model_get_iter(headings, &iter, priv->current_heading);
-	if(gtk_tree_model_iter_has_child(headings, &iter)) {
-		gtk_tree_model_iter_nth_child(headings, &next_iter, &iter, 0);
-		do {
-			gtk_tree_model_get(headings, &next_iter, I7_HEADINGS_LINE, &line, -1);
-			if(line > cur_line)
-				break;
-			iter = next_iter;
-		} while(gtk_tree_model_iter_next(headings, &next_iter));
+	if(!gtk_tree_model_get_iter(headings, &iter, priv->current_heading))
+		return gtk_tree_path_new_first();
+	gtk_tree_model_get(headings, &iter, I7_HEADINGS_LINE, &line, -1);
+
+	/* Go to the child of the current heading that contains the cursor. If the
+	heading containing the cursor is after the current heading but not inside
+	it, then the cursor is past all of its children, so go to the last one. */
+	if(entry && entry->line + 1 > (int)line) {
+		GtkTreeIter parent;
+		child = entry->iter;
+		while(gtk_tree_model_iter_parent(headings, &parent, &child)) {
+			guint parent_line = 0;
+			gtk_tree_model_get(headings, &parent, I7_HEADINGS_LINE, &parent_line, -1);
+			if(parent_line == line)
+				return gtk_tree_model_get_path(headings, &child);
+			child = parent;
+		}
+		int n_children = gtk_tree_model_iter_n_children(headings, &iter);
+		if(n_children > 0 && gtk_tree_model_iter_nth_child(headings, &child, &iter, n_children - 1))
+			return gtk_tree_model_get_path(headings, &child);
 	}
 
-	/* iter is the heading we want to go to; if it had no children, it stays
-	the same */
-	GtkTreePath *path = gtk_tree_model_get_path(headings, &iter);
-	return path;
+	/* If the current heading has no children before the cursor, it stays the
+	same */
+	return gtk_tree_model_get_path(headings, &iter);
 }
 
 GtkTreePath *
 i7_document_get_deepest_heading(I7Document *self)
 {
 	I7DocumentPrivate *priv = i7_document_get_instance_private(self);
-	GtkTreeModel *headings = GTK_TREE_MODEL(priv->headings);
 
+	/* The deepest heading containing the cursor is the last one before it */
 	guint cur_line = get_current_line_number(GTK_TEXT_BUFFER(priv->buffer));
-	GtkTreeIter iter, next_iter;
-	guint line = 0;
-	/* Could start at current_heading to be more efficient, but starting at the
-	root allows us to deal with changes that have occurred since the last
-	navigation action in the headings pane */
-	gtk_tree_model_get_iter_first(headings, &iter); /* line 0 */
-	while(TRUE) {
-		if(gtk_tree_model_iter_has_child(headings, &iter))
-			gtk_tree_model_iter_nth_child(headings, &next_iter, &iter, 0);
-		else {
-			next_iter = iter;
-			if(!gtk_tree_model_iter_next(headings, &next_iter)
-				&& !(gtk_tree_model_iter_parent(headings, &next_iter, &iter)
-				&& gtk_tree_model_iter_next(headings, &next_iter)))
-				/* We've reached the end */
-				break;
-		}
-		gtk_tree_model_get(headings, &next_iter, I7_HEADINGS_LINE, &line, -1);
-		if(line > cur_line)
-			break;
-		iter = next_iter;
-	}
-
-	/* Now iter is the heading we want to go to */
-	GtkTreePath *path = gtk_tree_model_get_path(headings, &iter);
-	return path;
+	HeadingEntry *entry = get_heading_entry_for_line(self, cur_line);
+	if(!entry)
+		return gtk_tree_path_new_first(); /* the title */
+	return gtk_tree_model_get_path(GTK_TREE_MODEL(priv->headings), &entry->iter);
 }
 
 /* Remove the invisible tag */
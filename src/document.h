@@ -117,6 +117,8 @@ void i7_document_refresh_elastic_tabstops(I7Document *self);
 void i7_document_expand_headings_view(I7Document *self);
 void i7_document_set_headings_filter_level(I7Document *self, gint depth);
 void i7_document_reindex_headings(I7Document *self);
+void i7_document_queue_headings_update(I7Document *self, GtkTextIter *start, GtkTextIter *end);
+void i7_document_update_headings(I7Document *self);
 void i7_document_show_heading(I7Document *self, GtkTreePath *path);
 GtkTreePath *i7_document_get_previous_heading(I7Document *self);
 GtkTreePath *i7_document_get_next_heading(I7Document *self);
@@ -15,18 +15,154 @@
 #include "configfile.h"
 #include "elastic.h"
 
+/* Widths of cell texts, measured with a PangoLayout of their own rather than
+ by asking the text view where the text is, which would make the view lay out
+ all the lines involved. There is one cache for each font, shared between
+ views. Tags that change the weight, style, or scale of the font are applied to
+ the layout, and are part of the key along with the text. */
+typedef struct {
+	PangoLayout *layout;
+	GHashTable *widths; /* cell text and font changes -> width in pixels */
+} CellWidthCache;
+
+static GHashTable *width_caches; /* font description string -> CellWidthCache */
+
+/* Keep the cache from growing without limit while typing in cells */
+#define MAX_CACHED_WIDTHS 65536
+
+static void
+cell_width_cache_free(CellWidthCache *cache)
+{
+	g_object_unref(cache->layout);
+	g_hash_table_destroy(cache->widths);
+	g_slice_free(CellWidthCache, cache);
+}
+
+/* Returns the width cache for the font that @view currently uses */
+static CellWidthCache *
+get_width_cache(GtkTextView *view)
+{
+	if(!width_caches)
+		width_caches = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)cell_width_cache_free);
+
+	PangoContext *view_context = gtk_widget_get_pango_context(GTK_WIDGET(view));
+	char *font = pango_font_description_to_string(pango_context_get_font_description(view_context));
+	CellWidthCache *cache = g_hash_table_lookup(width_caches, font);
+	if(cache) {
+		g_free(font);
+		return cache;
+	}
+
+	/* A context of its own, so that it keeps the font even if the view's
+	 font changes later */
+	PangoContext *context = gtk_widget_create_pango_context(GTK_WIDGET(view));
+	cache = g_slice_new0(CellWidthCache);
+	cache->layout = pango_layout_new(context);
+	cache->widths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	g_object_unref(context);
+	g_hash_table_insert(width_caches, font, cache);
+	return cache;
+}
+
+static void
+insert_attribute(PangoAttrList *attrs, PangoAttribute *attr, unsigned start_index, unsigned end_index)
+{
+	attr->start_index = start_index;
+	attr->end_index = end_index;
+	pango_attr_list_insert(attrs, attr);
+}
+
+/* Adds to @attrs the font changes made by the tags on the text between @start
+ and @end, which are on the same line, and describes them in @key. Tags with
+ higher priority override the others, as in the text view. */
+static void
+add_font_attributes(GtkTextIter *start, GtkTextIter *end, PangoAttrList *attrs, GString *key)
+{
+	int cell_index = gtk_text_iter_get_line_index(start);
+	GtkTextIter run_start = *start, run_end;
+
+	while(gtk_text_iter_compare(&run_start, end) < 0) {
+		run_end = run_start;
+		gtk_text_iter_forward_to_tag_toggle(&run_end, NULL);
+		if(gtk_text_iter_compare(&run_end, end) > 0)
+			run_end = *end;
+
+		int weight = -1, style = -1;
+		double scale = 0.0;
+		GSList *tags = gtk_text_iter_get_tags(&run_start), *iter;
+		for(iter = tags; iter; iter = g_slist_next(iter)) {
+			gboolean weight_set, style_set, scale_set;
+			int tag_weight;
+			PangoStyle tag_style;
+			double tag_scale;
+			g_object_get(iter->data,
+				"weight-set", &weight_set, "weight", &tag_weight,
+				"style-set", &style_set, "style", &tag_style,
+				"scale-set", &scale_set, "scale", &tag_scale,
+				NULL);
+			if(weight_set)
+				weight = tag_weight;
+			if(style_set)
+				style = tag_style;
+			if(scale_set)
+				scale = tag_scale;
+		}
+		g_slist_free(tags);
+
+		if(weight != -1 || style != -1 || scale != 0.0) {
+			unsigned start_index = gtk_text_iter_get_line_index(&run_start) - cell_index;
+			unsigned end_index = gtk_text_iter_get_line_index(&run_end) - cell_index;
+			if(weight != -1)
+				insert_attribute(attrs, pango_attr_weight_new(weight), start_index, end_index);
+			if(style != -1)
+				insert_attribute(attrs, pango_attr_style_new(style), start_index, end_index);
+			if(scale != 0.0)
+				insert_attribute(attrs, pango_attr_scale_new(scale), start_index, end_index);
+			g_string_append_printf(key, "\x1f%u-%u:%d,%d,%g", start_index, end_index, weight, style, scale);
+		}
+		run_start = run_end;
+	}
+}
+
 /* calculate the width of the text between @start and @end */
 static int
-get_text_width(GtkTextView *view, GtkTextIter *start, GtkTextIter *end)
+get_text_width(CellWidthCache *cache, GtkTextIter *start, GtkTextIter *end)
 {
-	GdkRectangle start_rect, end_rect;
+	char *text = gtk_text_iter_get_text(start, end);
+	PangoAttrList *attrs = pango_attr_list_new();
+	GString *key = g_string_new(text);
+	add_font_attributes(start, end, attrs, key);
+
+	void *cached;
+	if(g_hash_table_lookup_extended(cache->widths, key->str, NULL, &cached)) {
+		g_free(text);
+		g_string_free(key, TRUE);
+		pango_attr_list_unref(attrs);
+		return GPOINTER_TO_INT(cached);
+	}
 
-	gtk_text_view_get_iter_location(view, start, &start_rect);
-	gtk_text_view_get_iter_location(view, end, &end_rect);
+	int width;
+	pango_layout_set_text(cache->layout, text, -1);
+	pango_layout_set_attributes(cache->layout, attrs);
+	pango_layout_get_pixel_size(cache->layout, &width, NULL);
+	g_free(text);
+	pango_attr_list_unref(attrs);
+
+	if(g_hash_table_size(cache->widths) >= MAX_CACHED_WIDTHS)
+		g_hash_table_remove_all(cache->widths);
+	g_hash_table_insert(cache->widths, g_string_free(key, FALSE), GINT_TO_POINTER(width));
+	return width;
+}
 
-	/* last iter terminates the cell, so take end_rect.x rather than
-	 end_rect.x + end_rect.width */
-	return end_rect.x - start_rect.x;
+/*
+ * elastic_clear_width_cache:
+ *
+ * Forgets all measured cell widths; call this when the fonts change.
+ */
+void
+elastic_clear_width_cache(void)
+{
+	g_clear_pointer(&width_caches, g_hash_table_destroy);
 }
 
 /* Predicate function for gtk_text_iter_forward_find_char() in stretch_tabstops() */
@@ -47,10 +183,13 @@ stretch_tabstops(GtkTextBuffer *textbuffer, GtkTextView *view, GtkTextTag *tag,
 	guint max_tabs = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(tag), "elastictabstops-numtabs"));
 	int max_widths[max_tabs];
 	guint current_tab_num;
+	int min_width = g_settings_get_uint(prefs, PREFS_TAB_WIDTH);
+	int padding = g_settings_get_uint(prefs, PREFS_TABSTOPS_PADDING);
+	CellWidthCache *cache = get_width_cache(view);
 
 	/* initialize tab widths to minimum */
 	for(current_tab_num = 0; current_tab_num < max_tabs; current_tab_num++)
-		max_widths[current_tab_num] = g_settings_get_uint(prefs, PREFS_TAB_WIDTH);
+		max_widths[current_tab_num] = min_width;
 
 	/* get width of text in cells */
 	g_assert(gtk_text_iter_starts_line(block_start));
@@ -73,7 +212,7 @@ stretch_tabstops(GtkTextBuffer *textbuffer, GtkTextView *view, GtkTextTag *tag,
 			if (!gtk_text_iter_forward_find_char(&current_pos, (GtkTextCharPredicate)find_tab, NULL, &line_end))
 				break;
 
-			int text_width_in_tab = get_text_width(view, &cell_start, &current_pos);
+			int text_width_in_tab = get_text_width(cache, &cell_start, &current_pos);
 			max_widths[current_tab_num] = MAX(text_width_in_tab, max_widths[current_tab_num]);
 
 			cell_start = current_pos;
@@ -90,7 +229,7 @@ stretch_tabstops(GtkTextBuffer *textbuffer, GtkTextView *view, GtkTextTag *tag,
 	int acc_tabstop = 0;
 	PangoTabArray *tab_array = pango_tab_array_new(max_tabs, TRUE);
 	for (current_tab_num = 0; current_tab_num < max_tabs; current_tab_num++) {
-		acc_tabstop += max_widths[current_tab_num] + g_settings_get_uint(prefs, PREFS_TABSTOPS_PADDING);
+		acc_tabstop += max_widths[current_tab_num] + padding;
 		pango_tab_array_set_tab(tab_array, current_tab_num, PANGO_TAB_LEFT, acc_tabstop);
 	}
 	g_object_set(tag,
@@ -130,116 +269,372 @@ forward_to_block_boundary(GtkTextBuffer *textbuffer, GtkTextIter *location)
 	return max_tabs;
 }
 
-/* Divide the range from @start to @end into blocks of elastic tabstops, and
- calculate the tab widths */
+/* Record of the blocks in a buffer, so that after an edit only the blocks
+ around the edited lines need to be divided and measured again. Each block has
+ a tag giving its tab widths, and a mark at the start of its first line; the
+ array is in buffer order. The tags apply to every view of the buffer, so the
+ views that show it with elastic tabstops share one state, and the first of
+ them is used to measure the text. */
+typedef struct {
+	GtkTextMark *start;
+	GtkTextTag *tag;
+} ElasticBlock;
+
+typedef struct {
+	unsigned ref_count;
+	GtkTextBuffer *buffer; /* owns a reference */
+	GPtrArray *views; /* GtkTextView *, each holding a reference to the state */
+	GPtrArray *blocks; /* ElasticBlock * */
+	GtkTextMark *dirty_start; /* NULL if there were no edits since the last update */
+	GtkTextMark *dirty_end;
+	unsigned update_source;
+} ElasticState;
+
+/* Attached to each view with elastic tabstops */
+typedef struct {
+	ElasticState *state;
+	GtkTextView *view;
+} ElasticView;
+
+#define ELASTIC_STATE_KEY "elastictabstops-state"
+
+static GtkTextTag *
+create_block_tag(GtkTextBuffer *buffer, guint num_tabs)
+{
+	GtkTextTag *tag = gtk_text_buffer_create_tag(buffer, NULL, NULL);
+	/* Mark this tag so we can identify it as ours */
+	g_object_set_data(G_OBJECT(tag), "elastictabstops", tag);
+	/* Cache some data on it */
+	g_object_set_data(G_OBJECT(tag), "elastictabstops-numtabs", GUINT_TO_POINTER(num_tabs));
+	return tag;
+}
+
+/* Creates one block from @block_start to @block_end and measures it */
+static GtkTextTag *
+make_block(GtkTextView *view, GtkTextBuffer *buffer, guint num_tabs, GtkTextIter *block_start, GtkTextIter *block_end)
+{
+	GtkTextTag *tag = create_block_tag(buffer, num_tabs);
+	gtk_text_buffer_apply_tag(buffer, tag, block_start, block_end);
+
+	/* Calculate the widths of the tabs and apply them */
+	stretch_tabstops(buffer, view, tag, block_start, block_end);
+	return tag;
+}
+
+static ElasticBlock *
+elastic_block_new(GtkTextBuffer *buffer, GtkTextTag *tag, GtkTextIter *block_start)
+{
+	ElasticBlock *block = g_slice_new0(ElasticBlock);
+	block->start = gtk_text_buffer_create_mark(buffer, NULL, block_start, TRUE);
+	block->tag = tag;
+	return block;
+}
+
+/* Removes the block's tag and mark from the buffer */
+static void
+elastic_block_free(ElasticBlock *block)
+{
+	GtkTextBuffer *buffer = gtk_text_mark_get_buffer(block->start);
+	gtk_text_tag_table_remove(gtk_text_buffer_get_tag_table(buffer), block->tag);
+	gtk_text_buffer_delete_mark(buffer, block->start);
+	g_slice_free(ElasticBlock, block);
+}
+
+static GtkTextView *
+get_measuring_view(ElasticState *state)
+{
+	return g_ptr_array_index(state->views, 0);
+}
+
+static int
+get_block_line(GtkTextBuffer *buffer, ElasticBlock *block)
+{
+	GtkTextIter iter;
+	gtk_text_buffer_get_iter_at_mark(buffer, &iter, block->start);
+	return gtk_text_iter_get_line(&iter);
+}
+
+/* Returns the index of the last block starting on or before @line, by binary
+ search; the first block always starts at the beginning of the buffer */
+static unsigned
+find_block(ElasticState *state, GtkTextBuffer *buffer, int line)
+{
+	unsigned low = 0, high = state->blocks->len;
+	while(high - low > 1) {
+		unsigned mid = low + (high - low) / 2;
+		if(get_block_line(buffer, g_ptr_array_index(state->blocks, mid)) <= line)
+			low = mid;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/* Divide the range from @start to @end into blocks of elastic tabstops,
+ calculate the tab widths, and record the blocks in @state */
 static void
-divide_into_blocks(GtkTextView *view, GtkTextBuffer *buffer, GtkTextIter *start, GtkTextIter *end)
+divide_into_blocks(ElasticState *state, GtkTextIter *start, GtkTextIter *end)
 {
 	g_assert(gtk_text_iter_starts_line(start));
 
+	GtkTextBuffer *buffer = state->buffer;
 	GtkTextIter block_start, block_end = *start;
 
 	while (gtk_text_iter_in_range(&block_end, start, end)) {
 		block_start = block_end;
 		guint num_tabs = forward_to_block_boundary(buffer, &block_end);
+		GtkTextTag *tag = make_block(get_measuring_view(state), buffer, num_tabs, &block_start, &block_end);
+		g_ptr_array_add(state->blocks, elastic_block_new(buffer, tag, &block_start));
+	}
+}
+
+/* Divide the lines between the dirty marks again, starting from the block
+ before them, since the edit may have joined it to the next one. Carry on
+ past the dirty lines until a new block boundary falls on the start of an
+ existing block; from there on, the division into blocks is the same as
+ before, so the blocks after it are kept. */
+static void
+update_dirty_blocks(ElasticState *state)
+{
+	GtkTextBuffer *buffer = state->buffer;
+	GtkTextIter iter;
+
+	/* An empty buffer has no blocks at all */
+	if(state->blocks->len == 0) {
+		GtkTextIter start, end;
+		gtk_text_buffer_get_bounds(buffer, &start, &end);
+		divide_into_blocks(state, &start, &end);
+		return;
+	}
+
+	gtk_text_buffer_get_iter_at_mark(buffer, &iter, state->dirty_start);
+	int first_dirty_line = gtk_text_iter_get_line(&iter);
+	gtk_text_buffer_get_iter_at_mark(buffer, &iter, state->dirty_end);
+	int last_dirty_line = gtk_text_iter_get_line(&iter);
+
+	unsigned old = find_block(state, buffer, MAX(first_dirty_line - 1, 0));
+	GtkTextIter block_start, block_end;
+	gtk_text_buffer_get_iter_at_mark(buffer, &block_end, ((ElasticBlock *)g_ptr_array_index(state->blocks, old))->start);
+	gtk_text_iter_set_line_offset(&block_end, 0);
+
+	for(;;) {
+		block_start = block_end;
+		guint num_tabs = forward_to_block_boundary(buffer, &block_end);
+		gboolean at_end = gtk_text_iter_is_end(&block_end);
+		int end_line = gtk_text_iter_get_line(&block_end);
 
-		GtkTextTag *tag = gtk_text_buffer_create_tag(buffer, NULL, NULL);
-		/* Mark this tag so we can identify it as ours */
-		g_object_set_data(G_OBJECT(tag), "elastictabstops", tag);
-		/* Cache some data on it */
-		g_object_set_data(G_OBJECT(tag), "elastictabstops-numtabs", GUINT_TO_POINTER(num_tabs));
-		gtk_text_buffer_apply_tag(buffer, tag, &block_start, &block_end);
+		/* Old blocks that start inside the new one are gone */
+		while(old < state->blocks->len && (at_end || get_block_line(buffer, g_ptr_array_index(state->blocks, old)) < end_line))
+			g_ptr_array_remove_index(state->blocks, old);
 
-		/* Calculate the widths of the tabs and apply them */
-		stretch_tabstops(buffer, view, tag, &block_start, &block_end);
+		GtkTextTag *tag = make_block(get_measuring_view(state), buffer, num_tabs, &block_start, &block_end);
+		g_ptr_array_insert(state->blocks, old++, elastic_block_new(buffer, tag, &block_start));
+
+		if(at_end)
+			break;
+		if(end_line > last_dirty_line && old < state->blocks->len &&
+			get_block_line(buffer, g_ptr_array_index(state->blocks, old)) == end_line)
+			break;
 	}
 }
 
-/* foreach function for remove_all_elastic_tabstops_tags() */
 static void
-find_elastic_tabstops_tags(GtkTextTag *tag, GSList **list)
+clear_dirty_range(ElasticState *state)
 {
-	if (g_object_get_data(G_OBJECT(tag), "elastictabstops"))
-		*list = g_slist_prepend(*list, tag);
+	if(state->dirty_start) {
+		gtk_text_buffer_delete_mark(state->buffer, state->dirty_start);
+		gtk_text_buffer_delete_mark(state->buffer, state->dirty_end);
+		state->dirty_start = state->dirty_end = NULL;
+	}
 }
 
-/* foreach function for remove_all_elastic_tabstops_tags() */
-static void
-remove_elastic_tabstops_tag(GtkTextTag *tag, GtkTextTagTable *table)
+static ElasticState *
+get_state(GtkTextView *view)
 {
-	gtk_text_tag_table_remove(table, tag);
+	ElasticView *elastic_view = g_object_get_data(G_OBJECT(view), ELASTIC_STATE_KEY);
+	return elastic_view? elastic_view->state : NULL;
 }
 
-/* remove all our elastic tabstops tags from the buffer */
+/* Removes all the blocks, which removes only this state's tags from the
+ buffer, and divides the whole buffer again */
 static void
-remove_all_elastic_tabstops_tags(GtkTextBuffer *textbuffer)
+recalculate_state(ElasticState *state)
 {
-	GtkTextTagTable *table = gtk_text_buffer_get_tag_table(textbuffer);
-	GSList *ourtags = NULL;
-	gtk_text_tag_table_foreach(table, (GtkTextTagTableForeach)find_elastic_tabstops_tags, &ourtags);
-	g_slist_foreach(ourtags, (GFunc)remove_elastic_tabstops_tag, table);
-	g_slist_free(ourtags);
+	GtkTextIter start, end;
+
+	g_clear_handle_id(&state->update_source, g_source_remove);
+	clear_dirty_range(state);
+	g_ptr_array_set_size(state->blocks, 0);
+	gtk_text_buffer_get_bounds(state->buffer, &start, &end);
+	divide_into_blocks(state, &start, &end);
 }
 
-/* recalculate the elastic tab stops in the entire document; meant to be called
- either by itself or as a high-priority idle function with g_idle_add_full().
- The priority has to be high so that it runs before the GUI update, otherwise
- you have text shooting all over the place. */
+/* recalculate the elastic tab stops in the entire document, for example when
+ the tab widths or fonts changed; does nothing if @view doesn't have elastic
+ tabstops */
 gboolean
 elastic_recalculate_view(GtkTextView *view)
 {
-	GtkTextBuffer *textbuffer = gtk_text_view_get_buffer(view);
-	GtkTextIter start, end;
-
-	remove_all_elastic_tabstops_tags(textbuffer);
-	gtk_text_buffer_get_bounds(textbuffer, &start, &end);
-	divide_into_blocks(view, textbuffer, &start, &end);
+	ElasticState *state = get_state(view);
+	if(state)
+		recalculate_state(state);
 
 	return FALSE; /* one-shot idle function */
 }
 
 static void
-insert_text_cb(GtkTextBuffer *textbuffer, GtkTextIter *location, gchar *text, gint len, GtkTextView *view)
+update_state(ElasticState *state)
+{
+	g_clear_handle_id(&state->update_source, g_source_remove);
+	if(!state->dirty_start)
+		return;
+	update_dirty_blocks(state);
+	clear_dirty_range(state);
+}
+
+/*
+ * elastic_update_view:
+ * @view: a view with elastic tabstops
+ *
+ * Recalculates the elastic tabstops of the blocks that were edited since the
+ * last update. This happens automatically as a high-priority idle function,
+ * which has to run before the GUI update, otherwise you have text shooting all
+ * over the place.
+ */
+void
+elastic_update_view(GtkTextView *view)
+{
+	ElasticState *state = get_state(view);
+	g_return_if_fail(state);
+	update_state(state);
+}
+
+static gboolean
+on_update_idle(ElasticState *state)
+{
+	state->update_source = 0;
+	update_state(state);
+	return G_SOURCE_REMOVE;
+}
+
+/* Add the lines from @start to @end to the ones to be recalculated */
+static void
+mark_dirty(ElasticState *state, GtkTextBuffer *textbuffer, GtkTextIter *start, GtkTextIter *end)
+{
+	if(!state->dirty_start) {
+		state->dirty_start = gtk_text_buffer_create_mark(textbuffer, NULL, start, TRUE);
+		state->dirty_end = gtk_text_buffer_create_mark(textbuffer, NULL, end, FALSE);
+	} else {
+		GtkTextIter iter;
+		gtk_text_buffer_get_iter_at_mark(textbuffer, &iter, state->dirty_start);
+		if(gtk_text_iter_compare(start, &iter) < 0)
+			gtk_text_buffer_move_mark(textbuffer, state->dirty_start, start);
+		gtk_text_buffer_get_iter_at_mark(textbuffer, &iter, state->dirty_end);
+		if(gtk_text_iter_compare(end, &iter) > 0)
+			gtk_text_buffer_move_mark(textbuffer, state->dirty_end, end);
+	}
+
+	if(!state->update_source)
+		state->update_source = g_idle_add_full(G_PRIORITY_HIGH_IDLE, (GSourceFunc)on_update_idle, state, NULL);
+}
+
+static void
+insert_text_cb(GtkTextBuffer *textbuffer, GtkTextIter *location, gchar *text, gint len, ElasticState *state)
 {
 	/* no need to recalculate if we are typing at the end of a line and not
-	 entering a newline or tab */
-	if ((strchr(text, '\n') || strchr(text, '\t'))
+	 entering a newline or tab; @location is now after the inserted text */
+	if ((memchr(text, '\n', len) || memchr(text, '\t', len))
 		|| !gtk_text_iter_ends_line(location))
 	{
-		/* We first remove any pending recalculate function, but perhaps this
-		 might also remove idle functions spawned by other plugins? */
-		g_idle_remove_by_data(view);
-		g_idle_add_full(G_PRIORITY_HIGH_IDLE, (GSourceFunc)elastic_recalculate_view, view, NULL);
+		GtkTextIter start = *location;
+		gtk_text_iter_backward_chars(&start, g_utf8_strlen(text, len));
+		mark_dirty(state, textbuffer, &start, location);
 	}
 }
 
 static void
-delete_range_cb(GtkTextBuffer *textbuffer, GtkTextIter *start, GtkTextIter *end, GtkTextView *view)
+delete_range_cb(GtkTextBuffer *textbuffer, GtkTextIter *start, GtkTextIter *end, ElasticState *state)
 {
-	g_idle_remove_by_data(view); /* is this OK? (see insert_text_cb()) */
-	g_idle_add_full(G_PRIORITY_HIGH_IDLE, (GSourceFunc)elastic_recalculate_view, view, NULL);
+	mark_dirty(state, textbuffer, start, end);
 }
 
-void
-add_elastic_tabstops_to_view(GtkTextView *view)
+static ElasticState *
+elastic_state_new(GtkTextBuffer *buffer)
 {
-	GtkTextIter start, end;
-	GtkTextBuffer *textbuffer = gtk_text_view_get_buffer(view);
+	ElasticState *state = g_slice_new0(ElasticState);
+	state->ref_count = 1;
+	state->buffer = g_object_ref(buffer);
+	state->views = g_ptr_array_new();
+	state->blocks = g_ptr_array_new_with_free_func((GDestroyNotify)elastic_block_free);
+	g_object_set_data(G_OBJECT(buffer), ELASTIC_STATE_KEY, state);
+
+	g_signal_connect_after(buffer, "insert-text", G_CALLBACK(insert_text_cb), state);
+	g_signal_connect_after(buffer, "delete-range", G_CALLBACK(delete_range_cb), state);
+	return state;
+}
 
-	gtk_text_buffer_get_bounds(textbuffer, &start, &end);
-	divide_into_blocks(view, textbuffer, &start, &end);
+/* Removing the blocks also removes the state's tags from the buffer. Only
+ uses the buffer that it holds a reference to, since the last view may be
+ being destroyed. */
+static void
+elastic_state_unref(ElasticState *state)
+{
+	if(--state->ref_count > 0)
+		return;
+
+	g_signal_handlers_disconnect_by_func(state->buffer, insert_text_cb, state);
+	g_signal_handlers_disconnect_by_func(state->buffer, delete_range_cb, state);
+	g_clear_handle_id(&state->update_source, g_source_remove);
+	clear_dirty_range(state);
+	g_ptr_array_free(state->blocks, TRUE);
+	g_ptr_array_free(state->views, TRUE);
+	g_object_set_data(G_OBJECT(state->buffer), ELASTIC_STATE_KEY, NULL);
+	g_object_unref(state->buffer);
+	g_slice_free(ElasticState, state);
+}
 
-	g_signal_connect_after(textbuffer, "insert-text", G_CALLBACK(insert_text_cb), view);
-	g_signal_connect_after(textbuffer, "delete-range", G_CALLBACK(delete_range_cb), view);
+/* Also called when the view is destroyed */
+static void
+elastic_view_free(ElasticView *elastic_view)
+{
+	ElasticState *state = elastic_view->state;
+	g_ptr_array_remove(state->views, elastic_view->view);
+	elastic_state_unref(state);
+	g_slice_free(ElasticView, elastic_view);
 }
 
 void
-remove_elastic_tabstops_from_view(GtkTextView *view)
+add_elastic_tabstops_to_view(GtkTextView *view)
 {
 	GtkTextBuffer *textbuffer = gtk_text_view_get_buffer(view);
 
-	g_signal_handlers_disconnect_by_func(textbuffer, insert_text_cb, view);
-	g_signal_handlers_disconnect_by_func(textbuffer, delete_range_cb, view);
+	if(get_state(view))
+		return; /* already added */
+
+	ElasticState *state = g_object_get_data(G_OBJECT(textbuffer), ELASTIC_STATE_KEY);
+	gboolean new_state = (state == NULL);
+	if(new_state)
+		state = elastic_state_new(textbuffer);
+	else
+		state->ref_count++;
+
+	ElasticView *elastic_view = g_slice_new0(ElasticView);
+	elastic_view->state = state;
+	elastic_view->view = view;
+	g_ptr_array_add(state->views, view);
+	g_object_set_data_full(G_OBJECT(view), ELASTIC_STATE_KEY, elastic_view, (GDestroyNotify)elastic_view_free);
+
+	/* Another view of the buffer already divided it into blocks */
+	if(new_state) {
+		GtkTextIter start, end;
+		gtk_text_buffer_get_bounds(textbuffer, &start, &end);
+		divide_into_blocks(state, &start, &end);
+	}
+}
 
-	remove_all_elastic_tabstops_tags(textbuffer);
+void
+remove_elastic_tabstops_from_view(GtkTextView *view)
+{
+	/* The tags are removed when no other view of the buffer uses them */
+	g_object_set_data(G_OBJECT(view), ELASTIC_STATE_KEY, NULL);
 }
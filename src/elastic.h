@@ -10,5 +10,7 @@
 #include <gtk/gtk.h>
 
 gboolean elastic_recalculate_view(GtkTextView *view);
+void elastic_update_view(GtkTextView *view);
+void elastic_clear_width_cache(void);
 void add_elastic_tabstops_to_view(GtkTextView *view);
 void remove_elastic_tabstops_from_view(GtkTextView *view);
@@ -0,0 +1,238 @@
+#!/usr/bin/env python3
+
+# Extracts the text of the documentation pages in the Inform data archive and
+# writes an inverted index of it, for the documentation search. See
+# src/doc-index.c for the file format.
+
+import argparse
+import html.parser
+import os
+import re
+import struct
+import sys
+
+parser = argparse.ArgumentParser(
+    description='Generate documentation search index from Inform data archive')
+parser.add_argument('inform_dir')
+parser.add_argument('output', type=argparse.FileType('wb'))
+parser.add_argument('--depfile', type=argparse.FileType('w'),
+                    help='write the pages that were read, for the build system')
+args = parser.parse_args()
+
+MAGIC = b'I7DI'
+VERSION = 1
+NO_STRING = 0xffffffff
+FLAG_EXAMPLE = 1
+FLAG_RECIPE_BOOK = 2
+
+# Same as isspace() in the C locale
+WHITESPACE = ' \t\n\v\f\r'
+WHITESPACE_RUN = re.compile(f'[{WHITESPACE}]+')
+# Terms are runs of ASCII letters and digits, so that they are split the same
+# way when searching
+TERM = re.compile(r'[A-Za-z0-9]+')
+
+# Metadata in the documentation's HTML comments. These follow the scanf()
+# formats that used to parse them when the IDE indexed the pages itself.
+SEARCH_META = re.compile(r'\s*SEARCH\s*(TITLE|SECTION|SORT)\s*"([^"]+)')
+START_EXAMPLE = re.compile(r'\s*START\s*EXAMPLE\s*"([^"]+)"\s*"([^"]+)')
+START_ANCHORED = re.compile(r'\s*START\s*(\S{1,7})\s*"([^"]+)')
+START = re.compile(r'\s*START\s*(\S{1,7})')
+END = re.compile(r'\s*END\s*(\S{1,7})')
+
+
+class Doc:
+    def __init__(self, file, is_recipebook):
+        self.file = file
+        self.is_example = False
+        self.is_recipebook = is_recipebook
+        self.section = None
+        self.title = None
+        self.sort = None
+        self.anchor = None
+        self.example_title = None
+        self.body = ''
+
+    def subsection(self, anchor):
+        retval = Doc(self.file, self.is_recipebook)
+        retval.section = self.section
+        retval.title = self.title
+        retval.sort = self.sort
+        retval.anchor = anchor
+        return retval
+
+
+class DocParser(html.parser.HTMLParser):
+    def __init__(self, doc):
+        super().__init__(convert_charrefs=True)
+        self.chars = ''
+        self.ignore = 0
+        self.in_ignore_section = False
+        self.doc = doc
+        self.chars_stack = []
+        self.doc_stack = []
+        self.completed = []
+
+    def handle_starttag(self, tag, attrs):
+        if tag in ('style', 'script'):
+            self.ignore += 1
+
+    def handle_endtag(self, tag):
+        if tag in ('style', 'script'):
+            self.ignore -= 1
+
+    def handle_data(self, data):
+        if self.ignore != 0 or self.in_ignore_section:
+            return
+        condensed = WHITESPACE_RUN.sub(' ', data).strip(WHITESPACE)
+        if self.chars and self.chars[-1] != ' ':
+            self.chars += ' '
+        self.chars += condensed
+
+    def push(self, doc):
+        self.chars_stack.append(self.chars)
+        self.chars = ''
+        self.doc_stack.append(self.doc)
+        self.doc = doc
+
+    def handle_comment(self, data):
+        match = SEARCH_META.match(data)
+        if match:
+            setattr(self.doc, match[1].lower(), match[2])
+            return
+
+        match = START_EXAMPLE.match(data)
+        if match:
+            doc = self.doc.subsection(match[2])
+            doc.is_example = True
+            doc.example_title = match[1]
+            self.push(doc)
+            return
+
+        match = START_ANCHORED.match(data)
+        if match:
+            if match[1] not in ('CODE', 'PHRASE'):
+                print(f'Unhandled START {match[1]} section in doc comments',
+                      file=sys.stderr)
+                return
+            self.push(self.doc.subsection(match[2]))
+            return
+
+        match = START.match(data)
+        if match:
+            if match[1] == 'IGNORE':
+                self.in_ignore_section = True
+                return
+            print(f'Unhandled START {match[1]} section in doc comments',
+                  file=sys.stderr)
+
+        match = END.match(data)
+        if match:
+            if match[1] in ('EXAMPLE', 'CODE', 'PHRASE'):
+                self.doc.body = self.chars
+                self.completed.append(self.doc)
+                self.doc = self.doc_stack.pop()
+                self.chars = self.chars_stack.pop()
+                return
+            if match[1] == 'IGNORE':
+                self.in_ignore_section = False
+                return
+            print(f'Unhandled END {match[1]} section in doc comments',
+                  file=sys.stderr)
+
+
+def extract_docs(path, basename):
+    with open(path, 'rb') as f:
+        contents = f.read().decode('utf-8', errors='replace')
+    parser = DocParser(Doc(basename, basename.startswith('R')))
+    parser.feed(contents)
+    parser.close()
+    parser.doc.body = parser.chars
+    return [parser.doc] + parser.completed
+
+
+docs = []
+# The directory itself too, so that adding or removing a page is noticed
+pages_read = [args.inform_dir]
+if os.path.isdir(args.inform_dir):
+    for basename in sorted(os.listdir(args.inform_dir)):
+        if (not basename.endswith('.html') or
+                not (basename.startswith('doc') or
+                     basename.startswith('Rdoc'))):
+            continue
+        path = os.path.join(args.inform_dir, basename)
+        docs += extract_docs(path, basename)
+        pages_read.append(path)
+
+# Term -> {doc number: character offset of the term's first occurrence}
+postings = {}
+for doc_num, doc in enumerate(docs):
+    for match in TERM.finditer(doc.body):
+        postings.setdefault(match[0].lower(), {}).setdefault(doc_num,
+                                                             match.start())
+
+strings = bytearray()
+string_offsets = {}
+
+
+def add_string(string):
+    if string is None:
+        return NO_STRING
+    if string not in string_offsets:
+        string_offsets[string] = len(strings)
+        strings.extend(string.encode('utf-8') + b'\0')
+    return string_offsets[string]
+
+
+def varint(value):
+    retval = bytearray()
+    while value >= 0x80:
+        retval.append((value & 0x7f) | 0x80)
+        value >>= 7
+    retval.append(value)
+    return retval
+
+
+doc_table = bytearray()
+for doc in docs:
+    flags = ((FLAG_EXAMPLE if doc.is_example else 0) |
+             (FLAG_RECIPE_BOOK if doc.is_recipebook else 0))
+    doc_table += struct.pack('<9I', flags, add_string(doc.file),
+                             add_string(doc.anchor), add_string(doc.section),
+                             add_string(doc.title), add_string(doc.sort),
+                             add_string(doc.example_title),
+                             add_string(doc.body), len(doc.body))
+
+term_table = bytearray()
+posting_lists = bytearray()
+for term in sorted(postings):
+    term_postings = postings[term]
+    term_table += struct.pack('<3I', add_string(term), len(posting_lists),
+                              len(term_postings))
+    last_doc = 0
+    for doc_num in sorted(term_postings):
+        posting_lists += varint(doc_num - last_doc)
+        posting_lists += varint(term_postings[doc_num])
+        last_doc = doc_num
+
+HEADER_SIZE = 32
+docs_offset = HEADER_SIZE
+terms_offset = docs_offset + len(doc_table)
+postings_offset = terms_offset + len(term_table)
+strings_offset = postings_offset + len(posting_lists)
+
+args.output.write(MAGIC)
+args.output.write(struct.pack('<7I', VERSION, len(docs), len(postings),
+                              docs_offset, terms_offset, postings_offset,
+                              strings_offset))
+args.output.write(doc_table)
+args.output.write(term_table)
+args.output.write(posting_lists)
+args.output.write(strings)
+
+if args.depfile:
+    def escape(path):
+        return path.replace('\\', '\\\\').replace(' ', '\\ ')
+    args.depfile.write(f'{escape(args.output.name)}: ')
+    args.depfile.write(' '.join(escape(path) for path in pages_read))
+    args.depfile.write('\n')
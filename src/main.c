@@ -6,6 +6,7 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <glib.h>
 #include <glib/gi18n.h>
@@ -15,6 +16,7 @@
 #include "app.h"
 #include "error.h"
 #include "searchwindow.h"
+#include "skein-runner.h"
 
 /*
  * version:
@@ -45,6 +47,9 @@ main(int argc, char *argv[])
 	/* Set up the command-line options */
 	gchar **remaining_args = NULL;
 	gboolean print_version = FALSE;
+	char *test_skein_project = NULL;
+	char *skein_worker_story = NULL;
+	int n_jobs = 0;
 	GOptionEntry entries[] = {
 		{
 			.long_name = "version",
@@ -53,6 +58,30 @@ main(int argc, char *argv[])
 			.arg_data = &print_version,
 			.description = N_("Print version information"),
 		},
+		{
+			.long_name = "test-skein",
+			.arg = G_OPTION_ARG_FILENAME,
+			.arg_data = &test_skein_project,
+			.description = N_("Play all the blessed threads in a project's Skein "
+				"without opening a window, and report which knots don't match"),
+			.arg_description = N_("PROJECT"),
+		},
+		{
+			.long_name = "jobs",
+			.short_name = 'j',
+			.arg = G_OPTION_ARG_INT,
+			.arg_data = &n_jobs,
+			.description = N_("Number of stories to run at once with --test-skein "
+				"(default: number of processors)"),
+			.arg_description = N_("N"),
+		},
+		{
+			/* Used internally by --test-skein */
+			.long_name = "skein-worker",
+			.flags = G_OPTION_FLAG_HIDDEN,
+			.arg = G_OPTION_ARG_FILENAME,
+			.arg_data = &skein_worker_story,
+		},
 		{
 			.long_name = G_OPTION_REMAINING,
 			.arg = G_OPTION_ARG_FILENAME_ARRAY,
@@ -81,6 +110,26 @@ main(int argc, char *argv[])
 
 	gtk_init(&argc, &argv);
 
+	/* Playing the Skein in the background starts this program again */
+	g_autofree char *program = NULL;
+	if(g_path_is_absolute(argv[0]) || strchr(argv[0], G_DIR_SEPARATOR))
+		program = g_canonicalize_filename(argv[0], NULL);
+	else
+		program = g_find_program_in_path(argv[0]);
+	i7_skein_runner_set_worker_program(program);
+
+	if(skein_worker_story) {
+		int retval = i7_skein_runner_run_worker(skein_worker_story);
+		g_free(skein_worker_story);
+		return retval;
+	}
+	if(test_skein_project) {
+		int retval = i7_skein_runner_test_project(test_skein_project,
+			n_jobs > 0? n_jobs : g_get_num_processors());
+		g_free(test_skein_project);
+		return retval;
+	}
+
 	/* Initialize the Inform 7 application */
 	/* TRANSLATORS: this is the human-readable application name */
 	g_set_application_name(_("Inform 7"));
@@ -15,6 +15,7 @@
 
 #include "node.h"
 #include "skein.h"
+#include "string-pool.h"
 #include "transcript-diff.h"
 
 #define DIFFERS_BADGE_RADIUS 8.0
@@ -30,7 +31,8 @@ enum {
 	PROP_LOCKED,
 	PROP_PLAYED,
 	PROP_SCORE,
-	PROP_MATCH
+	PROP_MATCH,
+	PROP_DIFFS_CALCULATED
 };
 
 enum {
@@ -44,22 +46,32 @@ enum {
 
 typedef struct _I7NodePrivate {
 	gchar *id; /* Unique ID string for use in saving */
-	gchar *command; /* Game command that this knot represents */
-	gchar *label; /* Author's annotation that appears above this knot */
-	gchar *transcript_text; /* Response produced by the game to this command */
-	gchar *expected_text; /* Response the author thinks should be produced */
+	/* Text, owned by the skein's string pool */
+	I7StringPool *pool;
+	const char *command; /* Game command that this knot represents */
+	const char *label; /* Author's annotation that appears above this knot */
+	const char *transcript_text; /* Response produced by the game to this command */
+	const char *expected_text; /* Response the author thinks should be produced */
 	gboolean changed; /* Whether the response changed since last time this knot was played */
 	gboolean blessed; /* Whether this knot has an expected response */
 	gboolean played; /* Whether this knot is currently in the thread being played */
 	gboolean locked; /* Whether this knot is protected from automatic trimming */
 	gint score; /* The inverse likelihood of this knot being trimmed */
 
+	/* Index of the children by command, for knots with many children; NULL
+	 until needed. Maps each child's command string (owned by the child) to the
+	 first child with that command. */
+	GHashTable *child_index;
+
 	/* Diffs */
 	I7NodeMatchType match;
-	GList *transcript_diffs;
-	GList *expected_diffs;
+	GArray *transcript_diffs;
+	GArray *expected_diffs;
 	char *transcript_pango_string;
 	char *expected_pango_string;
+	unsigned diff_generation; /* Incremented whenever the diffs are cleared */
+	unsigned queued_generation; /* Generation of the diffs being calculated in
+	the background, or 0 if none */
 
 	/* Graphical goodness */
 	cairo_pattern_t *label_pattern;
@@ -70,16 +82,36 @@ typedef struct _I7NodePrivate {
 	GooCanvasItemModel *command_shape_item;
 	GooCanvasItemModel *label_shape_item;
 
-	/* x-coordinate */
+	/* Coordinates from the last layout */
 	gdouble x;
+	gdouble y;
+	gboolean layout_valid; /* Whether the subtree below this knot has moved
+	since the last layout */
 
 	/* Cached values; initialize to -1 */
 	gdouble command_width;
 	gdouble command_height;
 	gdouble label_width;
 	gdouble label_height;
+	gdouble tree_width; /* Width of the subtree below this knot */
 } I7NodePrivate;
 
+/* Snapshot of a knot's texts, for calculating the differences between them on
+ another thread */
+struct _I7NodeDiffJob {
+	I7Node *node; /* owns a reference */
+	I7StringPool *pool; /* owns a reference, may be NULL */
+	unsigned generation;
+	const char *expected_text; /* referenced in @pool */
+	const char *transcript_text; /* referenced in @pool */
+
+	/* Results */
+	GArray *expected_diffs;
+	GArray *transcript_diffs;
+	char *expected_pango_string;
+	char *transcript_pango_string;
+};
+
 G_DEFINE_TYPE_WITH_PRIVATE(I7Node, i7_node, GOO_TYPE_CANVAS_GROUP_MODEL);
 
 /* STATIC FUNCTIONS */
@@ -135,58 +167,99 @@ update_node_background(I7Node *self)
 		g_object_set(priv->badge_item, "visibility", GOO_CANVAS_ITEM_HIDDEN, NULL);
 }
 
+/* Change newline separators in @text to \n, in place. Since the string can only
+ get shorter, no reallocation is needed. Returns @text. */
+static char *
+normalize_newlines(char *text)
+{
+	char *src, *dest;
+	for(src = dest = text; *src; src++, dest++) {
+		if(*src == '\r') {
+			*dest = '\n';
+			if(src[1] == '\n')
+				src++;
+		} else {
+			*dest = *src;
+		}
+	}
+	*dest = '\0';
+	return text;
+}
+
 static void
 clear_diffs(I7Node *self)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
 
-	g_free(priv->transcript_pango_string);
-	g_free(priv->expected_pango_string);
-	g_list_free(priv->transcript_diffs);
-	g_list_free(priv->expected_diffs);
-	
-	priv->match = I7_NODE_CANT_COMPARE;
-	priv->transcript_diffs = NULL;
-	priv->transcript_pango_string = NULL;
-	priv->expected_diffs = NULL;
-	priv->expected_pango_string = NULL;
+	g_clear_pointer(&priv->transcript_pango_string, g_free);
+	g_clear_pointer(&priv->expected_pango_string, g_free);
+	g_clear_pointer(&priv->transcript_diffs, g_array_unref);
+	g_clear_pointer(&priv->expected_diffs, g_array_unref);
+	priv->diff_generation++;
 }
 
+/* Works out whether the transcript text matches the expected text. This is
+ cheap; the word-by-word differences are only calculated in calculate_diffs()
+ when something needs to display them. */
 static void
-calculate_diffs(I7Node *self)
+update_match(I7Node *self)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
 
 	I7NodeMatchType old_match_status = priv->match;
-	
-	clear_diffs(self);
 
-	if(!i7_node_get_blessed(self))
+	if(!priv->blessed)
 		priv->match = I7_NODE_CANT_COMPARE;
-	else if(!word_diff(priv->expected_text, priv->transcript_text, &priv->expected_diffs, &priv->transcript_diffs)) {
-		if(priv->expected_diffs || priv->transcript_diffs)
-			priv->match = I7_NODE_NO_MATCH;
-		else
-			priv->match = I7_NODE_NEAR_MATCH;
-	} else
+	else if(priv->expected_text == priv->transcript_text || strcmp(priv->expected_text, priv->transcript_text) == 0)
 		priv->match = I7_NODE_EXACT_MATCH;
+	else if(same_words(priv->expected_text, priv->transcript_text))
+		priv->match = I7_NODE_NEAR_MATCH;
+	else
+		priv->match = I7_NODE_NO_MATCH;
+
+	if(old_match_status != priv->match)
+		g_object_notify(G_OBJECT(self), "match");
+}
+
+/* Does the word-by-word comparison of two texts and the markup for displaying
+ the differences. Doesn't touch any knot, so it is safe to call from a worker
+ thread. */
+static void
+compute_word_diffs(const char *expected, const char *transcript,
+	GArray **expected_diffs, GArray **transcript_diffs,
+	char **expected_pango_string, char **transcript_pango_string)
+{
+	word_diff(expected, transcript, expected_diffs, transcript_diffs);
+	*transcript_pango_string = make_pango_markup_string(transcript, *transcript_diffs);
+	*expected_pango_string = make_pango_markup_string(expected, *expected_diffs);
+}
+
+/* Calculates the differences and the markup for displaying them, if that
+ hasn't been done since the text last changed */
+static void
+calculate_diffs(I7Node *self)
+{
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
+
+	if(priv->transcript_pango_string && priv->expected_pango_string)
+		return;
+	clear_diffs(self);
 
 	if(priv->match == I7_NODE_NO_MATCH) {
-		priv->transcript_pango_string = make_pango_markup_string(priv->transcript_text, priv->transcript_diffs);
-		priv->expected_pango_string = make_pango_markup_string(priv->expected_text, priv->expected_diffs);
+		compute_word_diffs(priv->expected_text, priv->transcript_text,
+			&priv->expected_diffs, &priv->transcript_diffs,
+			&priv->expected_pango_string, &priv->transcript_pango_string);
 	} else {
 		priv->transcript_pango_string = g_markup_escape_text(priv->transcript_text? priv->transcript_text : "", -1);
 		priv->expected_pango_string = g_markup_escape_text(priv->expected_text? priv->expected_text : "", -1);
 	}
-
-	if(old_match_status != priv->match)
-		g_object_notify(G_OBJECT(self), "match");
 }
 
 static void
 transcript_modified(I7Node *self)
 {
-	calculate_diffs(self);
+	clear_diffs(self);
+	update_match(self);
 	update_node_background(self);
 }
 
@@ -222,17 +295,10 @@ i7_node_set_expected_text(I7Node *self, const gchar *text)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
 
-	g_free(priv->expected_text);
-	priv->expected_text = g_strdup(text? text : ""); /* silently accept NULL */
-
-	/* Change newline separators to \n */
-	if(strstr(priv->expected_text, "\r\n")) {
-		gchar **lines = g_strsplit(priv->expected_text, "\r\n", 0);
-		g_free(priv->expected_text);
-		priv->expected_text = g_strjoinv("\n", lines);
-		g_strfreev(lines);
-	}
-	priv->expected_text = g_strdelimit(priv->expected_text, "\r", '\n');
+	/* Intern the new text before releasing the old, in case they are the same */
+	const char *old_text = priv->expected_text;
+	priv->expected_text = i7_string_pool_intern_take(priv->pool, normalize_newlines(g_strdup(text? text : ""))); /* silently accept NULL */
+	i7_string_pool_release(priv->pool, old_text);
 	priv->blessed = !(strlen(priv->expected_text) == 0);
 
 	transcript_modified(self);
@@ -287,6 +353,8 @@ i7_node_init(I7Node *self)
 
 	priv->blessed = FALSE;
 	priv->match = I7_NODE_CANT_COMPARE;
+	priv->diff_generation = 1;
+	priv->queued_generation = 0;
 	priv->transcript_diffs = NULL;
 	priv->transcript_pango_string = NULL;
 	priv->expected_diffs = NULL;
@@ -329,6 +397,9 @@ i7_node_init(I7Node *self)
 	it really slows down the story startup */
 
 	priv->x = 0.0;
+	priv->y = 0.0;
+	priv->layout_valid = FALSE;
+	priv->tree_width = -1.0;
 	priv->command_width = -1.0;
 	priv->command_height = -1.0;
 	priv->label_width = -1.0;
@@ -409,6 +480,9 @@ i7_node_get_property(GObject *object, guint prop_id, GValue *value, GParamSpec *
 		case PROP_MATCH:
 			g_value_set_int(value, i7_node_get_match_type(self));
 			break;
+		case PROP_DIFFS_CALCULATED:
+			g_value_set_boolean(value, i7_node_get_diffs_calculated(self));
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
 	}
@@ -431,16 +505,18 @@ i7_node_finalize(GObject *object)
 	cairo_pattern_destroy(priv->node_pattern[NODE_UNPLAYED_BLESSED]);
 	cairo_pattern_destroy(priv->node_pattern[NODE_PLAYED_UNBLESSED]);
 	cairo_pattern_destroy(priv->node_pattern[NODE_PLAYED_BLESSED]);
-	g_free(priv->command);
-	g_free(priv->label);
-	g_free(priv->transcript_text);
-	g_free(priv->expected_text);
+	i7_string_pool_release(priv->pool, priv->command);
+	i7_string_pool_release(priv->pool, priv->label);
+	i7_string_pool_release(priv->pool, priv->transcript_text);
+	i7_string_pool_release(priv->pool, priv->expected_text);
+	g_clear_pointer(&priv->pool, i7_string_pool_unref);
 	g_free(priv->transcript_pango_string);
 	g_free(priv->expected_pango_string);
 	g_free(priv->id);
 	goo_canvas_points_unref(self->tree_points);
-	g_list_free(priv->transcript_diffs);
-	g_list_free(priv->expected_diffs);
+	g_clear_pointer(&priv->transcript_diffs, g_array_unref);
+	g_clear_pointer(&priv->expected_diffs, g_array_unref);
+	g_clear_pointer(&priv->child_index, g_hash_table_destroy);
 
 	/* recurse */
 	g_node_children_foreach(self->gnode, G_TRAVERSE_ALL, (GNodeForeachFunc)unref_node, NULL);
@@ -500,6 +576,22 @@ i7_node_class_init(I7NodeClass *klass)
 	    g_param_spec_int("match", "Match type",
 		    "How this node's transcript and expected text differ",
 		    -1, 2, -1, flags | G_PARAM_READABLE));
+	g_object_class_install_property(object_class, PROP_DIFFS_CALCULATED,
+		g_param_spec_boolean("diffs-calculated", "Diffs calculated",
+			"Whether the markup showing the differences is available; notified "
+			"when it arrives from a background calculation",
+			FALSE, flags | G_PARAM_READABLE));
+}
+
+/* Makes the knot keep its text in @skein's string pool. This must happen while
+ all the text is still empty, since the empty string doesn't come from any
+ pool. */
+static void
+use_skein_string_pool(I7Node *self, GooCanvasItemModel *skein)
+{
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
+	if(skein)
+		priv->pool = i7_string_pool_ref(i7_skein_get_string_pool(I7_SKEIN(skein)));
 }
 
 I7Node *
@@ -507,20 +599,98 @@ i7_node_new(const gchar *command, const gchar *label, const gchar *transcript,
 	const gchar *expected, gboolean played, gboolean locked, gboolean changed,
     int score, GooCanvasItemModel *skein)
 {
+	/* The text can only be set once the knot knows about the string pool */
 	I7Node *self = g_object_new(I7_TYPE_NODE,
+		"locked", locked,
+		"played", played,
+		"score", score,
+		NULL);
+	use_skein_string_pool(self, skein);
+	g_object_set(self,
 		"command", command,
 		"label", label,
 		"transcript-text", transcript,
 		"expected-text", expected,
+		NULL);
+	/* Setting the transcript text changes this, so do it afterwards */
+	i7_node_set_changed(self, changed);
+	g_object_set(self, "parent", skein, NULL);
+	return self;
+}
+
+/* Common part of i7_node_new_take() and i7_node_new_interned(); the strings
+ are references in @skein's string pool (or owned, if @skein is %NULL) */
+static I7Node *
+new_with_pooled_text(const char *command, const char *label, const char *transcript,
+	const char *expected, gboolean locked, gboolean changed, int score,
+	GooCanvasItemModel *skein)
+{
+	I7Node *self = g_object_new(I7_TYPE_NODE,
 		"locked", locked,
-		"played", played,
-	    "changed", changed,
 		"score", score,
 		NULL);
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
+	use_skein_string_pool(self, skein);
+
+	/* The construct properties have only set the text to empty strings, which
+	 don't need releasing */
+	priv->command = command;
+	g_object_set(priv->command_item, "text", priv->command, NULL);
+
+	priv->label = label;
+	g_object_set(priv->label_item, "text", priv->label, NULL);
+
+	priv->transcript_text = transcript;
+
+	priv->expected_text = expected;
+	priv->blessed = priv->expected_text[0] != '\0';
+
+	/* Nobody is listening to this knot yet, so no need to notify */
+	priv->changed = changed;
+	transcript_modified(self);
+
 	g_object_set(self, "parent", skein, NULL);
 	return self;
 }
 
+/*
+ * i7_node_new_take:
+ *
+ * Like i7_node_new(), but takes ownership of @command, @label, @transcript and
+ * @expected instead of copying them. Any of them may be %NULL. The new knot is
+ * not played. This is used when loading a skein, where the strings have just
+ * been allocated by the XML reader and would otherwise be copied once more for
+ * nothing.
+ */
+I7Node *
+i7_node_new_take(char *command, char *label, char *transcript, char *expected,
+	gboolean locked, gboolean changed, int score, GooCanvasItemModel *skein)
+{
+	I7StringPool *pool = skein? i7_skein_get_string_pool(I7_SKEIN(skein)) : NULL;
+	return new_with_pooled_text(i7_string_pool_intern_take(pool, command),
+		i7_string_pool_intern_take(pool, label),
+		i7_string_pool_intern_take(pool, transcript? normalize_newlines(transcript) : NULL),
+		i7_string_pool_intern_take(pool, expected? normalize_newlines(expected) : NULL),
+		locked, changed, score, skein);
+}
+
+/*
+ * i7_node_new_interned:
+ *
+ * Like i7_node_new_take(), but @command, @label, @transcript and @expected are
+ * references in @skein's string pool, which the knot takes over. None of them
+ * may be %NULL, and the newlines must already be normalized. This is used when
+ * loading a skein from the binary cache.
+ */
+I7Node *
+i7_node_new_interned(const char *command, const char *label, const char *transcript,
+	const char *expected, gboolean locked, gboolean changed, int score,
+	GooCanvasItemModel *skein)
+{
+	g_return_val_if_fail(skein, NULL);
+	return new_with_pooled_text(command, label, transcript, expected, locked, changed, score, skein);
+}
+
 gchar *
 i7_node_get_command(I7Node *self)
 {
@@ -528,16 +698,34 @@ i7_node_get_command(I7Node *self)
 	return g_strdup(priv->command);
 }
 
+/* Returns the node's command without copying it; the string is owned by the
+ skein's string pool and only valid until the command is changed */
+const char *
+i7_node_peek_command(I7Node *self)
+{
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
+	return priv->command;
+}
+
 void
 i7_node_set_command(I7Node *self, const gchar *command)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
-	g_free(priv->command);
-	priv->command = g_strdup(command? command : ""); /* silently accept NULL */
+	I7Node *parent = self->gnode->parent? self->gnode->parent->data : NULL;
+
+	/* The parent's index refers to the old command string */
+	if(parent)
+		i7_node_child_removed(parent, self);
+	const char *old_command = priv->command;
+	priv->command = i7_string_pool_intern(priv->pool, command); /* silently accept NULL */
+	i7_string_pool_release(priv->pool, old_command);
+	if(parent)
+		i7_node_child_added(parent, self);
 
 	/* Update the graphics */
 	g_object_set(priv->command_item, "text", priv->command, NULL);
 	priv->command_width = priv->command_height = -1.0;
+	i7_node_invalidate_layout(self);
 
 	g_object_notify(G_OBJECT(self), "command");
 }
@@ -550,18 +738,28 @@ i7_node_get_label(I7Node *self)
 	return g_strdup(priv->label);
 }
 
+/* Borrowed, like i7_node_peek_command() */
+const char *
+i7_node_peek_label(I7Node *self)
+{
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
+	return priv->label;
+}
+
 void
 i7_node_set_label(I7Node *self, const gchar *label)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
-	g_free(priv->label);
-	priv->label = g_strdup(label? label : ""); /* silently accept NULL */
+	const char *old_label = priv->label;
+	priv->label = i7_string_pool_intern(priv->pool, label); /* silently accept NULL */
+	i7_string_pool_release(priv->pool, old_label);
 
 	/* Update the graphics */
 
 	g_object_set(priv->label_item, "text", priv->label, NULL);
 	priv->label_width = priv->label_height = -1.0;
 	priv->command_width = priv->command_height = -1.0;
+	i7_node_invalidate_layout(self);
 
 	g_object_notify(G_OBJECT(self), "label");
 }
@@ -580,30 +778,27 @@ i7_node_get_transcript_text(I7Node *self)
 	return g_strdup(priv->transcript_text);
 }
 
+/* Borrowed, like i7_node_peek_command() */
+const char *
+i7_node_peek_transcript_text(I7Node *self)
+{
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
+	return priv->transcript_text;
+}
+
 void
 i7_node_set_transcript_text(I7Node *self, const gchar *transcript)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
 
-	char *old_transcript_text = g_strdup(priv->transcript_text? priv->transcript_text : "");
-
-	g_free(priv->transcript_text);
-	priv->transcript_text = g_strdup(transcript? transcript : ""); /* silently accept NULL */
-
-	/* Change newline separators to \n */
-	if(strstr(priv->transcript_text, "\r\n")) {
-		gchar **lines = g_strsplit(priv->transcript_text, "\r\n", 0);
-		g_free(priv->transcript_text);
-		priv->transcript_text = g_strjoinv("\n", lines);
-		g_strfreev(lines);
-	}
-	priv->transcript_text = g_strdelimit(priv->transcript_text, "\r", '\n');
+	const char *old_transcript_text = priv->transcript_text;
+	priv->transcript_text = i7_string_pool_intern_take(priv->pool, normalize_newlines(g_strdup(transcript? transcript : ""))); /* silently accept NULL */
 
-	if(strcmp(old_transcript_text, priv->transcript_text) != 0)
+	if(strcmp(old_transcript_text? old_transcript_text : "", priv->transcript_text) != 0)
 		i7_node_set_changed(self, TRUE);
 	else
 		i7_node_set_changed(self, FALSE);
-	g_free(old_transcript_text);
+	i7_string_pool_release(priv->pool, old_transcript_text);
 
 	transcript_modified(self);
 
@@ -617,14 +812,20 @@ i7_node_get_expected_text(I7Node *self)
 	return g_strdup(priv->expected_text);
 }
 
+/* Borrowed, like i7_node_peek_command() */
+const char *
+i7_node_peek_expected_text(I7Node *self)
+{
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
+	return priv->expected_text;
+}
+
 const char *
 i7_node_get_transcript_pango_string(I7Node *self)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
 
-	if(!priv->transcript_pango_string)
-		calculate_diffs(self);
-	
+	calculate_diffs(self);
 	return priv->transcript_pango_string;
 }
 
@@ -633,20 +834,136 @@ i7_node_get_expected_pango_string(I7Node *self)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
 
-	if(!priv->expected_pango_string)
-		calculate_diffs(self);
-	
+	calculate_diffs(self);
 	return priv->expected_pango_string;
 }
 
-I7NodeMatchType
-i7_node_get_match_type(I7Node *self)
+/*
+ * i7_node_get_diffs_calculated:
+ * @self: the knot
+ *
+ * Returns %TRUE if i7_node_get_transcript_pango_string() and
+ * i7_node_get_expected_pango_string() will return quickly. If %FALSE, they
+ * have to compare the texts word by word, which can take a while for long
+ * transcripts; consider i7_skein_queue_diffs() instead, and wait for
+ * #I7Node:diffs-calculated to be notified.
+ */
+gboolean
+i7_node_get_diffs_calculated(I7Node *self)
+{
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
+	return priv->match != I7_NODE_NO_MATCH ||
+		(priv->transcript_pango_string != NULL && priv->expected_pango_string != NULL);
+}
+
+/*
+ * i7_node_diff_job_new:
+ * @self: the knot
+ *
+ * Takes a snapshot of @self's texts, so that the differences between them can
+ * be calculated on another thread with i7_node_diff_job_run(). Must be called
+ * on the main thread.
+ *
+ * Returns: (nullable): a new job, or %NULL if there is nothing to calculate or
+ * the calculation is already underway.
+ */
+I7NodeDiffJob *
+i7_node_diff_job_new(I7Node *self)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
 
-	if(!priv->expected_pango_string || !priv->transcript_pango_string)
-		calculate_diffs(self);
+	if(i7_node_get_diffs_calculated(self) || priv->queued_generation == priv->diff_generation)
+		return NULL;
+
+	I7NodeDiffJob *job = g_new0(I7NodeDiffJob, 1);
+	job->node = g_object_ref(self);
+	job->pool = priv->pool? i7_string_pool_ref(priv->pool) : NULL;
+	job->generation = priv->diff_generation;
+	/* Referencing the strings keeps them alive even if the knot's text changes
+	 in the meantime */
+	job->expected_text = i7_string_pool_intern(job->pool, priv->expected_text);
+	job->transcript_text = i7_string_pool_intern(job->pool, priv->transcript_text);
+
+	priv->queued_generation = priv->diff_generation;
+	return job;
+}
 
+/*
+ * i7_node_diff_job_run:
+ * @job: a job from i7_node_diff_job_new()
+ *
+ * Calculates the differences. Doesn't touch the knot, so it may be called on
+ * any thread.
+ */
+void
+i7_node_diff_job_run(I7NodeDiffJob *job)
+{
+	compute_word_diffs(job->expected_text, job->transcript_text,
+		&job->expected_diffs, &job->transcript_diffs,
+		&job->expected_pango_string, &job->transcript_pango_string);
+}
+
+/*
+ * i7_node_diff_job_finish:
+ * @job: a job from i7_node_diff_job_new(), that has been run
+ *
+ * Gives the results of @job to its knot, and frees @job. Must be called on the
+ * main thread. The results are thrown away if the knot's text changed since the
+ * job was created.
+ */
+void
+i7_node_diff_job_finish(I7NodeDiffJob *job)
+{
+	I7Node *self = job->node;
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
+
+	if(priv->queued_generation == job->generation)
+		priv->queued_generation = 0;
+
+	/* The results may also be stale because they were needed sooner and
+	 calculated on the main thread */
+	if(job->generation == priv->diff_generation && !i7_node_get_diffs_calculated(self)) {
+		g_clear_pointer(&priv->transcript_pango_string, g_free);
+		g_clear_pointer(&priv->expected_pango_string, g_free);
+		priv->expected_diffs = g_steal_pointer(&job->expected_diffs);
+		priv->transcript_diffs = g_steal_pointer(&job->transcript_diffs);
+		priv->expected_pango_string = g_steal_pointer(&job->expected_pango_string);
+		priv->transcript_pango_string = g_steal_pointer(&job->transcript_pango_string);
+		g_object_notify(G_OBJECT(self), "diffs-calculated");
+	}
+
+	i7_node_diff_job_free(job);
+}
+
+/*
+ * i7_node_diff_job_free:
+ * @job: a job from i7_node_diff_job_new()
+ *
+ * Frees @job without using its results. Must be called on the main thread.
+ */
+void
+i7_node_diff_job_free(I7NodeDiffJob *job)
+{
+	I7NodePrivate *priv = i7_node_get_instance_private(job->node);
+
+	if(priv->queued_generation == job->generation)
+		priv->queued_generation = 0;
+
+	i7_string_pool_release(job->pool, job->expected_text);
+	i7_string_pool_release(job->pool, job->transcript_text);
+	g_clear_pointer(&job->pool, i7_string_pool_unref);
+	g_clear_pointer(&job->expected_diffs, g_array_unref);
+	g_clear_pointer(&job->transcript_diffs, g_array_unref);
+	g_free(job->expected_pango_string);
+	g_free(job->transcript_pango_string);
+	g_object_unref(job->node);
+	g_free(job);
+}
+
+I7NodeMatchType
+i7_node_get_match_type(I7Node *self)
+{
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
 	return priv->match;
 }
 
@@ -654,9 +971,8 @@ i7_node_get_match_type(I7Node *self)
  * i7_node_get_different:
  * @self: the knot.
  *
- * Computes the differences between the transcript text and expected text, and
- * returns %TRUE if they do not match. Returns %FALSE if they do match, or if
- * there is no expected text.
+ * Returns %TRUE if the transcript text and expected text do not match. This is
+ * cheap, since it doesn't compute the differences themselves.
  *
  * Returns: %TRUE if transcript text and expected text differ, %FALSE if not
  * or if there is no expected text.
@@ -665,10 +981,6 @@ gboolean
 i7_node_get_different(I7Node *self)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
-
-	if(!priv->expected_pango_string || !priv->transcript_pango_string)
-		calculate_diffs(self);
-
 	return (priv->match == I7_NODE_NEAR_MATCH || priv->match == I7_NODE_NO_MATCH);
 }
 
@@ -737,26 +1049,60 @@ void i7_node_set_score(I7Node *self, gint score)
 	g_object_notify(G_OBJECT(self), "score");
 }
 
-gdouble
-i7_node_get_tree_width(I7Node *self, GooCanvasItemModel *skein, GooCanvas *canvas)
+static gdouble
+get_tree_width(I7Node *self, GooCanvasItemModel *skein, GooCanvas *canvas, gdouble spacing)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
-	gdouble spacing;
-	g_object_get(skein, "horizontal-spacing", &spacing, NULL);
+
+	if(priv->tree_width >= 0.0)
+		return priv->tree_width;
 
 	/* Get the tree width of all children */
-	unsigned i;
+	GNode *child;
 	gdouble total = 0.0;
-	for(i = 0; i < g_node_n_children(self->gnode); i++) {
-		total += i7_node_get_tree_width(g_node_nth_child(self->gnode, i)->data, skein, canvas);
-		if(i > 0)
+	for(child = self->gnode->children; child; child = child->next) {
+		total += get_tree_width(child->data, skein, canvas, spacing);
+		if(child != self->gnode->children)
 			total += spacing;
 	}
-	/* Return whichever is larger, that or the node width */
+	/* Cache whichever is larger, that or the node width */
 	if(priv->command_width < 0.0)
 		i7_node_calculate_size(self, skein, canvas);
 	gdouble width = MAX(priv->command_width, priv->label_width);
-	return MAX(total, width);
+	priv->tree_width = MAX(total, width);
+	return priv->tree_width;
+}
+
+gdouble
+i7_node_get_tree_width(I7Node *self, GooCanvasItemModel *skein, GooCanvas *canvas)
+{
+	gdouble spacing;
+	g_object_get(skein, "horizontal-spacing", &spacing, NULL);
+	return get_tree_width(self, skein, canvas, spacing);
+}
+
+/*
+ * i7_node_invalidate_layout:
+ * @self: the knot
+ *
+ * Forgets the cached tree widths and layout of @self and all of its ancestors.
+ * Call this whenever the size of @self changes, or when knots are added below
+ * it or removed from below it. Only the path up to the root is affected, so
+ * the next layout only has to recompute the widths along that path.
+ */
+void
+i7_node_invalidate_layout(I7Node *self)
+{
+	GNode *gnode;
+	for(gnode = self->gnode; gnode; gnode = gnode->parent) {
+		I7NodePrivate *priv = i7_node_get_instance_private(gnode->data);
+		/* If an ancestor is already invalid, then so are all of its
+		 ancestors */
+		if(gnode != self->gnode && priv->tree_width < 0.0 && !priv->layout_valid)
+			break;
+		priv->tree_width = -1.0;
+		priv->layout_valid = FALSE;
+	}
 }
 
 const gchar *
@@ -778,29 +1124,114 @@ i7_node_is_root(I7Node *self)
 	return self->gnode->parent == NULL;
 }
 
+/* Knots with more children than this get a child index */
+#define CHILD_INDEX_THRESHOLD 8
+
+/* Returns the first child of @self with @command, other than @except, by
+ looking through all the children */
+static I7Node *
+scan_children(I7Node *self, const char *command, I7Node *except)
+{
+	GNode *gnode;
+	for(gnode = self->gnode->children; gnode; gnode = gnode->next) {
+		I7NodePrivate *child_priv = i7_node_get_instance_private(gnode->data);
+		if(gnode->data != except && strcmp(child_priv->command, command) == 0)
+			return gnode->data;
+	}
+	return NULL;
+}
+
+static void
+build_child_index(I7Node *self)
+{
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
+	priv->child_index = g_hash_table_new(g_str_hash, g_str_equal);
+
+	/* Add in reverse order, so that the first child with any given command
+	 wins */
+	GNode *gnode;
+	for(gnode = g_node_last_child(self->gnode); gnode; gnode = gnode->prev) {
+		I7NodePrivate *child_priv = i7_node_get_instance_private(gnode->data);
+		g_hash_table_insert(priv->child_index, (char *)child_priv->command, gnode->data);
+	}
+}
+
+/*
+ * i7_node_child_added:
+ * @self: the knot
+ * @child: a knot that was just linked in as a child of @self
+ *
+ * Keeps the index used by i7_node_find_child() up to date. Call this after
+ * linking a child into the tree, except while building a new tree that
+ * i7_node_find_child() hasn't been called on yet.
+ */
+void
+i7_node_child_added(I7Node *self, I7Node *child)
+{
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
+	I7NodePrivate *child_priv = i7_node_get_instance_private(child);
+
+	if(!priv->child_index)
+		return;
+
+	/* If there's already a child with the same command, the index must keep
+	 pointing to whichever one comes first */
+	I7Node *existing = g_hash_table_lookup(priv->child_index, child_priv->command);
+	if(existing && existing != child) {
+		GNode *gnode;
+		for(gnode = child->gnode->next; gnode; gnode = gnode->next) {
+			if(gnode->data == existing)
+				break;
+		}
+		if(!gnode)
+			return; /* @existing comes first */
+	}
+	g_hash_table_insert(priv->child_index, (char *)child_priv->command, child);
+}
+
+/*
+ * i7_node_child_removed:
+ * @self: the knot
+ * @child: a knot that was just unlinked from @self's children
+ *
+ * Keeps the index used by i7_node_find_child() up to date. Call this after
+ * unlinking a child, before the child's command can be freed.
+ */
+void
+i7_node_child_removed(I7Node *self, I7Node *child)
+{
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
+	I7NodePrivate *child_priv = i7_node_get_instance_private(child);
+
+	if(!priv->child_index || g_hash_table_lookup(priv->child_index, child_priv->command) != child)
+		return;
+
+	g_hash_table_remove(priv->child_index, child_priv->command);
+	I7Node *next = scan_children(self, child_priv->command, child);
+	if(next) {
+		I7NodePrivate *next_priv = i7_node_get_instance_private(next);
+		g_hash_table_insert(priv->child_index, (char *)next_priv->command, next);
+	}
+}
+
 /* Is there a child node with the given command? (@command should already be
 escaped.) */
 I7Node *
 i7_node_find_child(I7Node *self, const gchar *command)
 {
-	I7Node *node = NULL;
-	GNode *gnode = self->gnode->children;
+	I7NodePrivate *priv = i7_node_get_instance_private(self);
+
 	/* Special case: NULL is treated as "" */
 	if (!command) {
 		command = "";
 	}
-	while(gnode != NULL) {
-		gchar *cmp_command = i7_node_get_command(I7_NODE(gnode->data));
-		if((strlen(cmp_command) == 0 && strlen(command) == 0) || strcmp(cmp_command, command) == 0) {
-			g_free(cmp_command);
-			node = gnode->data;
-			break;
-		}
-		gnode = gnode->next;
-		g_free(cmp_command);
-	}
 
-	return node;
+	if(!priv->child_index) {
+		if(g_node_n_children(self->gnode) <= CHILD_INDEX_THRESHOLD)
+			return scan_children(self, command, NULL);
+		build_child_index(self);
+	}
+	return g_hash_table_lookup(priv->child_index, command);
 }
 
 /*
@@ -888,90 +1319,67 @@ i7_node_get_next_difference(I7Node *node)
 	return NULL;
 }
 
-static void
-write_child_pointer(GNode *gnode, GString *string)
-{
-	I7NodePrivate *priv = i7_node_get_instance_private(I7_NODE(gnode->data));
-	g_string_append_printf(string, "      <child nodeId=\"%s\"/>\n", priv->id);
-}
-
-gchar *
-i7_node_get_xml(I7Node *self)
+gdouble
+i7_node_get_x(I7Node *self)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
-
-	/* Escape the following strings if necessary */
-	gchar *command = g_markup_escape_text(priv->command, -1);
-	gchar *transcript_text = g_markup_escape_text(priv->transcript_text, -1);
-	gchar *expected_text = g_markup_escape_text(priv->expected_text, -1);
-	gchar *label = g_markup_escape_text(priv->label, -1);
-
-	GString *string = g_string_new("");
-	g_string_append_printf(string, "  <item nodeId=\"%s\">\n", priv->id);
-	g_string_append_printf(string, "    <command xml:space=\"preserve\">%s</command>\n", command);
-	g_string_append_printf(string, "    <result xml:space=\"preserve\">%s</result>\n", transcript_text);
-	g_string_append_printf(string, "    <commentary xml:space=\"preserve\">%s</commentary>\n", expected_text);
-	g_string_append_printf(string, "    <played>%s</played>\n", priv->played? "YES" : "NO");
-	g_string_append_printf(string, "    <changed>%s</changed>\n", priv->changed? "YES" : "NO");
-	g_string_append_printf(string, "    <temporary score=\"%d\">%s</temporary>\n", priv->score, priv->locked? "NO" : "YES");
-
-	if(label)
-		g_string_append_printf(string, "    <annotation xml:space=\"preserve\">%s</annotation>\n", label);
-	if(self->gnode->children) {
-		g_string_append(string, "    <children>\n");
-		g_node_children_foreach(self->gnode, G_TRAVERSE_ALL, (GNodeForeachFunc)write_child_pointer, string);
-		g_string_append(string, "    </children>\n");
-	}
-	g_string_append(string, "  </item>\n");
-	/* Free strings if necessary */
-	g_free(command);
-	g_free(transcript_text);
-	g_free(expected_text);
-	g_free(label);
-
-	return g_string_free(string, FALSE); /* return cstr */
+	return priv->x;
 }
 
 gdouble
-i7_node_get_x(I7Node *self)
+i7_node_get_y(I7Node *self)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
-	return priv->x;
+	return priv->y;
 }
 
-void
-i7_node_layout(I7Node *self, GooCanvasItemModel *skein, GooCanvas *canvas, gdouble x)
+static void
+layout_recurse(I7Node *self, GooCanvasItemModel *skein, GooCanvas *canvas, gdouble x, gdouble y, gdouble hspacing, gdouble vspacing)
 {
 	I7NodePrivate *priv = i7_node_get_instance_private(self);
 
-	gdouble hspacing, vspacing;
-	g_object_get(skein,
-		"horizontal-spacing", &hspacing,
-		"vertical-spacing", &vspacing,
-		NULL);
+	/* If nothing changed below this knot since the last layout, and the knot
+	 itself didn't move, then nothing below it moves either */
+	if(priv->layout_valid && priv->x == x && priv->y == y)
+		return;
 
 	if(g_node_n_children(self->gnode) == 1)
-		i7_node_layout(self->gnode->children->data, skein, canvas, x);
+		layout_recurse(self->gnode->children->data, skein, canvas, x, y + vspacing, hspacing, vspacing);
 	else {
 		/* Find the total width of all descendant nodes */
-		gdouble total = i7_node_get_tree_width(self, skein, canvas);
+		gdouble total = get_tree_width(self, skein, canvas, hspacing);
 		/* Lay out each child node */
 		GNode *child;
 		gdouble child_x = 0.0;
 
 		for(child = self->gnode->children; child; child = child->next) {
-			gdouble treewidth = i7_node_get_tree_width(child->data, skein, canvas);
-			i7_node_layout(child->data, skein, canvas, x - total * 0.5 + child_x + treewidth * 0.5);
+			gdouble treewidth = get_tree_width(child->data, skein, canvas, hspacing);
+			layout_recurse(child->data, skein, canvas, x - total * 0.5 + child_x + treewidth * 0.5, y + vspacing, hspacing, vspacing);
 			child_x += treewidth + hspacing;
 		}
 	}
 
 	/* Move the node's group to its proper place */
-	gdouble y = (gdouble)(g_node_depth(self->gnode) - 1.0) * vspacing;
-	g_object_set(self, "x", x, "y", y, NULL);
-	
-	/* Cache the x coordinate */
+	if(priv->x != x || priv->y != y)
+		g_object_set(self, "x", x, "y", y, NULL);
+
+	/* Cache the coordinates */
 	priv->x = x;
+	priv->y = y;
+	priv->layout_valid = TRUE;
+}
+
+void
+i7_node_layout(I7Node *self, GooCanvasItemModel *skein, GooCanvas *canvas, gdouble x)
+{
+	gdouble hspacing, vspacing;
+	g_object_get(skein,
+		"horizontal-spacing", &hspacing,
+		"vertical-spacing", &vspacing,
+		NULL);
+
+	gdouble y = (gdouble)(g_node_depth(self->gnode) - 1.0) * vspacing;
+	layout_recurse(self, skein, canvas, x, y, hspacing, vspacing);
 }
 
 static void
@@ -1066,7 +1474,11 @@ i7_node_calculate_size(I7Node *self, GooCanvasItemModel *skein, GooCanvas *canva
 	command_height_changed = command_height != 0.0 && priv->command_height != command_height;
 	label_width_changed = label_width != 0.0 && priv->label_width != label_width;
 	label_height_changed = label_height != 0.0 && priv->label_height != label_height;
-	
+
+	/* If the knot had a size already, then its tree width is now wrong */
+	if((command_width_changed && priv->command_width >= 0.0) || (label_width_changed && priv->label_width >= 0.0))
+		i7_node_invalidate_layout(self);
+
 	if(command_width_changed || command_height_changed)
 		redraw_command(self, command_width, command_height);
 
@@ -1107,6 +1519,7 @@ i7_node_invalidate_size(I7Node *self)
 	priv->command_height = -1.0;
 	priv->label_width = -1.0;
 	priv->label_height = -1.0;
+	i7_node_invalidate_layout(self);
 }
 
 static gboolean
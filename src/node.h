@@ -19,6 +19,7 @@
 
 typedef struct _I7NodeClass I7NodeClass;
 typedef struct _I7Node I7Node;
+typedef struct _I7NodeDiffJob I7NodeDiffJob;
 
 struct _I7NodeClass {
 	GooCanvasGroupModelClass parent_class;
@@ -48,18 +49,29 @@ GType i7_node_get_type(void) G_GNUC_CONST;
 I7Node *i7_node_new(const gchar *line, const gchar *label, const gchar *transcript,
 	const gchar *expected, gboolean played, gboolean locked, gboolean changed,
     int score, GooCanvasItemModel *skein);
+I7Node *i7_node_new_take(char *command, char *label, char *transcript,
+	char *expected, gboolean locked, gboolean changed, int score,
+	GooCanvasItemModel *skein);
+I7Node *i7_node_new_interned(const char *command, const char *label,
+	const char *transcript, const char *expected, gboolean locked,
+	gboolean changed, int score, GooCanvasItemModel *skein);
 
 /* Properties */
 gchar *i7_node_get_command(I7Node *self);
+const char *i7_node_peek_command(I7Node *self);
 void i7_node_set_command(I7Node *self, const gchar *line);
 gchar *i7_node_get_label(I7Node *self);
+const char *i7_node_peek_label(I7Node *self);
 void i7_node_set_label(I7Node *self, const gchar *label);
 gboolean i7_node_has_label(I7Node *self);
 gchar *i7_node_get_transcript_text(I7Node *self);
+const char *i7_node_peek_transcript_text(I7Node *self);
 void i7_node_set_transcript_text(I7Node *self, const gchar *transcript);
 gchar *i7_node_get_expected_text(I7Node *self);
+const char *i7_node_peek_expected_text(I7Node *self);
 const char *i7_node_get_transcript_pango_string(I7Node *self);
 const char *i7_node_get_expected_pango_string(I7Node *self);
+gboolean i7_node_get_diffs_calculated(I7Node *self);
 I7NodeMatchType i7_node_get_match_type(I7Node *self);
 gboolean i7_node_get_different(I7Node *self);
 gboolean i7_node_get_changed(I7Node *self);
@@ -76,19 +88,28 @@ void i7_node_set_score(I7Node *self, gint score);
 gboolean i7_node_in_thread(I7Node *self, I7Node *endnode);
 gboolean i7_node_is_root(I7Node *self);
 I7Node *i7_node_find_child(I7Node *self, const gchar *command);
+void i7_node_child_added(I7Node *self, I7Node *child);
+void i7_node_child_removed(I7Node *self, I7Node *child);
 I7Node *i7_node_get_next_difference_below(I7Node *node);
 I7Node *i7_node_get_next_difference(I7Node *node);
 
+/* Calculating differences on another thread */
+I7NodeDiffJob *i7_node_diff_job_new(I7Node *self);
+void i7_node_diff_job_run(I7NodeDiffJob *job);
+void i7_node_diff_job_finish(I7NodeDiffJob *job);
+void i7_node_diff_job_free(I7NodeDiffJob *job);
+
 /* Serialization */
 const gchar *i7_node_get_unique_id(I7Node *self);
-gchar *i7_node_get_xml(I7Node *self);
 
 /* Drawing on a GooCanvas */
 gdouble i7_node_get_x(I7Node *self);
+gdouble i7_node_get_y(I7Node *self);
 gdouble i7_node_get_tree_width(I7Node *self, GooCanvasItemModel *skein, GooCanvas *canvas);
 void i7_node_layout(I7Node *self, GooCanvasItemModel *skein, GooCanvas *canvas, gdouble x);
 void i7_node_calculate_size(I7Node *self, GooCanvasItemModel *skein, GooCanvas *canvas);
 void i7_node_invalidate_size(I7Node *self);
+void i7_node_invalidate_layout(I7Node *self);
 gboolean i7_node_get_command_coordinates(I7Node *self, GdkRectangle *rect, GooCanvas *canvas);
 gboolean i7_node_get_label_coordinates(I7Node *self, GdkRectangle *rect, GooCanvas *canvas);
 
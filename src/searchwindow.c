@@ -11,10 +11,10 @@
 #include <glib.h>
 #include <glib/gi18n.h>
 #include <gtk/gtk.h>
-#include <libxml/HTMLparser.h>
 #include <webkit2/webkit2.h>
 
 #include "app.h"
+#include "doc-index.h"
 #include "document.h"
 #include "error.h"
 #include "file.h"
@@ -22,23 +22,10 @@
 #include "searchwindow.h"
 #include "story.h"
 
-/* An index of the text of the documentation and example pages. Only built
-the first time someone does a documentation search, and freed at the end of the
-main program. */
-static GList *doc_index = NULL;
-
-typedef struct {
-	gboolean is_example;
-	gboolean is_recipebook;
-	gchar *section;
-	gchar *title;
-	gchar *sort;
-	gchar *body;
-	GFile *file;
-	char *anchor;
-
-	char *example_title;
-} DocText;
+/* An index of the text of the documentation and example pages, generated when
+building. Only loaded the first time someone does a documentation search, and
+freed at the end of the main program. */
+static I7DocIndex *doc_index = NULL;
 
 /* Columns for the search results tree view */
 typedef enum {
@@ -60,21 +47,6 @@ typedef enum {
 	I7_RESULT_TYPE_RECIPE_BOOK
 } I7ResultType;
 
-typedef struct {
-	GString *chars;
-	int ignore;
-	gboolean in_ignore_section;
-
-	/* Metadata */
-	DocText *doctext;
-
-	/* Stacks that we push onto when we encounter subsections */
-	GSList *chars_stack;  /* type GString */
-	GSList *doctext_stack;  /* type DocText */
-
-	GSList *completed_doctexts;
-} Ctxt;
-
 struct _I7SearchWindow {
 	GtkDialog parent;
 
@@ -392,27 +364,6 @@ update_label(I7SearchWindow *self)
 	gtk_label_set_text(self->results_label, label);
 }
 
-static gboolean
-is_ignore_element(const xmlChar *name)
-{
-	return xmlStrcasecmp(name, (xmlChar *)"style") == 0
-		|| xmlStrcasecmp(name, (xmlChar *)"script") == 0;
-}
-
-static void
-start_element_callback(Ctxt *ctxt, const xmlChar *name, const xmlChar **atts)
-{
-	if(is_ignore_element(name))
-		ctxt->ignore++;
-}
-
-static void
-end_element_callback(Ctxt *ctxt, const xmlChar *name)
-{
-	if(is_ignore_element(name))
-		ctxt->ignore--;
-}
-
 /* Collapse multiple white space characters into one space  */
 static char *
 collapse_whitespace(const char *ch, ssize_t len)
@@ -436,152 +387,6 @@ collapse_whitespace(const char *ch, ssize_t len)
 	return condensed;
 }
 
-static void
-character_callback(Ctxt *ctxt, const xmlChar *ch, int len)
-{
-	if(ctxt->ignore != 0 || ctxt->in_ignore_section)
-		return;
-
-	g_autofree char *condensed = collapse_whitespace((const char *)ch, len);
-
-	if (ctxt->chars->len && ctxt->chars->str[ctxt->chars->len - 1] != ' ')
-		g_string_append_c(ctxt->chars, ' ');
-	g_string_append(ctxt->chars, g_strstrip(condensed));
-}
-
-static DocText *
-dup_doctext(const DocText *doctext)
-{
-	DocText *retval = g_slice_new0(DocText);
-	retval->is_recipebook = doctext->is_recipebook;
-	retval->section = g_strdup(doctext->section);
-	retval->title = g_strdup(doctext->title);
-	retval->sort = g_strdup(doctext->sort);
-	retval->file = g_object_ref(doctext->file);
-	return retval;
-}
-
-static void
-comment_callback(Ctxt *ctxt, const xmlChar *value)
-{
-	/* Extract metadata from comments. Use sscanf() to be lenient about space */
-	if (sscanf((char *) value, " SEARCH TITLE \"%m[^\"]\"", &ctxt->doctext->title) == 1)
-		return;
-	if (sscanf((char *) value, " SEARCH SECTION \"%m[^\"]\"", &ctxt->doctext->section) == 1)
-		return;
-	if (sscanf((char *) value, " SEARCH SORT \"%m[^\"]\"", &ctxt->doctext->sort) == 1)
-		return;
-
-	/* From here on, these are particular subsections of the documentation page,
-	such as examples. We assume that the above metadata always appear before a
-	subsection can appear. */
-
-	if (sscanf((char *) value, " START EXAMPLE \"%m[^\"]\" \"%m[^\"]\"", &ctxt->doctext->example_title, &ctxt->doctext->anchor) == 2) {
-		ctxt->chars_stack = g_slist_prepend(ctxt->chars_stack, g_steal_pointer(&ctxt->chars));
-		ctxt->chars = g_string_new("");
-
-		DocText *doctext = dup_doctext(ctxt->doctext);
-		doctext->is_example = true;
-		doctext->anchor = g_steal_pointer(&ctxt->doctext->anchor);
-		doctext->example_title = g_steal_pointer(&ctxt->doctext->example_title);
-		ctxt->doctext_stack = g_slist_prepend(ctxt->doctext_stack, g_steal_pointer(&ctxt->doctext));
-		ctxt->doctext = doctext;
-		return;
-	}
-
-	char section_type[8];  /* len(EXAMPLE) + 1 */
-	if (sscanf((char *) value, " START %7s \"%m[^\"]\"", section_type, &ctxt->doctext->anchor) == 2) {
-		if (strcmp(section_type, "CODE") != 0 && strcmp(section_type, "PHRASE") != 0) {
-			g_warning("Unhandled START %s section in doc comments", section_type);
-			return;
-		}
-
-		ctxt->chars_stack = g_slist_prepend(ctxt->chars_stack, g_steal_pointer(&ctxt->chars));
-		ctxt->chars = g_string_new("");
-
-		DocText *doctext = dup_doctext(ctxt->doctext);
-		doctext->anchor = g_steal_pointer(&ctxt->doctext->anchor);
-		ctxt->doctext_stack = g_slist_prepend(ctxt->doctext_stack, g_steal_pointer(&ctxt->doctext));
-		ctxt->doctext = doctext;
-		return;
-	}
-	
-	if (sscanf((char *) value, " START %7s", section_type) == 1) {
-		if (strcmp(section_type, "IGNORE") == 0) {
-			ctxt->in_ignore_section = true;
-			return;
-		}
-
-		g_warning("Unhandled START %s section in doc comments", section_type);
-	}
-
-	if (sscanf((char *) value, " END %7s", section_type) == 1) {
-		if (strcmp(section_type, "EXAMPLE") == 0 || strcmp(section_type, "CODE") == 0 || strcmp(section_type, "PHRASE") == 0) {
-			ctxt->doctext->body = g_string_free(ctxt->chars, false);
-			ctxt->completed_doctexts = g_slist_prepend(ctxt->completed_doctexts, ctxt->doctext);
-
-			/* Awkward idiom to pop the first item of GSList */
-			GSList *head = ctxt->doctext_stack;
-			ctxt->doctext_stack = g_slist_remove_link(ctxt->doctext_stack, head);
-			ctxt->doctext = head->data;
-			g_slist_free1(head);
-
-			head = ctxt->chars_stack;
-			ctxt->chars_stack = g_slist_remove_link(ctxt->chars_stack, head);
-			ctxt->chars = head->data;
-			g_slist_free1(head);
-			return;
-		}
-
-		if (strcmp(section_type, "IGNORE") == 0) {
-			ctxt->in_ignore_section = false;
-			return;
-		}
-
-		g_warning("Unhandled END %s section in doc comments", section_type);
-	}
-}
-
-xmlSAXHandler i7_html_sax = {
-	.startElement = (startElementSAXFunc)start_element_callback,
-	.endElement = (endElementSAXFunc)end_element_callback,
-	.characters = (charactersSAXFunc)character_callback,
-	.comment = (commentSAXFunc)comment_callback,
-};
-
-static GSList *
-html_to_ascii(GFile *file, gboolean is_recipebook)
-{
-	Ctxt *ctxt = g_slice_new0(Ctxt);
-	ctxt->chars = g_string_new("");
-	DocText *doctext = g_slice_new0(DocText);
-	doctext->is_recipebook = is_recipebook;
-	doctext->file = g_object_ref(file);
-	ctxt->doctext = doctext;
-
-	g_autoptr(GError) error = NULL;
-	g_autofree char *html_contents = NULL;
-	/* file is in a GResource in memory, this doesn't block */
-	if (!g_file_load_contents(doctext->file, /* cancellable = */ NULL,
-		&html_contents, /* length = */ NULL, /* etag = */ NULL, &error)) {
-		g_autofree char *uri = g_file_get_uri(doctext->file);
-		g_warning("Error loading documentation resource '%s': %s", uri, error->message);
-		return NULL;
-	}
-
-	// COMPAT: 2.11 - use htmlNewSAXParserCtxt()
-	htmlParserCtxtPtr html_parser = htmlNewParserCtxt();
-	html_parser->sax = &i7_html_sax;
-	html_parser->userData = ctxt;
-	xmlFreeDoc(htmlCtxtReadDoc(html_parser, (xmlChar *) html_contents,
-		/* URL = */ NULL, /* encoding = */ NULL, HTML_PARSE_NONET));
-
-	doctext->body = g_string_free(ctxt->chars, FALSE);
-	GSList *retval = g_slist_prepend(ctxt->completed_doctexts, ctxt->doctext);
-	g_slice_free(Ctxt, ctxt);
-	return retval;
-}
-
 /* Borrow from searchbar.c */
 extern gboolean find_no_wrap(const GtkTextIter *, const char *, gboolean, GtkTextSearchFlags, I7SearchFlags, GtkTextIter *, GtkTextIter *);
 
@@ -621,15 +426,17 @@ extract_context(GtkTextBuffer *buffer, GtkTextIter *match_start, GtkTextIter *ma
 	return context;
 }
 
-/* Helper function: search one documentation page */
+/* Helper function: search one documentation page, starting at @start_offset
+ since there can be no match before it */
 static void
-search_documentation(DocText *doctext, I7SearchWindow *self)
+search_documentation(I7SearchWindow *self, GFile *doc_dir, const I7DocText *doctext, unsigned start_offset)
 {
 	GtkTreeIter result;
 	GtkTextIter search_from, match_start, match_end;
 	g_autoptr(GtkTextBuffer) buffer = gtk_text_buffer_new(NULL);
 	gtk_text_buffer_set_text(buffer, doctext->body, -1);
-	gtk_text_buffer_get_start_iter(buffer, &search_from);
+	gtk_text_buffer_get_iter_at_offset(buffer, &search_from, start_offset);
+	g_autoptr(GFile) file = g_file_get_child(doc_dir, doctext->file);
 	bool ignore_case = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(self->ignore_case));
 	I7SearchFlags algorithm = gtk_combo_box_get_active(GTK_COMBO_BOX(self->search_type));
 	const char *text = gtk_entry_get_text(GTK_ENTRY(self->entry));
@@ -650,7 +457,7 @@ search_documentation(DocText *doctext, I7SearchWindow *self)
 		gtk_list_store_set(self->results, &result,
 			I7_RESULT_CONTEXT_COLUMN, context,
 			I7_RESULT_SORT_STRING_COLUMN, doctext->sort,
-			I7_RESULT_FILE_COLUMN, doctext->file,
+			I7_RESULT_FILE_COLUMN, file,
 			I7_RESULT_ANCHOR_COLUMN, doctext->anchor,
 			I7_RESULT_RESULT_TYPE_COLUMN, doctext->is_recipebook?
 				I7_RESULT_TYPE_RECIPE_BOOK : I7_RESULT_TYPE_DOCUMENTATION,
@@ -680,64 +487,35 @@ stop_spinner(I7SearchWindow *self)
 	gtk_widget_hide(GTK_WIDGET(self->spinner));
 }
 
-/* Search the documentation pages for the string 'text', building the index
+/* Search the documentation pages for the string 'text', loading the index
   if necessary */
 static void
 i7_search_window_search_documentation(I7SearchWindow *self)
 {
-	GError *err;
-
-	if(doc_index == NULL) { /* documentation index hasn't been built yet */
-		g_autoptr(GFile) doc_file = g_file_new_for_uri("resource:///com/inform7/IDE/inform");
-
-		GFileEnumerator *docdir;
-		if((docdir = g_file_enumerate_children(doc_file, "standard::*", G_FILE_QUERY_INFO_NONE, NULL, &err)) == NULL) {
-			IO_ERROR_DIALOG(GTK_WINDOW(self), doc_file, err, _("opening documentation directory"));
-			g_object_unref(doc_file);
+	if(doc_index == NULL) {
+		GError *err = NULL;
+		doc_index = i7_doc_index_new_from_resource("/com/inform7/IDE/doc-index.bin", &err);
+		if(doc_index == NULL) {
+			error_dialog(GTK_WINDOW(self), err, _("Error opening the documentation index: "));
 			return;
 		}
+	}
 
-		start_spinner(self);
-
-		GFileInfo *info;
-		while((info = g_file_enumerator_next_file(docdir, NULL, &err)) != NULL) {
-			const char *basename = g_file_info_get_name(info);
-			const char *displayname = g_file_info_get_display_name(info);
-
-			if(!g_str_has_suffix(basename, ".html") ||
-			   (!g_str_has_prefix(basename, "doc") && !g_str_has_prefix(basename, "Rdoc")))
-				continue;
-
-			char *label = g_strdup_printf(_("Please be patient, indexing %s…"), displayname);
-			gtk_label_set_text(self->results_label, label);
-			g_free(label);
-
-			while(gtk_events_pending())
-				gtk_main_iteration();
-
-			GFile *file = g_file_get_child(doc_file, basename);
-			GSList *doctexts = html_to_ascii(file, g_str_has_prefix(basename, "R"));
-			g_object_unref(file);
-			if(doctexts != NULL) {
-				GSList *iter;
-				/* Append the entries to the documentation index and search them
-				right now while we're at it */
-				for(iter = doctexts; iter != NULL; iter = g_slist_next(iter)) {
-					doc_index = g_list_prepend(doc_index, iter->data);
-					search_documentation(iter->data, self);
-				}
-				g_slist_free(doctexts);
-			}
-		}
+	start_spinner(self);
 
-		stop_spinner(self);
-		update_label(self);
-	} else {
-		start_spinner(self);
-		g_list_foreach(doc_index, (GFunc)search_documentation, self);
-		stop_spinner(self);
+	/* Only the pages containing all the words of the search text need to be
+	searched, and only from the first occurrence */
+	g_autoptr(GFile) doc_dir = g_file_new_for_uri("resource:///com/inform7/IDE/inform");
+	const char *text = gtk_entry_get_text(GTK_ENTRY(self->entry));
+	g_autoptr(GArray) candidates = i7_doc_index_find_candidates(doc_index, text);
+	for(unsigned ix = 0; ix < candidates->len; ix++) {
+		I7DocCandidate *candidate = &g_array_index(candidates, I7DocCandidate, ix);
+		I7DocText doctext;
+		i7_doc_index_get_doc(doc_index, candidate->doc, &doctext);
+		search_documentation(self, doc_dir, &doctext, candidate->start_offset);
 	}
-	return;
+
+	stop_spinner(self);
 }
 
 /* Search the project file for the string 'text' */
@@ -922,6 +700,7 @@ void
 i7_search_window_do_search(I7SearchWindow *self)
 {
 	gtk_list_store_clear(self->results);
+	update_label(self);
 
 	/* Show the results widget */
 	gtk_revealer_set_reveal_child(self->results_revealer, TRUE);
@@ -947,21 +726,5 @@ i7_search_window_do_search(I7SearchWindow *self)
 void
 i7_search_window_free_index(void)
 {
-	if(doc_index == NULL)
-		return;
-
-	GList *iter;
-	for(iter = doc_index; iter != NULL; iter = g_list_next(iter)) {
-		DocText *text = (DocText *)(iter->data);
-		g_free(text->section);
-		g_free(text->title);
-		g_free(text->sort);
-		g_free(text->body);
-		g_object_unref(text->file);
-		g_free(text->anchor);
-		g_free(text->example_title);
-		g_slice_free(DocText, text);
-	}
-	g_list_free(doc_index);
-	doc_index = NULL;
+	g_clear_pointer(&doc_index, i7_doc_index_free);
 }
@@ -0,0 +1,735 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * SPDX-FileCopyrightText: Philip Chimento <philip.chimento@gmail.com>
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+#include <libchimara/chimara-glk.h>
+#include <libchimara/chimara-if.h>
+
+#include "configfile.h"
+#include "node.h"
+#include "skein.h"
+#include "skein-runner.h"
+
+/* Playing through the skein without the Story pane:
+ - turning an #I7SkeinReplayPlan into lines of input for the interpreter
+ - running the blessed threads in several interpreter processes at once, and
+   putting the transcripts they send back into the skein
+ - the worker process itself, which runs the interpreter in a widget that is
+   never shown
+ - testing a project from the command line
+
+ Interpreters can't run side by side in one process, since they keep their
+ state in global variables, so each worker is a process of its own. The worker
+ knows nothing about the skein. It gets the lines of input as a GVariant of
+ type "as" on its standard input, and writes a GVariant of type "(sa(ss))" to
+ its standard output: the text printed before the first prompt, and each
+ command the interpreter reported with its response. */
+
+static char *worker_program = NULL;
+
+static char *
+get_save_file_name(const char *save_dir, unsigned slot)
+{
+	g_autofree char *name = g_strdup_printf("state-%u", slot);
+	return g_build_filename(save_dir, name, NULL);
+}
+
+static void
+add_replay_line(GArray *lines, char *text, I7Node *node)
+{
+	I7ReplayLine line = { text, node? g_object_ref(node) : NULL };
+	g_array_append_val(lines, line);
+}
+
+static void
+clear_replay_line(I7ReplayLine *line)
+{
+	g_free(line->text);
+	g_clear_object(&line->node);
+}
+
+/*
+ * i7_replay_lines_new:
+ * @plan: a plan from i7_skein_plan_replay()
+ * @save_dir: directory for the saved states, or %NULL if @plan doesn't need any
+ *
+ * Works out the lines to type into the interpreter to carry out @plan. The
+ * story's state is saved and restored with the story's own SAVE and RESTORE
+ * commands. The interpreter must not be interactive, so that it reads the name
+ * of the saved game from the next line of input.
+ *
+ * Returns: (transfer full): a #GArray of #I7ReplayLine. Free with
+ * g_array_free().
+ */
+GArray *
+i7_replay_lines_new(I7SkeinReplayPlan *plan, const char *save_dir)
+{
+	g_return_val_if_fail(plan->n_slots == 0 || save_dir, NULL);
+
+	GArray *lines = g_array_sized_new(FALSE, FALSE, sizeof(I7ReplayLine), plan->steps->len + plan->n_slots);
+	g_array_set_clear_func(lines, (GDestroyNotify)clear_replay_line);
+
+	unsigned ix;
+	for(ix = 0; ix < plan->steps->len; ix++) {
+		I7SkeinReplayStep *step = &g_array_index(plan->steps, I7SkeinReplayStep, ix);
+		switch(step->action) {
+			case I7_SKEIN_REPLAY_COMMAND:
+				add_replay_line(lines, g_strcompress(i7_node_peek_command(step->node)), step->node);
+				break;
+			case I7_SKEIN_REPLAY_SAVE:
+				add_replay_line(lines, g_strdup("save"), NULL);
+				add_replay_line(lines, get_save_file_name(save_dir, step->slot), NULL);
+				break;
+			case I7_SKEIN_REPLAY_RESTORE:
+				add_replay_line(lines, g_strdup("restore"), NULL);
+				add_replay_line(lines, get_save_file_name(save_dir, step->slot), NULL);
+				break;
+		}
+	}
+	return lines;
+}
+
+/*
+ * i7_replay_lines_match:
+ * @lines: lines from i7_replay_lines_new()
+ * @next_line: (inout): index of the first line not yet seen; start at 0
+ * @input: a command that the interpreter reported
+ *
+ * Finds the line that the interpreter reported as @input. The lines that are
+ * read by the story without being reported as commands, such as the name of a
+ * saved game, are skipped. A command from the skein is never skipped, so if
+ * the story reads its input differently than planned, this stops matching
+ * rather than putting responses on the wrong knots.
+ *
+ * Returns: (transfer none): the line; if its @node is %NULL, then it was one
+ * of the lines that saved or restored the story's state. %NULL if @input is
+ * not the next command from the skein, or if there were no more lines.
+ */
+I7ReplayLine *
+i7_replay_lines_match(GArray *lines, unsigned *next_line, const char *input)
+{
+	while(*next_line < lines->len) {
+		I7ReplayLine *line = &g_array_index(lines, I7ReplayLine, *next_line);
+		if(strcmp(input, line->text) == 0) {
+			(*next_line)++;
+			return line;
+		}
+		if(line->node)
+			return NULL;
+		(*next_line)++;
+	}
+	return NULL;
+}
+
+/* Deletes the saved games in @save_dir, and the directory itself */
+void
+i7_replay_remove_save_dir(const char *save_dir)
+{
+	g_autoptr(GDir) dir = g_dir_open(save_dir, 0, NULL);
+	if(dir) {
+		const char *name;
+		while((name = g_dir_read_name(dir))) {
+			g_autofree char *path = g_build_filename(save_dir, name, NULL);
+			g_unlink(path);
+		}
+	}
+	g_rmdir(save_dir);
+}
+
+/*
+ * i7_skein_runner_set_worker_program:
+ * @program: full path of the inform7-ide executable
+ *
+ * Sets the program to run as a worker process in i7_skein_runner_run_async().
+ */
+void
+i7_skein_runner_set_worker_program(const char *program)
+{
+	g_free(worker_program);
+	worker_program = g_strdup(program);
+}
+
+/* The state of the whole run, the task data */
+typedef struct {
+	unsigned n_running;
+	GError *error; /* the first error from any of the jobs */
+	unsigned n_knots; /* knots played by all the jobs */
+	unsigned n_knots_done; /* knots played by the jobs that have finished */
+	I7SkeinRunnerProgressFunc progress;
+	void *progress_data;
+	GHashTable *played; /* set of I7Node *, not owned; knots given a transcript */
+} RunnerData;
+
+/* One interpreter at a time, playing one or more plans, each in a worker
+ process of its own */
+typedef struct {
+	GTask *task; /* owns a reference */
+	GPtrArray *plans; /* I7SkeinReplayPlan */
+	unsigned next_plan;
+	char *story_path;
+	/* The worker that is running */
+	GArray *lines; /* I7ReplayLine */
+	char *save_dir;
+	gboolean first; /* whether to use the text before the first prompt */
+	unsigned n_knots;
+} RunnerJob;
+
+static void
+runner_data_free(RunnerData *data)
+{
+	g_clear_error(&data->error);
+	g_hash_table_unref(data->played);
+	g_free(data);
+}
+
+/* Cleans up after the worker that was running */
+static void
+clear_worker(RunnerJob *job)
+{
+	g_clear_pointer(&job->lines, g_array_unref);
+	if(job->save_dir) {
+		i7_replay_remove_save_dir(job->save_dir);
+		g_clear_pointer(&job->save_dir, g_free);
+	}
+}
+
+static void
+runner_job_free(RunnerJob *job)
+{
+	clear_worker(job);
+	g_ptr_array_free(job->plans, TRUE);
+	g_free(job->story_path);
+	g_object_unref(job->task);
+	g_free(job);
+}
+
+static void
+finish_job(RunnerJob *job, GError *error)
+{
+	GTask *task = g_object_ref(job->task);
+	RunnerData *data = g_task_get_task_data(task);
+
+	if(error && !data->error)
+		data->error = error;
+	else if(error)
+		g_error_free(error);
+	runner_job_free(job);
+
+	if(--data->n_running == 0) {
+		if(data->error)
+			g_task_return_error(task, g_steal_pointer(&data->error));
+		else
+			g_task_return_boolean(task, TRUE);
+	}
+	g_object_unref(task);
+}
+
+/* Puts the transcripts from one worker into the skein. If the story didn't
+ read the lines as planned, the transcripts from there on are left out, since
+ it's not known which knots they belong to. */
+static gboolean
+merge_transcripts(RunnerJob *job, GVariant *output, GError **error)
+{
+	I7Skein *skein = g_task_get_source_object(job->task);
+	RunnerData *data = g_task_get_task_data(job->task);
+	const char *intro, *input, *response;
+	g_autoptr(GVariantIter) iter = NULL;
+	unsigned next_line = 0, n_merged = 0;
+	gboolean success = TRUE;
+
+	g_variant_get(output, "(&sa(ss))", &intro, &iter);
+	i7_skein_begin_transaction(skein);
+	if(job->first && *intro != '\0')
+		i7_node_set_transcript_text(i7_skein_get_root_node(skein), intro);
+
+	while(g_variant_iter_next(iter, "(&s&s)", &input, &response)) {
+		I7ReplayLine *line = i7_replay_lines_match(job->lines, &next_line, input);
+		if(line == NULL) {
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+				_("The story read \"%s\" when another command was expected, so the rest of the Skein could not be played."), input);
+			success = FALSE;
+			break;
+		}
+		if(line->node) {
+			i7_node_set_transcript_text(line->node, response);
+			g_hash_table_add(data->played, line->node);
+			n_merged++;
+		}
+	}
+	i7_skein_end_transaction(skein);
+	g_debug("Skein runner: merged %u transcripts", n_merged);
+	return success;
+}
+
+static gboolean start_worker(RunnerJob *job, GError **error);
+
+static void
+on_worker_finish(GSubprocess *process, GAsyncResult *res, RunnerJob *job)
+{
+	g_autoptr(GBytes) output = NULL;
+	GError *error = NULL;
+
+	if(!g_subprocess_communicate_finish(process, res, &output, NULL, &error)) {
+		g_subprocess_force_exit(process);
+		finish_job(job, error);
+		return;
+	}
+	/* The worker may have finished just before the run was cancelled; its
+	 transcripts must not go into the skein anymore */
+	if(g_cancellable_set_error_if_cancelled(g_task_get_cancellable(job->task), &error)) {
+		finish_job(job, error);
+		return;
+	}
+	if(!g_subprocess_get_successful(process)) {
+		finish_job(job, g_error_new_literal(G_IO_ERROR, G_IO_ERROR_FAILED,
+			_("The story could not be played in the background.")));
+		return;
+	}
+
+	g_autoptr(GVariant) variant = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE("(sa(ss))"), output, FALSE));
+	if(!merge_transcripts(job, variant, &error)) {
+		finish_job(job, error);
+		return;
+	}
+
+	RunnerData *data = g_task_get_task_data(job->task);
+	data->n_knots_done += job->n_knots;
+	if(data->progress)
+		data->progress(data->n_knots_done, data->n_knots, data->progress_data);
+
+	clear_worker(job);
+	if(job->next_plan < job->plans->len) {
+		job->first = FALSE;
+		if(!start_worker(job, &error))
+			finish_job(job, error);
+		return;
+	}
+	finish_job(job, NULL);
+}
+
+/* Starts a worker process carrying out the job's next plan */
+static gboolean
+start_worker(RunnerJob *job, GError **error)
+{
+	I7SkeinReplayPlan *plan = g_ptr_array_index(job->plans, job->next_plan++);
+	g_autofree char *save_dir = NULL;
+	if(plan->n_slots > 0) {
+		save_dir = g_dir_make_tmp("inform7-replay-XXXXXX", error);
+		if(!save_dir)
+			return FALSE;
+	}
+
+	const char *argv[] = { worker_program, "--skein-worker", job->story_path, NULL };
+	GSubprocess *process = g_subprocess_newv(argv,
+		G_SUBPROCESS_FLAGS_STDIN_PIPE | G_SUBPROCESS_FLAGS_STDOUT_PIPE, error);
+	if(!process) {
+		if(save_dir)
+			i7_replay_remove_save_dir(save_dir);
+		return FALSE;
+	}
+
+	job->lines = i7_replay_lines_new(plan, save_dir);
+	job->save_dir = g_steal_pointer(&save_dir);
+	job->n_knots = plan->n_commands;
+
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE_STRING_ARRAY);
+	unsigned ix;
+	for(ix = 0; ix < job->lines->len; ix++)
+		g_variant_builder_add(&builder, "s", g_array_index(job->lines, I7ReplayLine, ix).text);
+	g_autoptr(GVariant) input = g_variant_ref_sink(g_variant_builder_end(&builder));
+	g_autoptr(GBytes) input_bytes = g_variant_get_data_as_bytes(input);
+
+	g_debug("Skein runner: worker plays %u knots", plan->n_commands);
+	g_subprocess_communicate_async(process, input_bytes, g_task_get_cancellable(job->task),
+		(GAsyncReadyCallback)on_worker_finish, job);
+	g_object_unref(process);
+	return TRUE;
+}
+
+/* Starts playing through the threads ending in @thread_ends. Like "Play All
+ Blessed", each knot is played only once, going back to a saved state at each
+ branch, if @save_states is set; otherwise each thread is played from the
+ beginning, by one worker process after another. */
+static gboolean
+start_job(GTask *task, I7Skein *skein, GSList *thread_ends, const char *story_path, gboolean first, gboolean save_states, GError **error)
+{
+	RunnerData *data = g_task_get_task_data(task);
+	RunnerJob *job = g_new0(RunnerJob, 1);
+	job->task = g_object_ref(task);
+	job->plans = g_ptr_array_new_with_free_func((GDestroyNotify)i7_skein_replay_plan_free);
+	job->story_path = g_strdup(story_path);
+	job->first = first;
+
+	I7SkeinReplayPlan *plan = i7_skein_plan_replay(skein, thread_ends);
+	if(plan->n_slots == 0 || save_states) {
+		g_ptr_array_add(job->plans, plan);
+	} else {
+		i7_skein_replay_plan_free(plan);
+		GSList *iter;
+		for(iter = thread_ends; iter; iter = g_slist_next(iter)) {
+			GSList thread_end = { iter->data, NULL };
+			g_ptr_array_add(job->plans, i7_skein_plan_replay(skein, &thread_end));
+		}
+	}
+
+	if(!start_worker(job, error)) {
+		runner_job_free(job);
+		return FALSE;
+	}
+
+	unsigned ix;
+	for(ix = 0; ix < job->plans->len; ix++)
+		data->n_knots += ((I7SkeinReplayPlan *)g_ptr_array_index(job->plans, ix))->n_commands;
+	data->n_running++;
+	return TRUE;
+}
+
+/*
+ * i7_skein_runner_run_async:
+ * @skein: the skein
+ * @story_file: the compiled story
+ * @n_jobs: how many interpreters to run at once
+ * @save_states: whether the story's state may be saved and restored, so that
+ * threads don't have to be played from the beginning
+ * @cancel: (nullable): a #GCancellable
+ * @progress: (nullable): function to call each time a worker's transcripts
+ * have been put into @skein
+ * @progress_data: user data for @progress
+ * @callback: function to call when done
+ * @data: user data for @callback
+ *
+ * Plays through all the blessed threads of @skein, like "Play All Blessed",
+ * but without the Story pane. The threads are divided over @n_jobs
+ * interpreters, which run at the same time, each in worker processes of their
+ * own. The transcripts are put into @skein
+ * as each worker finishes. Once @cancel is cancelled, no more transcripts are
+ * put into @skein. Call i7_skein_runner_set_worker_program() first.
+ */
+void
+i7_skein_runner_run_async(I7Skein *skein, GFile *story_file, unsigned n_jobs, gboolean save_states, GCancellable *cancel, I7SkeinRunnerProgressFunc progress, void *progress_data, GAsyncReadyCallback callback, void *data)
+{
+	GTask *task = g_task_new(skein, cancel, callback, data);
+	g_task_set_source_tag(task, i7_skein_runner_run_async);
+
+	if(worker_program == NULL) {
+		g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "No worker program set.");
+		g_object_unref(task);
+		return;
+	}
+
+	RunnerData *run = g_new0(RunnerData, 1);
+	run->played = g_hash_table_new(NULL, NULL);
+	run->progress = progress;
+	run->progress_data = progress_data;
+	g_task_set_task_data(task, run, (GDestroyNotify)runner_data_free);
+
+	GSList *thread_ends = i7_skein_get_blessed_thread_ends(skein);
+	unsigned n_threads = g_slist_length(thread_ends);
+	if(n_threads == 0) {
+		g_task_return_boolean(task, TRUE);
+		g_object_unref(task);
+		return;
+	}
+	n_jobs = CLAMP(n_jobs, 1, n_threads);
+
+	/* Give each job a run of neighbouring threads, since those share the most
+	 commands; they come in depth-first order */
+	g_autofree char *story_path = g_file_get_path(story_file);
+	GSList *rest = thread_ends;
+	unsigned ix;
+	for(ix = 0; ix < n_jobs; ix++) {
+		unsigned n_in_job = (ix + 1) * n_threads / n_jobs - ix * n_threads / n_jobs;
+		GSList *job_ends = rest;
+		GSList *last = g_slist_nth(rest, n_in_job - 1);
+		rest = last->next;
+		last->next = NULL;
+
+		GError *error = NULL;
+		if(!start_job(task, skein, job_ends, story_path, ix == 0, save_states, &error)) {
+			if(!run->error)
+				run->error = error;
+			else
+				g_error_free(error);
+		}
+		g_slist_free(job_ends);
+	}
+
+	/* If none of the jobs started, nothing will return the result */
+	if(run->n_running == 0)
+		g_task_return_error(task, g_steal_pointer(&run->error));
+	g_object_unref(task);
+}
+
+/*
+ * i7_skein_runner_run_finish:
+ * @skein: the skein
+ * @res: the result passed to the callback of i7_skein_runner_run_async()
+ * @played: (out) (optional) (transfer full): return location for the set of
+ * #I7Node knots that were given a transcript, or %NULL
+ * @error: return location for an error
+ *
+ * Knots that the story never got to, for example because it ended early, keep
+ * the transcript they had before, so they are not in @played.
+ *
+ * Returns: %TRUE if all the workers played their threads.
+ */
+gboolean
+i7_skein_runner_run_finish(I7Skein *skein, GAsyncResult *res, GHashTable **played, GError **error)
+{
+	g_return_val_if_fail(g_task_is_valid(res, skein), FALSE);
+	if(!g_task_propagate_boolean(G_TASK(res), error))
+		return FALSE;
+	if(played) {
+		RunnerData *data = g_task_get_task_data(G_TASK(res));
+		*played = g_hash_table_ref(data->played);
+	}
+	return TRUE;
+}
+
+/* WORKER PROCESS */
+
+typedef struct {
+	GVariant *lines; /* "as" */
+	char *intro;
+	GVariantBuilder transcript; /* "a(ss)" */
+	GMainLoop *loop;
+} WorkerData;
+
+static void
+on_worker_started(ChimaraGlk *glk, WorkerData *data)
+{
+	GVariantIter iter;
+	const char *line;
+	g_variant_iter_init(&iter, data->lines);
+	while(g_variant_iter_next(&iter, "&s", &line))
+		chimara_glk_feed_line_input(glk, line);
+}
+
+static void
+on_worker_command(ChimaraIF *glk, char *input, char *response, WorkerData *data)
+{
+	if(!input) {
+		/* Only the text before the first prompt is interesting */
+		if(!data->intro)
+			data->intro = g_strdup(response? response : "");
+		return;
+	}
+	g_variant_builder_add(&data->transcript, "(ss)", input, response? response : "");
+}
+
+static void
+on_worker_waiting(ChimaraGlk *glk, WorkerData *data)
+{
+	if(!chimara_glk_is_line_input_pending(glk))
+		chimara_glk_stop(glk);
+}
+
+static void
+on_worker_stopped(ChimaraGlk *glk, WorkerData *data)
+{
+	g_main_loop_quit(data->loop);
+}
+
+/*
+ * i7_skein_runner_run_worker:
+ * @story_path: the compiled story
+ *
+ * Main function of a worker process started by i7_skein_runner_run_async().
+ *
+ * Returns: exit code for the process.
+ */
+int
+i7_skein_runner_run_worker(const char *story_path)
+{
+	/* Standard output is for the results only */
+	g_log_writer_default_set_use_stderr(TRUE);
+
+	GByteArray *buffer = g_byte_array_new();
+	guint8 chunk[4096];
+	size_t n_read;
+	while((n_read = fread(chunk, 1, sizeof(chunk), stdin)) > 0)
+		g_byte_array_append(buffer, chunk, n_read);
+	g_autoptr(GBytes) input = g_byte_array_free_to_bytes(buffer);
+
+	WorkerData data = { NULL };
+	data.lines = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE_STRING_ARRAY, input, FALSE));
+	g_variant_builder_init(&data.transcript, G_VARIANT_TYPE("a(ss)"));
+	data.loop = g_main_loop_new(NULL, FALSE);
+
+	/* The interpreter needs a widget, but it doesn't need to be seen */
+	GtkWidget *window = gtk_offscreen_window_new();
+	GtkWidget *glk = chimara_if_new();
+	gtk_container_add(GTK_CONTAINER(window), glk);
+	gtk_widget_show_all(window);
+	chimara_glk_set_interactive(CHIMARA_GLK(glk), FALSE);
+	g_signal_connect_after(glk, "started", G_CALLBACK(on_worker_started), &data);
+	g_signal_connect(glk, "command", G_CALLBACK(on_worker_command), &data);
+	g_signal_connect_after(glk, "waiting", G_CALLBACK(on_worker_waiting), &data);
+	g_signal_connect(glk, "stopped", G_CALLBACK(on_worker_stopped), &data);
+
+	int retval = EXIT_SUCCESS;
+	GError *error = NULL;
+	g_autoptr(GFile) story_file = g_file_new_for_commandline_arg(story_path);
+	if(chimara_if_run_game_file(CHIMARA_IF(glk), story_file, &error)) {
+		g_main_loop_run(data.loop);
+		chimara_glk_wait(CHIMARA_GLK(glk));
+
+		g_autoptr(GVariant) output = g_variant_ref_sink(g_variant_new("(sa(ss))",
+			data.intro? data.intro : "", &data.transcript));
+		fwrite(g_variant_get_data(output), 1, g_variant_get_size(output), stdout);
+		fflush(stdout);
+	} else {
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		g_variant_builder_clear(&data.transcript);
+		retval = EXIT_FAILURE;
+	}
+
+	gtk_widget_destroy(window);
+	g_main_loop_unref(data.loop);
+	g_variant_unref(data.lines);
+	g_free(data.intro);
+	return retval;
+}
+
+/* COMMAND LINE */
+
+/* Finds the story that was compiled last in @project */
+static GFile *
+find_story_file(GFile *project)
+{
+	static const char * const names[] = {
+		"output.ulx", "output.z8", "output.z5", "output.gblorb", "output.zblorb",
+	};
+	g_autoptr(GFile) build_dir = g_file_get_child(project, "Build");
+	unsigned ix;
+	for(ix = 0; ix < G_N_ELEMENTS(names); ix++) {
+		GFile *file = g_file_get_child(build_dir, names[ix]);
+		if(g_file_query_exists(file, NULL))
+			return file;
+		g_object_unref(file);
+	}
+	return NULL;
+}
+
+typedef struct {
+	I7Skein *skein;
+	gboolean done;
+	GError *error;
+	GHashTable *played;
+	unsigned n_blessed;
+	unsigned n_different;
+	unsigned n_not_played;
+} TestProjectData;
+
+static void
+on_test_project_finish(I7Skein *skein, GAsyncResult *res, TestProjectData *data)
+{
+	i7_skein_runner_run_finish(skein, res, &data->played, &data->error);
+	data->done = TRUE;
+}
+
+static char *
+get_thread_text(I7Skein *skein, I7Node *node)
+{
+	GSList *commands = i7_skein_get_commands_to_node(skein, i7_skein_get_root_node(skein), node);
+	GString *thread = g_string_new("");
+	GSList *iter;
+	for(iter = commands; iter; iter = g_slist_next(iter))
+		g_string_append_printf(thread, "%s%s", iter == commands? "" : " > ", (char *)iter->data);
+	g_slist_free_full(commands, g_free);
+	return g_string_free(thread, FALSE);
+}
+
+static gboolean
+report_knot(GNode *gnode, TestProjectData *data)
+{
+	I7Node *node = gnode->data;
+	if(!i7_node_get_blessed(node))
+		return FALSE; /* Don't stop the traversal */
+
+	data->n_blessed++;
+	/* The knot's transcript is still the one from Skein.skein if the story
+	 never got to it */
+	if(gnode->parent && !g_hash_table_contains(data->played, node)) {
+		g_autofree char *thread = get_thread_text(data->skein, node);
+		g_print(_("Not played: %s\n"), thread);
+		data->n_not_played++;
+	} else if(i7_node_get_different(node)) {
+		g_autofree char *thread = get_thread_text(data->skein, node);
+		g_print(_("Does not match: %s\n"), thread);
+		data->n_different++;
+	}
+	return FALSE; /* Don't stop the traversal */
+}
+
+/*
+ * i7_skein_runner_test_project:
+ * @project_path: path to an Inform project on the command line
+ * @n_jobs: how many interpreters to run at once
+ *
+ * Plays through all the blessed threads of the project's skein, using the
+ * story that was last compiled, and prints which blessed knots don't match.
+ * For regression tests outside the IDE. The skein is not changed on disk.
+ *
+ * Returns: exit code for the process; failure if any blessed knot doesn't
+ * match or wasn't played.
+ */
+int
+i7_skein_runner_test_project(const char *project_path, unsigned n_jobs)
+{
+	g_autoptr(GFile) project = g_file_new_for_commandline_arg(project_path);
+	g_autoptr(GFile) skein_file = g_file_get_child(project, "Skein.skein");
+	g_autoptr(GFile) story_file = find_story_file(project);
+	TestProjectData data = { NULL };
+
+	if(!story_file) {
+		g_printerr(_("%s has not been compiled yet.\n"), project_path);
+		return EXIT_FAILURE;
+	}
+
+	data.skein = i7_skein_new();
+	if(!i7_skein_load(data.skein, skein_file, &data.error)) {
+		g_printerr(_("Could not read the Skein: %s\n"), data.error->message);
+		g_error_free(data.error);
+		g_object_unref(data.skein);
+		return EXIT_FAILURE;
+	}
+
+	g_autoptr(GSettings) settings = g_settings_new(SCHEMA_SKEIN);
+	gboolean save_states = g_settings_get_boolean(settings, PREFS_SKEIN_REPLAY_SAVE_STATES);
+
+	gint64 start = g_get_monotonic_time();
+	i7_skein_runner_run_async(data.skein, story_file, n_jobs, save_states, NULL, NULL, NULL, (GAsyncReadyCallback)on_test_project_finish, &data);
+	while(!data.done)
+		g_main_context_iteration(NULL, TRUE);
+	if(data.error) {
+		g_printerr(_("Could not play the Skein: %s\n"), data.error->message);
+		g_error_free(data.error);
+		g_object_unref(data.skein);
+		return EXIT_FAILURE;
+	}
+
+	g_node_traverse(i7_skein_get_root_node(data.skein)->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+		(GNodeTraverseFunc)report_knot, &data);
+	g_print(_("%u of %u blessed knots match (%u jobs, %.1f s)\n"),
+		data.n_blessed - data.n_different - data.n_not_played,
+		data.n_blessed, n_jobs, (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC);
+
+	g_hash_table_unref(data.played);
+	g_object_unref(data.skein);
+	return data.n_different > 0 || data.n_not_played > 0? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,35 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * SPDX-FileCopyrightText: Philip Chimento <philip.chimento@gmail.com>
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include <gio/gio.h>
+#include <glib.h>
+
+#include "node.h"
+#include "skein.h"
+
+/* One line of input for the interpreter, when carrying out an
+ #I7SkeinReplayPlan. Lines that aren't commands from the skein save or restore
+ the story's state. */
+typedef struct {
+	char *text;
+	I7Node *node; /* owns a reference; the knot whose command this is, or %NULL */
+} I7ReplayLine;
+
+GArray *i7_replay_lines_new(I7SkeinReplayPlan *plan, const char *save_dir);
+I7ReplayLine *i7_replay_lines_match(GArray *lines, unsigned *next_line, const char *input);
+void i7_replay_remove_save_dir(const char *save_dir);
+
+/* Called with the number of knots played so far, out of @n_total */
+typedef void (*I7SkeinRunnerProgressFunc)(unsigned n_done, unsigned n_total, void *data);
+
+void i7_skein_runner_set_worker_program(const char *program);
+void i7_skein_runner_run_async(I7Skein *skein, GFile *story_file, unsigned n_jobs, gboolean save_states, GCancellable *cancel, I7SkeinRunnerProgressFunc progress, void *progress_data, GAsyncReadyCallback callback, void *data);
+gboolean i7_skein_runner_run_finish(I7Skein *skein, GAsyncResult *res, GHashTable **played, GError **error);
+int i7_skein_runner_run_worker(const char *story_path);
+int i7_skein_runner_test_project(const char *project_path, unsigned n_jobs);
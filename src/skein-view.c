@@ -17,6 +17,15 @@ typedef struct _I7SkeinViewPrivate
 	I7Skein *skein;
 	gulong layout_handler;
 
+	/* Scrolling, for telling the skein which part of it is visible */
+	GtkAdjustment *hadjustment;
+	GtkAdjustment *vadjustment;
+
+	/* Frame time counter */
+	unsigned n_frames;
+	gint64 frame_time_total;
+	gint64 frame_time_max;
+
 	/* Drag-scroll information */
 	gboolean dragging;
 	double drag_anchor[2];
@@ -52,6 +61,59 @@ on_item_created(I7SkeinView *self, GooCanvasItem *item, GooCanvasItemModel *mode
 	}
 }
 
+/* Tells the skein which part of it is currently visible in this view, and
+ redraws if that means different knots are to be shown. */
+static void
+update_visible_area(I7SkeinView *self)
+{
+	I7SkeinViewPrivate *priv = i7_skein_view_get_instance_private(self);
+
+	if(!priv->skein || !priv->hadjustment || !priv->vadjustment)
+		return;
+
+	gdouble scale = goo_canvas_get_scale(GOO_CANVAS(self));
+	GooCanvasBounds area;
+	area.x1 = gtk_adjustment_get_value(priv->hadjustment);
+	area.y1 = gtk_adjustment_get_value(priv->vadjustment);
+	goo_canvas_convert_from_pixels(GOO_CANVAS(self), &area.x1, &area.y1);
+	area.x2 = area.x1 + gtk_adjustment_get_page_size(priv->hadjustment) / scale;
+	area.y2 = area.y1 + gtk_adjustment_get_page_size(priv->vadjustment) / scale;
+
+	i7_skein_set_visible_area(priv->skein, GOO_CANVAS(self), &area);
+
+	gboolean virtualized;
+	g_object_get(priv->skein, "virtualized", &virtualized, NULL);
+	if(virtualized && GPOINTER_TO_INT(g_object_get_data(G_OBJECT(self), "waiting-for-draw")) == 0)
+		i7_skein_schedule_draw(priv->skein, GOO_CANVAS(self));
+}
+
+static void
+set_adjustment(I7SkeinView *self, GtkAdjustment **adjptr, GtkAdjustment *adj)
+{
+	if(*adjptr == adj)
+		return;
+
+	if(*adjptr) {
+		g_signal_handlers_disconnect_by_func(*adjptr, update_visible_area, self);
+		g_object_unref(*adjptr);
+	}
+	*adjptr = adj;
+	if(adj) {
+		g_object_ref(adj);
+		g_signal_connect_swapped(adj, "value-changed", G_CALLBACK(update_visible_area), self);
+		g_signal_connect_swapped(adj, "changed", G_CALLBACK(update_visible_area), self);
+	}
+}
+
+static void
+on_adjustments_changed(I7SkeinView *self)
+{
+	I7SkeinViewPrivate *priv = i7_skein_view_get_instance_private(self);
+	set_adjustment(self, &priv->hadjustment, gtk_scrollable_get_hadjustment(GTK_SCROLLABLE(self)));
+	set_adjustment(self, &priv->vadjustment, gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(self)));
+	update_visible_area(self);
+}
+
 /* Changes the mouse cursor to a dragging hand (GDK_FLEUR) if @dragging is TRUE.
 Otherwise, changes it back to normal. */
 static void
@@ -163,6 +225,35 @@ i7_skein_view_init(I7SkeinView *self)
 	g_signal_connect(self, "button-press-event", G_CALLBACK(on_button_press), NULL);
 	g_signal_connect(self, "button-release-event", G_CALLBACK(on_button_release), NULL);
 	g_signal_connect(self, "motion-notify-event", G_CALLBACK(on_motion), NULL);
+	g_signal_connect(self, "notify::hadjustment", G_CALLBACK(on_adjustments_changed), NULL);
+	g_signal_connect(self, "notify::vadjustment", G_CALLBACK(on_adjustments_changed), NULL);
+	g_signal_connect(self, "notify::scale", G_CALLBACK(update_visible_area), NULL);
+}
+
+/* Number of frames over which to average the drawing time */
+#define FRAME_TIME_SAMPLES 100
+
+static gboolean
+i7_skein_view_draw(GtkWidget *widget, cairo_t *cr)
+{
+	I7SkeinViewPrivate *priv = i7_skein_view_get_instance_private(I7_SKEIN_VIEW(widget));
+
+	gint64 start_time = g_get_monotonic_time();
+	gboolean retval = GTK_WIDGET_CLASS(i7_skein_view_parent_class)->draw(widget, cr);
+	gint64 frame_time = g_get_monotonic_time() - start_time;
+
+	priv->frame_time_total += frame_time;
+	priv->frame_time_max = MAX(priv->frame_time_max, frame_time);
+	if(++priv->n_frames == FRAME_TIME_SAMPLES) {
+		g_debug("Skein view frame time: %.2f ms average, %.2f ms max over %d frames",
+			priv->frame_time_total / (1000.0 * FRAME_TIME_SAMPLES),
+			priv->frame_time_max / 1000.0, FRAME_TIME_SAMPLES);
+		priv->n_frames = 0;
+		priv->frame_time_total = 0;
+		priv->frame_time_max = 0;
+	}
+
+	return retval;
 }
 
 static void
@@ -172,8 +263,11 @@ i7_skein_view_finalize(GObject *object)
 
 	if(priv->skein) {
 		g_signal_handler_disconnect(priv->skein, priv->layout_handler);
+		i7_skein_set_visible_area(priv->skein, GOO_CANVAS(object), NULL);
 		g_object_unref(priv->skein);
 	}
+	set_adjustment(I7_SKEIN_VIEW(object), &priv->hadjustment, NULL);
+	set_adjustment(I7_SKEIN_VIEW(object), &priv->vadjustment, NULL);
 
 	G_OBJECT_CLASS(i7_skein_view_parent_class)->finalize(object);
 }
@@ -183,6 +277,8 @@ i7_skein_view_class_init(I7SkeinViewClass *klass)
 {
 	GObjectClass* object_class = G_OBJECT_CLASS(klass);
 	object_class->finalize = i7_skein_view_finalize;
+	GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(klass);
+	widget_class->draw = i7_skein_view_draw;
 
 	/* node-popup-menu - user right-clicked on a node */
 	i7_skein_view_signals[NODE_MENU_POPUP] = g_signal_new("node-menu-popup",
@@ -211,6 +307,7 @@ i7_skein_view_set_skein(I7SkeinView *self, I7Skein *skein)
 
 	if(priv->skein) {
 		g_signal_handler_disconnect(priv->skein, priv->layout_handler);
+		i7_skein_set_visible_area(priv->skein, GOO_CANVAS(self), NULL);
 		g_object_unref(priv->skein);
 	}
 	priv->skein = skein;
@@ -223,6 +320,7 @@ i7_skein_view_set_skein(I7SkeinView *self, I7Skein *skein)
 	goo_canvas_set_root_item_model(GOO_CANVAS(self), GOO_CANVAS_ITEM_MODEL(skein));
 	g_object_ref(skein);
 	priv->layout_handler = g_signal_connect(skein, "needs-layout", G_CALLBACK(i7_skein_schedule_draw), self);
+	update_visible_area(self);
 	i7_skein_draw(skein, GOO_CANVAS(self));
 }
 
@@ -6,16 +6,21 @@
 #include "config.h"
 
 #include <stdbool.h>
+#include <string.h>
 
 #include <gio/gio.h>
 #include <glib/gi18n.h>
 #include <goocanvas.h>
 #include <gtk/gtk.h>
-#include <libxml/parser.h>
-#include <libxml/tree.h>
+#include <libxml/xmlreader.h>
 
 #include "node.h"
 #include "skein.h"
+#include "transcript-diff.h"
+
+/* How long to spend giving the results of background diffs to their knots,
+ before letting the main loop do something else */
+#define DIFF_DELIVERY_BUDGET_US 5000
 
 #define VALID_ITER(iter, priv) ( \
 	(iter) != NULL \
@@ -23,22 +28,71 @@
 	&& I7_IS_NODE((iter)->user_data) \
 	&& (iter)->stamp == (priv)->stamp)
 
+/* Calculates the differences between knots' transcript and expected texts on
+ worker threads. Refcounted, because the main loop source that gives the
+ results back to the knots may outlive the skein. */
+typedef struct {
+	GThreadPool *pool;
+	GAsyncQueue *results; /* I7NodeDiffJob *, finished running */
+	GMainContext *context; /* Where the results are delivered */
+	int delivery_scheduled; /* atomic */
+	int cancelled; /* atomic */
+} DiffEngine;
+
 typedef struct _I7SkeinPrivate
 {
 	I7Node *root;
 	I7Node *current; /* Node currently displayed in Transcript */
 	I7Node *played;  /* Node currently played (yellow) */
+	unsigned n_played_touched; /* Knots changed by the last played node change */
 	gboolean modified;
+	unsigned n_modifications; /* To tell if the skein changed during a save */
+	/* The XML file as the last save left it, so that the cache doesn't have to
+	 read it again to hash it */
+	GFile *saved_file;
+	guint64 saved_size;
+	guint64 saved_mtime;
+	guint64 saved_hash;
 
 	gdouble hspacing;
 	gdouble vspacing;
 
 	GooCanvasLineDash *locked_dash;
 	GooCanvasLineDash *unlocked_dash;
+	GdkRGBA locked_color;
+	GdkRGBA unlocked_color;
+
+	/* Virtualized rendering: only knots in or near the visible part of a view
+	 are made visible, and tree lines are recycled between knots */
+	gboolean virtualized;
+	GHashTable *visible_areas; /* GooCanvas * -> GooCanvasBounds * */
+	GHashTable *materialized; /* Set of I7Node * currently shown */
+	GPtrArray *line_pool; /* Tree line models not in use */
 
 	GSettings *settings; /* skein settings */
 
 	int stamp; /* Stamp for identifying tree iterators belonging to this model */
+
+	/* The nodes of the current thread, from the root to the bottom, as shown
+	 by the list model interface */
+	GPtrArray *thread;
+
+	/* Text of all the knots */
+	I7StringPool *string_pool;
+
+	/* Signals held back until the outermost transaction ends */
+	unsigned transaction_depth;
+	gboolean pending_layout;
+	gboolean pending_modified;
+	I7Node *pending_show_node; /* owns a reference */
+	I7SkeinShowNodeReason pending_show_reason;
+	GPtrArray *thread_before; /* Copy of the thread when the transaction began */
+
+	/* Labelled knots, sorted by label, as shown in the labels menu */
+	GSequence *labels; /* I7SkeinNodeLabel * */
+	GHashTable *label_iters; /* I7Node * -> GSequenceIter * in labels */
+
+	DiffEngine *diff_engine; /* NULL until needed */
 } I7SkeinPrivate;
 
 enum
@@ -60,6 +114,7 @@ enum
 	PROP_PLAYED_NODE,
 	PROP_HORIZONTAL_SPACING,
 	PROP_VERTICAL_SPACING,
+	PROP_VIRTUALIZED,
 };
 
 static guint i7_skein_signals[LAST_SIGNAL] = { 0 };
@@ -70,33 +125,241 @@ G_DEFINE_TYPE_EXTENDED(I7Skein, i7_skein, GOO_TYPE_CANVAS_GROUP_MODEL, 0,
 	G_ADD_PRIVATE(I7Skein)
     G_IMPLEMENT_INTERFACE(G_TYPE_LIST_MODEL, i7_skein_list_model_init));
 
+/* TRANSACTIONS */
+
+/* Inside a transaction, these only remember that the signal is due. The
+ "modified" flag is still set straight away, so that a save in the middle of
+ a transaction knows the skein has changed. */
+static void
+emit_needs_layout(I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	if(priv->transaction_depth > 0)
+		priv->pending_layout = TRUE;
+	else
+		g_signal_emit(self, i7_skein_signals[NEEDS_LAYOUT], 0);
+}
+
+static void
+emit_modified(I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	if(priv->transaction_depth > 0) {
+		priv->pending_modified = TRUE;
+		priv->modified = TRUE;
+		priv->n_modifications++;
+	} else {
+		g_signal_emit(self, i7_skein_signals[MODIFIED], 0);
+	}
+}
+
+/* Only the last knot to be shown in a transaction is shown at the end */
+static void
+emit_show_node(I7Skein *self, I7SkeinShowNodeReason why, I7Node *node)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	if(priv->transaction_depth > 0) {
+		g_set_object(&priv->pending_show_node, node);
+		priv->pending_show_reason = why;
+	} else {
+		g_signal_emit(self, i7_skein_signals[SHOW_NODE], 0, why, node);
+	}
+}
+
+/*
+ * i7_skein_begin_transaction:
+ * @self: the skein
+ *
+ * Starts a batch of changes to the skein. Until the matching call to
+ * i7_skein_end_transaction(), the needs-layout, modified, show-node and
+ * items-changed signals and property notifications are held back, and then
+ * emitted at most once each. Transactions may be nested.
+ */
+void
+i7_skein_begin_transaction(I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	g_object_freeze_notify(G_OBJECT(self));
+	if(priv->transaction_depth++ > 0)
+		return;
+
+	/* Hold references, so that a knot removed during the transaction can't be
+	 freed and its address reused by a new knot in the same place */
+	priv->thread_before = g_ptr_array_new_full(priv->thread->len, g_object_unref);
+	unsigned ix;
+	for(ix = 0; ix < priv->thread->len; ix++)
+		g_ptr_array_add(priv->thread_before, g_object_ref(g_ptr_array_index(priv->thread, ix)));
+}
+
+/* Announces the difference between the thread at the start of the transaction
+ and now in one items-changed signal. The old copy holds references to its
+ knots, so a removed knot never compares equal to a new one. */
+static void
+emit_thread_changes(I7Skein *self, GPtrArray *before)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	GPtrArray *after = priv->thread;
+
+	unsigned start = 0;
+	while(start < before->len && start < after->len && g_ptr_array_index(before, start) == g_ptr_array_index(after, start))
+		start++;
+	if(start == before->len && start == after->len)
+		return;
+
+	unsigned end_before = before->len, end_after = after->len;
+	while(end_before > start && end_after > start && g_ptr_array_index(before, end_before - 1) == g_ptr_array_index(after, end_after - 1)) {
+		end_before--;
+		end_after--;
+	}
+
+	g_list_model_items_changed(G_LIST_MODEL(self), start, end_before - start, end_after - start);
+}
+
+void
+i7_skein_end_transaction(I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	g_return_if_fail(priv->transaction_depth > 0);
+
+	if(--priv->transaction_depth > 0) {
+		g_object_thaw_notify(G_OBJECT(self));
+		return;
+	}
+
+	GPtrArray *before = g_steal_pointer(&priv->thread_before);
+	emit_thread_changes(self, before);
+	g_ptr_array_free(before, TRUE);
+
+	if(priv->pending_layout) {
+		priv->pending_layout = FALSE;
+		emit_needs_layout(self);
+	}
+
+	/* Don't show a knot that was removed in the meantime */
+	g_autoptr(I7Node) show = g_steal_pointer(&priv->pending_show_node);
+	if(show && g_node_get_root(show->gnode) == priv->root->gnode)
+		emit_show_node(self, priv->pending_show_reason, show);
+
+	if(priv->pending_modified) {
+		priv->pending_modified = FALSE;
+		emit_modified(self);
+	}
+
+	g_object_thaw_notify(G_OBJECT(self));
+}
+
 /* SIGNAL HANDLERS */
 
 static void
 on_node_other_notify(I7Node *node, GParamSpec *pspec, I7Skein *self)
 {
-	g_signal_emit_by_name(self, "modified");
+	emit_modified(self);
 }
 
 static void
 on_node_layout_notify(I7Node *node, GParamSpec *pspec, I7Skein *self)
 {
-	g_signal_emit_by_name(self, "needs-layout");
+	emit_needs_layout(self);
 	on_node_other_notify(node, pspec, self);
 }
 
+/* LABEL INDEX */
+
+static void
+free_node_label(I7SkeinNodeLabel *label)
+{
+	g_free(label->label);
+	g_slice_free(I7SkeinNodeLabel, label);
+}
+
+static int
+compare_node_labels(const I7SkeinNodeLabel *a, const I7SkeinNodeLabel *b, void *data)
+{
+	int result = strcmp(a->label, b->label);
+	if(result != 0)
+		return result;
+	/* Keep knots with the same label in a stable order */
+	return (a->node > b->node) - (a->node < b->node);
+}
+
+/* Takes @node out of the label index, if it is in there */
+static void
+unindex_label(I7Skein *self, I7Node *node)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	GSequenceIter *iter = g_hash_table_lookup(priv->label_iters, node);
+	if(!iter)
+		return;
+	unsigned pos = g_sequence_iter_get_position(iter);
+	g_hash_table_remove(priv->label_iters, node);
+	g_sequence_remove(iter);
+	g_signal_emit_by_name(self, "labels-changed", pos, 1, 0);
+}
+
+/* Puts @node into the label index, if it has a label. Returns the new entry,
+ or %NULL. */
+static GSequenceIter *
+insert_label(I7Skein *self, I7Node *node)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	if(!i7_node_has_label(node))
+		return NULL;
+	I7SkeinNodeLabel *nodelabel = g_slice_new0(I7SkeinNodeLabel);
+	nodelabel->label = i7_node_get_label(node);
+	nodelabel->node = node;
+	GSequenceIter *iter = g_sequence_insert_sorted(priv->labels, nodelabel, (GCompareDataFunc)compare_node_labels, NULL);
+	g_hash_table_insert(priv->label_iters, node, iter);
+	return iter;
+}
+
+static void
+index_label(I7Skein *self, I7Node *node)
+{
+	GSequenceIter *iter = insert_label(self, node);
+	if(iter)
+		g_signal_emit_by_name(self, "labels-changed", g_sequence_iter_get_position(iter), 0, 1);
+}
+
+static gboolean
+insert_label_traverse(GNode *gnode, I7Skein *self)
+{
+	insert_label(self, gnode->data);
+	return FALSE; /* Don't stop the traversal */
+}
+
+/* Rebuilds the whole label index, after the tree has been replaced */
+static void
+reindex_labels(I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	unsigned old_len = g_sequence_get_length(priv->labels);
+	g_hash_table_remove_all(priv->label_iters);
+	g_sequence_remove_range(g_sequence_get_begin_iter(priv->labels), g_sequence_get_end_iter(priv->labels));
+	g_node_traverse(priv->root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)insert_label_traverse, self);
+	g_signal_emit_by_name(self, "labels-changed", 0, old_len, g_sequence_get_length(priv->labels));
+}
+
 static void
 on_node_label_notify(I7Node *node, GParamSpec *pspec, I7Skein *self)
 {
 	if(i7_node_has_label(node))
 		i7_skein_lock(self, i7_skein_get_thread_bottom(self, node));
-	g_signal_emit_by_name(self, "labels-changed");
+	unindex_label(self, node);
+	index_label(self, node);
 	on_node_layout_notify(node, pspec, self);
 }
 
 static void
 node_listen(I7Skein *self, I7Node *node)
 {
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	/* In virtualized mode, knots only become visible once they are found to be
+	 inside the visible area */
+	if(priv->virtualized)
+		g_object_set(node, "visibility", GOO_CANVAS_ITEM_INVISIBLE, NULL);
+
 	g_signal_connect(node, "notify::command", G_CALLBACK(on_node_layout_notify), self);
 	g_signal_connect(node, "notify::label", G_CALLBACK(on_node_label_notify), self);
 	g_signal_connect(node, "notify::transcript-text", G_CALLBACK(on_node_other_notify), self);
@@ -104,23 +367,142 @@ node_listen(I7Skein *self, I7Node *node)
 	g_signal_connect(node, "notify::locked", G_CALLBACK(on_node_layout_notify), self);
 }
 
+static gboolean
+invalidate_layout(GNode *gnode)
+{
+	i7_node_invalidate_layout(I7_NODE(gnode->data));
+	return FALSE; /* Don't stop the traversal */
+}
+
+static void
+invalidate_all_layout(I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	g_node_traverse(priv->root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)invalidate_layout, NULL);
+}
+
+/* BACKGROUND DIFFS */
+
+static void
+diff_engine_clear(DiffEngine *engine)
+{
+	g_async_queue_unref(engine->results);
+	g_main_context_unref(engine->context);
+}
+
+static void
+diff_engine_release(DiffEngine *engine)
+{
+	g_atomic_rc_box_release_full(engine, (GDestroyNotify)diff_engine_clear);
+}
+
+/* Runs on the main thread; gives a batch of results to their knots, which
+ update their displays */
+static gboolean
+deliver_diff_results(DiffEngine *engine)
+{
+	gint64 deadline = g_get_monotonic_time() + DIFF_DELIVERY_BUDGET_US;
+	I7NodeDiffJob *job;
+
+	while((job = g_async_queue_try_pop(engine->results)) != NULL) {
+		i7_node_diff_job_finish(job);
+
+		if(g_get_monotonic_time() >= deadline)
+			return G_SOURCE_CONTINUE;
+	}
+
+	g_atomic_int_set(&engine->delivery_scheduled, FALSE);
+	/* A worker may have pushed a result after the queue was found empty, but
+	 before the flag was cleared; it won't have scheduled another delivery */
+	if(g_async_queue_length(engine->results) > 0 &&
+		g_atomic_int_compare_and_exchange(&engine->delivery_scheduled, FALSE, TRUE))
+		return G_SOURCE_CONTINUE;
+	return G_SOURCE_REMOVE;
+}
+
+/* Runs on a worker thread */
+static void
+run_diff_job(I7NodeDiffJob *job, DiffEngine *engine)
+{
+	if(!g_atomic_int_get(&engine->cancelled))
+		i7_node_diff_job_run(job);
+
+	g_async_queue_push(engine->results, job);
+
+	if(g_atomic_int_compare_and_exchange(&engine->delivery_scheduled, FALSE, TRUE)) {
+		GSource *source = g_idle_source_new();
+		g_source_set_callback(source, (GSourceFunc)deliver_diff_results,
+			g_atomic_rc_box_acquire(engine), (GDestroyNotify)diff_engine_release);
+		g_source_attach(source, engine->context);
+		g_source_unref(source);
+	}
+}
+
+static DiffEngine *
+get_diff_engine(I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	if(priv->diff_engine == NULL) {
+		DiffEngine *engine = g_atomic_rc_box_new0(DiffEngine);
+		engine->results = g_async_queue_new();
+		engine->context = g_main_context_ref_thread_default();
+		/* Non-exclusive pools can't fail to be created */
+		engine->pool = g_thread_pool_new((GFunc)run_diff_job, engine,
+			g_get_num_processors(), FALSE, NULL);
+		priv->diff_engine = engine;
+	}
+	return priv->diff_engine;
+}
+
+/* Waits for the workers to stop and throws away any results that haven't been
+ delivered yet */
+static void
+stop_diff_engine(I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	DiffEngine *engine = priv->diff_engine;
+	if(engine == NULL)
+		return;
+
+	g_atomic_int_set(&engine->cancelled, TRUE);
+	g_thread_pool_free(engine->pool, FALSE, TRUE);
+	engine->pool = NULL;
+
+	I7NodeDiffJob *job;
+	while((job = g_async_queue_try_pop(engine->results)) != NULL)
+		i7_node_diff_job_free(job);
+
+	g_clear_pointer(&priv->diff_engine, diff_engine_release);
+}
+
 /* TYPE SYSTEM */
 
 static void
 i7_skein_init(I7Skein *self)
 {
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
-	priv->root = i7_node_new(_("- start -"), "", "", "", FALSE, FALSE, FALSE, 0, GOO_CANVAS_ITEM_MODEL(self));
+	priv->string_pool = i7_string_pool_new();
+	priv->root = i7_node_new(_("- start -"), "", "", "", TRUE, FALSE, FALSE, 0, GOO_CANVAS_ITEM_MODEL(self));
 	node_listen(self, priv->root);
 	priv->current = priv->root;
 	priv->played = priv->root;
 	priv->modified = TRUE;
 	priv->locked_dash = goo_canvas_line_dash_new(0);
 	priv->unlocked_dash = goo_canvas_line_dash_new(2, 5.0, 5.0);
+	priv->virtualized = FALSE;
+	priv->visible_areas = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+	priv->materialized = g_hash_table_new(NULL, NULL);
+	priv->line_pool = g_ptr_array_new();
+	priv->thread = g_ptr_array_new();
+	g_ptr_array_add(priv->thread, priv->root);
+	priv->labels = g_sequence_new((GDestroyNotify)free_node_label);
+	priv->label_iters = g_hash_table_new(NULL, NULL);
 
 	priv->settings = g_settings_new("com.inform7.IDE.preferences.skein");
 	g_settings_bind(priv->settings, "horizontal-spacing", self, "horizontal-spacing", G_SETTINGS_BIND_DEFAULT);
 	g_settings_bind(priv->settings, "vertical-spacing", self, "vertical-spacing", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind(priv->settings, "virtualized-rendering", self, "virtualized", G_SETTINGS_BIND_DEFAULT);
 
 	priv->stamp = g_random_int();
 }
@@ -136,13 +518,18 @@ i7_skein_set_property(GObject *self, guint prop_id, const GValue *value, GParamS
 			break;
 		case PROP_HORIZONTAL_SPACING:
 			priv->hspacing = g_value_get_double(value);
+			invalidate_all_layout(I7_SKEIN(self));
 			g_object_notify(self, "horizontal-spacing");
-			g_signal_emit_by_name(self, "needs-layout");
+			emit_needs_layout(I7_SKEIN(self));
 			break;
 		case PROP_VERTICAL_SPACING:
 			priv->vspacing = g_value_get_double(value);
+			invalidate_all_layout(I7_SKEIN(self));
 			g_object_notify(self, "vertical-spacing");
-			g_signal_emit_by_name(self, "needs-layout");
+			emit_needs_layout(I7_SKEIN(self));
+			break;
+		case PROP_VIRTUALIZED:
+			i7_skein_set_virtualized(I7_SKEIN(self), g_value_get_boolean(value));
 			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID(self, prop_id, pspec);
@@ -167,6 +554,9 @@ i7_skein_get_property(GObject *self, guint prop_id, GValue *value, GParamSpec *p
 		case PROP_VERTICAL_SPACING:
 			g_value_set_double(value, priv->vspacing);
 			break;
+		case PROP_VIRTUALIZED:
+			g_value_set_boolean(value, priv->virtualized);
+			break;
 		default:
 			G_OBJECT_WARN_INVALID_PROPERTY_ID(self, prop_id, pspec);
 	}
@@ -177,8 +567,20 @@ i7_skein_finalize(GObject *self)
 {
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(I7_SKEIN(self));
 
+	stop_diff_engine(I7_SKEIN(self));
 	g_object_unref(priv->root);
 	goo_canvas_line_dash_unref(priv->unlocked_dash);
+	g_hash_table_destroy(priv->visible_areas);
+	g_hash_table_destroy(priv->materialized);
+	g_ptr_array_free(priv->line_pool, TRUE);
+	g_ptr_array_free(priv->thread, TRUE);
+	g_clear_object(&priv->pending_show_node);
+	if(priv->thread_before)
+		g_ptr_array_free(priv->thread_before, TRUE);
+	g_sequence_free(priv->labels);
+	g_hash_table_destroy(priv->label_iters);
+	i7_string_pool_unref(priv->string_pool);
+	g_clear_object(&priv->saved_file);
 
 	G_OBJECT_CLASS(i7_skein_parent_class)->finalize(self);
 }
@@ -189,6 +591,7 @@ i7_skein_modified(I7Skein *self)
 {
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
 	priv->modified = TRUE;
+	priv->n_modifications++;
 }
 
 static void
@@ -221,11 +624,14 @@ i7_skein_class_init(I7SkeinClass *klass)
 		G_OBJECT_CLASS_TYPE(klass), 0,
 		G_STRUCT_OFFSET(I7SkeinClass, transcript_thread_changed), NULL, NULL,
 		g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
-	/* labels-changed - for controlling the 'labels' dropdown menu */
+	/* labels-changed - for controlling the 'labels' dropdown menu; at
+	position, a number of labels were removed and a number added, like
+	GListModel::items-changed */
 	i7_skein_signals[LABELS_CHANGED] = g_signal_new("labels-changed",
 		G_OBJECT_CLASS_TYPE(klass), 0,
 		G_STRUCT_OFFSET(I7SkeinClass, labels_changed), NULL, NULL,
-		g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+		/* marshaller = */ NULL, G_TYPE_NONE, 3,
+		G_TYPE_UINT, G_TYPE_UINT, G_TYPE_UINT);
 	/* show-node - skein requests its view to display a certain node */
 	i7_skein_signals[SHOW_NODE] = g_signal_new("show-node",
 		G_OBJECT_CLASS_TYPE(klass), 0,
@@ -256,6 +662,10 @@ i7_skein_class_init(I7SkeinClass *klass)
 		g_param_spec_double("vertical-spacing", "Vertical spacing",
 			"Pixels of vertical space between skein items",
 			20.0, 100.0, 40.0, G_PARAM_READWRITE | flags));
+	g_object_class_install_property(object_class, PROP_VIRTUALIZED,
+		g_param_spec_boolean("virtualized", "Virtualized",
+			"Whether to only show the knots near the visible area of the views",
+			FALSE, G_PARAM_READWRITE | flags));
 }
 
 /* LIST MODEL INTERFACE IMPLEMENTATION */
@@ -269,39 +679,18 @@ i7_skein_get_item_type(GListModel *model)
 static unsigned
 i7_skein_get_n_items(GListModel *model)
 {
-	I7Skein *self = I7_SKEIN(model);
-	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
-
-	I7Node *last = i7_skein_get_thread_bottom(self, priv->current);
-	return g_node_depth(last->gnode);
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(I7_SKEIN(model));
+	return priv->thread->len;
 }
 
 static void *
 i7_skein_get_item(GListModel *model, unsigned pos)
 {
-	I7Skein *self = I7_SKEIN(model);
-	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
-
-	I7Node *last = i7_skein_get_thread_bottom(self, priv->current);
-	unsigned thread_depth = g_node_depth(last->gnode) - 1;
-	/* g_node_depth returns 0 for NULL and 1 for the root node */
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(I7_SKEIN(model));
 
-	if (pos > thread_depth)
+	if(pos >= priv->thread->len)
 		return NULL;
-
-	if (pos == 0)
-		return g_object_ref(priv->root);
-
-	if (pos == thread_depth)
-		return g_object_ref(last);
-
-	/* Return the pos'th node between the root node and the bottom of the
-	 * current node's thread */
-	GNode *gnode;
-	for (gnode = last->gnode; thread_depth > pos; thread_depth--)
-		gnode = gnode->parent;
-
-	return g_object_ref(gnode->data);
+	return g_object_ref(g_ptr_array_index(priv->thread, pos));
 }
 
 static void
@@ -326,6 +715,14 @@ i7_skein_error_quark(void)
 	return g_quark_from_static_string("i7-skein-error-quark");
 }
 
+/* The pool of strings that the skein's knots keep their text in */
+I7StringPool *
+i7_skein_get_string_pool(I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	return priv->string_pool;
+}
+
 I7Node *
 i7_skein_get_root_node(I7Skein *self)
 {
@@ -348,55 +745,81 @@ i7_skein_set_current_node(I7Skein *self, I7Node *node)
 	if(priv->current == node)
 		return;
 
-	/* Old end of the list */
-	I7Node *old_last = i7_skein_get_thread_bottom(self, priv->current);
-	/* New end of the list */
-	I7Node *last = i7_skein_get_thread_bottom(self, node);
-
 	priv->current = node;
+	update_thread(self);
 
-	/* Emit items-changed on our list model interface */
-	if(old_last != last) {
-		unsigned removed = 0;
-		unsigned added = 0;
-
-		/* Find a common ancestor of the old and new list bottoms */
-		GNode *gnode = old_last->gnode;
-		unsigned depth = g_node_depth(gnode);
-		while (gnode && !i7_node_in_thread(gnode->data, last)) {
-			depth--;
-			removed++;
-			gnode = gnode->parent;
-		}
+	g_object_notify(G_OBJECT(self), "current-node");
+	emit_needs_layout(self);
+}
 
-		/* gnode is now the common ancestor, possibly the root node if no
-		 common ancestor, or possibly NULL if the tree is being rebuilt; in
-		 the latter case, count the new root node as added */
-		if(gnode == NULL) {
-			gnode = priv->root->gnode;
-			added++;
-		}
-		while(gnode != last->gnode) {
-			for(gnode = gnode->children; gnode; gnode = gnode->next) {
-				if(i7_node_in_thread(gnode->data, last))
-					break;
-			}
-			added++;
-		}
+/* Stores @node at @pos in the cached thread array, keeping track of where the
+ new thread starts to differ from the old one */
+static void
+set_thread_node(GPtrArray *thread, unsigned pos, I7Node *node, unsigned *diverge)
+{
+	if(pos < thread->len) {
+		if(*diverge == G_MAXUINT && g_ptr_array_index(thread, pos) != node)
+			*diverge = pos;
+		g_ptr_array_index(thread, pos) = node;
+	} else {
+		if(*diverge == G_MAXUINT)
+			*diverge = pos;
+		g_ptr_array_add(thread, node);
+	}
+}
 
-		g_list_model_items_changed(G_LIST_MODEL(self), depth, removed, added);
+/* Brings the cached thread array up to date with the thread of the current
+ node, after the current node or the tree structure have changed. Only the
+ part of the array below the deepest ancestor of the current node that is
+ still in the right place is recalculated. Emits items-changed on the list
+ model interface for the part that actually changed. */
+static void
+update_thread(I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	GPtrArray *thread = priv->thread;
+	unsigned old_len = thread->len;
+	unsigned diverge = G_MAXUINT;
+
+	/* Find the deepest ancestor of the current node that is already in the
+	 array at the index corresponding to its depth. Pointers in the array are
+	 only compared, never dereferenced, since they may refer to nodes that were
+	 removed from the skein. */
+	GSList *path = NULL;
+	GNode *gnode = priv->current->gnode;
+	unsigned depth = g_node_depth(gnode);
+	while(gnode && (depth > old_len || g_ptr_array_index(thread, depth - 1) != gnode->data)) {
+		path = g_slist_prepend(path, gnode->data);
+		gnode = gnode->parent;
+		depth--;
 	}
 
-	g_object_notify(G_OBJECT(self), "current-node");
-	g_signal_emit_by_name(self, "needs-layout");
+	/* Fill in the nodes from there to the current node */
+	unsigned pos = depth;
+	GSList *iter;
+	for(iter = path; iter; iter = g_slist_next(iter))
+		set_thread_node(thread, pos++, iter->data, &diverge);
+	g_slist_free(path);
+
+	/* Then follow the thread down to its bottom */
+	for(gnode = priv->current->gnode; g_node_n_children(gnode) == 1; gnode = gnode->children)
+		set_thread_node(thread, pos++, gnode->children->data, &diverge);
+
+	if(pos < old_len && diverge == G_MAXUINT)
+		diverge = pos;
+	g_ptr_array_set_size(thread, pos);
+
+	/* In a transaction, the whole change is announced when it ends */
+	if(diverge != G_MAXUINT && priv->transaction_depth == 0)
+		g_list_model_items_changed(G_LIST_MODEL(self), diverge, old_len - diverge, pos - diverge);
 }
 
 gboolean
 i7_skein_is_node_in_current_thread(I7Skein *self, I7Node *node)
 {
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
-	I7Node *last = i7_skein_get_thread_bottom(self, priv->current);
-	return i7_node_in_thread(node, last);
+	unsigned depth = g_node_depth(node->gnode);
+	return depth <= priv->thread->len && g_ptr_array_index(priv->thread, depth - 1) == node;
 }
 
 I7Node *
@@ -406,11 +829,12 @@ i7_skein_get_played_node(I7Skein *self)
 	return priv->played;
 }
 
-static gboolean
-change_node_played(GNode *gnode, gpointer data)
+static void
+touch_played(I7Skein *self, GNode *gnode, gboolean played)
 {
-	i7_node_set_played(I7_NODE(gnode->data), GPOINTER_TO_INT(data));
-	return FALSE; /* Don't stop the traversal */
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	i7_node_set_played(I7_NODE(gnode->data), played);
+	priv->n_played_touched++;
 }
 
 /* Private */
@@ -419,222 +843,648 @@ i7_skein_set_played_node(I7Skein *self, I7Node *node)
 {
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
 
-	/* Change the colors of the nodes */
-
-	GNode *gnode;
-	if(priv->played && i7_node_in_thread(priv->played, node)) {
-		/* If the new played node is a descendant of the old played node, then
-		 just change the colors in a line down to the new one */
-		gnode = priv->played->gnode;
-	}
-	else {
-		/* Otherwise, make every node unplayed first and start again at the
-		 root node */
-		g_node_traverse(priv->root->gnode, G_IN_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)change_node_played, GINT_TO_POINTER(FALSE));
-		gnode = priv->root->gnode;
-	}
-
-	/* Calculate which nodes should be "played" */
-	do {
-		i7_node_set_played(I7_NODE(gnode->data), TRUE);
-		for(gnode = gnode->children; gnode; gnode = gnode->next) {
-			if(i7_node_in_thread(I7_NODE(gnode->data), node))
-				break;
-		}
-	} while(gnode);
+	/* The knots on the way from the root to the played knot are "played".
+	 Only the knots on one of the old and new ways, but not both, need to
+	 change: walk up from both ends until they meet. Without an old played
+	 knot, such as just after loading, nothing is played yet. */
+	GNode *old_gnode = priv->played? priv->played->gnode : NULL;
+	GNode *new_gnode = node->gnode;
+	unsigned old_depth = old_gnode? g_node_depth(old_gnode) : 0;
+	unsigned new_depth = g_node_depth(new_gnode);
+
+	priv->n_played_touched = 0;
+	for(; old_depth > new_depth; old_depth--, old_gnode = old_gnode->parent)
+		touch_played(self, old_gnode, FALSE);
+	for(; new_depth > old_depth; new_depth--, new_gnode = new_gnode->parent)
+		touch_played(self, new_gnode, TRUE);
+	while(old_gnode != new_gnode) {
+		touch_played(self, old_gnode, FALSE);
+		touch_played(self, new_gnode, TRUE);
+		old_gnode = old_gnode->parent;
+		new_gnode = new_gnode->parent;
+	}
 
 	priv->played = node;
 	g_object_notify(G_OBJECT(self), "played-node");
 }
 
-/* Search an xmlNode's properties for a certain one and return its content.
-String must be freed. Return NULL if not found */
-static gchar *
-get_property_from_node(xmlNode *node, const gchar *propertyname)
+/*
+ * i7_skein_get_played_nodes_touched:
+ * @self: the skein
+ *
+ * For testing: how many knots had their "played" flag changed the last time
+ * the played knot changed.
+ */
+unsigned
+i7_skein_get_played_nodes_touched(I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	return priv->n_played_touched;
+}
+
+/* Get the value of the attribute @name of the reader's current element, or
+ NULL if not found. String must be freed. */
+static char *
+reader_get_attribute(xmlTextReader *reader, const char *name)
+{
+	return (char *)xmlTextReaderGetAttribute(reader, (const xmlChar *)name);
+}
+
+/* Get the text content of the reader's current element. The string is
+ allocated by libxml2 with the system allocator, so ownership can be passed on
+ to anything that frees it with g_free(). */
+static char *
+reader_get_text_content(xmlTextReader *reader)
 {
-	xmlAttr *props;
-	for(props = node->properties; props; props = props->next)
-		if(xmlStrEqual(props->name, (const xmlChar *)propertyname))
-			return g_strdup((gchar *)props->children->content);
-	return NULL;
+	return (char *)xmlTextReaderReadString(reader);
 }
 
 /* Read the ObjectiveC "YES" and "NO" into a boolean, or return default_val if
  content is malformed */
 static gboolean
-get_boolean_from_content(xmlNode *node, gboolean default_val)
+reader_get_boolean_content(xmlTextReader *reader, gboolean default_val)
 {
-	if(xmlStrEqual(node->children->content, (xmlChar *)"YES"))
+	g_autofree char *content = reader_get_text_content(reader);
+	if(g_strcmp0(content, "YES") == 0)
 		return TRUE;
-	else if(xmlStrEqual(node->children->content, (xmlChar *)"NO"))
+	else if(g_strcmp0(content, "NO") == 0)
 		return FALSE;
 	else
 		return default_val;
 }
 
-static gchar *
-get_text_content_from_node(xmlNode *node)
+static void
+set_xml_error(GError **error)
 {
-	if(node->children)
-		if(xmlStrEqual(node->children->name, (xmlChar *)"text"))
-			return g_strdup((gchar *)node->children->content);
-	return NULL;
+	const xmlError *xml_error = xmlGetLastError();
+	g_set_error_literal(error, I7_SKEIN_ERROR, I7_SKEIN_ERROR_XML,
+		xml_error && xml_error->message? xml_error->message : _("Unknown XML error"));
 }
 
-/* Doesn't actually free the node itself, but removes it from the canvas so that
- it gets freed. Has reversed arguments and returns FALSE for use in tree
- traversals. */
+/* A parent-child link that is resolved after all the knots have been read,
+ since a <child> can refer to an <item> further on in the file */
+typedef struct {
+	I7Node *parent;
+	char *child_id;
+} ChildLink;
+
+/* Doesn't actually free the node itself, but removes it from the canvas and
+ the label index so that it gets freed. Has reversed arguments and returns
+ FALSE for use in tree traversals. */
 static gboolean
 remove_node_from_canvas(GNode *gnode, I7Skein *self)
 {
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	unindex_label(self, gnode->data);
+	g_hash_table_remove(priv->materialized, gnode->data);
 	if(I7_NODE(gnode->data)->tree_item)
 		goo_canvas_item_model_remove(I7_NODE(gnode->data)->tree_item);
 	goo_canvas_item_model_remove(GOO_CANVAS_ITEM_MODEL(gnode->data));
 	return FALSE;
 }
 
-gboolean
-i7_skein_load(I7Skein *self, GFile *file, GError **error)
+/* Read one <item> element, create a knot for it and add it to @nodetable, and
+ queue its <child> elements in @links. The reader must be positioned on the
+ <item> start tag; afterwards it is positioned on the corresponding end tag. */
+static gboolean
+load_item(I7Skein *self, xmlTextReader *reader, GHashTable *nodetable, GArray *links, GError **error)
 {
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
-	g_return_val_if_fail(file, FALSE);
-
-	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
-
-	char *filename = g_file_get_path(file);
-	xmlDoc *xmldoc = xmlParseFile(filename);
-	g_free(filename);
-	if(!xmldoc) {
-		const xmlError *xml_error = xmlGetLastError();
-		if(error)
-			*error = g_error_new_literal(I7_SKEIN_ERROR, I7_SKEIN_ERROR_XML, g_strdup(xml_error->message));
+	char *id = reader_get_attribute(reader, "nodeId");
+	if(!id) {
+		g_set_error(error, I7_SKEIN_ERROR, I7_SKEIN_ERROR_BAD_FORMAT, "nodeId attribute not found.");
 		return FALSE;
 	}
 
-	/* Get the top XML node */
-	xmlNode *top = xmlDocGetRootElement(xmldoc);
-	if(!xmlStrEqual(top->name, (xmlChar *)"Skein")) {
-		if(error)
-			*error = g_error_new(I7_SKEIN_ERROR, I7_SKEIN_ERROR_BAD_FORMAT, "<Skein> element not found.");
-		goto fail;
-	}
-
-	/* Get the ID of the root node */
-	gchar *root_id = get_property_from_node(top, "rootNode");
-	if(!root_id) {
-		if(error)
-			*error = g_error_new(I7_SKEIN_ERROR, I7_SKEIN_ERROR_BAD_FORMAT, "rootNode attribute not found.");
-		goto fail;
-	}
+	char *command = NULL, *label = NULL, *transcript = NULL, *expected = NULL;
+	gboolean unlocked = TRUE, changed = FALSE;
+	int score = 0;
+	unsigned first_link = links->len;
+
+	if(!xmlTextReaderIsEmptyElement(reader)) {
+		int status;
+		while((status = xmlTextReaderRead(reader)) == 1) {
+			int type = xmlTextReaderNodeType(reader);
+			int depth = xmlTextReaderDepth(reader);
+			if(type == XML_READER_TYPE_END_ELEMENT && depth == 1)
+				break;
+			if(type != XML_READER_TYPE_ELEMENT)
+				continue;
 
-	/* Get all the item nodes and the ID of the active node */
-	GHashTable *nodetable = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-	gchar *active_id = NULL;
-	xmlNode *item;
-	/* Create a node object for each of the XML item nodes */
-	for(item = top->children; item; item = item->next) {
-		if(xmlStrEqual(item->name, (xmlChar *)"activeNode"))
-			active_id = get_property_from_node(item, "nodeId");
-		else if(xmlStrEqual(item->name, (xmlChar *)"item")) {
-			gchar *id, *command = NULL, *label = NULL;
-			gchar *transcript = NULL, *expected = NULL;
-			gboolean unlocked = TRUE, changed = FALSE;
-			int score = 0;
-
-			xmlNode *child;
-			for(child = item->children; child; child = child->next) {
-				/* Ignore "played" and "changed"; these are calculated */
-				if(xmlStrEqual(child->name, (xmlChar *)"command"))
-					command = get_text_content_from_node(child);
-				else if(xmlStrEqual(child->name, (xmlChar *)"annotation"))
-					label = get_text_content_from_node(child);
-				else if(xmlStrEqual(child->name, (xmlChar *)"result"))
-					transcript = get_text_content_from_node(child);
-				else if(xmlStrEqual(child->name, (xmlChar *)"commentary"))
-					expected = get_text_content_from_node(child);
-				else if(xmlStrEqual(child->name, (xmlChar *)"changed"))
-					changed = get_boolean_from_content(child, FALSE);
-				else if(xmlStrEqual(child->name, (xmlChar *)"temporary")) {
-					unlocked = get_boolean_from_content(child, TRUE);
-					gchar *trash = get_property_from_node(child, "score");
-					sscanf(trash, "%d", &score);
-					g_free(trash);
-				}
+			const xmlChar *name = xmlTextReaderConstLocalName(reader);
+			if(depth == 3 && xmlStrEqual(name, (xmlChar *)"child")) {
+				ChildLink link = { NULL, reader_get_attribute(reader, "nodeId") };
+				if(link.child_id)
+					g_array_append_val(links, link);
 			}
-			id = get_property_from_node(item, "nodeId"); /* freed by table */
+			if(depth != 2)
+				continue;
 
-			I7Node *skein_node = i7_node_new(command, label, transcript, expected, FALSE, !unlocked, changed, score, GOO_CANVAS_ITEM_MODEL(self));
-			node_listen(self, skein_node);
-			g_hash_table_insert(nodetable, id, skein_node);
+			/* Ignore "played"; it is calculated */
+			if(xmlStrEqual(name, (xmlChar *)"command")) {
+				g_free(command);
+				command = reader_get_text_content(reader);
+			} else if(xmlStrEqual(name, (xmlChar *)"annotation")) {
+				g_free(label);
+				label = reader_get_text_content(reader);
+			} else if(xmlStrEqual(name, (xmlChar *)"result")) {
+				g_free(transcript);
+				transcript = reader_get_text_content(reader);
+			} else if(xmlStrEqual(name, (xmlChar *)"commentary")) {
+				g_free(expected);
+				expected = reader_get_text_content(reader);
+			} else if(xmlStrEqual(name, (xmlChar *)"changed")) {
+				changed = reader_get_boolean_content(reader, FALSE);
+			} else if(xmlStrEqual(name, (xmlChar *)"temporary")) {
+				g_autofree char *score_string = reader_get_attribute(reader, "score");
+				if(score_string)
+					sscanf(score_string, "%d", &score);
+				unlocked = reader_get_boolean_content(reader, TRUE);
+			}
+		}
+		if(status != 1) {
+			set_xml_error(error);
+			g_free(id);
 			g_free(command);
 			g_free(label);
 			g_free(transcript);
 			g_free(expected);
+			return FALSE;
 		}
 	}
 
-	/* Loop through the item nodes again, adding the children to each parent */
-	for(item = top->children; item; item = item->next) {
-		if(!xmlStrEqual(item->name, (xmlChar *)"item"))
-			continue;
-		gchar *id = get_property_from_node(item, "nodeId");
-		I7Node *parent_node = g_hash_table_lookup(nodetable, id);
-		xmlNode *child;
-		for(child = item->children; child; child = child->next) {
-			if(!xmlStrEqual(child->name, (xmlChar *)"children"))
-				continue;
-			xmlNode *list;
-			for(list = child->children; list; list = list->next) {
-				if(!xmlStrEqual(list->name, (xmlChar *)"child"))
-					continue;
-				gchar *child_id = get_property_from_node(list, "nodeId");
-				g_node_append(parent_node->gnode, I7_NODE(g_hash_table_lookup(nodetable, child_id))->gnode);
-				g_free(child_id);
-			}
-		}
-		g_free(id);
-	}
-
-	/* Discard the current skein and replace with the new */
-	g_node_traverse(priv->root->gnode, G_POST_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)remove_node_from_canvas, self);
-	priv->root = I7_NODE(g_hash_table_lookup(nodetable, root_id));
-	priv->played = NULL;
-	i7_skein_set_played_node(self, I7_NODE(g_hash_table_lookup(nodetable, active_id)));
-	i7_skein_set_current_node(self, priv->root);
-
-	g_signal_emit_by_name(self, "needs-layout");
-	g_signal_emit_by_name(self, "labels-changed");
-	priv->modified = FALSE;
+	/* The knot takes ownership of the strings */
+	I7Node *skein_node = i7_node_new_take(command, label, transcript, expected, !unlocked, changed, score, GOO_CANVAS_ITEM_MODEL(self));
+	g_hash_table_insert(nodetable, id, skein_node); /* id freed by table */
 
-	g_free(root_id);
-	g_free(active_id);
-	g_hash_table_destroy(nodetable);
-    xmlFreeDoc(xmldoc);
+	unsigned ix;
+	for(ix = first_link; ix < links->len; ix++)
+		g_array_index(links, ChildLink, ix).parent = skein_node;
 
 	return TRUE;
-fail:
-	xmlFreeDoc(xmldoc);
-	return FALSE;
 }
 
-static gboolean
-node_write_xml(GNode *gnode, GDataOutputStream *stream)
+static void
+discard_loaded_node(const char *id, I7Node *node, I7Skein *self)
 {
-	gchar *xml = i7_node_get_xml(I7_NODE(gnode->data));
-	g_data_output_stream_put_string(stream, xml, NULL, NULL);
-	g_free(xml);
-	return FALSE; /* Do not stop the traversal */
+	remove_node_from_canvas(node->gnode, self);
+	g_object_unref(node);
 }
 
-static void on_file_replace_finish(GFile *file, GAsyncResult *res, GTask *data);
-
-void
-i7_skein_save_async(I7Skein *self, GFile *file, int priority, GCancellable *cancel, GAsyncReadyCallback callback, void *data)
+/* Discard the current skein and replace it with the tree under @root, which
+ has just been loaded */
+static void
+replace_tree(I7Skein *self, I7Node *root, I7Node *active)
 {
-    GTask *task = g_task_new(self, cancel, callback, data);
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	if(!active || !i7_node_in_thread(root, active))
+		active = root;
+
+	I7Node *old_root = priv->root;
+	priv->root = root;
+	reindex_labels(self);
+	g_node_traverse(old_root->gnode, G_POST_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)remove_node_from_canvas, self);
+	priv->played = NULL;
+	i7_skein_set_played_node(self, active);
+	i7_skein_set_current_node(self, priv->root);
+
+	emit_needs_layout(self);
+	priv->modified = FALSE;
+}
+
+/* Once each knot has at most one parent and the root has none, the links form
+ a tree unless some knots are linked in a loop, cut off from the root. Walk up
+ from each knot until reaching one that was already seen: if it was seen on
+ the same walk, there is a loop. Each knot is only walked over once. */
+static gboolean
+links_form_loop(GHashTable *parents)
+{
+	GHashTable *seen = g_hash_table_new(NULL, NULL); /* I7Node * -> walk number */
+	GHashTableIter iter;
+	I7Node *node;
+	unsigned walk = 0;
+	gboolean retval = FALSE;
+
+	g_hash_table_iter_init(&iter, parents);
+	while(!retval && g_hash_table_iter_next(&iter, (gpointer *)&node, NULL)) {
+		walk++;
+		for(; node; node = g_hash_table_lookup(parents, node)) {
+			unsigned seen_on = GPOINTER_TO_UINT(g_hash_table_lookup(seen, node));
+			if(seen_on != 0) {
+				retval = (seen_on == walk);
+				break;
+			}
+			g_hash_table_insert(seen, node, GUINT_TO_POINTER(walk));
+		}
+	}
+
+	g_hash_table_destroy(seen);
+	return retval;
+}
+
+/* Load the skein using libxml2's streaming reader, so that the document tree
+ is never built in memory. Knots are created in one pass over the file, and the
+ parent-child links are resolved at the end. */
+gboolean
+i7_skein_load(I7Skein *self, GFile *file, GError **error)
+{
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	g_return_val_if_fail(file, FALSE);
+
+	g_autofree char *filename = g_file_get_path(file);
+	xmlTextReader *reader = xmlReaderForFile(filename, NULL, XML_PARSE_NONET);
+	if(!reader) {
+		set_xml_error(error);
+		return FALSE;
+	}
+
+	GHashTable *nodetable = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	GArray *links = g_array_new(FALSE, FALSE, sizeof(ChildLink));
+	GHashTable *parents = NULL; /* I7Node * child -> I7Node * parent */
+	g_autofree char *root_id = NULL;
+	g_autofree char *active_id = NULL;
+	unsigned ix;
+	int status;
+
+	/* Get the top XML element */
+	while((status = xmlTextReaderRead(reader)) == 1 && xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)
+		;
+	if(status != 1) {
+		set_xml_error(error);
+		goto fail;
+	}
+	if(!xmlStrEqual(xmlTextReaderConstLocalName(reader), (xmlChar *)"Skein")) {
+		g_set_error(error, I7_SKEIN_ERROR, I7_SKEIN_ERROR_BAD_FORMAT, "<Skein> element not found.");
+		goto fail;
+	}
+
+	/* Get the ID of the root node */
+	root_id = reader_get_attribute(reader, "rootNode");
+	if(!root_id) {
+		g_set_error(error, I7_SKEIN_ERROR, I7_SKEIN_ERROR_BAD_FORMAT, "rootNode attribute not found.");
+		goto fail;
+	}
+
+	/* Create a node object for each of the XML item elements, and get the ID
+	 of the active node */
+	while((status = xmlTextReaderRead(reader)) == 1) {
+		if(xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT || xmlTextReaderDepth(reader) != 1)
+			continue;
+
+		const xmlChar *name = xmlTextReaderConstLocalName(reader);
+		if(xmlStrEqual(name, (xmlChar *)"activeNode")) {
+			g_free(active_id);
+			active_id = reader_get_attribute(reader, "nodeId");
+		} else if(xmlStrEqual(name, (xmlChar *)"item")) {
+			if(!load_item(self, reader, nodetable, links, error))
+				goto fail;
+		}
+	}
+	if(status != 0) {
+		set_xml_error(error);
+		goto fail;
+	}
+
+	I7Node *root = g_hash_table_lookup(nodetable, root_id);
+	if(!root) {
+		g_set_error(error, I7_SKEIN_ERROR, I7_SKEIN_ERROR_BAD_FORMAT, "Root node %s not found.", root_id);
+		goto fail;
+	}
+
+	/* Check that all the links can be resolved, and form a tree, before
+	 changing anything */
+	parents = g_hash_table_new(NULL, NULL);
+	for(ix = 0; ix < links->len; ix++) {
+		ChildLink *link = &g_array_index(links, ChildLink, ix);
+		I7Node *child = g_hash_table_lookup(nodetable, link->child_id);
+		if(!child) {
+			g_set_error(error, I7_SKEIN_ERROR, I7_SKEIN_ERROR_BAD_FORMAT, "Child node %s not found.", link->child_id);
+			goto fail;
+		}
+		if(child == root) {
+			g_set_error(error, I7_SKEIN_ERROR, I7_SKEIN_ERROR_BAD_FORMAT, "Root node %s is listed as a child.", link->child_id);
+			goto fail;
+		}
+		if(!g_hash_table_insert(parents, child, link->parent)) {
+			g_set_error(error, I7_SKEIN_ERROR, I7_SKEIN_ERROR_BAD_FORMAT, "Child node %s is listed more than once.", link->child_id);
+			goto fail;
+		}
+	}
+	if(links_form_loop(parents)) {
+		g_set_error_literal(error, I7_SKEIN_ERROR, I7_SKEIN_ERROR_BAD_FORMAT, "Child nodes are linked in a loop.");
+		goto fail;
+	}
+	g_clear_pointer(&parents, g_hash_table_destroy);
+
+	/* Add the children to each parent. Links from the same parent are
+	 consecutive, so keep track of the last child instead of letting
+	 g_node_append() walk the list of siblings each time. */
+	GNode *last_child = NULL;
+	for(ix = 0; ix < links->len; ix++) {
+		ChildLink *link = &g_array_index(links, ChildLink, ix);
+		I7Node *child = g_hash_table_lookup(nodetable, link->child_id);
+		if(last_child && last_child->parent == link->parent->gnode)
+			last_child = g_node_insert_after(link->parent->gnode, last_child, child->gnode);
+		else
+			last_child = g_node_append(link->parent->gnode, child->gnode);
+		g_free(link->child_id);
+	}
+	g_array_free(links, TRUE);
+
+	/* Listen to the nodes only now, so that loading doesn't cause a flood of
+	 notifications */
+	GHashTableIter iter;
+	I7Node *node;
+	g_hash_table_iter_init(&iter, nodetable);
+	while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&node))
+		node_listen(self, node);
+
+	I7Node *active = active_id? g_hash_table_lookup(nodetable, active_id) : NULL;
+	replace_tree(self, root, active);
+
+	g_hash_table_destroy(nodetable);
+	xmlFreeTextReader(reader);
+
+	return TRUE;
+fail:
+	g_clear_pointer(&parents, g_hash_table_destroy);
+	for(ix = 0; ix < links->len; ix++)
+		g_free(g_array_index(links, ChildLink, ix).child_id);
+	g_array_free(links, TRUE);
+	/* None of the nodes have been linked together yet at this point */
+	g_hash_table_foreach(nodetable, (GHFunc)discard_loaded_node, self);
+	g_hash_table_destroy(nodetable);
+	xmlFreeTextReader(reader);
+	return FALSE;
+}
+
+/* Immutable copy of what is saved of a knot, so that it can be serialized on
+ another thread */
+typedef struct {
+	const char *id; /* in the snapshot's string chunk */
+	const char *command; /* referenced in the snapshot's string pool */
+	const char *label;
+	const char *transcript_text;
+	const char *expected_text;
+	unsigned parent; /* index of the parent knot, or SNAPSHOT_NONE */
+	unsigned first_child; /* index into the snapshot's children */
+	unsigned n_children;
+	int score;
+	gboolean played;
+	gboolean changed;
+	gboolean locked;
+} SnapshotKnot;
+
+#define SNAPSHOT_NONE G_MAXUINT32
 
-    g_file_replace_async(file, /* etag = */ NULL, /* backup = */ FALSE, G_FILE_CREATE_NONE, priority, cancel,
-        (GAsyncReadyCallback)on_file_replace_finish, task);
+typedef struct {
+	GNode *gnode;
+	unsigned index;
+} SnapshotAncestor;
+
+typedef struct {
+	I7StringPool *pool; /* owns a reference */
+	GStringChunk *ids; /* IDs of all the knots, deduplicated */
+	GArray *knots; /* SnapshotKnot, in pre-order */
+	GPtrArray *children; /* child IDs, in @ids */
+	const char *root_id;
+	const char *current_id;
+	unsigned current; /* index of the current knot */
+	gsize text_size; /* Unescaped size of all the text, for sizing the buffer */
+	guint64 xml_hash; /* set by serialize_skein_thread() */
+
+	GNode *current_gnode; /* only while taking the snapshot */
+	GArray *ancestors; /* SnapshotAncestor, only while taking the snapshot */
+} SkeinSnapshot;
+
+static gboolean
+snapshot_knot(GNode *gnode, SkeinSnapshot *snapshot)
+{
+	I7Node *node = I7_NODE(gnode->data);
+	GNode *child;
+	SnapshotKnot knot;
+
+	knot.id = g_string_chunk_insert_const(snapshot->ids, i7_node_get_unique_id(node));
+	knot.command = i7_string_pool_intern(snapshot->pool, i7_node_peek_command(node));
+	knot.label = i7_string_pool_intern(snapshot->pool, i7_node_peek_label(node));
+	knot.transcript_text = i7_string_pool_intern(snapshot->pool, i7_node_peek_transcript_text(node));
+	knot.expected_text = i7_string_pool_intern(snapshot->pool, i7_node_peek_expected_text(node));
+	knot.score = i7_node_get_score(node);
+	knot.played = i7_node_get_played(node);
+	knot.changed = i7_node_get_changed(node);
+	knot.locked = i7_node_get_locked(node);
+
+	/* Pop the ancestors that aren't this knot's parent; the traversal is in
+	 pre-order, so the parent is always on the stack */
+	while(snapshot->ancestors->len > 0 &&
+		g_array_index(snapshot->ancestors, SnapshotAncestor, snapshot->ancestors->len - 1).gnode != gnode->parent)
+		g_array_set_size(snapshot->ancestors, snapshot->ancestors->len - 1);
+	knot.parent = snapshot->ancestors->len > 0?
+		g_array_index(snapshot->ancestors, SnapshotAncestor, snapshot->ancestors->len - 1).index : SNAPSHOT_NONE;
+	SnapshotAncestor ancestor = { gnode, snapshot->knots->len };
+	g_array_append_val(snapshot->ancestors, ancestor);
+	if(gnode == snapshot->current_gnode)
+		snapshot->current = snapshot->knots->len;
+
+	knot.first_child = snapshot->children->len;
+	knot.n_children = 0;
+	for(child = gnode->children; child; child = child->next) {
+		g_ptr_array_add(snapshot->children, g_string_chunk_insert_const(snapshot->ids, i7_node_get_unique_id(child->data)));
+		knot.n_children++;
+	}
+
+	snapshot->text_size += strlen(knot.command) + strlen(knot.label) +
+		strlen(knot.transcript_text) + strlen(knot.expected_text);
+	g_array_append_val(snapshot->knots, knot);
+	return FALSE; /* Don't stop the traversal */
+}
+
+/* Must be called on the main thread. The text is shared with the skein, not
+ copied. */
+static SkeinSnapshot *
+skein_snapshot_new(I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	SkeinSnapshot *snapshot = g_new0(SkeinSnapshot, 1);
+	snapshot->pool = i7_string_pool_ref(priv->string_pool);
+	snapshot->ids = g_string_chunk_new(4096);
+	snapshot->knots = g_array_new(FALSE, FALSE, sizeof(SnapshotKnot));
+	snapshot->children = g_ptr_array_new();
+	snapshot->current = 0;
+	snapshot->current_gnode = priv->current->gnode;
+	snapshot->ancestors = g_array_new(FALSE, FALSE, sizeof(SnapshotAncestor));
+	g_node_traverse(priv->root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)snapshot_knot, snapshot);
+	g_array_free(snapshot->ancestors, TRUE);
+	snapshot->ancestors = NULL;
+	snapshot->current_gnode = NULL;
+	snapshot->root_id = g_string_chunk_insert_const(snapshot->ids, i7_node_get_unique_id(priv->root));
+	snapshot->current_id = g_string_chunk_insert_const(snapshot->ids, i7_node_get_unique_id(priv->current));
+	return snapshot;
+}
+
+/* Must be called on the main thread, since it gives the text back to the
+ string pool */
+static void
+skein_snapshot_free(SkeinSnapshot *snapshot)
+{
+	unsigned ix;
+	for(ix = 0; ix < snapshot->knots->len; ix++) {
+		SnapshotKnot *knot = &g_array_index(snapshot->knots, SnapshotKnot, ix);
+		i7_string_pool_release(snapshot->pool, knot->command);
+		i7_string_pool_release(snapshot->pool, knot->label);
+		i7_string_pool_release(snapshot->pool, knot->transcript_text);
+		i7_string_pool_release(snapshot->pool, knot->expected_text);
+	}
+	i7_string_pool_unref(snapshot->pool);
+	g_string_chunk_free(snapshot->ids);
+	g_array_free(snapshot->knots, TRUE);
+	g_ptr_array_free(snapshot->children, TRUE);
+	g_free(snapshot);
+}
+
+static void
+append_xml_element(GString *xml, const char *name, const char *text)
+{
+	g_string_append(xml, "    <");
+	g_string_append(xml, name);
+	g_string_append(xml, " xml:space=\"preserve\">");
+	append_markup_escaped(xml, text, -1);
+	g_string_append(xml, "</");
+	g_string_append(xml, name);
+	g_string_append(xml, ">\n");
+}
+
+static guint64 hash_bytes(const unsigned char *data, gsize length);
+static gboolean get_file_stamp(GFile *file, guint64 *size, guint64 *mtime, GError **error);
+
+/* Runs on a worker thread */
+static void
+serialize_skein_thread(GTask *task, I7Skein *self, SkeinSnapshot *snapshot, GCancellable *cancel)
+{
+	/* Room for the text plus about 350 bytes of markup per knot, so the buffer
+	 rarely has to grow */
+	GString *xml = g_string_sized_new(snapshot->text_size + snapshot->text_size / 16 +
+		snapshot->knots->len * 350 + 256);
+
+	g_string_append_printf(xml,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<Skein rootNode=\"%s\" "
+		"xmlns=\"http://www.logicalshift.org.uk/IF/Skein\">\n"
+		"  <generator>Inform 7</generator>\n"
+		"  <activeNode nodeId=\"%s\"/>\n",
+		snapshot->root_id, snapshot->current_id);
+
+	unsigned ix, child;
+	for(ix = 0; ix < snapshot->knots->len; ix++) {
+		const SnapshotKnot *knot = &g_array_index(snapshot->knots, SnapshotKnot, ix);
+
+		if(ix % 1024 == 0 && g_task_return_error_if_cancelled(task)) {
+			g_string_free(xml, TRUE);
+			return;
+		}
+
+		g_string_append(xml, "  <item nodeId=\"");
+		g_string_append(xml, knot->id);
+		g_string_append(xml, "\">\n");
+		append_xml_element(xml, "command", knot->command);
+		append_xml_element(xml, "result", knot->transcript_text);
+		append_xml_element(xml, "commentary", knot->expected_text);
+		g_string_append(xml, knot->played? "    <played>YES</played>\n" : "    <played>NO</played>\n");
+		g_string_append(xml, knot->changed? "    <changed>YES</changed>\n" : "    <changed>NO</changed>\n");
+		g_string_append_printf(xml, "    <temporary score=\"%d\">%s</temporary>\n", knot->score, knot->locked? "NO" : "YES");
+		append_xml_element(xml, "annotation", knot->label);
+
+		if(knot->n_children > 0) {
+			g_string_append(xml, "    <children>\n");
+			for(child = knot->first_child; child < knot->first_child + knot->n_children; child++) {
+				g_string_append(xml, "      <child nodeId=\"");
+				g_string_append(xml, g_ptr_array_index(snapshot->children, child));
+				g_string_append(xml, "\"/>\n");
+			}
+			g_string_append(xml, "    </children>\n");
+		}
+		g_string_append(xml, "  </item>\n");
+	}
+
+	g_string_append(xml, "</Skein>\n");
+	snapshot->xml_hash = hash_bytes((const unsigned char *)xml->str, xml->len);
+
+	g_task_return_pointer(task, g_string_free_to_bytes(xml), (GDestroyNotify)g_bytes_unref);
+}
+
+typedef struct {
+	GFile *file;
+	unsigned n_modifications; /* When the snapshot was taken */
+	guint64 hash; /* of the XML being written */
+} SaveData;
+
+static void
+save_data_free(SaveData *save_data)
+{
+	g_object_unref(save_data->file);
+	g_free(save_data);
+}
+
+static void on_serialize_finish(I7Skein *self, GAsyncResult *res, GTask *data);
+static void on_file_replace_finish(GFile *file, GAsyncResult *res, GTask *data);
+
+/*
+ * i7_skein_save_async:
+ * @self: the skein
+ * @file: where to save it
+ * @priority: I/O priority of the request
+ * @cancel: (nullable): a #GCancellable
+ * @callback: called when the skein is saved
+ * @data: user data for @callback
+ *
+ * Saves the skein. Only a snapshot is taken on the main thread; the skein is
+ * turned into XML on a worker thread, and written to @file in one go.
+ */
+void
+i7_skein_save_async(I7Skein *self, GFile *file, int priority, GCancellable *cancel, GAsyncReadyCallback callback, void *data)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	GTask *task = g_task_new(self, cancel, callback, data);
+	g_task_set_priority(task, priority);
+	SaveData *save_data = g_new0(SaveData, 1);
+	save_data->file = g_object_ref(file);
+	save_data->n_modifications = priv->n_modifications;
+	g_task_set_task_data(task, save_data, (GDestroyNotify)save_data_free);
+
+	SkeinSnapshot *snapshot = skein_snapshot_new(self);
+
+	/* The snapshot is freed in on_serialize_finish(), since that must happen
+	 on the main thread */
+	GTask *serialize_task = g_task_new(self, cancel, (GAsyncReadyCallback)on_serialize_finish, task);
+	g_task_set_priority(serialize_task, priority);
+	g_task_set_task_data(serialize_task, snapshot, NULL);
+	g_task_run_in_thread(serialize_task, (GTaskThreadFunc)serialize_skein_thread);
+	g_object_unref(serialize_task);
+}
+
+static void
+on_serialize_finish(I7Skein *self, GAsyncResult *res, GTask *data)
+{
+	GTask *task = data;
+	SaveData *save_data = g_task_get_task_data(task);
+	SkeinSnapshot *snapshot = g_task_get_task_data(G_TASK(res));
+	GError *error = NULL;
+
+	save_data->hash = snapshot->xml_hash;
+	skein_snapshot_free(snapshot);
+
+	g_autoptr(GBytes) bytes = g_task_propagate_pointer(G_TASK(res), &error);
+	if (!bytes) {
+		g_task_return_error(task, error);
+		g_object_unref(task);
+		return;
+	}
+
+	g_file_replace_contents_bytes_async(save_data->file, bytes,
+		/* etag = */ NULL, /* backup = */ FALSE, G_FILE_CREATE_NONE, g_task_get_cancellable(task),
+		(GAsyncReadyCallback)on_file_replace_finish, task);
 }
 
 static void
@@ -642,181 +1492,876 @@ on_file_replace_finish(GFile *file, GAsyncResult *res, GTask *data)
 {
 	g_autoptr(GTask) task = data;
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(g_task_get_source_object(task));
+	SaveData *save_data = g_task_get_task_data(task);
 	GError *error = NULL;
 
-	GFileOutputStream *fstream = g_file_replace_finish(file, res, &error);
-	if (!fstream) {
+	if (!g_file_replace_contents_finish(file, res, /* etag = */ NULL, &error)) {
 		g_task_return_error(task, error);
 		return;
 	}
 
-	g_debug("Save Skein: Skein.skein opened for writing");
+	/* Changes made while saving didn't make it into the file */
+	if(priv->n_modifications == save_data->n_modifications)
+		priv->modified = FALSE;
+
+	g_clear_object(&priv->saved_file);
+	if(get_file_stamp(file, &priv->saved_size, &priv->saved_mtime, NULL)) {
+		priv->saved_file = g_object_ref(file);
+		priv->saved_hash = save_data->hash;
+	}
+
+	g_task_return_boolean(task, TRUE);
+
+	g_debug("Save Skein: finished saving");
+}
+
+bool
+i7_skein_save_finish(I7Skein *self, GAsyncResult *res, GError **error)
+{
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	return g_task_propagate_boolean(G_TASK(res), error);
+}
+
+/* BINARY CACHE
+
+ A copy of the skein in a form that can be used straight from a memory map, so
+ that opening a project with a huge skein doesn't need to parse the XML. The XML
+ file is still the one that counts; the cache is only used if the XML file has
+ the same size, modification time, and hash as when the cache was written. The
+ layout of the cache is:
+
+ CacheHeader
+ CacheKnot[n_knots], in pre-order, so the root comes first
+ guint32[n_strings], offsets of the strings into the string data
+ The string data, NUL-terminated strings
+
+ Numbers are in the byte order of the machine that wrote the cache; a cache from
+ a machine with another byte order is not used. */
+
+#define CACHE_MAGIC "I7SKEIN"
+#define CACHE_VERSION 1
+#define CACHE_BYTE_ORDER 0x01020304
+
+enum {
+	CACHE_KNOT_LOCKED = 1 << 0,
+	CACHE_KNOT_CHANGED = 1 << 1,
+};
+
+typedef struct {
+	char magic[8];
+	guint32 version;
+	guint32 byte_order;
+	guint64 xml_size;
+	guint64 xml_mtime; /* microseconds since the epoch */
+	guint64 xml_hash;
+	guint32 n_knots;
+	guint32 n_strings;
+	guint32 active; /* index of the knot saved as the active node */
+	guint32 reserved;
+	guint64 string_data_size;
+} CacheHeader;
+
+typedef struct {
+	guint32 parent; /* indices of other knots, or SNAPSHOT_NONE */
+	guint32 first_child;
+	guint32 next_sibling;
+	guint32 command; /* indices into the string offsets */
+	guint32 label;
+	guint32 transcript_text;
+	guint32 expected_text;
+	gint32 score;
+	guint32 flags;
+} CacheKnot;
+
+G_STATIC_ASSERT(sizeof(CacheHeader) == 64);
+G_STATIC_ASSERT(sizeof(CacheKnot) == 36);
+
+static GFile *
+get_cache_file(GFile *file)
+{
+	g_autofree char *path = g_file_get_path(file);
+	g_autofree char *cache_path = g_strconcat(path, ".cache", NULL);
+	return g_file_new_for_path(cache_path);
+}
+
+/* Gets what the cache remembers of the XML file to tell if it changed */
+static gboolean
+get_file_stamp(GFile *file, guint64 *size, guint64 *mtime, GError **error)
+{
+	g_autoptr(GFileInfo) info = g_file_query_info(file,
+		G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+		G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC, G_FILE_QUERY_INFO_NONE, NULL, error);
+	if(!info)
+		return FALSE;
+	*size = g_file_info_get_size(info);
+	*mtime = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+		g_file_info_get_attribute_uint32(info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+	return TRUE;
+}
+
+/* FNV-1a; this only has to notice that the file changed */
+static guint64
+hash_bytes(const unsigned char *data, gsize length)
+{
+	guint64 hash = G_GUINT64_CONSTANT(14695981039346656037);
+	gsize ix;
+	for(ix = 0; ix < length; ix++) {
+		hash ^= data[ix];
+		hash *= G_GUINT64_CONSTANT(1099511628211);
+	}
+	return hash;
+}
+
+static gboolean
+hash_file(GFile *file, guint64 *hash, GError **error)
+{
+	g_autofree char *path = g_file_get_path(file);
+	GMappedFile *map = g_mapped_file_new(path, FALSE, error);
+	if(!map)
+		return FALSE;
+
+	*hash = hash_bytes((const unsigned char *)g_mapped_file_get_contents(map), g_mapped_file_get_length(map));
+	g_mapped_file_unref(map);
+	return TRUE;
+}
+
+/* Hashing the XML file is a pass over all of it, so that is only done when the
+ size and modification time already match those in the cache */
+static gboolean
+cache_is_current(GFile *file, const CacheHeader *header, GError **error)
+{
+	guint64 xml_size, xml_mtime, xml_hash;
+
+	if(!get_file_stamp(file, &xml_size, &xml_mtime, error))
+		return FALSE;
+	if(xml_size == header->xml_size && xml_mtime == header->xml_mtime) {
+		if(!hash_file(file, &xml_hash, error))
+			return FALSE;
+		if(xml_hash == header->xml_hash)
+			return TRUE;
+	}
+
+	g_set_error_literal(error, I7_SKEIN_ERROR, I7_SKEIN_ERROR_CACHE, "Skein cache is out of date.");
+	return FALSE;
+}
+
+static gboolean
+cache_damaged(GError **error)
+{
+	g_set_error_literal(error, I7_SKEIN_ERROR, I7_SKEIN_ERROR_CACHE, "Skein cache is damaged.");
+	return FALSE;
+}
+
+/* Checks that all the indices in the cache are in range and that the knots
+ form a tree, so that a damaged cache can't make the loader read outside the
+ map or link a knot twice */
+static gboolean
+validate_cache(const CacheHeader *header, const CacheKnot *knots,
+	const guint32 *string_offsets, const char *string_data, GError **error)
+{
+	guint32 n_knots = header->n_knots, n_strings = header->n_strings;
+	guint32 ix, n_linked = 0;
+
+	if(n_knots == 0 || n_strings == 0 || header->string_data_size == 0 ||
+		header->active >= n_knots || string_data[header->string_data_size - 1] != '\0')
+		return cache_damaged(error);
+
+	for(ix = 0; ix < n_strings; ix++) {
+		if(string_offsets[ix] >= header->string_data_size)
+			return cache_damaged(error);
+	}
+
+	for(ix = 0; ix < n_knots; ix++) {
+		const CacheKnot *knot = &knots[ix];
+		if(knot->command >= n_strings || knot->label >= n_strings ||
+			knot->transcript_text >= n_strings || knot->expected_text >= n_strings)
+			return cache_damaged(error);
+		if(ix == 0? knot->parent != SNAPSHOT_NONE : knot->parent >= ix)
+			return cache_damaged(error);
+
+		/* Children come after their parent and after each other */
+		guint32 child, previous = ix;
+		for(child = knot->first_child; child != SNAPSHOT_NONE; child = knots[child].next_sibling) {
+			if(child >= n_knots || child <= previous || knots[child].parent != ix)
+				return cache_damaged(error);
+			previous = child;
+			n_linked++;
+		}
+	}
+	if(n_linked != n_knots - 1)
+		return cache_damaged(error);
+
+	return TRUE;
+}
+
+/*
+ * i7_skein_load_cache:
+ * @self: the skein
+ * @file: the skein's XML file
+ * @error: return location for an error
+ *
+ * Loads the skein from the binary cache next to @file, if there is one that
+ * is up to date with @file. This is much faster than i7_skein_load() for big
+ * skeins. Write the cache with i7_skein_update_cache().
+ *
+ * Returns: %TRUE if the skein was loaded, %FALSE with @error set if there was
+ * no usable cache, in which case use i7_skein_load().
+ */
+gboolean
+i7_skein_load_cache(I7Skein *self, GFile *file, GError **error)
+{
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	g_return_val_if_fail(file, FALSE);
+
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	g_autoptr(GFile) cache_file = get_cache_file(file);
+	g_autofree char *cache_path = g_file_get_path(cache_file);
+	GMappedFile *map = g_mapped_file_new(cache_path, FALSE, error);
+	if(!map)
+		return FALSE;
+
+	const char *data = g_mapped_file_get_contents(map);
+	gsize length = g_mapped_file_get_length(map);
+	const CacheHeader *header = (const CacheHeader *)data;
+
+	if(length < sizeof(CacheHeader) || memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+		header->version != CACHE_VERSION || header->byte_order != CACHE_BYTE_ORDER) {
+		g_set_error_literal(error, I7_SKEIN_ERROR, I7_SKEIN_ERROR_CACHE, "Not a Skein cache, or from another version.");
+		goto fail;
+	}
+
+	if(!cache_is_current(file, header, error))
+		goto fail;
+
+	guint64 knots_offset = sizeof(CacheHeader);
+	guint64 offsets_offset = knots_offset + (guint64)header->n_knots * sizeof(CacheKnot);
+	guint64 strings_offset = offsets_offset + (guint64)header->n_strings * sizeof(guint32);
+	if(strings_offset + header->string_data_size != length) {
+		cache_damaged(error);
+		goto fail;
+	}
+	const CacheKnot *knots = (const CacheKnot *)(data + knots_offset);
+	const guint32 *string_offsets = (const guint32 *)(data + offsets_offset);
+	const char *string_data = data + strings_offset;
+	if(!validate_cache(header, knots, string_offsets, string_data, error))
+		goto fail;
 
-	GDataOutputStream *skein_stream = g_data_output_stream_new(G_OUTPUT_STREAM(fstream));
+	/* Intern each string once, with as many references as there are uses */
+	guint32 ix, n_knots = header->n_knots, n_strings = header->n_strings;
+	unsigned *counts = g_new0(unsigned, n_strings);
+	for(ix = 0; ix < n_knots; ix++) {
+		counts[knots[ix].command]++;
+		counts[knots[ix].label]++;
+		counts[knots[ix].transcript_text]++;
+		counts[knots[ix].expected_text]++;
+	}
+	const char **strings = g_new0(const char *, n_strings);
+	for(ix = 0; ix < n_strings; ix++) {
+		if(counts[ix] > 0)
+			strings[ix] = i7_string_pool_intern_n(priv->string_pool, string_data + string_offsets[ix], counts[ix]);
+	}
+	g_free(counts);
+
+	I7Node **nodes = g_new(I7Node *, n_knots);
+	for(ix = 0; ix < n_knots; ix++) {
+		const CacheKnot *knot = &knots[ix];
+		nodes[ix] = i7_node_new_interned(strings[knot->command], strings[knot->label],
+			strings[knot->transcript_text], strings[knot->expected_text],
+			knot->flags & CACHE_KNOT_LOCKED, knot->flags & CACHE_KNOT_CHANGED,
+			CLAMP(knot->score, G_MININT16, G_MAXINT16), GOO_CANVAS_ITEM_MODEL(self));
+	}
+	g_free(strings);
+
+	for(ix = 0; ix < n_knots; ix++) {
+		GNode *last_child = NULL;
+		guint32 child;
+		for(child = knots[ix].first_child; child != SNAPSHOT_NONE; child = knots[child].next_sibling) {
+			if(last_child)
+				last_child = g_node_insert_after(nodes[ix]->gnode, last_child, nodes[child]->gnode);
+			else
+				last_child = g_node_append(nodes[ix]->gnode, nodes[child]->gnode);
+		}
+	}
+
+	/* Listen to the nodes only now, like i7_skein_load() */
+	for(ix = 0; ix < n_knots; ix++)
+		node_listen(self, nodes[ix]);
+
+	replace_tree(self, nodes[0], nodes[header->active]);
+	g_free(nodes);
+	g_mapped_file_unref(map);
+	return TRUE;
+
+fail:
+	g_mapped_file_unref(map);
+	return FALSE;
+}
+
+static guint32
+add_cache_string(const char *string, GHashTable *indices, GArray *offsets, GString *string_data)
+{
+	/* The strings are all from the same pool, so equal strings are the same
+	 pointer */
+	gpointer index_plus_one = g_hash_table_lookup(indices, string);
+	if(index_plus_one)
+		return GPOINTER_TO_UINT(index_plus_one) - 1;
+
+	guint32 index = offsets->len;
+	guint32 offset = string_data->len;
+	g_array_append_val(offsets, offset);
+	g_string_append_len(string_data, string, strlen(string) + 1);
+	g_hash_table_insert(indices, (gpointer)string, GUINT_TO_POINTER(index + 1));
+	return index;
+}
+
+typedef struct {
+	SkeinSnapshot *snapshot;
+	GFile *file;
+	/* The XML file that @snapshot matches */
+	guint64 xml_size;
+	guint64 xml_mtime;
+	guint64 xml_hash;
+} WriteCacheData;
+
+/* Runs on a worker thread */
+static void
+write_cache_thread(GTask *task, I7Skein *self, WriteCacheData *data, GCancellable *cancel)
+{
+	const SkeinSnapshot *snapshot = data->snapshot;
+	GError *error = NULL;
+
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+	header.version = CACHE_VERSION;
+	header.byte_order = CACHE_BYTE_ORDER;
+	header.xml_size = data->xml_size;
+	header.xml_mtime = data->xml_mtime;
+	header.xml_hash = data->xml_hash;
+
+	guint32 ix, n_knots = snapshot->knots->len;
+	CacheKnot *knots = g_new(CacheKnot, n_knots);
+	guint32 *last_child = g_new(guint32, n_knots);
+	GHashTable *string_indices = g_hash_table_new(NULL, NULL);
+	GArray *string_offsets = g_array_new(FALSE, FALSE, sizeof(guint32));
+	GString *string_data = g_string_new("");
+
+	for(ix = 0; ix < n_knots; ix++) {
+		const SnapshotKnot *knot = &g_array_index(snapshot->knots, SnapshotKnot, ix);
+		CacheKnot *cached = &knots[ix];
+
+		cached->parent = knot->parent;
+		cached->first_child = cached->next_sibling = last_child[ix] = SNAPSHOT_NONE;
+		/* Knots are in pre-order, so the parent has already been seen, and
+		 so have this knot's older siblings */
+		if(knot->parent != SNAPSHOT_NONE) {
+			if(last_child[knot->parent] == SNAPSHOT_NONE)
+				knots[knot->parent].first_child = ix;
+			else
+				knots[last_child[knot->parent]].next_sibling = ix;
+			last_child[knot->parent] = ix;
+		}
+
+		cached->command = add_cache_string(knot->command, string_indices, string_offsets, string_data);
+		cached->label = add_cache_string(knot->label, string_indices, string_offsets, string_data);
+		cached->transcript_text = add_cache_string(knot->transcript_text, string_indices, string_offsets, string_data);
+		cached->expected_text = add_cache_string(knot->expected_text, string_indices, string_offsets, string_data);
+		cached->score = knot->score;
+		cached->flags = (knot->locked? CACHE_KNOT_LOCKED : 0) | (knot->changed? CACHE_KNOT_CHANGED : 0);
+	}
+	g_free(last_child);
+	g_hash_table_destroy(string_indices);
+
+	header.n_knots = n_knots;
+	header.n_strings = string_offsets->len;
+	header.active = snapshot->current;
+	header.string_data_size = string_data->len;
+
+	/* Put it all together, to write in one go */
+	gsize knots_size = n_knots * sizeof(CacheKnot);
+	gsize offsets_size = string_offsets->len * sizeof(guint32);
+	gsize length = sizeof(header) + knots_size + offsets_size + string_data->len;
+	char *contents = g_malloc(length);
+	char *pos = contents;
+	memcpy(pos, &header, sizeof(header));
+	pos += sizeof(header);
+	memcpy(pos, knots, knots_size);
+	pos += knots_size;
+	memcpy(pos, string_offsets->data, offsets_size);
+	pos += offsets_size;
+	memcpy(pos, string_data->str, string_data->len);
+	g_free(knots);
+	g_array_free(string_offsets, TRUE);
+	g_string_free(string_data, TRUE);
+
+	/* If the XML file was saved again since the snapshot was taken, the cache
+	 would have the old knots but claim to match the new file */
+	guint64 xml_size, xml_mtime;
+	if(!get_file_stamp(data->file, &xml_size, &xml_mtime, &error)) {
+		g_free(contents);
+		g_task_return_error(task, error);
+		return;
+	}
+	if(xml_size != data->xml_size || xml_mtime != data->xml_mtime) {
+		g_free(contents);
+		g_task_return_new_error(task, I7_SKEIN_ERROR, I7_SKEIN_ERROR_CACHE, "Skein file changed before the cache was written.");
+		return;
+	}
 
-	g_autofree char *header = g_strdup_printf(
-			"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-			"<Skein rootNode=\"%s\" "
-			"xmlns=\"http://www.logicalshift.org.uk/IF/Skein\">\n"
-			"  <generator>Inform 7</generator>\n"
-			"  <activeNode nodeId=\"%s\"/>\n",
-			i7_node_get_unique_id(priv->root),
-			i7_node_get_unique_id(priv->current));
-	if(!g_data_output_stream_put_string(skein_stream, header, NULL, &error)) {
+	g_autoptr(GFile) cache_file = get_cache_file(data->file);
+	gboolean success = g_file_replace_contents(cache_file, contents, length, /* etag = */ NULL,
+		/* backup = */ FALSE, G_FILE_CREATE_NONE, /* new etag = */ NULL, cancel, &error);
+	g_free(contents);
+	if(!success) {
 		g_task_return_error(task, error);
 		return;
 	}
+	g_task_return_boolean(task, TRUE);
+}
+
+static void
+on_write_cache_finish(I7Skein *self, GAsyncResult *res, void *unused)
+{
+	WriteCacheData *data = g_task_get_task_data(G_TASK(res));
+	GError *error = NULL;
+
+	if(!g_task_propagate_boolean(G_TASK(res), &error)) {
+		g_debug("Skein cache not written: %s", error->message);
+		g_error_free(error);
+	}
+
+	skein_snapshot_free(data->snapshot);
+	g_object_unref(data->file);
+	g_free(data);
+}
+
+/*
+ * i7_skein_update_cache:
+ * @self: the skein
+ * @file: the XML file @self was just loaded from or saved to
+ *
+ * Writes the binary cache next to @file, for i7_skein_load_cache(), on a
+ * worker thread. The cache has to match the XML file, so nothing is written
+ * if @self has changes that haven't been saved, or if @file is saved again
+ * before the cache is written.
+ */
+void
+i7_skein_update_cache(I7Skein *self, GFile *file)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	guint64 xml_size, xml_mtime, xml_hash;
+	GError *error = NULL;
+
+	if(priv->modified) {
+		g_debug("Skein cache not written: unsaved changes");
+		return;
+	}
+
+	/* The file's stamp and hash are taken together with the snapshot, so that
+	 they describe the same skein. After a save, the hash of what was written
+	 is already known. */
+	if(!get_file_stamp(file, &xml_size, &xml_mtime, &error))
+		goto fail;
+	if(priv->saved_file && g_file_equal(file, priv->saved_file) &&
+		xml_size == priv->saved_size && xml_mtime == priv->saved_mtime)
+		xml_hash = priv->saved_hash;
+	else if(!hash_file(file, &xml_hash, &error))
+		goto fail;
+
+	WriteCacheData *data = g_new0(WriteCacheData, 1);
+	data->snapshot = skein_snapshot_new(self);
+	data->file = g_object_ref(file);
+	data->xml_size = xml_size;
+	data->xml_mtime = xml_mtime;
+	data->xml_hash = xml_hash;
+
+	/* The task data is freed in on_write_cache_finish(), since the snapshot
+	 must be freed on the main thread */
+	GTask *task = g_task_new(self, NULL, (GAsyncReadyCallback)on_write_cache_finish, NULL);
+	g_task_set_priority(task, G_PRIORITY_LOW);
+	g_task_set_task_data(task, data, NULL);
+	g_task_run_in_thread(task, (GTaskThreadFunc)write_cache_thread);
+	g_object_unref(task);
+	return;
+
+fail:
+	g_debug("Skein cache not written: %s", error->message);
+	g_error_free(error);
+}
+
+/* Imports a list of commands into the Skein */
+gboolean
+i7_skein_import(I7Skein *self, GFile *file, GError **error)
+{
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	g_return_val_if_fail(file, FALSE);
+
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	I7Node *node = priv->root;
+	gboolean added = FALSE;
+
+	GFileInputStream *istream = g_file_read(file, NULL, error);
+	if(!istream)
+		return FALSE;
+	GDataInputStream *stream = g_data_input_stream_new(G_INPUT_STREAM(istream));
+
+	gchar *line;
+	while((line = g_data_input_stream_read_line(stream, NULL, NULL, error))) {
+		g_strstrip(line);
+		if(*line) {
+			gchar *node_command = g_strescape(line, "\"");
+			I7Node *newnode = i7_node_find_child(node, node_command);
+			if(!newnode) {
+				/* Wasn't found, create new node */
+				newnode = i7_node_new(node_command, "", "", "", FALSE, FALSE, FALSE, 0, GOO_CANVAS_ITEM_MODEL(self));
+				node_listen(self, newnode);
+				g_node_append(node->gnode, newnode->gnode);
+				i7_node_child_added(node, newnode);
+				i7_node_invalidate_layout(node);
+				added = TRUE;
+			}
+			g_free(node_command);
+			node = newnode;	
+		}
+		g_free(line);
+	}
+
+	if(*error)
+		goto fail;
+
+	if(added) {
+		update_thread(self);
+		emit_needs_layout(self);
+		emit_modified(self);
+	}
+
+	g_object_unref(stream);
+	g_object_unref(istream);
+	return TRUE;
+
+fail:
+	if(added)
+		update_thread(self);
+	g_object_unref(stream);
+	g_object_unref(istream);
+	return FALSE;
+}
+
+/* Rewinds the skein to the beginning; if @current is TRUE, also resets the
+ view in the Transcript to the beginning */
+void
+i7_skein_reset(I7Skein *self, gboolean current)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	if(current)
+		i7_skein_set_current_node(self, priv->root);
+	i7_skein_set_played_node(self, priv->root);
+}
+
+/* Rewinds the skein to @node, which must be on the way to the played knot,
+ when the story has gone back to the state it was in there; also resets the
+ view in the Transcript to @node */
+void
+i7_skein_rewind_to_node(I7Skein *self, I7Node *node)
+{
+	i7_skein_set_current_node(self, node);
+	i7_skein_set_played_node(self, node);
+}
+
+/* Give @node a tree line, either a recycled one or a new one */
+static void
+attach_tree_line(I7Skein *self, I7Node *node)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	if(priv->line_pool->len > 0) {
+		node->tree_item = g_ptr_array_steal_index_fast(priv->line_pool, priv->line_pool->len - 1);
+		g_object_set(node->tree_item, "visibility", GOO_CANVAS_ITEM_VISIBLE, NULL);
+	} else {
+		node->tree_item = goo_canvas_polyline_model_new(GOO_CANVAS_ITEM_MODEL(self), FALSE, 0, NULL);
+		goo_canvas_item_model_lower(node->tree_item, NULL); /* put at bottom */
+	}
+
+	/* Make sure the points and style get set in draw_tree_line() */
+	node->tree_points->coords[0] = -G_MAXDOUBLE;
+	g_object_set_data(G_OBJECT(node->tree_item), "line-style", NULL);
+}
+
+static void
+materialize_node(I7Node *node, I7Skein *self)
+{
+	g_object_set(node, "visibility", GOO_CANVAS_ITEM_VISIBLE, NULL);
+	if(node->gnode->parent && !node->tree_item)
+		attach_tree_line(self, node);
+}
+
+static void
+dematerialize_node(I7Node *node, I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	g_object_set(node, "visibility", GOO_CANVAS_ITEM_INVISIBLE, NULL);
+	if(node->tree_item) {
+		g_object_set(node->tree_item, "visibility", GOO_CANVAS_ITEM_INVISIBLE, NULL);
+		g_ptr_array_add(priv->line_pool, node->tree_item);
+		node->tree_item = NULL;
+	}
+}
+
+static gboolean
+materialize_gnode(GNode *gnode, I7Skein *self)
+{
+	materialize_node(gnode->data, self);
+	return FALSE; /* Don't stop the traversal */
+}
+
+static gboolean
+dematerialize_gnode(GNode *gnode, I7Skein *self)
+{
+	dematerialize_node(gnode->data, self);
+	return FALSE; /* Don't stop the traversal */
+}
+
+void
+i7_skein_set_virtualized(I7Skein *self, gboolean virtualized)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	if(priv->virtualized == virtualized)
+		return;
+	priv->virtualized = virtualized;
+
+	/* Without virtualization, every knot is shown, and there is no need to
+	 keep track of them. With it, start over from nothing; the next draw will
+	 show the knots that need to be shown. */
+	g_node_traverse(priv->root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+		(GNodeTraverseFunc)(virtualized? dematerialize_gnode : materialize_gnode), self);
+	g_hash_table_remove_all(priv->materialized);
+
+	g_object_notify(G_OBJECT(self), "virtualized");
+	emit_needs_layout(self);
+}
+
+/*
+ * i7_skein_set_visible_area:
+ * @self: the skein
+ * @canvas: a view showing @self
+ * @area: (nullable): the part of @self visible in @canvas, in canvas units, or
+ * %NULL if @canvas no longer shows @self
+ *
+ * Views call this when they scroll or change size, so that in virtualized mode
+ * the skein knows which knots to show. The knots near any of the visible areas
+ * are shown at the next draw.
+ */
+void
+i7_skein_set_visible_area(I7Skein *self, GooCanvas *canvas, const GooCanvasBounds *area)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	if(area)
+		g_hash_table_insert(priv->visible_areas, canvas, g_memdup2(area, sizeof(GooCanvasBounds)));
+	else
+		g_hash_table_remove(priv->visible_areas, canvas);
+}
 
-	g_node_traverse(priv->root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)node_write_xml, skein_stream);
+/* Add to @visible all the knots under @node that are in or near @area. Subtrees
+ that lie completely outside @area are skipped. */
+static void
+collect_visible_nodes(I7Skein *self, I7Node *node, gdouble parent_x, const GooCanvasBounds *area, GooCanvas *canvas, GHashTable *visible)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
 
-	if (!g_data_output_stream_put_string(skein_stream, "</Skein>\n", NULL, &error)) {
-		g_task_return_error(task, error);
+	gdouble y = i7_node_get_y(node);
+	if(y - priv->vspacing > area->y2)
 		return;
-	}
-
-	g_object_unref(skein_stream);
-	g_object_unref(fstream);
 
-	priv->modified = FALSE;
+	/* The subtree, and the tree line up to the parent, lie within these
+	 horizontal bounds */
+	gdouble x = i7_node_get_x(node);
+	gdouble half_width = 0.5 * i7_node_get_tree_width(node, GOO_CANVAS_ITEM_MODEL(self), canvas);
+	if(MAX(x + half_width, parent_x) < area->x1 || MIN(x - half_width, parent_x) > area->x2)
+		return;
 
-	g_task_return_boolean(task, TRUE);
+	if(y + priv->vspacing >= area->y1)
+		g_hash_table_add(visible, node);
 
-	g_debug("Save Skein: finished saving");
+	GNode *child;
+	for(child = node->gnode->children; child; child = child->next)
+		collect_visible_nodes(self, child->data, x, area, canvas, visible);
 }
 
-bool
-i7_skein_save_finish(I7Skein *self, GAsyncResult *res, GError **error)
+static gboolean
+add_node_to_set(GNode *gnode, GHashTable *set)
 {
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
-	return g_task_propagate_boolean(G_TASK(res), error);
+	g_hash_table_add(set, gnode->data);
+	return FALSE; /* Don't stop the traversal */
 }
 
-/* Imports a list of commands into the Skein */
-gboolean
-i7_skein_import(I7Skein *self, GFile *file, GError **error)
+/* Work out which knots should be visible and show or hide the ones whose
+ status changed. Returns the set of visible knots, or %NULL if not virtualized,
+ in which case all knots are visible. */
+static GHashTable *
+update_materialized_nodes(I7Skein *self, GooCanvas *canvas)
 {
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
-	g_return_val_if_fail(file, FALSE);
-
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	GHashTableIter iter;
+	I7Node *node;
 
-	I7Node *node = priv->root;
-	gboolean added = FALSE;
-
-	GFileInputStream *istream = g_file_read(file, NULL, error);
-	if(!istream)
-		return FALSE;
-	GDataInputStream *stream = g_data_input_stream_new(G_INPUT_STREAM(istream));
+	if(!priv->virtualized)
+		return NULL;
 
-	gchar *line;
-	while((line = g_data_input_stream_read_line(stream, NULL, NULL, error))) {
-		g_strstrip(line);
-		if(*line) {
-			gchar *node_command = g_strescape(line, "\"");
-			I7Node *newnode = i7_node_find_child(node, node_command);
-			if(!newnode) {
-				/* Wasn't found, create new node */
-				newnode = i7_node_new(node_command, "", "", "", FALSE, FALSE, FALSE, 0, GOO_CANVAS_ITEM_MODEL(self));
-				node_listen(self, newnode);
-				g_node_append(node->gnode, newnode->gnode);
-				added = TRUE;
-			}
-			g_free(node_command);
-			node = newnode;	
+	GHashTable *visible = g_hash_table_new(NULL, NULL);
+	if(g_hash_table_size(priv->visible_areas) > 0) {
+		GooCanvasBounds *area;
+		g_hash_table_iter_init(&iter, priv->visible_areas);
+		while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&area)) {
+			/* Include the knots near the area, so that they are already
+			 there when scrolling a little way */
+			gdouble margin_x = 0.5 * (area->x2 - area->x1);
+			gdouble margin_y = 0.5 * (area->y2 - area->y1);
+			GooCanvasBounds near_area = {
+				area->x1 - margin_x, area->y1 - margin_y,
+				area->x2 + margin_x, area->y2 + margin_y,
+			};
+			collect_visible_nodes(self, priv->root, i7_node_get_x(priv->root), &near_area, canvas, visible);
 		}
-		g_free(line);
+	} else {
+		g_node_traverse(priv->root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)add_node_to_set, visible);
 	}
 
-	if(*error)
-		goto fail;
+	g_hash_table_iter_init(&iter, priv->materialized);
+	while(g_hash_table_iter_next(&iter, (gpointer *)&node, NULL)) {
+		if(!g_hash_table_contains(visible, node))
+			dematerialize_node(node, self);
+	}
+	g_hash_table_iter_init(&iter, visible);
+	while(g_hash_table_iter_next(&iter, (gpointer *)&node, NULL)) {
+		if(!g_hash_table_contains(priv->materialized, node))
+			materialize_node(node, self);
+	}
 
-	if(added) {
-		g_signal_emit_by_name(self, "needs-layout");
-		g_signal_emit_by_name(self, "modified");
+	g_hash_table_unref(priv->materialized);
+	priv->materialized = visible;
+	return visible;
+}
+
+enum {
+	LINE_STYLE_LOCKED = 1 << 0,
+	LINE_STYLE_CURRENT_THREAD = 1 << 1,
+	LINE_STYLE_SET = 1 << 2,
+};
+
+/* Draw a line from the node to its parent */
+static void
+draw_tree_line(I7Skein *self, I7Node *node, GHashTable *current_thread, gboolean restyle)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	if(!node->gnode->parent)
+		return;
+	if(!node->tree_item)
+		attach_tree_line(self, node);
+
+	/* Calculate the coordinates */
+	gdouble nodex = i7_node_get_x(node);
+	gdouble destx = i7_node_get_x(I7_NODE(node->gnode->parent->data));
+	gdouble nodey = i7_node_get_y(node);
+	gdouble desty = nodey - priv->vspacing;
+
+	if(node->tree_points->coords[0] != destx || node->tree_points->coords[4] != nodex
+		|| node->tree_points->coords[1] != desty || node->tree_points->coords[7] != nodey) {
+		node->tree_points->coords[0] = node->tree_points->coords[2] = destx;
+		node->tree_points->coords[1] = desty;
+		node->tree_points->coords[3] = desty + 0.2 * priv->vspacing;
+		node->tree_points->coords[4] = node->tree_points->coords[6] = nodex;
+		node->tree_points->coords[5] = nodey - 0.2 * priv->vspacing;
+		node->tree_points->coords[7] = nodey;
+		g_object_set(node->tree_item, "points", node->tree_points, NULL);
 	}
 
-	g_object_unref(stream);
-	g_object_unref(istream);
-	return TRUE;
+	/* Only touch the style if it changed, since each change causes the item
+	 to be updated */
+	gboolean locked = i7_node_get_locked(node);
+	gboolean in_current_thread = g_hash_table_contains(current_thread, node);
+	int style = LINE_STYLE_SET | (locked? LINE_STYLE_LOCKED : 0) | (in_current_thread? LINE_STYLE_CURRENT_THREAD : 0);
+	if(!restyle && GPOINTER_TO_INT(g_object_get_data(G_OBJECT(node->tree_item), "line-style")) == style)
+		return;
 
-fail:
-	g_object_unref(stream);
-	g_object_unref(istream);
-	return FALSE;
+	g_object_set(node->tree_item,
+		"stroke-color-gdk-rgba", locked? &priv->locked_color : &priv->unlocked_color,
+		"line-dash", locked? priv->locked_dash : priv->unlocked_dash,
+		"line-width", in_current_thread? 4.0 : 1.5,
+		NULL);
+	g_object_set_data(G_OBJECT(node->tree_item), "line-style", GINT_TO_POINTER(style));
 }
 
-/* Rewinds the skein to the beginning; if @current is TRUE, also resets the
- view in the Transcript to the beginning */
-void
-i7_skein_reset(I7Skein *self, gboolean current)
+/* Look up the thread colors from the theme; returns TRUE if they changed
+ since the last time */
+static gboolean
+update_thread_colors(I7Skein *self, GooCanvas *canvas)
 {
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
-	if(current)
-		i7_skein_set_current_node(self, priv->root);
-	i7_skein_set_played_node(self, priv->root);
+	GtkStyleContext *style = gtk_widget_get_style_context(GTK_WIDGET(canvas));
+	GtkStateFlags state = gtk_style_context_get_state(style);
+	GdkRGBA locked_color, unlocked_color;
+
+	gtk_style_context_save(style);
+	gtk_style_context_add_class(style, "locked-thread");
+	gtk_style_context_get_color(style, state, &locked_color);
+	gtk_style_context_restore(style);
+
+	gtk_style_context_save(style);
+	gtk_style_context_add_class(style, "unlocked-thread");
+	gtk_style_context_get_color(style, state, &unlocked_color);
+	gtk_style_context_restore(style);
+
+	if(gdk_rgba_equal(&locked_color, &priv->locked_color) && gdk_rgba_equal(&unlocked_color, &priv->unlocked_color))
+		return FALSE;
+	priv->locked_color = locked_color;
+	priv->unlocked_color = unlocked_color;
+	return TRUE;
+}
+
+typedef struct {
+	I7Skein *skein;
+	GHashTable *current_thread;
+	gboolean restyle;
+} DrawTreeData;
+
+static gboolean
+draw_tree_line_gnode(GNode *gnode, DrawTreeData *data)
+{
+	draw_tree_line(data->skein, gnode->data, data->current_thread, data->restyle);
+	return FALSE; /* Don't stop the traversal */
 }
 
 static void
-draw_tree(I7Skein *self, I7Node *node, GooCanvas *canvas)
+draw_tree(I7Skein *self, GooCanvas *canvas)
 {
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
 
-	/* Draw a line from the node to its parent */
-	if(node->gnode->parent) {
-		/* Calculate the coordinates */
-		gdouble nodex = i7_node_get_x(node);
-		gdouble destx = i7_node_get_x(I7_NODE(node->gnode->parent->data));
-		gdouble nodey = (gdouble)(g_node_depth(node->gnode) - 1.0) * priv->vspacing;
-		gdouble desty = nodey - priv->vspacing;
-
-		if(!node->tree_item)
-			node->tree_item = goo_canvas_polyline_model_new(GOO_CANVAS_ITEM_MODEL(self), FALSE, 0, NULL);
-
-		if(node->tree_points->coords[0] != destx || node->tree_points->coords[4] != nodex) {
-			node->tree_points->coords[0] = node->tree_points->coords[2] = destx;
-			node->tree_points->coords[1] = desty;
-			node->tree_points->coords[3] = desty + 0.2 * priv->vspacing;
-			node->tree_points->coords[4] = node->tree_points->coords[6] = nodex;
-			node->tree_points->coords[5] = nodey - 0.2 * priv->vspacing;
-			node->tree_points->coords[7] = nodey;
-			g_object_set(node->tree_item, "points", node->tree_points, NULL);
-		}
-
-		gboolean in_current_thread = i7_skein_is_node_in_current_thread(self, node);
-		GtkStyleContext *style = gtk_widget_get_style_context(GTK_WIDGET(canvas));
-		GdkRGBA stroke_color;
-		GtkStateFlags state = gtk_style_context_get_state(style);
-		gtk_style_context_save(style);
-
-		if (i7_node_get_locked(node)) {
-			gtk_style_context_add_class(style, "locked-thread");
-			gtk_style_context_get_color(style, state, &stroke_color);
-			g_object_set(node->tree_item,
-				"stroke-color-gdk-rgba", &stroke_color,
-			    "line-dash", priv->locked_dash,
-				"line-width", in_current_thread? 4.0 : 1.5,
-				NULL);
-		} else {
-			gtk_style_context_add_class(style, "unlocked-thread");
-			gtk_style_context_get_color(style, state, &stroke_color);
-			g_object_set(node->tree_item,
-				"stroke-color-gdk-rgba", &stroke_color,
-				"line-dash", priv->unlocked_dash,
-				"line-width", in_current_thread? 4.0 : 1.5,
-				NULL);
-		}
-
-		gtk_style_context_restore(style);
+	gboolean restyle = update_thread_colors(self, canvas);
 
-		goo_canvas_item_model_lower(node->tree_item, NULL); /* put at bottom */
+	GHashTable *current_thread = g_hash_table_new(NULL, NULL);
+	GNode *gnode;
+	for(gnode = i7_skein_get_thread_bottom(self, priv->current)->gnode; gnode; gnode = gnode->parent)
+		g_hash_table_add(current_thread, gnode->data);
+
+	GHashTable *visible = update_materialized_nodes(self, canvas);
+	if(visible) {
+		GHashTableIter iter;
+		I7Node *node;
+		g_hash_table_iter_init(&iter, visible);
+		while(g_hash_table_iter_next(&iter, (gpointer *)&node, NULL))
+			draw_tree_line(self, node, current_thread, restyle);
+	} else {
+		DrawTreeData data = { self, current_thread, restyle };
+		g_node_traverse(priv->root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)draw_tree_line_gnode, &data);
 	}
 
-	/* Draw the children's lines to this node */
-	unsigned i;
-	for(i = 0; i < g_node_n_children(node->gnode); i++) {
-		I7Node *child = g_node_nth_child(node->gnode, i)->data;
-		draw_tree(self, child, canvas);
-	}
+	g_hash_table_destroy(current_thread);
 }
 
 static void
@@ -830,7 +2375,7 @@ draw_intern(I7Skein *self, GooCanvas *canvas)
 	i7_node_layout(priv->root, GOO_CANVAS_ITEM_MODEL(self), canvas, 0.0);
 
 	gdouble treewidth = i7_node_get_tree_width(priv->root, GOO_CANVAS_ITEM_MODEL(self), canvas);
-	draw_tree(self, priv->root, canvas);
+	draw_tree(self, canvas);
 
 	goo_canvas_set_bounds(canvas,
 		-treewidth * 0.5 - priv->hspacing, -(priv->vspacing) * 0.5,
@@ -894,10 +2439,10 @@ i7_skein_new_command(I7Skein *self, const gchar *command)
 		node = i7_node_new(node_command, "", "", "", TRUE, FALSE, FALSE, 0, GOO_CANVAS_ITEM_MODEL(self));
 		node_listen(self, node);
 
-		bool emit = i7_skein_is_node_in_current_thread(self, priv->played);
 		g_node_append(priv->played->gnode, node->gnode);
-		if (emit)
-			g_list_model_items_changed(G_LIST_MODEL(self), g_node_depth(node->gnode) - 1, 0, 1);
+		i7_node_child_added(priv->played, node);
+		i7_node_invalidate_layout(priv->played);
+		update_thread(self);
 		node_added = TRUE;
 	}
 	g_free(node_command);
@@ -908,9 +2453,9 @@ i7_skein_new_command(I7Skein *self, const gchar *command)
 
 	/* Send signals */
 	if(node_added)
-		g_signal_emit_by_name(self, "needs-layout");
-	g_signal_emit_by_name(self, "show-node", I7_REASON_COMMAND, node);
-	g_signal_emit_by_name(self, "modified");
+		emit_needs_layout(self);
+	emit_show_node(self, I7_REASON_COMMAND, node);
+	emit_modified(self);
 
 	return node;
 }
@@ -929,10 +2474,8 @@ i7_skein_next_command(I7Skein *self, gchar **command)
 	while(next->gnode->parent != priv->played->gnode)
 		next = next->gnode->parent->data;
 	priv->played = next;
-	gchar *temp = i7_node_get_command(next);
-	*command = g_strcompress(temp);
-	g_free(temp);
-	g_signal_emit_by_name(self, "show-node", I7_REASON_COMMAND, next);
+	*command = g_strcompress(i7_node_peek_command(next));
+	emit_show_node(self, I7_REASON_COMMAND, next);
 	return TRUE;
 }
 
@@ -941,21 +2484,104 @@ i7_skein_next_command(I7Skein *self, gchar **command)
 GSList *
 i7_skein_get_commands_to_node(I7Skein *self, I7Node *from_node, I7Node *to_node)
 {
+	/* Walk up from @to_node, so that the list comes out in the right order */
 	GSList *commands = NULL;
-	GNode *pointer = from_node->gnode;
-	while(g_node_is_ancestor(pointer, to_node->gnode)) {
-		I7Node *next = to_node;
-		while(next->gnode->parent != pointer)
-			next = next->gnode->parent->data;
-		pointer = next->gnode;
-		gchar *skein_command = i7_node_get_command(next);
-		commands = g_slist_prepend(commands, g_strcompress(skein_command));
-		g_free(skein_command);
-	}
-	commands = g_slist_reverse(commands);
+	GNode *gnode;
+	for(gnode = to_node->gnode; gnode && gnode != from_node->gnode; gnode = gnode->parent)
+		commands = g_slist_prepend(commands, g_strcompress(i7_node_peek_command(gnode->data)));
+
+	if(gnode == NULL) {
+		/* Reached the root without meeting @from_node */
+		g_slist_free_full(commands, g_free);
+		return NULL;
+	}
+	return commands;
+}
+
+I7SkeinCommands *
+i7_skein_commands_new(void)
+{
+	I7SkeinCommands *commands = g_new0(I7SkeinCommands, 1);
+	commands->text = g_string_sized_new(256);
+	commands->offsets = g_array_new(FALSE, FALSE, sizeof(gsize));
+	commands->path = g_ptr_array_new();
 	return commands;
 }
 
+void
+i7_skein_commands_free(I7SkeinCommands *commands)
+{
+	g_string_free(commands->text, TRUE);
+	g_array_free(commands->offsets, TRUE);
+	g_ptr_array_free(commands->path, TRUE);
+	g_free(commands);
+}
+
+unsigned
+i7_skein_commands_get_n_commands(I7SkeinCommands *commands)
+{
+	return commands->offsets->len;
+}
+
+/* The returned string is owned by @commands and is valid until it is filled
+ again */
+const char *
+i7_skein_commands_get_command(I7SkeinCommands *commands, unsigned ix)
+{
+	g_return_val_if_fail(ix < commands->offsets->len, NULL);
+	return commands->text->str + g_array_index(commands->offsets, gsize, ix);
+}
+
+/* Appends @command to @text with the escapes undone, like g_strcompress() */
+static void
+append_compressed_command(GString *text, const char *command)
+{
+	if(strchr(command, '\\') == NULL) {
+		g_string_append(text, command);
+		return;
+	}
+	char *compressed = g_strcompress(command);
+	g_string_append(text, compressed);
+	g_free(compressed);
+}
+
+/*
+ * i7_skein_fill_commands_to_node:
+ * @self: the skein
+ * @from_node: the knot to start from
+ * @to_node: the knot to end at
+ * @commands: a buffer from i7_skein_commands_new()
+ *
+ * Like i7_skein_get_commands_to_node(), but replaces the contents of
+ * @commands instead of allocating a list. Reusing the same buffer avoids
+ * allocating memory for each command when playing through many threads.
+ *
+ * Returns: %FALSE if @from_node is not an ancestor of @to_node, in which case
+ * @commands is left empty.
+ */
+gboolean
+i7_skein_fill_commands_to_node(I7Skein *self, I7Node *from_node, I7Node *to_node, I7SkeinCommands *commands)
+{
+	g_string_truncate(commands->text, 0);
+	g_array_set_size(commands->offsets, 0);
+	g_ptr_array_set_size(commands->path, 0);
+
+	GNode *gnode;
+	for(gnode = to_node->gnode; gnode && gnode != from_node->gnode; gnode = gnode->parent)
+		g_ptr_array_add(commands->path, gnode->data);
+	if(gnode == NULL)
+		return FALSE;
+
+	unsigned ix;
+	for(ix = commands->path->len; ix > 0; ix--) {
+		gsize offset = commands->text->len;
+		g_array_append_val(commands->offsets, offset);
+		append_compressed_command(commands->text, i7_node_peek_command(g_ptr_array_index(commands->path, ix - 1)));
+		g_string_append_c(commands->text, '\0');
+	}
+	return TRUE;
+}
+
 /* Get a list of the commands from the root node to the play pointer */
 GSList *
 i7_skein_get_commands(I7Skein *self)
@@ -973,7 +2599,7 @@ i7_skein_update_after_playing(I7Skein *self, const gchar *transcript)
 	i7_node_set_played(priv->played, TRUE);
 	if(strlen(transcript)) {
 		i7_node_set_transcript_text(priv->played, transcript);
-		g_signal_emit_by_name(self, "show-node", I7_REASON_TRANSCRIPT, priv->played);
+		emit_show_node(self, I7_REASON_TRANSCRIPT, priv->played);
 	}
 }
 
@@ -1004,13 +2630,13 @@ i7_skein_add_new(I7Skein *self, I7Node *node)
 	I7Node *newnode = i7_node_new("", "", "", "", FALSE, FALSE, FALSE, 0, GOO_CANVAS_ITEM_MODEL(self));
 	node_listen(self, newnode);
 
-	bool emit = i7_skein_is_node_in_current_thread(self, node);
 	g_node_append(node->gnode, newnode->gnode);
-	if (emit)
-		g_list_model_items_changed(G_LIST_MODEL(self), g_node_depth(newnode->gnode) - 1, 0, 1);
+	i7_node_child_added(node, newnode);
+	i7_node_invalidate_layout(node);
+	update_thread(self);
 
-	g_signal_emit_by_name(self, "needs-layout");
-	g_signal_emit_by_name(self, "modified");
+	emit_needs_layout(self);
+	emit_modified(self);
 
 	return newnode;
 }
@@ -1018,18 +2644,21 @@ i7_skein_add_new(I7Skein *self, I7Node *node)
 I7Node *
 i7_skein_add_new_parent(I7Skein *self, I7Node *node)
 {
-	I7Node *newnode = i7_node_new("", "", "", "", FALSE, FALSE, FALSE, 0, GOO_CANVAS_ITEM_MODEL(self));
+	/* If @node is on the played thread, then so is the new knot */
+	I7Node *newnode = i7_node_new("", "", "", "", i7_node_get_played(node), FALSE, FALSE, 0, GOO_CANVAS_ITEM_MODEL(self));
 	node_listen(self, newnode);
 
-	bool emit = i7_skein_is_node_in_current_thread(self, node);
-	g_node_insert(node->gnode->parent, g_node_child_position(node->gnode->parent, node->gnode), newnode->gnode);
+	I7Node *parent = node->gnode->parent->data;
+	g_node_insert(parent->gnode, g_node_child_position(parent->gnode, node->gnode), newnode->gnode);
+	i7_node_child_added(parent, newnode);
 	g_node_unlink(node->gnode);
+	i7_node_child_removed(parent, node);
 	g_node_append(newnode->gnode, node->gnode);
-	if (emit)
-		g_list_model_items_changed(G_LIST_MODEL(self), g_node_depth(newnode->gnode) - 1, 0, 1);
+	i7_node_invalidate_layout(newnode);
+	update_thread(self);
 
-	g_signal_emit_by_name(self, "needs-layout");
-	g_signal_emit_by_name(self, "modified");
+	emit_needs_layout(self);
+	emit_modified(self);
 
 	return newnode;
 }
@@ -1048,11 +2677,15 @@ i7_skein_remove_all(I7Skein *self, I7Node *node)
 	if(i7_skein_is_node_in_current_thread(self, node))
 		i7_skein_set_current_node(self, priv->root);
 
+	I7Node *parent = node->gnode->parent->data;
+	i7_node_invalidate_layout(parent);
 	g_node_unlink(node->gnode);
+	i7_node_child_removed(parent, node);
+	update_thread(self);
 	g_node_traverse(node->gnode, G_POST_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)remove_node_from_canvas, self);
 
-	g_signal_emit_by_name(self, "needs-layout");
-	g_signal_emit_by_name(self, "modified");
+	emit_needs_layout(self);
+	emit_modified(self);
 	return TRUE;
 }
 
@@ -1069,19 +2702,24 @@ i7_skein_remove_single(I7Skein *self, I7Node *node)
 	if(i7_skein_is_node_in_current_thread(self, node))
 		i7_skein_set_current_node(self, priv->root);
 
+	I7Node *parent = node->gnode->parent->data;
+	i7_node_invalidate_layout(parent);
 	if(!G_NODE_IS_LEAF(node->gnode)) {
 		int i;
 		for(i = g_node_n_children(node->gnode) - 1; i >= 0; i--) {
 			GNode *iter = g_node_nth_child(node->gnode, i);
 			g_node_unlink(iter);
-			g_node_insert_after(node->gnode->parent, node->gnode, iter);
+			g_node_insert_after(parent->gnode, node->gnode, iter);
+			i7_node_child_added(parent, iter->data);
 		}
 	}
 	g_node_unlink(node->gnode);
+	i7_node_child_removed(parent, node);
+	update_thread(self);
 	remove_node_from_canvas(node->gnode, self);
 
-	g_signal_emit_by_name(self, "needs-layout");
-	g_signal_emit_by_name(self, "modified");
+	emit_needs_layout(self);
+	emit_modified(self);
 	return TRUE;
 }
 
@@ -1090,9 +2728,11 @@ i7_skein_lock(I7Skein *self, I7Node *node)
 {
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
 
+	i7_skein_begin_transaction(self);
 	GNode *iter;
 	for(iter = node->gnode; iter; iter = iter->parent)
 		i7_node_set_locked(I7_NODE(iter->data), TRUE);
+	i7_skein_end_transaction(self);
 
 	/* TODO change thread colors */
 	priv->modified = TRUE;
@@ -1104,7 +2744,7 @@ i7_skein_unlock_recurse(I7Skein *self, I7Node *node)
 	i7_node_set_locked(node, FALSE);
 	GNode *iter;
 	for(iter = node->gnode->children; iter; iter = iter->next)
-		i7_skein_unlock(self, I7_NODE(iter->data));
+		i7_skein_unlock_recurse(self, I7_NODE(iter->data));
 
 	/* TODO change thread colors */
 }
@@ -1112,135 +2752,210 @@ i7_skein_unlock_recurse(I7Skein *self, I7Node *node)
 void
 i7_skein_unlock(I7Skein *self, I7Node *node)
 {
+	i7_skein_begin_transaction(self);
 	i7_skein_unlock_recurse(self, node);
-	g_signal_emit_by_name(self, "modified");
+	emit_modified(self);
+	i7_skein_end_transaction(self);
 }
 
+/* State shared by the steps of i7_skein_trim() */
+typedef struct {
+	I7Skein *skein;
+	int min_score;
+	unsigned n_removed;
+} TrimData;
+
+/* Adds the scores of @gnode and all knots below it to the set @scores */
 static void
-i7_skein_trim_recurse(I7Skein *self, I7Node *node, gint min_score)
+collect_scores(GNode *gnode, GHashTable *scores)
 {
-	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	g_hash_table_add(scores, GINT_TO_POINTER(i7_node_get_score(I7_NODE(gnode->data))));
+	for(gnode = gnode->children; gnode; gnode = gnode->next)
+		collect_scores(gnode, scores);
+}
 
-	unsigned i = 0;
-	while(i < g_node_n_children(node->gnode)) {
-		I7Node *child = g_node_nth_child(node->gnode, i)->data;
-		if(i7_node_get_locked(child) || i7_node_get_score(child) > min_score) {
-			i7_skein_trim_recurse(self, child, min_score);
-			i++;
-		} else {
-			if(i7_skein_is_node_in_current_thread(self, child)) {
-				i7_skein_set_current_node(self, priv->root);
-				i7_skein_set_played_node(self, priv->root);
-			}
+/* Restores the min-heap property of @heap by moving the element at @pos down */
+static void
+heap_sift_down(int *heap, unsigned len, unsigned pos)
+{
+	for(;;) {
+		unsigned smallest = pos, left = 2 * pos + 1, right = left + 1;
+		if(left < len && heap[left] < heap[smallest])
+			smallest = left;
+		if(right < len && heap[right] < heap[smallest])
+			smallest = right;
+		if(smallest == pos)
+			return;
+		int tmp = heap[pos];
+		heap[pos] = heap[smallest];
+		heap[smallest] = tmp;
+		pos = smallest;
+	}
+}
 
-			if(i7_skein_remove_all(self, child) == FALSE)
-				i++;
+/* Returns the (@n + 1)th highest of the distinct @scores, or 0 if there are
+ not that many. The @n + 1 highest scores seen so far are kept in a min-heap,
+ whose top is the one to replace whenever a higher score turns up. */
+static int
+select_min_score(GHashTable *scores, unsigned n)
+{
+	if(g_hash_table_size(scores) <= n)
+		return 0;
+	unsigned size = n + 1;
+
+	int *heap = g_new(int, size);
+	unsigned len = 0;
+	GHashTableIter iter;
+	void *key;
+	g_hash_table_iter_init(&iter, scores);
+	while(g_hash_table_iter_next(&iter, &key, NULL)) {
+		int score = GPOINTER_TO_INT(key);
+		if(len < size) {
+			heap[len++] = score;
+			if(len == size) {
+				unsigned i;
+				for(i = size / 2; i-- > 0; )
+					heap_sift_down(heap, len, i);
+			}
+		} else if(score > heap[0]) {
+			heap[0] = score;
+			heap_sift_down(heap, len, 0);
 		}
 	}
+
+	int retval = heap[0];
+	g_free(heap);
+	return retval;
 }
 
-static gint
-int_compare_reversed(gconstpointer a, gconstpointer b)
+static gboolean
+trim_keeps(TrimData *data, I7Node *node)
 {
-	return GPOINTER_TO_INT(a) < GPOINTER_TO_INT(b);
+	return i7_node_get_locked(node) || i7_node_get_score(node) > data->min_score;
 }
 
+/* Whether trimming below @node will remove any of the knots in @path, which
+ holds knots by depth starting from the root */
 static gboolean
-look_for_scores(GNode *gnode, GList **listptr)
+trim_removes_from_path(TrimData *data, I7Node *node, GPtrArray *path)
 {
-	gint score = i7_node_get_score(I7_NODE(gnode->data));
+	unsigned depth = g_node_depth(node->gnode);
+	if(depth > path->len || g_ptr_array_index(path, depth - 1) != node)
+		return FALSE;
+	for(; depth < path->len; depth++) {
+		if(!trim_keeps(data, g_ptr_array_index(path, depth)))
+			return TRUE;
+	}
+	return FALSE;
+}
 
-	if(g_list_index(*listptr, GINT_TO_POINTER(score)) == -1)
-		*listptr = g_list_insert_sorted(*listptr, GINT_TO_POINTER(score), int_compare_reversed);
+/* Detaches @node and everything below it from the skein, without emitting any
+ of the skein's signals */
+static void
+trim_remove(TrimData *data, I7Node *node)
+{
+	data->n_removed += g_node_n_nodes(node->gnode, G_TRAVERSE_ALL);
 
-	return FALSE; /* don't stop the traversal */
+	I7Node *parent = node->gnode->parent->data;
+	i7_node_invalidate_layout(parent);
+	g_node_unlink(node->gnode);
+	i7_node_child_removed(parent, node);
+	g_node_traverse(node->gnode, G_POST_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)remove_node_from_canvas, data->skein);
 }
 
-/*static void
-print_score(gpointer item, gpointer data)
-{
-	g_print("%d ", GPOINTER_TO_INT(item));
-}*/
+/* Removes the knots below @node that are neither locked nor scored above the
+ minimum */
+static void
+trim_recurse(TrimData *data, I7Node *node)
+{
+	GNode *iter = node->gnode->children;
+	while(iter) {
+		GNode *next = iter->next; /* @iter may be unlinked below */
+		I7Node *child = iter->data;
+		if(trim_keeps(data, child))
+			trim_recurse(data, child);
+		else
+			trim_remove(data, child);
+		iter = next;
+	}
+}
 
-void
-i7_skein_trim(I7Skein *self, I7Node *node, gint max_temps)
+/*
+ * i7_skein_trim:
+ * @self: the skein
+ * @node: the knot below which to trim
+ * @max_temps: how many of the highest distinct scores to keep
+ *
+ * Removes the knots below @node that are not locked and whose score is not
+ * among the @max_temps highest ones in the skein. The skein's signals are
+ * emitted only once, after all the knots have been removed.
+ *
+ * Returns: the number of knots removed.
+ */
+unsigned
+i7_skein_trim(I7Skein *self, I7Node *node, unsigned max_temps)
 {
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
 
-	GList *scores_in_use = NULL;
-	g_node_traverse(priv->root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)look_for_scores, &scores_in_use);
+	GHashTable *scores = g_hash_table_new(g_direct_hash, g_direct_equal);
+	collect_scores(priv->root->gnode, scores);
 
-	/*g_print("Scores in use: ");
-	g_list_foreach(scores_in_use, print_score, NULL);
-	g_print("\n");*/
+	TrimData data = { self, select_min_score(scores, max_temps), 0 };
+	g_hash_table_destroy(scores);
 
-	/* Keep only the highest @max_temps scores (and those that are locked, of course) */
-	gint min_score = GPOINTER_TO_INT(g_list_nth_data(scores_in_use, max_temps));
-	/*g_print("Min score: %d\n", min_score);*/
-	g_list_free(scores_in_use);
+	/* Removing a knot on the current thread starts the game over, as does
+	 removing the played knot or one of its ancestors. Do that before removing
+	 anything, so that neither points to a removed knot, and only notify once
+	 everything is removed. */
+	g_object_freeze_notify(G_OBJECT(self));
+	unsigned depth = g_node_depth(priv->played->gnode);
+	GPtrArray *played_path = g_ptr_array_sized_new(depth);
+	g_ptr_array_set_size(played_path, depth);
+	GNode *gnode;
+	for(gnode = priv->played->gnode; gnode; gnode = gnode->parent)
+		g_ptr_array_index(played_path, --depth) = gnode->data;
+	gboolean reset_current = trim_removes_from_path(&data, node, priv->thread);
+	if(reset_current || trim_removes_from_path(&data, node, played_path))
+		i7_skein_set_played_node(self, priv->root);
+	g_ptr_array_free(played_path, TRUE);
+	if(reset_current) {
+		priv->current = priv->root;
+		g_object_notify(G_OBJECT(self), "current-node");
+	}
 
-	i7_skein_trim_recurse(self, node, min_score);
-	g_signal_emit_by_name(self, "needs-layout");
-	g_signal_emit_by_name(self, "modified");
-}
+	trim_recurse(&data, node);
 
-static void
-get_labels(GNode *gnode, GSList **labels)
-{
-	I7Node *node = gnode->data;
-	if(i7_node_has_label(node)) {
-		I7SkeinNodeLabel *nodelabel = g_slice_new0(I7SkeinNodeLabel);
-		nodelabel->label = i7_node_get_label(node);
-		nodelabel->node = node;
-		*labels = g_slist_prepend(*labels, nodelabel);
+	if(data.n_removed > 0) {
+		update_thread(self);
+		emit_needs_layout(self);
+		emit_modified(self);
 	}
-	g_node_children_foreach(gnode, G_TRAVERSE_ALL, (GNodeForeachFunc)get_labels, labels);
+	g_object_thaw_notify(G_OBJECT(self));
+	return data.n_removed;
 }
 
-/* Free the list after use with the convenience function
- i7_skein_free_node_label_list() */
-GSList *
-i7_skein_get_labels(I7Skein *self)
+unsigned
+i7_skein_get_n_labels(I7Skein *self)
 {
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
-	GSList *labels = NULL;
-	get_labels(priv->root->gnode, &labels);
-	labels = g_slist_sort_with_data(labels, (GCompareDataFunc)strcmp, NULL);
-	return labels;
-}
-
-static void
-free_node_label(I7SkeinNodeLabel *label)
-{
-	g_free(label->label);
-	g_slice_free(I7SkeinNodeLabel, label);
-}
-
-void
-i7_skein_free_node_label_list(GSList *labels)
-{
-	g_slist_foreach(labels, (GFunc)free_node_label, NULL);
-	g_slist_free(labels);
+	return g_sequence_get_length(priv->labels);
 }
 
-static gboolean
-has_labels(I7Node *node)
+/* Returns the labelled knot at @pos in the sorted label index, owned by the
+ skein */
+const I7SkeinNodeLabel *
+i7_skein_get_label(I7Skein *self, unsigned pos)
 {
-	if(i7_node_has_label(node))
-		return TRUE;
-
-	GNode *iter;
-	for(iter = node->gnode->children; iter; iter = iter->next)
-		if(has_labels(iter->data))
-			return TRUE;
-	return FALSE;
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	g_return_val_if_fail(pos < g_sequence_get_length(priv->labels), NULL);
+	return g_sequence_get(g_sequence_get_iter_at_pos(priv->labels, pos));
 }
 
 gboolean
 i7_skein_has_labels(I7Skein *self)
 {
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
-	return has_labels(priv->root);
+	return !g_sequence_is_empty(priv->labels);
 }
 
 /*
@@ -1254,11 +2969,13 @@ i7_skein_has_labels(I7Skein *self)
 void
 i7_skein_bless(I7Skein *self, I7Node *node, gboolean all)
 {
+	i7_skein_begin_transaction(self);
 	GNode *iter;
 	for(iter = node->gnode; iter; iter = all? iter->parent : NULL)
 		i7_node_bless(I7_NODE(iter->data));
 
-	g_signal_emit_by_name(self, "modified");
+	emit_modified(self);
+	i7_skein_end_transaction(self);
 }
 
 gboolean
@@ -1347,6 +3064,145 @@ i7_skein_get_blessed_thread_ends(I7Skein *self)
 	return retval;
 }
 
+/* Helper function: recursive function for i7_skein_plan_replay(). Adds the
+steps to play every knot in @needed under @node, assuming the story is at
+@node. */
+static void
+plan_replay_recurse(I7SkeinReplayPlan *plan, I7Node *node, GHashTable *needed, unsigned *n_open)
+{
+	GNode *gnode;
+	unsigned n_needed = 0, slot = 0;
+
+	for(gnode = node->gnode->children; gnode; gnode = gnode->next) {
+		if(g_hash_table_contains(needed, gnode->data))
+			n_needed++;
+	}
+	if(n_needed == 0)
+		return;
+
+	/* At a branch, save the state so that each branch after the first one can
+	 start from here instead of from the beginning. Branches are nested, so
+	 the slots are used like a stack. */
+	if(n_needed > 1) {
+		slot = (*n_open)++;
+		plan->n_slots = MAX(plan->n_slots, *n_open);
+		I7SkeinReplayStep save = { I7_SKEIN_REPLAY_SAVE, node, slot };
+		g_array_append_val(plan->steps, save);
+	}
+
+	gboolean first = TRUE;
+	for(gnode = node->gnode->children; gnode; gnode = gnode->next) {
+		if(!g_hash_table_contains(needed, gnode->data))
+			continue;
+		if(!first) {
+			I7SkeinReplayStep restore = { I7_SKEIN_REPLAY_RESTORE, node, slot };
+			g_array_append_val(plan->steps, restore);
+		}
+		first = FALSE;
+
+		I7SkeinReplayStep command = { I7_SKEIN_REPLAY_COMMAND, gnode->data, 0 };
+		g_array_append_val(plan->steps, command);
+		plan->n_commands++;
+		plan_replay_recurse(plan, gnode->data, needed, n_open);
+	}
+
+	if(n_needed > 1)
+		(*n_open)--;
+}
+
+/*
+ * i7_skein_plan_replay:
+ * @self: the skein
+ * @thread_ends: list of knots, such as from i7_skein_get_blessed_thread_ends()
+ *
+ * Works out how to play through all the threads ending in @thread_ends in one
+ * run of the story. Instead of starting again from the beginning for each
+ * thread, the plan saves the story's state at each knot where the threads
+ * branch, and restores it to play the next branch. So each knot is played
+ * only once, however many threads share it.
+ *
+ * Returns: a new #I7SkeinReplayPlan. Free with i7_skein_replay_plan_free().
+ */
+I7SkeinReplayPlan *
+i7_skein_plan_replay(I7Skein *self, GSList *thread_ends)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+	GHashTable *needed = g_hash_table_new(NULL, NULL);
+	GSList *iter;
+
+	/* Mark the knots on the way to each thread end, stopping where an earlier
+	 thread was already marked */
+	for(iter = thread_ends; iter; iter = g_slist_next(iter)) {
+		GNode *gnode;
+		for(gnode = I7_NODE(iter->data)->gnode; gnode && gnode != priv->root->gnode; gnode = gnode->parent) {
+			if(!g_hash_table_add(needed, gnode->data))
+				break;
+		}
+	}
+
+	I7SkeinReplayPlan *plan = g_new0(I7SkeinReplayPlan, 1);
+	plan->steps = g_array_sized_new(FALSE, FALSE, sizeof(I7SkeinReplayStep), g_hash_table_size(needed));
+	unsigned n_open = 0;
+	plan_replay_recurse(plan, priv->root, needed, &n_open);
+
+	g_hash_table_destroy(needed);
+	return plan;
+}
+
+void
+i7_skein_replay_plan_free(I7SkeinReplayPlan *plan)
+{
+	g_array_free(plan->steps, TRUE);
+	g_free(plan);
+}
+
+/*
+ * i7_skein_queue_diffs:
+ * @self: the skein
+ * @node: a knot in @self
+ *
+ * Starts calculating the differences between @node's transcript and expected
+ * texts on a worker thread, if they are needed. When they are done,
+ * #I7Node:diffs-calculated is notified on @node.
+ */
+void
+i7_skein_queue_diffs(I7Skein *self, I7Node *node)
+{
+	I7NodeDiffJob *job = i7_node_diff_job_new(node);
+	if(job == NULL)
+		return;
+
+	DiffEngine *engine = get_diff_engine(self);
+	g_thread_pool_push(engine->pool, job, NULL);
+}
+
+static gboolean
+queue_diffs_traverse(GNode *gnode, I7Skein *self)
+{
+	i7_skein_queue_diffs(self, I7_NODE(gnode->data));
+	return FALSE; /* Don't stop the traversal */
+}
+
+/*
+ * i7_skein_queue_all_diffs:
+ * @self: the skein
+ *
+ * Starts calculating the differences for every knot in @self that needs it,
+ * on worker threads. The knots in the current thread go first, since those
+ * are the ones being displayed.
+ */
+void
+i7_skein_queue_all_diffs(I7Skein *self)
+{
+	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
+
+	unsigned ix;
+	for(ix = 0; ix < priv->thread->len; ix++)
+		i7_skein_queue_diffs(self, g_ptr_array_index(priv->thread, ix));
+
+	g_node_traverse(priv->root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)queue_diffs_traverse, self);
+}
+
 /* Returns whether the skein was modified since last save or load */
 gboolean
 i7_skein_get_modified(I7Skein *self)
@@ -1368,7 +3224,7 @@ i7_skein_set_font(I7Skein *self, PangoFontDescription *font)
 	I7SkeinPrivate *priv = i7_skein_get_instance_private(self);
 	g_object_set(self, "font-desc", font, NULL);
 	g_node_traverse(priv->root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)invalidate, NULL);
-	g_signal_emit_by_name(self, "needs-layout");
+	emit_needs_layout(self);
 }
 
 /* DEBUG */
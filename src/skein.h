@@ -15,6 +15,7 @@
 #include <goocanvas.h>
 
 #include "node.h"
+#include "string-pool.h"
 
 typedef enum {
 	I7_REASON_COMMAND,
@@ -34,6 +35,36 @@ typedef struct {
 	I7Node *node;
 } I7SkeinNodeLabel;
 
+/* A reusable buffer of commands, stored back to back in one block of memory.
+ Use i7_skein_commands_get_n_commands() and i7_skein_commands_get_command() to
+ read them. */
+typedef struct {
+	GString *text; /* The commands, each one followed by a NUL byte */
+	GArray *offsets; /* gsize offset of each command in @text */
+	GPtrArray *path; /* Scratch space */
+} I7SkeinCommands;
+
+/* What to do at each step of an #I7SkeinReplayPlan */
+typedef enum {
+	I7_SKEIN_REPLAY_COMMAND, /* Type the command of @node */
+	I7_SKEIN_REPLAY_SAVE, /* Save the state of the story at @node in @slot */
+	I7_SKEIN_REPLAY_RESTORE, /* Go back to the state at @node saved in @slot */
+} I7SkeinReplayAction;
+
+typedef struct {
+	I7SkeinReplayAction action;
+	I7Node *node;
+	unsigned slot;
+} I7SkeinReplayStep;
+
+/* Steps to play through several threads in one run of the story, from
+ i7_skein_plan_replay() */
+typedef struct {
+	GArray *steps; /* I7SkeinReplayStep */
+	unsigned n_slots; /* Number of saved states needed at the same time */
+	unsigned n_commands; /* Number of I7_SKEIN_REPLAY_COMMAND steps */
+} I7SkeinReplayPlan;
+
 typedef struct _I7SkeinClass I7SkeinClass;
 typedef struct _I7Skein I7Skein;
 
@@ -46,7 +77,7 @@ struct _I7SkeinClass
 	void(* node_activate) (I7Skein *self, I7Node *node);
 	void(* differs_badge_activate) (I7Skein *self, I7Node *node);
 	void(* transcript_thread_changed) (I7Skein *self);
-	void(* labels_changed) (I7Skein *self);
+	void(* labels_changed) (I7Skein *self, unsigned position, unsigned removed, unsigned added);
 	void(* show_node) (I7Skein *self, guint why, I7Node *node);
 	void(* modified) (I7Skein *self);
 };
@@ -59,6 +90,7 @@ struct _I7Skein
 typedef enum _I7SkeinError {
 	I7_SKEIN_ERROR_XML,
 	I7_SKEIN_ERROR_BAD_FORMAT,
+	I7_SKEIN_ERROR_CACHE,
 } I7SkeinError;
 
 #define I7_SKEIN_ERROR i7_skein_error_quark()
@@ -66,24 +98,37 @@ typedef enum _I7SkeinError {
 GQuark i7_skein_error_quark(void);
 GType i7_skein_get_type(void) G_GNUC_CONST;
 I7Skein *i7_skein_new(void);
-void i7_skein_free_node_label_list(GSList *labels);
 
+I7StringPool *i7_skein_get_string_pool(I7Skein *self);
 I7Node *i7_skein_get_root_node(I7Skein *self);
+void i7_skein_begin_transaction(I7Skein *self);
+void i7_skein_end_transaction(I7Skein *self);
 I7Node *i7_skein_get_current_node(I7Skein *self);
 void i7_skein_set_current_node(I7Skein *self, I7Node *node);
 gboolean i7_skein_is_node_in_current_thread(I7Skein *self, I7Node *node);
 I7Node *i7_skein_get_played_node(I7Skein *self);
+unsigned i7_skein_get_played_nodes_touched(I7Skein *self);
 gboolean i7_skein_load(I7Skein *self, GFile *file, GError **error);
+gboolean i7_skein_load_cache(I7Skein *self, GFile *file, GError **error);
+void i7_skein_update_cache(I7Skein *self, GFile *file);
 void i7_skein_save_async(I7Skein *self, GFile *file, int priority, GCancellable *cancel, GAsyncReadyCallback callback, void *data);
 bool i7_skein_save_finish(I7Skein *self, GAsyncResult *res, GError **error);
 gboolean i7_skein_import(I7Skein *self, GFile *file, GError **error);
 void i7_skein_reset(I7Skein *self, gboolean current);
+void i7_skein_rewind_to_node(I7Skein *self, I7Node *node);
 void i7_skein_draw(I7Skein *self, GooCanvas *canvas);
 void i7_skein_schedule_draw(I7Skein *self, GooCanvas *canvas);
+void i7_skein_set_virtualized(I7Skein *self, gboolean virtualized);
+void i7_skein_set_visible_area(I7Skein *self, GooCanvas *canvas, const GooCanvasBounds *area);
 I7Node *i7_skein_new_command(I7Skein *self, const gchar *command);
 gboolean i7_skein_next_command(I7Skein *self, gchar **command);
 GSList *i7_skein_get_commands(I7Skein *self);
 GSList *i7_skein_get_commands_to_node(I7Skein *self, I7Node *from_node, I7Node *to_node);
+gboolean i7_skein_fill_commands_to_node(I7Skein *self, I7Node *from_node, I7Node *to_node, I7SkeinCommands *commands);
+I7SkeinCommands *i7_skein_commands_new(void);
+void i7_skein_commands_free(I7SkeinCommands *commands);
+unsigned i7_skein_commands_get_n_commands(I7SkeinCommands *commands);
+const char *i7_skein_commands_get_command(I7SkeinCommands *commands, unsigned ix);
 void i7_skein_update_after_playing(I7Skein *self, const gchar *transcript);
 gboolean i7_skein_get_line_from_history(I7Skein *self, gchar **line, int history);
 I7Node *i7_skein_add_new(I7Skein *self, I7Node *node);
@@ -92,16 +137,24 @@ gboolean i7_skein_remove_all(I7Skein *self, I7Node *node);
 gboolean i7_skein_remove_single(I7Skein *self, I7Node *node);
 void i7_skein_lock(I7Skein *self, I7Node *node);
 void i7_skein_unlock(I7Skein *self, I7Node *node);
-void i7_skein_trim(I7Skein *self, I7Node *node, gint max_temps);
-GSList *i7_skein_get_labels(I7Skein *self);
+unsigned i7_skein_trim(I7Skein *self, I7Node *node, unsigned max_temps);
+unsigned i7_skein_get_n_labels(I7Skein *self);
+const I7SkeinNodeLabel *i7_skein_get_label(I7Skein *self, unsigned pos);
 gboolean i7_skein_has_labels(I7Skein *self);
 void i7_skein_bless(I7Skein *self, I7Node *node, gboolean all);
 gboolean i7_skein_can_bless(I7Skein *self, I7Node *node, gboolean all);
 I7Node *i7_skein_get_thread_top(I7Skein *self, I7Node *node);
 I7Node *i7_skein_get_thread_bottom(I7Skein *self, I7Node *node);
 GSList *i7_skein_get_blessed_thread_ends(I7Skein *self);
+I7SkeinReplayPlan *i7_skein_plan_replay(I7Skein *self, GSList *thread_ends);
+void i7_skein_replay_plan_free(I7SkeinReplayPlan *plan);
+void i7_skein_queue_diffs(I7Skein *self, I7Node *node);
+void i7_skein_queue_all_diffs(I7Skein *self);
 gboolean i7_skein_get_modified(I7Skein *self);
 void i7_skein_set_font(I7Skein *self, PangoFontDescription *font);
 
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(I7SkeinCommands, i7_skein_commands_free)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(I7SkeinReplayPlan, i7_skein_replay_plan_free)
+
 /* DEBUG */
 void i7_skein_dump(I7Skein *self);
@@ -12,10 +12,12 @@
 #include <libchimara/chimara-glk.h>
 #include <libchimara/chimara-if.h>
 
+#include "configfile.h"
 #include "error.h"
 #include "html.h"
 #include "node.h"
 #include "skein.h"
+#include "skein-runner.h"
 #include "story.h"
 
 /* Methods of I7Story having to do with the Story (formerly called Game) pane:
@@ -177,91 +179,234 @@ i7_story_run_commands_from_node(I7Story *self, I7Node *node)
 	g_slist_free(commands);
 }
 
-/* One-off data structure for passing variables to the handlers below */
+/* State of "Play All Blessed" in the Story pane. This is a state machine
+driven by the interpreter's signals, so that the main loop keeps running
+normally while the story is being played: each run of the story starts the
+interpreter, feeds it the lines in on_replay_started(), stops it in
+on_replay_waiting() when they are done, and goes on to the next run from
+on_replay_stopped(). */
 struct RunSkeinData {
-	I7Story *story;
+	I7Story *story; /* owns a reference */
 	I7Skein *skein;
 	ChimaraGlk *glk;
+	GCancellable *cancel;
 
-	GSList *commands;
-	unsigned long started_handler, waiting_handler;
-	gboolean finished; /* don't have to use a GCond because this communication
-	is within the same thread and only one way? */
+	GPtrArray *plans; /* I7SkeinReplayPlan, one for each run of the story */
+	unsigned next_plan;
+	char *save_dir; /* only if the plans need saved states */
+	GArray *lines; /* I7ReplayLine, of the run in progress */
+	unsigned next_line; /* next line expected back in on_game_command() */
+	unsigned n_played, n_total; /* knots, for the progress bar */
+
+	unsigned long started_handler, waiting_handler, stopped_handler, cancelled_handler;
+	unsigned next_run_source;
 };
 
-/* Helper function: stop the interpreter when forced input is done processing;
-this signal is set up in run_entire_skein_loop() because the interpreter
-processes the commands you feed it asynchronously. */
+/* The skein's changes are announced in batches of this many replayed knots,
+ so that the skein and transcript keep up with the replay without being laid
+ out again after every command */
+#define REPLAY_BATCH_KNOTS 50
+
+static void start_next_replay_run(struct RunSkeinData *data);
+
+/* Each run of the story is one transaction on the skein, which is ended here
+ if the run was started */
 static void
-on_waiting_stop_interpreter(ChimaraGlk *glk, struct RunSkeinData *data)
+disconnect_replay_run(struct RunSkeinData *data)
 {
-	if(!chimara_glk_is_line_input_pending(glk)) {
-		/* Stop the interpreter */
-		chimara_glk_stop(glk);
-		data->finished = TRUE;
+	g_clear_signal_handler(&data->started_handler, data->glk);
+	g_clear_signal_handler(&data->waiting_handler, data->glk);
+	g_clear_signal_handler(&data->stopped_handler, data->glk);
+	if(data->lines) {
+		g_array_free(data->lines, TRUE);
+		data->lines = NULL;
+		i7_skein_end_transaction(data->skein);
+	}
+}
+
+/* Helper function: clean up after "Play All Blessed", whether it was done or
+cancelled. */
+static void
+finish_replay(struct RunSkeinData *data)
+{
+	I7Story *self = data->story;
+
+	disconnect_replay_run(data);
+	g_clear_handle_id(&data->next_run_source, g_source_remove);
+	g_clear_signal_handler(&data->cancelled_handler, data->cancel);
+	g_object_set_data(G_OBJECT(self), "replay-data", NULL);
+
+	chimara_glk_set_interactive(data->glk, TRUE);
+	i7_blob_clear_progress(self->blob);
+	g_debug("Replayed %u of %u knots", data->n_played, data->n_total);
 
-		/* Disconnect this handler */
-		g_signal_handler_disconnect(data->glk, data->waiting_handler);
+	/* Many knots' transcripts may have changed; work out how they differ from
+	 the expected text without blocking the UI */
+	i7_skein_queue_all_diffs(data->skein);
+
+	if(data->save_dir) {
+		i7_replay_remove_save_dir(data->save_dir);
+		g_free(data->save_dir);
 	}
+	g_ptr_array_free(data->plans, TRUE);
+	g_object_unref(data->cancel);
+	g_object_unref(self);
+	g_slice_free(struct RunSkeinData, data);
 }
 
-/* Helper function: feed the commands to the interpreter after the game has
-started; this signal is set up in run_entire_skein_loop() because it's not clear
-how soon the game is ready to accept input after the call to
-chimara_if_run_game_file(). */
+/* Helper function: feed the lines to the interpreter after the game has
+started; it's not clear how soon the game is ready to accept input after the
+call to chimara_if_run_game_file(). */
 static void
-on_started_feed_commands(ChimaraGlk *glk, struct RunSkeinData *data)
+on_replay_started(ChimaraGlk *glk, struct RunSkeinData *data)
 {
 	/* Display the interpreter */
 	i7_story_show_pane(data->story, I7_PANE_STORY);
 
-	/* Feed the commands into the interpreter */
-	GSList *iter;
-	for(iter = data->commands; iter; iter = g_slist_next(iter)) {
-		chimara_glk_feed_line_input(glk, (char *)iter->data);
+	unsigned ix;
+	for(ix = 0; ix < data->lines->len; ix++)
+		chimara_glk_feed_line_input(glk, g_array_index(data->lines, I7ReplayLine, ix).text);
+
+	g_clear_signal_handler(&data->started_handler, data->glk);
+}
+
+/* Helper function: stop the interpreter when the forced input is done
+processing; the interpreter processes the lines asynchronously. Stopping
+doesn't block; on_replay_stopped() is called when it's done. */
+static void
+on_replay_waiting(ChimaraGlk *glk, struct RunSkeinData *data)
+{
+	if(!chimara_glk_is_line_input_pending(glk)) {
+		g_clear_signal_handler(&data->waiting_handler, data->glk);
+		chimara_glk_stop(glk);
 	}
+}
+
+static gboolean
+next_replay_run_idle(struct RunSkeinData *data)
+{
+	data->next_run_source = 0;
 
-	/* Disconnect this handler */
-	g_signal_handler_disconnect(data->glk, data->started_handler);
+	/* The interpreter thread has already stopped, so this doesn't block for
+	 long; it has to be joined before the interpreter can run again */
+	chimara_glk_wait(data->glk);
+	start_next_replay_run(data);
+	return G_SOURCE_REMOVE;
+}
+
+/* Helper function: the run is over, either because all the lines were played
+or because the story ended by itself. Start the next run from the main loop,
+not from inside the interpreter's signal. */
+static void
+on_replay_stopped(ChimaraGlk *glk, struct RunSkeinData *data)
+{
+	disconnect_replay_run(data);
+	data->next_run_source = g_idle_add((GSourceFunc)next_replay_run_idle, data);
+}
+
+/* Helper function: the Stop button in the progress bar was pressed */
+static void
+on_replay_cancelled(GCancellable *cancel, struct RunSkeinData *data)
+{
+	if(data->lines)
+		chimara_glk_stop(data->glk);
 }
 
-/* Helper function: Run the compiler output and feed the commands from the
-Skein up to a certain knot @node. Wait until the interpreter is done and stop
-it in preparation for the next knot. */
 static void
-run_entire_skein_loop(I7Node *node, struct RunSkeinData *data)
+start_next_replay_run(struct RunSkeinData *data)
 {
-	data->commands = i7_skein_get_commands_to_node(data->skein, i7_skein_get_root_node(data->skein), node);
+	if(g_cancellable_is_cancelled(data->cancel) || data->next_plan == data->plans->len) {
+		finish_replay(data);
+		return;
+	}
 
+	I7SkeinReplayPlan *plan = g_ptr_array_index(data->plans, data->next_plan++);
+	i7_skein_begin_transaction(data->skein);
+	data->lines = i7_replay_lines_new(plan, data->save_dir);
+	data->next_line = 0;
 	i7_skein_reset(data->skein, TRUE);
 
-	/* Set up signals to finish the actions when the input is done being
-	processed */
 	data->started_handler = g_signal_connect_after(data->glk, "started",
-	    G_CALLBACK(on_started_feed_commands), data);
+		G_CALLBACK(on_replay_started), data);
 	data->waiting_handler = g_signal_connect_after(data->glk, "waiting",
-	    G_CALLBACK(on_waiting_stop_interpreter), data);
-	data->finished = FALSE;
-
-	/* Start the interpreter */
-	if (!load_and_start_interpreter(data->story, CHIMARA_IF(data->glk))) {
-		g_signal_handler_disconnect(data->glk, data->waiting_handler);
-		g_signal_handler_disconnect(data->glk, data->started_handler);
-		goto finally;
+		G_CALLBACK(on_replay_waiting), data);
+	data->stopped_handler = g_signal_connect_after(data->glk, "stopped",
+		G_CALLBACK(on_replay_stopped), data);
+
+	if(!load_and_start_interpreter(data->story, CHIMARA_IF(data->glk)))
+		finish_replay(data);
+}
+
+/* Helper function: called from on_game_command() while replaying. Returns
+TRUE if @input was one of the lines that saved or restored the story's state,
+which don't belong in the skein. */
+static gboolean
+filter_replay_line(struct RunSkeinData *data, const char *input)
+{
+	/* If the story didn't read the lines as planned, the command is recorded
+	 wherever the story is, as when playing by hand */
+	I7ReplayLine *line = i7_replay_lines_match(data->lines, &data->next_line, input);
+	if(line == NULL)
+		return FALSE;
+	if(line->node == NULL)
+		return TRUE;
+
+	data->n_played++;
+	i7_blob_set_progress(data->story->blob, (double)data->n_played / data->n_total, data->cancel);
+	if(data->n_played % REPLAY_BATCH_KNOTS == 0) {
+		i7_skein_end_transaction(data->skein);
+		i7_skein_begin_transaction(data->skein);
 	}
 
-	/* This will run until all the line input forced in
-	on_started_feed_commands() is finished processing */
-	while(!data->finished)
-		gtk_main_iteration_do(FALSE); /* don't block */
+	/* If the story's state was restored, go back to the same place in the
+	 skein, so that the command is recorded under the right knot */
+	I7Node *parent = line->node->gnode->parent->data;
+	if(i7_skein_get_played_node(data->skein) != parent)
+		i7_skein_rewind_to_node(data->skein, parent);
+	return FALSE;
+}
 
-	/* This should block on the chimara_glk_stop() call in
-	on_waiting_stop_interpreter() */
-	chimara_glk_wait(data->glk);
+/* Stops playing the skein in the background, if it is being played; its
+ transcripts don't go into the skein after this */
+static void
+cancel_skein_runner(I7Story *self)
+{
+	g_autoptr(GCancellable) cancel = i7_story_get_skein_runner_cancellable(self);
+	if(cancel == NULL)
+		return;
+	g_cancellable_cancel(cancel);
+	i7_story_set_skein_runner_cancellable(self, NULL);
+	i7_blob_clear_progress(self->blob);
+}
+
+static void
+on_run_entire_skein_in_background_progress(unsigned n_done, unsigned n_total, I7Story *self)
+{
+	g_autoptr(GCancellable) cancel = i7_story_get_skein_runner_cancellable(self);
+	i7_blob_set_progress(self->blob, (double)n_done / n_total, cancel);
+}
+
+static void
+on_run_entire_skein_in_background_finish(I7Skein *skein, GAsyncResult *res, I7Story *data)
+{
+	g_autoptr(I7Story) self = data;
+	g_autoptr(GCancellable) cancel = i7_story_get_skein_runner_cancellable(self);
+	GError *err = NULL;
 
-finally:
-	g_slist_foreach(data->commands, (GFunc)g_free, NULL);
-	g_slist_free(data->commands);
+	/* A run that was cancelled may finish after the next one has started;
+	 the progress and the cancellable belong to that one then */
+	if(cancel == g_task_get_cancellable(G_TASK(res))) {
+		i7_blob_clear_progress(self->blob);
+		i7_story_set_skein_runner_cancellable(self, NULL);
+	}
+	if(!i7_skein_runner_run_finish(skein, res, NULL, &err)) {
+		if(!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			error_dialog(GTK_WINDOW(self), err, _("There was an error playing the Skein: "));
+		else
+			g_error_free(err);
+		return;
+	}
+	i7_skein_queue_all_diffs(skein);
 }
 
 /*
@@ -269,7 +414,8 @@ finally:
  * @self: the story
  *
  * Callback for when compiling is finished. Plays through as many threads as
- * necessary to visit each blessed knot in the skein at least once.
+ * necessary to visit each blessed knot in the skein at least once. Returns
+ * right away; the progress is shown in the blob, which can also cancel it.
  */
 void
 i7_story_run_compiler_output_and_entire_skein(I7Story *self)
@@ -281,21 +427,61 @@ i7_story_run_compiler_output_and_entire_skein(I7Story *self)
 		return;
 	}
 
+	/* Play the threads in several interpreters at once, without showing them,
+	 if so configured */
+	unsigned n_jobs = g_settings_get_uint(i7_story_get_skein_settings(self), PREFS_SKEIN_REPLAY_JOBS);
+	if(n_jobs > 1) {
+		g_autoptr(GFile) story_file = i7_story_get_compiler_output_file(self);
+		g_autoptr(GCancellable) cancel = g_cancellable_new();
+		g_slist_free(blessed_nodes);
+		cancel_skein_runner(self);
+		i7_story_set_skein_runner_cancellable(self, cancel);
+		i7_blob_set_progress(self->blob, 0.0, cancel);
+		gboolean save_states = g_settings_get_boolean(i7_story_get_skein_settings(self), PREFS_SKEIN_REPLAY_SAVE_STATES);
+		i7_skein_runner_run_async(skein, story_file, n_jobs, save_states, cancel,
+			(I7SkeinRunnerProgressFunc)on_run_entire_skein_in_background_progress, self,
+			(GAsyncReadyCallback)on_run_entire_skein_in_background_finish, g_object_ref(self));
+		return;
+	}
+
 	struct RunSkeinData *data = g_slice_new0(struct RunSkeinData);
-	data->story = self;
+	data->story = g_object_ref(self);
 	data->skein = skein;
+	data->cancel = g_cancellable_new();
+	data->plans = g_ptr_array_new_with_free_func((GDestroyNotify)i7_skein_replay_plan_free);
 
 	/* Make sure the interpreter is non-interactive */
 	I7StoryPanel side = i7_story_choose_panel(self, I7_PANE_STORY);
 	data->glk = CHIMARA_GLK(self->panel[side]->tabs[I7_PANE_STORY]);
 	chimara_glk_set_interactive(data->glk, FALSE);
 
-	g_slist_foreach(blessed_nodes, (GFunc)run_entire_skein_loop, data);
+	/* Threads share most of their commands, so play each knot only once if
+	 possible, going back to a saved state at each branch. Otherwise, start
+	 again from the beginning for each thread. */
+	I7SkeinReplayPlan *plan = i7_skein_plan_replay(skein, blessed_nodes);
+	if(plan->n_slots > 0 && g_settings_get_boolean(i7_story_get_skein_settings(self), PREFS_SKEIN_REPLAY_SAVE_STATES))
+		data->save_dir = g_dir_make_tmp("inform7-replay-XXXXXX", NULL);
+
+	if(plan->n_slots == 0 || data->save_dir) {
+		g_ptr_array_add(data->plans, plan);
+		data->n_total = plan->n_commands;
+	} else {
+		i7_skein_replay_plan_free(plan);
+		GSList *iter;
+		for(iter = blessed_nodes; iter; iter = g_slist_next(iter)) {
+			GSList thread_end = { iter->data, NULL };
+			plan = i7_skein_plan_replay(skein, &thread_end);
+			g_ptr_array_add(data->plans, plan);
+			data->n_total += plan->n_commands;
+		}
+	}
 	g_slist_free(blessed_nodes);
+	g_debug("Replaying %u knots in %u runs", data->n_total, data->plans->len);
 
-	chimara_glk_set_interactive(data->glk, TRUE);
-
-	g_slice_free(struct RunSkeinData, data);
+	g_object_set_data(G_OBJECT(self), "replay-data", data);
+	data->cancelled_handler = g_signal_connect(data->cancel, "cancelled", G_CALLBACK(on_replay_cancelled), data);
+	i7_blob_set_progress(self->blob, 0.0, data->cancel);
+	start_next_replay_run(data);
 }
 
 /* Helper function: stop the game in @panel if it is running */
@@ -312,6 +498,12 @@ panel_stop_running_game(I7Story *story, I7Panel *panel)
 void
 i7_story_stop_running_game(I7Story *story)
 {
+	/* Stopping the game also stops "Play All Blessed" */
+	struct RunSkeinData *replay = g_object_get_data(G_OBJECT(story), "replay-data");
+	if(replay)
+		finish_replay(replay);
+	cancel_skein_runner(story);
+
 	i7_story_foreach_panel(story, (I7PanelForeachFunc)panel_stop_running_game, NULL);
 }
 
@@ -424,11 +616,17 @@ on_game_command(ChimaraIF *game, char *input, char *response, I7Story *self)
 		return;
 	}
 
+	/* Don't record the lines that save and restore the state while replaying
+	 the skein */
+	struct RunSkeinData *replay = g_object_get_data(G_OBJECT(self), "replay-data");
+	if(replay && replay->lines && input && filter_replay_line(replay, input))
+		return;
+
 	if(!input) {
 		/* If no input, then this was either the text printed before the first 
 		 prompt, or a keypress of Enter in response to character input. */
 		I7Node *root = i7_skein_get_root_node(skein);
-		if(i7_skein_get_current_node(skein) == root) {
+		if(i7_skein_get_current_node(skein) == root && (!replay || replay->next_line == 0)) {
 			i7_node_set_transcript_text(root, response);
 		}
 		return;
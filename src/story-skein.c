@@ -240,23 +240,20 @@ on_node_popup(I7SkeinView *view, I7Node *node)
 #undef ADD_SEPARATOR
 #undef ADD_IMAGE_MENU_ITEM
 
-static void
-create_labels_menu(I7SkeinNodeLabel *nodelabel, I7Panel *panel)
-{
-	g_autofree char *detailed_action = g_strdup_printf("panel.jump-to-node(uint64 %" PRIuPTR ")", (uintptr_t)nodelabel->node);
-	g_menu_append(panel->labels_menu, nodelabel->label, detailed_action);
-}
-
+/* Keeps the panel's labels menu in step with the skein's label index, only
+ changing the items that changed */
 void
-on_labels_changed(I7Skein *skein, I7Panel *panel)
+on_labels_changed(I7Skein *skein, unsigned position, unsigned removed, unsigned added, I7Panel *panel)
 {
-	GSList *labels = i7_skein_get_labels(skein);
-
-	g_menu_remove_all(panel->labels_menu);
-
-	/* Create a new menu */
-	g_slist_foreach(labels, (GFunc)create_labels_menu, panel);
-	i7_skein_free_node_label_list(labels);
+	unsigned ix;
+	for(ix = 0; ix < removed; ix++)
+		g_menu_remove(panel->labels_menu, position);
+
+	for(ix = 0; ix < added; ix++) {
+		const I7SkeinNodeLabel *nodelabel = i7_skein_get_label(skein, position + ix);
+		g_autofree char *detailed_action = g_strdup_printf("panel.jump-to-node(uint64 %" PRIuPTR ")", (uintptr_t)nodelabel->node);
+		g_menu_insert(panel->labels_menu, position + ix, nodelabel->label, detailed_action);
+	}
 }
 
 void
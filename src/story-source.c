@@ -94,19 +94,19 @@ on_source_key_press_event(GtkSourceView *source, GdkEventKey *event, I7SourceVie
 void
 after_source_buffer_delete_range(GtkTextBuffer *buffer, GtkTextIter *start, GtkTextIter *end, I7Document *document)
 {
-	/* Reindex the section headings anytime text is deleted, because running after
+	/* Reindex the section headings around the deletion, because running after
 	the default signal handler means we have no access to the deleted text. */
-	i7_document_reindex_headings(document);
-	/* TODO: do this in idle time and remove the old idle function */
+	i7_document_queue_headings_update(document, start, end);
 }
 
 void
 after_source_buffer_insert_text(GtkTextBuffer *buffer, GtkTextIter *location, gchar *text, gint len, I7Document *document)
 {
 	/* For any text, a section heading might have been entered or changed, so
-	reindex the section headings */
-	i7_document_reindex_headings(document);
-	/* TODO: do this in idle time and remove the old idle function */
+	reindex the section headings around it; @location is now after the text */
+	GtkTextIter start = *location;
+	gtk_text_iter_backward_chars(&start, g_utf8_strlen(text, len));
+	i7_document_queue_headings_update(document, &start, location);
 
 	/* If the text ends with a space, check whether it is a section heading that
 	needs auto-numbering */
@@ -167,11 +167,3 @@ on_panel_jump_to_line(I7Panel *panel, guint line, I7Story *story)
 	gtk_notebook_set_current_page(GTK_NOTEBOOK(story->panel[side]->notebook), I7_PANE_SOURCE);
 	i7_source_view_jump_to_line(story->panel[side]->sourceview, line);
 }
-
-/* Reindex the section headings */
-gboolean
-reindex_headings(GtkTextBuffer *buffer, I7Document *document)
-{
-	i7_document_reindex_headings(document);
-	return FALSE; /* One-shot idle function */
-}
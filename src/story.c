@@ -67,6 +67,7 @@ typedef struct {
 	I7Skein *skein;
 	GSettings *skein_settings;
 	gboolean test_me;
+	GCancellable *skein_runner_cancel; /* background "Play All Blessed" */
 } I7StoryPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE(I7Story, i7_story, I7_TYPE_DOCUMENT);
@@ -77,7 +78,7 @@ G_DEFINE_TYPE_WITH_PRIVATE(I7Story, i7_story, I7_TYPE_DOCUMENT);
 void on_skein_modified(I7Skein *, I7Story *);
 void on_node_activate(I7Skein *, I7Node *, I7Story *);
 void on_node_popup(I7SkeinView *, I7Node *);
-void on_labels_changed(I7Skein *, I7Panel *);
+void on_labels_changed(I7Skein *, unsigned, unsigned, unsigned, I7Panel *);
 void on_show_node(I7Skein *, I7SkeinShowNodeReason, I7Node *, I7Panel *);
 /* Defined in story-game.c */
 void on_game_started(ChimaraGlk *, I7Story *);
@@ -610,6 +611,13 @@ on_save_skein_finish(I7Skein *skein, GAsyncResult *res, I7Story *data)
 		error_dialog(GTK_WINDOW(self), err, _("There was an error saving the Skein. Your story will still be saved. Problem: "));
 	} else {
 		g_debug("Save as: Skein.skein saved");
+
+		I7StoryPrivate *priv = i7_story_get_instance_private(self);
+		if(g_settings_get_boolean(priv->skein_settings, PREFS_SKEIN_BINARY_CACHE)) {
+			g_autoptr(GFile) project_file = i7_document_get_file(I7_DOCUMENT(self));
+			g_autoptr(GFile) skein_file = g_file_get_child(project_file, "Skein.skein");
+			i7_skein_update_cache(skein, skein_file);
+		}
 	}
 }
 
@@ -1008,6 +1016,7 @@ story_init_panel(I7Story *self, I7Panel *panel)
 	g_signal_connect(panel, "display-compiler-report", G_CALLBACK(on_panel_display_compiler_report), self);
 	g_signal_connect(panel, "display-index-page", G_CALLBACK(on_panel_display_index_page), self);
 	g_signal_connect(priv->skein, "labels-changed", G_CALLBACK(on_labels_changed), panel);
+	on_labels_changed(priv->skein, 0, 0, i7_skein_get_n_labels(priv->skein), panel);
 	g_signal_connect(priv->skein, "show-node", G_CALLBACK(on_show_node), self);
 	g_signal_connect(panel->tabs[I7_PANE_SKEIN], "node-menu-popup", G_CALLBACK(on_node_popup), NULL);
 	g_signal_connect(panel->tabs[I7_PANE_STORY], "started", G_CALLBACK(on_game_started), self);
@@ -1136,6 +1145,7 @@ i7_story_init(I7Story *self)
 	priv->copy_blorb_dest_file = NULL;
 	priv->compiler_output_file = NULL;
 	priv->test_me = FALSE;
+	priv->skein_runner_cancel = NULL;
 	priv->manifest = NULL;
 
 	/* Set up the Skein */
@@ -1224,6 +1234,7 @@ i7_story_finalize(GObject *object)
 		g_object_unref(priv->copy_blorb_dest_file);
 	if(priv->compiler_output_file)
 		g_object_unref(priv->compiler_output_file);
+	g_clear_object(&priv->skein_runner_cancel);
 	g_clear_pointer(&priv->settings, plist_free);
 	g_clear_pointer(&priv->manifest, plist_free);
     g_clear_object(&self->skein_spacing_popover);
@@ -1421,9 +1432,18 @@ i7_story_open(I7Story *self)
 
 	/* Read the skein */
 	GFile *skein_file = g_file_get_child(file, "Skein.skein");
-	if(!i7_skein_load(priv->skein, skein_file, &err)) {
-		error_dialog(window, err, _("This project's Skein was not found, or it was unreadable."));
-		err = NULL;
+	gboolean use_cache = g_settings_get_boolean(priv->skein_settings, PREFS_SKEIN_BINARY_CACHE);
+	if(!use_cache || !i7_skein_load_cache(priv->skein, skein_file, &err)) {
+		if(use_cache) {
+			g_debug("Skein cache not used: %s", err->message);
+			g_clear_error(&err);
+		}
+		if(!i7_skein_load(priv->skein, skein_file, &err)) {
+			error_dialog(window, err, _("This project's Skein was not found, or it was unreadable."));
+			err = NULL;
+		} else if(use_cache) {
+			i7_skein_update_cache(priv->skein, skein_file);
+		}
 	}
 	g_object_unref(skein_file);
 
@@ -1750,6 +1770,24 @@ i7_story_set_compiler_output_file(I7Story *self, GFile *file)
 		priv->compiler_output_file = g_object_ref(file);
 }
 
+GCancellable *
+i7_story_get_skein_runner_cancellable(I7Story *self)
+{
+	I7StoryPrivate *priv = i7_story_get_instance_private(self);
+	if (priv->skein_runner_cancel == NULL)
+		return NULL;
+	return g_object_ref(priv->skein_runner_cancel);
+}
+
+void
+i7_story_set_skein_runner_cancellable(I7Story *self, GCancellable *cancel)
+{
+	I7StoryPrivate *priv = i7_story_get_instance_private(self);
+	g_clear_object(&priv->skein_runner_cancel);
+	if (cancel)
+		priv->skein_runner_cancel = g_object_ref(cancel);
+}
+
 /* Clear the previous compile output */
 void
 i7_story_clear_compile_output(I7Story *self)
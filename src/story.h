@@ -88,6 +88,8 @@ GFile *i7_story_get_copy_blorb_dest_file(I7Story *self);
 void i7_story_set_copy_blorb_dest_file(I7Story *self, GFile *file);
 GFile *i7_story_get_compiler_output_file(I7Story *self);
 void i7_story_set_compiler_output_file(I7Story *self, GFile *file);
+GCancellable *i7_story_get_skein_runner_cancellable(I7Story *self);
+void i7_story_set_skein_runner_cancellable(I7Story *self, GCancellable *cancel);
 void i7_story_clear_compile_output(I7Story *self);
 void i7_story_set_debug_log_contents(I7Story *self, const char *text);
 void i7_story_set_i6_source_contents(I7Story *self, const char *text);
@@ -101,7 +103,6 @@ GSettings *i7_story_get_skein_settings(I7Story *self);
 /* Source pane, story-source.c */
 void on_panel_paste_code(I7Panel *panel, char *code, I7Story *self);
 void on_panel_jump_to_line(I7Panel *panel, unsigned line, I7Story *self);
-gboolean reindex_headings(GtkTextBuffer *buffer, I7Document *document);
 
 /* Results pane, story-results.c */
 void i7_story_add_debug_tabs(I7Story *story);
@@ -0,0 +1,180 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * SPDX-FileCopyrightText: Philip Chimento <philip.chimento@gmail.com>
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "string-pool.h"
+
+/* A pool of reference-counted, read-only strings, so that identical strings
+ are only stored once. The skein keeps the text of all its knots here, since
+ commands such as "look" and their responses repeat many times over.
+
+ The empty string is never stored; it is always the same static string. A
+ %NULL pool is allowed, and just copies and frees the strings. */
+
+struct _I7StringPool {
+	int ref_count;
+	GHashTable *strings; /* owned string -> reference count; the strings are
+	freed by hand, so that the counts can be updated in place */
+	unsigned n_references;
+	gsize stored_bytes;
+	gsize referenced_bytes;
+};
+
+static const char empty_string[] = "";
+
+I7StringPool *
+i7_string_pool_new(void)
+{
+	I7StringPool *self = g_new0(I7StringPool, 1);
+	self->ref_count = 1;
+	self->strings = g_hash_table_new(g_str_hash, g_str_equal);
+	return self;
+}
+
+I7StringPool *
+i7_string_pool_ref(I7StringPool *self)
+{
+	g_return_val_if_fail(self, NULL);
+	self->ref_count++;
+	return self;
+}
+
+void
+i7_string_pool_unref(I7StringPool *self)
+{
+	g_return_if_fail(self);
+	if(--self->ref_count > 0)
+		return;
+
+	GHashTableIter iter;
+	char *string;
+	g_hash_table_iter_init(&iter, self->strings);
+	while(g_hash_table_iter_next(&iter, (void **)&string, NULL))
+		g_free(string);
+	g_hash_table_destroy(self->strings);
+	g_free(self);
+}
+
+/* Common part of i7_string_pool_intern() and i7_string_pool_intern_take();
+ @owned is @string if the caller gives it up, or %NULL. Adds @n_refs
+ references. */
+static const char *
+intern(I7StringPool *self, const char *string, char *owned, unsigned n_refs)
+{
+	char *stored;
+	void *count;
+	gsize len = strlen(string) + 1;
+
+	if(g_hash_table_lookup_extended(self->strings, string, (void **)&stored, &count)) {
+		g_free(owned);
+		g_hash_table_insert(self->strings, stored, GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + n_refs));
+	} else {
+		stored = owned? owned : g_memdup2(string, len);
+		g_hash_table_insert(self->strings, stored, GUINT_TO_POINTER(n_refs));
+		self->stored_bytes += len;
+	}
+	self->n_references += n_refs;
+	self->referenced_bytes += len * n_refs;
+	return stored;
+}
+
+/*
+ * i7_string_pool_intern:
+ * @self: (nullable): the pool
+ * @string: (nullable): a string; %NULL is treated as ""
+ *
+ * Returns: a string equal to @string that is owned by the pool. Give it back
+ * with i7_string_pool_release() when done with it.
+ */
+const char *
+i7_string_pool_intern(I7StringPool *self, const char *string)
+{
+	if(!string || *string == '\0')
+		return empty_string;
+	if(!self)
+		return g_strdup(string);
+	return intern(self, string, NULL, 1);
+}
+
+/* Like i7_string_pool_intern(), but hands out @n_refs references at once, each
+ of which must be given back with i7_string_pool_release(). Saves looking up
+ the string once for each use, when the number of uses is known in advance. */
+const char *
+i7_string_pool_intern_n(I7StringPool *self, const char *string, unsigned n_refs)
+{
+	g_return_val_if_fail(self, NULL);
+	g_return_val_if_fail(n_refs > 0, NULL);
+
+	if(!string || *string == '\0')
+		return empty_string;
+	return intern(self, string, NULL, n_refs);
+}
+
+/* Like i7_string_pool_intern(), but takes ownership of @string, avoiding a copy
+ if it isn't in the pool yet */
+const char *
+i7_string_pool_intern_take(I7StringPool *self, char *string)
+{
+	if(!string || *string == '\0') {
+		g_free(string);
+		return empty_string;
+	}
+	if(!self)
+		return string;
+	return intern(self, string, string, 1);
+}
+
+void
+i7_string_pool_release(I7StringPool *self, const char *string)
+{
+	if(!string || string == empty_string)
+		return;
+	if(!self) {
+		g_free((char *)string);
+		return;
+	}
+
+	char *stored;
+	void *count;
+	if(!g_hash_table_lookup_extended(self->strings, string, (void **)&stored, &count)) {
+		g_critical("String \"%s\" does not belong to this pool", string);
+		return;
+	}
+
+	gsize len = strlen(stored) + 1;
+	self->n_references--;
+	self->referenced_bytes -= len;
+	if(GPOINTER_TO_UINT(count) == 1) {
+		self->stored_bytes -= len;
+		g_hash_table_remove(self->strings, stored);
+		g_free(stored);
+	} else {
+		g_hash_table_insert(self->strings, stored, GUINT_TO_POINTER(GPOINTER_TO_UINT(count) - 1));
+	}
+}
+
+void
+i7_string_pool_get_stats(I7StringPool *self, I7StringPoolStats *stats)
+{
+	stats->n_strings = g_hash_table_size(self->strings);
+	stats->n_references = self->n_references;
+	stats->stored_bytes = self->stored_bytes;
+	stats->referenced_bytes = self->referenced_bytes;
+}
+
+/* Returns how many times less memory the strings take up than they would
+ without the pool */
+double
+i7_string_pool_get_dedup_ratio(I7StringPool *self)
+{
+	if(self->stored_bytes == 0)
+		return 1.0;
+	return (double)self->referenced_bytes / self->stored_bytes;
+}
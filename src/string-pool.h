@@ -0,0 +1,31 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * SPDX-FileCopyrightText: Philip Chimento <philip.chimento@gmail.com>
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include <glib.h>
+
+typedef struct _I7StringPool I7StringPool;
+
+typedef struct {
+	unsigned n_strings; /* Distinct strings stored */
+	unsigned n_references; /* Strings handed out and not yet released */
+	gsize stored_bytes; /* Memory used by the distinct strings */
+	gsize referenced_bytes; /* Memory the strings would use without the pool */
+} I7StringPoolStats;
+
+I7StringPool *i7_string_pool_new(void);
+I7StringPool *i7_string_pool_ref(I7StringPool *self);
+void i7_string_pool_unref(I7StringPool *self);
+const char *i7_string_pool_intern(I7StringPool *self, const char *string);
+const char *i7_string_pool_intern_take(I7StringPool *self, char *string);
+const char *i7_string_pool_intern_n(I7StringPool *self, const char *string, unsigned n_refs);
+void i7_string_pool_release(I7StringPool *self, const char *string);
+void i7_string_pool_get_stats(I7StringPool *self, I7StringPoolStats *stats);
+double i7_string_pool_get_dedup_ratio(I7StringPool *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(I7StringPool, i7_string_pool_unref)
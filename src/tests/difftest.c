@@ -22,8 +22,8 @@ char *actual_different = "This text isn't the same at all.\nGeronimo!\n\n";
 void
 test_diffs_same(void)
 {
-	GList *expected_diffs = NULL;
-	GList *actual_diffs = NULL;
+	GArray *expected_diffs = NULL;
+	GArray *actual_diffs = NULL;
 	bool result = word_diff(expected_same, actual_same, &expected_diffs, &actual_diffs);
 
 	g_assert_true(result);
@@ -34,8 +34,8 @@ test_diffs_same(void)
 void
 test_diffs_whitespace(void)
 {
-	GList *expected_diffs = NULL;
-	GList *actual_diffs = NULL;
+	GArray *expected_diffs = NULL;
+	GArray *actual_diffs = NULL;
 	bool result = word_diff(expected_whitespace, actual_whitespace, &expected_diffs, &actual_diffs);
 
 	g_assert_false(result);
@@ -52,13 +52,15 @@ test_diffs_whitespace(void)
 void
 test_diffs_different(void)
 {
-	GList *expected_diffs = NULL;
-	GList *actual_diffs = NULL;
+	GArray *expected_diffs = NULL;
+	GArray *actual_diffs = NULL;
 	bool result = word_diff(expected_different, actual_different, &expected_diffs, &actual_diffs);
 
 	g_assert_false(result);
 	g_assert_nonnull(expected_diffs);
 	g_assert_nonnull(actual_diffs);
+	g_assert_cmpuint(expected_diffs->len, ==, 3);
+	g_assert_cmpuint(actual_diffs->len, ==, 2);
 
 	g_autofree char *expected_pango = make_pango_markup_string(expected_different, expected_diffs);
 	g_assert_cmpstr(expected_pango, ==, "This text <u>is</u> <u>not</u> the same at all.\n\n<u>Cowabunga!</u>\n");
@@ -66,6 +68,86 @@ test_diffs_different(void)
 	g_autofree char *actual_pango = make_pango_markup_string(actual_different, actual_diffs);
 	g_assert_cmpstr(actual_pango, ==, "This text <u>isn&apos;t</u> the same at all.\n<u>Geronimo!</u>\n\n");
 
-	g_list_free(expected_diffs);
-	g_list_free(actual_diffs);
+	g_array_unref(expected_diffs);
+	g_array_unref(actual_diffs);
+}
+
+void
+test_diffs_escape(void)
+{
+	/* Without any differences, the text is still escaped */
+	g_autofree char *pango = make_pango_markup_string("Say \"a < b & c\"\n", NULL);
+	g_assert_cmpstr(pango, ==, "Say &quot;a &lt; b &amp; c&quot;\n");
+
+	/* Control characters come out the same as from GLib */
+	static const char *text = "tab\tbell\a\x7f \xc2\x80\xc2\x85\xc2\xa0 'quote' <&>";
+	g_autofree char *glib_escaped = g_markup_escape_text(text, -1);
+	GString *escaped = g_string_new("");
+	append_markup_escaped(escaped, text, -1);
+	g_assert_cmpstr(escaped->str, ==, glib_escaped);
+	g_string_truncate(escaped, 0);
+	append_markup_escaped(escaped, text, 9);
+	g_assert_cmpstr(escaped->str, ==, "tab\tbell&#x7;");
+	g_string_free(escaped, TRUE);
+}
+
+/* Generates a transcript of about @n_words words. Every @change_interval'th
+ word is changed, if @change_interval is nonzero. */
+static char *
+make_large_transcript(unsigned n_words, unsigned change_interval)
+{
+	static const char * const words[] = {
+		"You", "are", "standing", "in", "an", "open", "field", "west", "of",
+		"a", "white", "house,", "with", "a", "boarded", "front", "door.",
+		"There", "is", "a", "small", "mailbox", "here.\n\n>",
+	};
+	GString *text = g_string_sized_new(n_words * 6);
+	unsigned ix;
+
+	for(ix = 0; ix < n_words; ix++) {
+		if(change_interval && ix % change_interval == change_interval - 1)
+			g_string_append(text, "grue");
+		else
+			g_string_append(text, words[ix % G_N_ELEMENTS(words)]);
+		g_string_append_c(text, ix % 13 == 12? '\n' : ' ');
+	}
+	return g_string_free(text, FALSE);
+}
+
+/* Benchmark; only runs in -m perf mode */
+void
+test_diffs_perf(void)
+{
+	if(!g_test_perf()) {
+		g_test_skip("Benchmark; run with -m perf");
+		return;
+	}
+
+	const unsigned n_words = 100000;
+	g_autofree char *expected = make_large_transcript(n_words, 0);
+	g_autofree char *actual = make_large_transcript(n_words, 997);
+	GArray *expected_diffs = NULL;
+	GArray *actual_diffs = NULL;
+
+	g_test_timer_start();
+	bool result = word_diff(expected, actual, &expected_diffs, &actual_diffs);
+	double diff_time = g_test_timer_elapsed();
+	g_assert_false(result);
+	g_assert_nonnull(actual_diffs);
+
+	g_test_timer_start();
+	g_autofree char *expected_pango = make_pango_markup_string(expected, expected_diffs);
+	g_autofree char *actual_pango = make_pango_markup_string(actual, actual_diffs);
+	double markup_time = g_test_timer_elapsed();
+
+	g_test_minimized_result(diff_time + markup_time,
+		"Diffed %u words in %.3f s, made markup in %.3f s", n_words, diff_time, markup_time);
+
+	g_test_timer_start();
+	g_assert_true(same_words(expected, expected));
+	g_assert_false(same_words(expected, actual));
+	g_test_message("Compared words without diffing in %.3f s", g_test_timer_elapsed());
+
+	g_array_unref(expected_diffs);
+	g_array_unref(actual_diffs);
 }
@@ -8,3 +8,5 @@
 void test_diffs_same(void);
 void test_diffs_whitespace(void);
 void test_diffs_different(void);
+void test_diffs_escape(void);
+void test_diffs_perf(void);
@@ -0,0 +1,145 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * SPDX-FileCopyrightText: Philip Chimento <philip.chimento@gmail.com>
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <gio/gio.h>
+#include <glib.h>
+
+#include "doc-index.h"
+
+/* The index is generated at build time from the pages in tests/docs. Its docs
+ are numbered in order of the page file names, with each page's sections after
+ the page itself. */
+enum {
+	RECIPE_PAGE,
+	PAGE,
+	PHRASE,
+	EXAMPLE,
+	N_DOCS
+};
+
+typedef struct {
+	I7DocIndex *index;
+} DocIndexFixture;
+
+static void
+doc_index_setup(DocIndexFixture *fx, const void *unused)
+{
+	const char *filename = g_test_get_filename(G_TEST_BUILT, "test-doc-index.bin", NULL);
+	char *contents;
+	size_t length;
+	g_autoptr(GError) error = NULL;
+	g_assert_true(g_file_get_contents(filename, &contents, &length, &error));
+	g_assert_no_error(error);
+
+	g_autoptr(GBytes) bytes = g_bytes_new_take(contents, length);
+	fx->index = i7_doc_index_new(bytes, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(fx->index);
+}
+
+static void
+doc_index_teardown(DocIndexFixture *fx, const void *unused)
+{
+	i7_doc_index_free(fx->index);
+}
+
+static void
+test_doc_index_docs(DocIndexFixture *fx, const void *unused)
+{
+	g_assert_cmpuint(i7_doc_index_get_n_docs(fx->index), ==, N_DOCS);
+
+	I7DocText text;
+	i7_doc_index_get_doc(fx->index, PAGE, &text);
+	g_assert_false(text.is_example);
+	g_assert_false(text.is_recipebook);
+	g_assert_cmpstr(text.file, ==, "doc1.html");
+	g_assert_null(text.anchor);
+	g_assert_cmpstr(text.section, ==, "3.1");
+	g_assert_cmpstr(text.title, ==, "Rooms and doors");
+	g_assert_cmpstr(text.sort, ==, "0003000100000");
+	g_assert_null(text.example_title);
+	g_assert_nonnull(strstr(text.body, "Doors connect two rooms & can be opened."));
+	/* Sections, ignored sections, and scripts are not part of the page */
+	g_assert_null(strstr(text.body, "now the door is open"));
+	g_assert_null(strstr(text.body, "Navigation"));
+	g_assert_null(strstr(text.body, "cupboard"));
+
+	i7_doc_index_get_doc(fx->index, PHRASE, &text);
+	g_assert_false(text.is_example);
+	g_assert_cmpstr(text.anchor, ==, "phrase_open");
+	g_assert_cmpstr(text.title, ==, "Rooms and doors");
+	g_assert_cmpstr(text.body, ==, "now the door is open ");
+
+	i7_doc_index_get_doc(fx->index, EXAMPLE, &text);
+	g_assert_true(text.is_example);
+	g_assert_cmpstr(text.anchor, ==, "ex1");
+	g_assert_cmpstr(text.example_title, ==, "Escape from the Kitchen");
+
+	i7_doc_index_get_doc(fx->index, RECIPE_PAGE, &text);
+	g_assert_true(text.is_recipebook);
+	g_assert_cmpstr(text.file, ==, "Rdoc1.html");
+}
+
+static void
+assert_candidates(DocIndexFixture *fx, const char *search_text, unsigned n_expected, const I7DocCandidate *expected)
+{
+	g_autoptr(GArray) candidates = i7_doc_index_find_candidates(fx->index, search_text);
+	g_assert_cmpuint(candidates->len, ==, n_expected);
+	for(unsigned ix = 0; ix < n_expected; ix++) {
+		I7DocCandidate *candidate = &g_array_index(candidates, I7DocCandidate, ix);
+		g_assert_cmpuint(candidate->doc, ==, expected[ix].doc);
+		g_assert_cmpuint(candidate->start_offset, ==, expected[ix].start_offset);
+	}
+}
+
+static void
+test_doc_index_candidates(DocIndexFixture *fx, const void *unused)
+{
+	/* Candidates start searching at the first occurrence */
+	assert_candidates(fx, "KITCHEN", 3, (I7DocCandidate[]) {
+		{ RECIPE_PAGE, 27 }, { PAGE, 56 }, { EXAMPLE, 4 } });
+	/* Words can be parts of longer words */
+	assert_candidates(fx, "oor", 3, (I7DocCandidate[]) {
+		{ PAGE, 65 }, { PHRASE, 8 }, { EXAMPLE, 34 } });
+	/* Every word must occur */
+	assert_candidates(fx, "kitchen is", 2, (I7DocCandidate[]) {
+		{ PAGE, 56 }, { EXAMPLE, 4 } });
+	/* Words between spaces must be whole words */
+	assert_candidates(fx, "the door is", 2, (I7DocCandidate[]) {
+		{ PHRASE, 4 }, { EXAMPLE, 0 } });
+	assert_candidates(fx, " pantry ", 1, (I7DocCandidate[]) { { EXAMPLE, 26 } });
+	assert_candidates(fx, "the doo", 3, (I7DocCandidate[]) {
+		{ PAGE, 27 }, { PHRASE, 4 }, { EXAMPLE, 0 } });
+	assert_candidates(fx, "cupboard", 0, NULL);
+	/* Nothing to look up, so everything is a candidate */
+	assert_candidates(fx, " & ", N_DOCS, (I7DocCandidate[]) {
+		{ RECIPE_PAGE, 0 }, { PAGE, 0 }, { PHRASE, 0 }, { EXAMPLE, 0 } });
+}
+
+static void
+test_doc_index_corrupt(void)
+{
+	static const char garbage[] = "I7DI this is not an index at all";
+	g_autoptr(GBytes) bytes = g_bytes_new_static(garbage, sizeof(garbage));
+	g_autoptr(GError) error = NULL;
+	I7DocIndex *index = i7_doc_index_new(bytes, &error);
+	g_assert_null(index);
+	g_assert_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA);
+}
+
+void
+add_doc_index_tests(void)
+{
+#define ADD_DOC_INDEX_TEST(name) \
+	g_test_add("/doc-index/" #name, DocIndexFixture, NULL, doc_index_setup, test_doc_index_##name, doc_index_teardown);
+	ADD_DOC_INDEX_TEST(docs)
+	ADD_DOC_INDEX_TEST(candidates)
+#undef ADD_DOC_INDEX_TEST
+	g_test_add_func("/doc-index/corrupt", test_doc_index_corrupt);
+}
@@ -0,0 +1,259 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * SPDX-FileCopyrightText: Philip Chimento <philip.chimento@gmail.com>
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <glib.h>
+#include <gtk/gtk.h>
+
+#include "app.h"
+#include "elastic.h"
+
+typedef struct {
+	I7App *app;
+	GtkWidget *window;
+	GtkTextView *view;
+	GtkTextBuffer *buffer;
+} ElasticFixture;
+
+static void
+elastic_setup(ElasticFixture *fx, const void *unused)
+{
+	fx->app = i7_app_new();
+	fx->window = gtk_offscreen_window_new();
+	fx->view = GTK_TEXT_VIEW(gtk_text_view_new());
+	fx->buffer = gtk_text_view_get_buffer(fx->view);
+	gtk_container_add(GTK_CONTAINER(fx->window), GTK_WIDGET(fx->view));
+	gtk_widget_show_all(fx->window);
+}
+
+static void
+elastic_teardown(ElasticFixture *fx, const void *unused)
+{
+	gtk_widget_destroy(fx->window);
+	g_object_unref(fx->app);
+}
+
+/* A story with a table every @table_every lines, between paragraphs of
+ ordinary text */
+static char *
+make_source(unsigned n_lines, unsigned table_every)
+{
+	GString *text = g_string_new("");
+	unsigned line;
+	for(line = 0; line < n_lines; line++) {
+		unsigned in_table = line % table_every;
+		if(in_table == 0)
+			g_string_append_printf(text, "Table of Things %u\n", line);
+		else if(in_table == 1)
+			g_string_append(text, "name\tdescription\tweight\n");
+		else if(in_table < 6)
+			g_string_append_printf(text, "thing %u\t\"A thing of some kind.\"\t%u\n", line, line % 97);
+		else
+			g_string_append_printf(text, "The thing %u is in the Kitchen.\n", line);
+	}
+	return g_string_free(text, FALSE);
+}
+
+/* Describes the tab stops in effect on each line, to compare the result of
+ the incremental update with recalculating the whole buffer */
+static char *
+describe_tabstops(GtkTextBuffer *buffer)
+{
+	GString *desc = g_string_new("");
+	GtkTextIter iter;
+	gtk_text_buffer_get_start_iter(buffer, &iter);
+	do {
+		g_autoptr(GSList) tags = gtk_text_iter_get_tags(&iter);
+		GSList *tag;
+		for(tag = tags; tag; tag = g_slist_next(tag)) {
+			if(!g_object_get_data(tag->data, "elastictabstops"))
+				continue;
+			PangoTabArray *tabs;
+			g_object_get(tag->data, "tabs", &tabs, NULL);
+			int *locations;
+			int ix, size = pango_tab_array_get_size(tabs);
+			pango_tab_array_get_tabs(tabs, NULL, &locations);
+			for(ix = 0; ix < size; ix++)
+				g_string_append_printf(desc, "%d ", locations[ix]);
+			g_free(locations);
+			pango_tab_array_free(tabs);
+		}
+		g_string_append_c(desc, '\n');
+	} while(gtk_text_iter_forward_line(&iter));
+	return g_string_free(desc, FALSE);
+}
+
+static void
+insert_at_line(GtkTextBuffer *buffer, int line, int offset, const char *text)
+{
+	GtkTextIter iter;
+	gtk_text_buffer_get_iter_at_line_offset(buffer, &iter, line, offset);
+	gtk_text_buffer_insert(buffer, &iter, text, -1);
+}
+
+static void
+delete_lines(GtkTextBuffer *buffer, int first, int n_lines)
+{
+	GtkTextIter start, end;
+	gtk_text_buffer_get_iter_at_line(buffer, &start, first);
+	gtk_text_buffer_get_iter_at_line(buffer, &end, first + n_lines);
+	gtk_text_buffer_delete(buffer, &start, &end);
+}
+
+static void
+check_against_full_recalculation(ElasticFixture *fx)
+{
+	elastic_update_view(fx->view);
+	g_autofree char *incremental = describe_tabstops(fx->buffer);
+	elastic_recalculate_view(fx->view);
+	g_autofree char *full = describe_tabstops(fx->buffer);
+	g_assert_cmpstr(incremental, ==, full);
+}
+
+static void
+test_elastic_incremental(ElasticFixture *fx, const void *unused)
+{
+	g_autofree char *source = make_source(200, 20);
+	gtk_text_buffer_set_text(fx->buffer, source, -1);
+	add_elastic_tabstops_to_view(fx->view);
+
+	/* Widen a cell */
+	insert_at_line(fx->buffer, 23, 6, "with a much longer name");
+	check_against_full_recalculation(fx);
+
+	/* Add a column to one row */
+	insert_at_line(fx->buffer, 44, 0, "extra\t");
+	check_against_full_recalculation(fx);
+
+	/* Join two tables by removing the text between them */
+	delete_lines(fx->buffer, 66, 14);
+	check_against_full_recalculation(fx);
+
+	/* Split a table with a line of text */
+	insert_at_line(fx->buffer, 103, 0, "Some text in between.\n");
+	check_against_full_recalculation(fx);
+
+	/* Several edits before one update */
+	insert_at_line(fx->buffer, 122, 0, "\t");
+	insert_at_line(fx->buffer, 5, 0, "a\tb\tc\td\n");
+	delete_lines(fx->buffer, 160, 3);
+	check_against_full_recalculation(fx);
+
+	/* Emptying the buffer and starting again */
+	gtk_text_buffer_set_text(fx->buffer, "", -1);
+	check_against_full_recalculation(fx);
+	insert_at_line(fx->buffer, 0, 0, "a\tb\nlonger\tc\n");
+	check_against_full_recalculation(fx);
+}
+
+static void
+count_elastic_tag(GtkTextTag *tag, unsigned *count)
+{
+	if(g_object_get_data(G_OBJECT(tag), "elastictabstops"))
+		(*count)++;
+}
+
+/* The two panels of a story show the same buffer in two views */
+static void
+test_elastic_shared_buffer(ElasticFixture *fx, const void *unused)
+{
+	g_autofree char *source = make_source(200, 20);
+	gtk_text_buffer_set_text(fx->buffer, source, -1);
+	GtkTextView *other = GTK_TEXT_VIEW(gtk_text_view_new_with_buffer(fx->buffer));
+	g_object_ref_sink(other);
+	add_elastic_tabstops_to_view(fx->view);
+	add_elastic_tabstops_to_view(other);
+
+	/* Recalculating from one view leaves the blocks valid for the other */
+	elastic_recalculate_view(other);
+	insert_at_line(fx->buffer, 23, 6, "with a much longer name");
+	check_against_full_recalculation(fx);
+
+	/* Removing elastic tabstops from one view keeps them in the other */
+	remove_elastic_tabstops_from_view(other);
+	insert_at_line(fx->buffer, 44, 0, "extra\t");
+	check_against_full_recalculation(fx);
+
+	add_elastic_tabstops_to_view(other);
+	gtk_widget_destroy(GTK_WIDGET(other));
+	g_object_unref(other);
+	delete_lines(fx->buffer, 66, 14);
+	check_against_full_recalculation(fx);
+
+	/* Removing them from the last view removes all the tags */
+	remove_elastic_tabstops_from_view(fx->view);
+	unsigned n_tags = 0;
+	gtk_text_tag_table_foreach(gtk_text_buffer_get_tag_table(fx->buffer), (GtkTextTagTableForeach)count_elastic_tag, &n_tags);
+	g_assert_cmpuint(n_tags, ==, 0);
+}
+
+/* Cells are measured in the font that their tags give them, such as the bold
+ of quoted text in the syntax highlighting */
+static void
+test_elastic_styled_cells(ElasticFixture *fx, const void *unused)
+{
+	gtk_text_buffer_set_text(fx->buffer, "\"A rather long quoted cell\"\tend\nx\ty\n", -1);
+	add_elastic_tabstops_to_view(fx->view);
+	elastic_recalculate_view(fx->view);
+	g_autofree char *plain = describe_tabstops(fx->buffer);
+
+	GtkTextTag *tag = gtk_text_buffer_create_tag(fx->buffer, NULL, "scale", 2.0, NULL);
+	GtkTextIter start, end;
+	gtk_text_buffer_get_iter_at_line_offset(fx->buffer, &start, 0, 0);
+	gtk_text_buffer_get_iter_at_line_offset(fx->buffer, &end, 0, 27);
+	gtk_text_buffer_apply_tag(fx->buffer, tag, &start, &end);
+	elastic_recalculate_view(fx->view);
+	g_autofree char *scaled = describe_tabstops(fx->buffer);
+
+	g_assert_cmpint(atoi(scaled), >, atoi(plain));
+}
+
+/* Benchmark; only runs in -m perf mode. Typing in a table cell in the middle
+ of a large source should only measure the table it is in. */
+static void
+test_elastic_keystroke_perf(ElasticFixture *fx, const void *unused)
+{
+	if(!g_test_perf()) {
+		g_test_skip("Benchmark; run with -m perf");
+		return;
+	}
+
+	const unsigned n_lines = 50000, n_keystrokes = 100;
+	g_autofree char *source = make_source(n_lines, 20);
+	gtk_text_buffer_set_text(fx->buffer, source, -1);
+	add_elastic_tabstops_to_view(fx->view);
+
+	g_test_timer_start();
+	elastic_recalculate_view(fx->view);
+	double full = g_test_timer_elapsed();
+	g_test_message("Recalculating all %u lines: %.3f ms", n_lines, 1000.0 * full);
+
+	/* A cell in the middle of the source */
+	int line = n_lines / 2 + 3;
+	unsigned ix;
+	g_test_timer_start();
+	for(ix = 0; ix < n_keystrokes; ix++) {
+		insert_at_line(fx->buffer, line, 6, "x");
+		elastic_update_view(fx->view);
+	}
+	double elapsed = g_test_timer_elapsed();
+	g_test_minimized_result(elapsed / n_keystrokes, "Keystroke in a %u-line source: %.3f ms",
+		n_lines, 1000.0 * elapsed / n_keystrokes);
+}
+
+void
+add_elastic_tests(void)
+{
+#define ADD_ELASTIC_TEST(path, name) \
+	g_test_add("/elastic/" path, ElasticFixture, NULL, elastic_setup, test_elastic_##name, elastic_teardown);
+	ADD_ELASTIC_TEST("incremental", incremental)
+	ADD_ELASTIC_TEST("shared-buffer", shared_buffer)
+	ADD_ELASTIC_TEST("styled-cells", styled_cells)
+	ADD_ELASTIC_TEST("keystroke/perf", keystroke_perf)
+#undef ADD_ELASTIC_TEST
+}
@@ -0,0 +1,262 @@
+/*
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ * SPDX-FileCopyrightText: Philip Chimento <philip.chimento@gmail.com>
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <goocanvas.h>
+
+#include "node.h"
+#include "skein.h"
+#include "skein-test.h"
+
+/* Benchmarks for the skein, on synthetic skeins of several shapes. These only
+ run in -m perf mode. Each result is reported with g_test_minimized_result()
+ and collected; the last test writes them all out as JSON, to the file named
+ by INFORM7_BENCHMARK_JSON or otherwise skein-benchmarks.json in the test build
+ directory, so that the numbers can be compared between releases:
+
+ { "version": "...", "results": [
+   { "shape": "random", "knots": 100000, "operation": "load", "seconds": 0.5 },
+   ... ] } */
+
+typedef enum {
+	SHAPE_DEEP,   /* One long thread */
+	SHAPE_WIDE,   /* Many short threads branching off near the root */
+	SHAPE_RANDOM, /* Mostly long threads with occasional branches, as in play */
+} SkeinShape;
+
+typedef struct {
+	const char *name;
+	SkeinShape shape;
+	unsigned n_knots;
+} BenchmarkSkein;
+
+/* The deep skein is smaller, because laying out, trimming, and traversing the
+ knots recurse once per level, and a thread of 100000 knots overflows the
+ stack */
+static const BenchmarkSkein benchmark_skeins[] = {
+	{ "deep", SHAPE_DEEP, 10000 },
+	{ "wide", SHAPE_WIDE, 100000 },
+	{ "random", SHAPE_RANDOM, 100000 },
+};
+
+/* Results collected for the report, as JSON objects */
+static GPtrArray *benchmark_results;
+
+static void
+record_result(const BenchmarkSkein *bench, const char *operation, double seconds)
+{
+	if(!benchmark_results)
+		benchmark_results = g_ptr_array_new_with_free_func(g_free);
+	g_ptr_array_add(benchmark_results, g_strdup_printf("{ \"shape\": \"%s\", "
+		"\"knots\": %u, \"operation\": \"%s\", \"seconds\": %.6f }",
+		bench->name, bench->n_knots, operation, seconds));
+	g_test_minimized_result(seconds, "%s skein, %u knots, %s: %.3f s",
+		bench->name, bench->n_knots, operation, seconds);
+}
+
+/* Each knot's parent comes before it, so the array describes the tree in the
+ order the knots are written out */
+static unsigned *
+generate_parents(const BenchmarkSkein *bench, GRand *rand)
+{
+	unsigned *parents = g_new(unsigned, bench->n_knots);
+	unsigned ix;
+	parents[0] = 0;
+	for(ix = 1; ix < bench->n_knots; ix++) {
+		switch(bench->shape) {
+			case SHAPE_DEEP:
+				parents[ix] = ix - 1;
+				break;
+			case SHAPE_WIDE:
+				parents[ix] = ix <= 1000? 0 : (ix - 1) % 1000 + 1;
+				break;
+			case SHAPE_RANDOM:
+				/* Nine times out of ten, carry on with the same thread */
+				if(g_rand_int_range(rand, 0, 10) != 0)
+					parents[ix] = ix - 1;
+				else
+					parents[ix] = g_rand_int_range(rand, 0, ix);
+				break;
+		}
+	}
+	return parents;
+}
+
+static void
+on_save_finish(I7Skein *skein, GAsyncResult *res, gboolean *done)
+{
+	GError *err = NULL;
+	g_assert_true(i7_skein_save_finish(skein, res, &err));
+	g_assert_no_error(err);
+	*done = TRUE;
+}
+
+static gboolean
+find_deepest(GNode *gnode, GNode **deepest)
+{
+	if(g_node_depth(gnode) > g_node_depth(*deepest))
+		*deepest = gnode;
+	return FALSE; /* Don't stop the traversal */
+}
+
+static gboolean
+label_every_hundredth(GNode *gnode, unsigned *count)
+{
+	if(gnode->parent && ++(*count) % 100 == 0) {
+		g_autofree char *label = g_strdup_printf("Label %u", *count * 7919 % 1000);
+		i7_node_set_label(I7_NODE(gnode->data), label);
+	}
+	return FALSE; /* Don't stop the traversal */
+}
+
+static void
+on_diffs_calculated(I7Node *node, GParamSpec *pspec, unsigned *n_waiting)
+{
+	if(i7_node_get_diffs_calculated(node))
+		(*n_waiting)--;
+}
+
+static gboolean
+listen_unmatched(GNode *gnode, unsigned *n_waiting)
+{
+	I7Node *node = gnode->data;
+	if(i7_node_get_match_type(node) == I7_NODE_NO_MATCH && !i7_node_get_diffs_calculated(node)) {
+		g_signal_connect(node, "notify::diffs-calculated", G_CALLBACK(on_diffs_calculated), n_waiting);
+		(*n_waiting)++;
+	}
+	return FALSE; /* Don't stop the traversal */
+}
+
+static void
+run_benchmarks(const BenchmarkSkein *bench)
+{
+	if(!g_test_perf()) {
+		g_test_skip("Benchmark; run with -m perf");
+		return;
+	}
+
+	GError *err = NULL;
+	g_autofree char *tmpdir = g_dir_make_tmp("skein-bench-XXXXXX", &err);
+	g_assert_no_error(err);
+	g_autofree char *path = g_build_filename(tmpdir, "Skein.skein", NULL);
+	g_autoptr(GFile) file = g_file_new_for_path(path);
+	GRand *rand = g_rand_new_with_seed(bench->n_knots + bench->shape);
+	unsigned *parents = generate_parents(bench, rand);
+	write_synthetic_skein_with_parents(file, bench->n_knots, parents, rand);
+	g_free(parents);
+	g_rand_free(rand);
+
+	I7Skein *skein = i7_skein_new();
+	g_test_timer_start();
+	g_assert_true(i7_skein_load(skein, file, &err));
+	record_result(bench, "load", g_test_timer_elapsed());
+	g_assert_no_error(err);
+	I7Node *root = i7_skein_get_root_node(skein);
+
+	gboolean done = FALSE;
+	g_test_timer_start();
+	i7_skein_save_async(skein, file, G_PRIORITY_DEFAULT, NULL, (GAsyncReadyCallback)on_save_finish, &done);
+	while(!done)
+		g_main_context_iteration(NULL, TRUE);
+	record_result(bench, "save", g_test_timer_elapsed());
+
+	GooCanvas *canvas = GOO_CANVAS(goo_canvas_new());
+	g_object_ref_sink(canvas);
+	goo_canvas_set_root_item_model(canvas, GOO_CANVAS_ITEM_MODEL(skein));
+	g_test_timer_start();
+	i7_skein_draw(skein, canvas);
+	record_result(bench, "layout", g_test_timer_elapsed());
+
+	/* Commands to the deepest knot, as when playing to it */
+	GNode *deepest = root->gnode;
+	g_node_traverse(root->gnode, G_PRE_ORDER, G_TRAVERSE_LEAVES, -1, (GNodeTraverseFunc)find_deepest, &deepest);
+	g_autoptr(I7SkeinCommands) commands = i7_skein_commands_new();
+	const unsigned n_runs = 100;
+	unsigned run;
+	g_test_timer_start();
+	for(run = 0; run < n_runs; run++)
+		i7_skein_fill_commands_to_node(skein, root, deepest->data, commands);
+	record_result(bench, "commands-to-node", g_test_timer_elapsed() / n_runs);
+	g_assert_cmpuint(i7_skein_commands_get_n_commands(commands), ==, g_node_depth(deepest) - 1);
+
+	/* Label one knot in a hundred, then list the labels as the menu does */
+	unsigned count = 0;
+	i7_skein_begin_transaction(skein);
+	g_test_timer_start();
+	g_node_traverse(root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)label_every_hundredth, &count);
+	record_result(bench, "label", g_test_timer_elapsed());
+	i7_skein_end_transaction(skein);
+	g_test_timer_start();
+	unsigned n_labels = i7_skein_get_n_labels(skein), ix;
+	for(ix = 0; ix < n_labels; ix++)
+		g_assert_nonnull(i7_skein_get_label(skein, ix)->label);
+	record_result(bench, "list-labels", g_test_timer_elapsed());
+	g_assert_cmpuint(n_labels, ==, (bench->n_knots - 1) / 100);
+
+	unsigned n_waiting = 0;
+	g_node_traverse(root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)listen_unmatched, &n_waiting);
+	g_test_timer_start();
+	i7_skein_queue_all_diffs(skein);
+	while(n_waiting > 0)
+		g_main_context_iteration(NULL, TRUE);
+	record_result(bench, "diff", g_test_timer_elapsed());
+
+	g_test_timer_start();
+	unsigned n_removed = i7_skein_trim(skein, root, 5);
+	record_result(bench, "trim", g_test_timer_elapsed());
+	g_test_message("Trimmed %u knots", n_removed);
+
+	g_object_unref(canvas);
+	g_object_unref(skein);
+	g_file_delete(file, NULL, NULL);
+	g_autofree char *cache_path = g_strconcat(path, ".cache", NULL);
+	g_unlink(cache_path);
+	g_rmdir(tmpdir);
+}
+
+static void
+write_report(void)
+{
+	if(!g_test_perf()) {
+		g_test_skip("Benchmark; run with -m perf");
+		return;
+	}
+	if(!benchmark_results) {
+		g_test_skip("No benchmarks were run");
+		return;
+	}
+
+	GString *json = g_string_new("{\n  \"version\": \"" PACKAGE_VERSION "\",\n  \"results\": [\n");
+	unsigned ix;
+	for(ix = 0; ix < benchmark_results->len; ix++)
+		g_string_append_printf(json, "    %s%s\n", (char *)g_ptr_array_index(benchmark_results, ix),
+			ix + 1 < benchmark_results->len? "," : "");
+	g_string_append(json, "  ]\n}\n");
+
+	const char *path = g_getenv("INFORM7_BENCHMARK_JSON");
+	if(path == NULL)
+		path = g_test_get_filename(G_TEST_BUILT, "skein-benchmarks.json", NULL);
+	GError *err = NULL;
+	g_assert_true(g_file_set_contents(path, json->str, json->len, &err));
+	g_assert_no_error(err);
+	g_test_message("Benchmark results written to %s", path);
+
+	g_string_free(json, TRUE);
+	g_clear_pointer(&benchmark_results, g_ptr_array_unref);
+}
+
+void
+add_skein_benchmarks(void)
+{
+	unsigned ix;
+	for(ix = 0; ix < G_N_ELEMENTS(benchmark_skeins); ix++) {
+		g_autofree char *path = g_strdup_printf("/skein/benchmark/%s", benchmark_skeins[ix].name);
+		g_test_add_data_func(path, &benchmark_skeins[ix], (GTestDataFunc)run_benchmarks);
+	}
+	g_test_add_func("/skein/benchmark/report", write_report);
+}
@@ -5,10 +5,18 @@
 
 #include "config.h"
 
+#include <math.h>
+#include <string.h>
+#include <sys/resource.h>
+
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <goocanvas.h>
 
 #include "node.h"
 #include "skein.h"
+#include "skein-runner.h"
+#include "transcript-diff.h"
 
 void
 test_skein_import(void)
@@ -45,4 +53,1516 @@ test_skein_import(void)
 	}
 
 	g_object_unref(skein);
-}
\ No newline at end of file
+}
+
+static void
+append_sentences(GString *text, GRand *rand, unsigned n_sentences)
+{
+	static const char * const sentences[] = {
+		"You can't go that way.",
+		"Taken.",
+		"Time passes.",
+		"The lamp is now switched on.",
+		"You see nothing special about the wallpaper.",
+		"It's pitch dark, and you can't see a thing.",
+		"The door is locked.",
+		"You are carrying: a brass lamp, a small key and a pile of leaflets.",
+		"A hollow voice says &quot;Fool.&quot;",
+		"Living room\nYou are in the living room. There is a doorway to the east.",
+	};
+	unsigned ix;
+	for(ix = 0; ix < n_sentences; ix++) {
+		g_string_append(text, sentences[g_rand_int_range(rand, 0, G_N_ELEMENTS(sentences))]);
+		g_string_append_c(text, ' ');
+	}
+}
+
+/*
+ * write_synthetic_skein_with_parents:
+ * @file: where to write the skein
+ * @n_knots: number of knots
+ * @parents: for each knot other than the root, knot 0, the index of its
+ * parent, which must come before it
+ * @rand: (nullable): random number generator for the text
+ *
+ * Writes a synthetic skein to @file. Commands and transcripts are taken from a
+ * small vocabulary, as in a real skein. Without @rand, knot @i's text and score
+ * only depend on @i. With @rand, transcripts vary in length, and a third of the
+ * knots have expected text with one sentence more than the transcript.
+ */
+void
+write_synthetic_skein_with_parents(GFile *file, unsigned n_knots, const unsigned *parents, GRand *rand)
+{
+	static const char * const commands[] = {
+		"look", "inventory", "x me", "north", "south", "take lamp",
+		"open door", "wait", "z", "examine wallpaper", "east", "west",
+		"turn on lamp", "unlock door with key", "read leaflet", "say xyzzy",
+	};
+	unsigned ix;
+
+	/* Children in order, as linked lists */
+	unsigned *first_child = g_new(unsigned, n_knots);
+	unsigned *last_child = g_new(unsigned, n_knots);
+	unsigned *next_sibling = g_new(unsigned, n_knots);
+	for(ix = 0; ix < n_knots; ix++)
+		first_child[ix] = last_child[ix] = next_sibling[ix] = G_MAXUINT;
+	for(ix = 1; ix < n_knots; ix++) {
+		unsigned parent = parents[ix];
+		if(first_child[parent] == G_MAXUINT)
+			first_child[parent] = ix;
+		else
+			next_sibling[last_child[parent]] = ix;
+		last_child[parent] = ix;
+	}
+
+	GString *xml = g_string_new("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<Skein rootNode=\"node-0\" xmlns=\"http://www.logicalshift.org.uk/IF/Skein\">\n"
+		"  <generator>Inform 7</generator>\n"
+		"  <activeNode nodeId=\"node-0\"/>\n");
+	GString *transcript = g_string_new("");
+	GString *expected = g_string_new("");
+	for(ix = 0; ix < n_knots; ix++) {
+		const char *command;
+		int score;
+		gboolean locked;
+		g_string_truncate(transcript, 0);
+		g_string_truncate(expected, 0);
+		if(rand) {
+			command = commands[g_rand_int_range(rand, 0, G_N_ELEMENTS(commands))];
+			append_sentences(transcript, rand, g_rand_int_range(rand, 1, 12));
+			if(ix % 3 == 0) {
+				g_string_append(expected, transcript->str);
+				append_sentences(expected, rand, 1);
+			}
+			score = g_rand_int_range(rand, 0, 20);
+			locked = g_rand_int_range(rand, 0, 50) == 0;
+		} else {
+			command = commands[ix % 10];
+			g_string_append_printf(transcript, "You %s. Nothing much happens &amp; "
+				"the room stays the same.\r\nTurn %u.", ix == 0? "- start -" : command, ix);
+			if(ix % 3 == 0)
+				g_string_append(expected, "You look around. Nothing much happens.");
+			score = ix % 10;
+			locked = ix % 7 == 0;
+		}
+		if(ix == 0)
+			command = "- start -";
+
+		g_string_append_printf(xml, "  <item nodeId=\"node-%u\">\n", ix);
+		g_string_append_printf(xml, "    <command xml:space=\"preserve\">%s</command>\n", command);
+		g_string_append_printf(xml, "    <result xml:space=\"preserve\">%s</result>\n", transcript->str);
+		g_string_append_printf(xml, "    <commentary xml:space=\"preserve\">%s</commentary>\n", expected->str);
+		g_string_append(xml, "    <played>NO</played>\n    <changed>NO</changed>\n");
+		g_string_append_printf(xml, "    <temporary score=\"%d\">%s</temporary>\n", score, locked? "NO" : "YES");
+		g_string_append(xml, "    <annotation xml:space=\"preserve\"></annotation>\n");
+		if(first_child[ix] != G_MAXUINT) {
+			g_string_append(xml, "    <children>\n");
+			unsigned child;
+			for(child = first_child[ix]; child != G_MAXUINT; child = next_sibling[child])
+				g_string_append_printf(xml, "      <child nodeId=\"node-%u\"/>\n", child);
+			g_string_append(xml, "    </children>\n");
+		}
+		g_string_append(xml, "  </item>\n");
+	}
+	g_string_append(xml, "</Skein>\n");
+
+	GError *err = NULL;
+	g_assert_true(g_file_replace_contents(file, xml->str, xml->len, NULL, FALSE,
+		G_FILE_CREATE_NONE, NULL, NULL, &err));
+	g_assert_no_error(err);
+
+	g_string_free(expected, TRUE);
+	g_string_free(transcript, TRUE);
+	g_string_free(xml, TRUE);
+	g_free(first_child);
+	g_free(last_child);
+	g_free(next_sibling);
+}
+
+/* Write a synthetic skein with @n_knots knots to @file. Each knot @i is a child
+ of knot (@i - 1) / @fan_out, so the result is a complete tree. */
+static void
+write_synthetic_skein(GFile *file, unsigned n_knots, unsigned fan_out)
+{
+	unsigned *parents = g_new(unsigned, n_knots);
+	unsigned ix;
+	parents[0] = 0;
+	for(ix = 1; ix < n_knots; ix++)
+		parents[ix] = (ix - 1) / fan_out;
+	write_synthetic_skein_with_parents(file, n_knots, parents, NULL);
+	g_free(parents);
+}
+
+static GFile *
+create_temp_skein_file(char **tmpdir)
+{
+	GError *err = NULL;
+	*tmpdir = g_dir_make_tmp("skein-test-XXXXXX", &err);
+	g_assert_no_error(err);
+	g_autofree char *path = g_build_filename(*tmpdir, "Skein.skein", NULL);
+	return g_file_new_for_path(path);
+}
+
+static void
+remove_temp_skein_file(GFile *file, char *tmpdir)
+{
+	g_file_delete(file, NULL, NULL);
+	g_rmdir(tmpdir);
+	g_free(tmpdir);
+}
+
+void
+test_skein_load(void)
+{
+	GError *err = NULL;
+	char *tmpdir;
+	g_autoptr(GFile) file = create_temp_skein_file(&tmpdir);
+	write_synthetic_skein(file, 13, 3);
+
+	I7Skein *skein = i7_skein_new();
+	g_assert_true(i7_skein_load(skein, file, &err));
+	g_assert_no_error(err);
+	g_assert_false(i7_skein_get_modified(skein));
+
+	I7Node *root = i7_skein_get_root_node(skein);
+	g_autofree char *root_command = i7_node_get_command(root);
+	g_assert_cmpstr(root_command, ==, "- start -");
+	g_assert_cmpuint(g_node_n_nodes(root->gnode, G_TRAVERSE_ALL), ==, 13);
+	g_assert_cmpuint(g_node_n_children(root->gnode), ==, 3);
+	g_assert_cmpuint(g_node_max_height(root->gnode), ==, 3);
+
+	/* Children are in document order, and text is unescaped and normalized */
+	I7Node *first = root->gnode->children->data;
+	g_autofree char *first_command = i7_node_get_command(first);
+	g_assert_cmpstr(first_command, ==, "inventory");
+	g_autofree char *first_transcript = i7_node_get_transcript_text(first);
+	g_assert_cmpstr(first_transcript, ==, "You inventory. Nothing much happens & the room stays the same.\nTurn 1.");
+	g_assert_false(i7_node_get_blessed(first));
+	g_assert_true(i7_node_get_blessed(root));
+	g_assert_true(i7_node_get_locked(root));
+	g_assert_cmpint(i7_node_get_score(g_node_nth_child(root->gnode, 2)->data), ==, 3);
+
+	g_object_unref(skein);
+	remove_temp_skein_file(file, tmpdir);
+}
+
+void
+test_skein_load_bad_format(void)
+{
+	static const char * const items[] = {
+		/* Missing child */
+		"  <item nodeId=\"node-0\"><children><child nodeId=\"node-1\"/></children></item>\n",
+		/* Root listed as a child */
+		"  <item nodeId=\"node-0\"><children><child nodeId=\"node-1\"/></children></item>\n"
+		"  <item nodeId=\"node-1\"><children><child nodeId=\"node-0\"/></children></item>\n",
+		/* Same child listed twice */
+		"  <item nodeId=\"node-0\"><children><child nodeId=\"node-1\"/><child nodeId=\"node-1\"/></children></item>\n"
+		"  <item nodeId=\"node-1\"/>\n",
+		/* Child of two parents */
+		"  <item nodeId=\"node-0\"><children><child nodeId=\"node-1\"/><child nodeId=\"node-2\"/></children></item>\n"
+		"  <item nodeId=\"node-1\"><children><child nodeId=\"node-3\"/></children></item>\n"
+		"  <item nodeId=\"node-2\"><children><child nodeId=\"node-3\"/></children></item>\n"
+		"  <item nodeId=\"node-3\"/>\n",
+		/* Loop cut off from the root */
+		"  <item nodeId=\"node-0\"/>\n"
+		"  <item nodeId=\"node-1\"><children><child nodeId=\"node-2\"/></children></item>\n"
+		"  <item nodeId=\"node-2\"><children><child nodeId=\"node-1\"/></children></item>\n",
+		/* Knot that is its own child */
+		"  <item nodeId=\"node-0\"/>\n"
+		"  <item nodeId=\"node-1\"><children><child nodeId=\"node-1\"/></children></item>\n",
+	};
+	GError *err = NULL;
+	char *tmpdir;
+	g_autoptr(GFile) file = create_temp_skein_file(&tmpdir);
+	I7Skein *skein = i7_skein_new();
+	I7Node *old_root = i7_skein_get_root_node(skein);
+
+	unsigned ix;
+	for(ix = 0; ix < G_N_ELEMENTS(items); ix++) {
+		g_autofree char *xml = g_strconcat("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+			"<Skein rootNode=\"node-0\">\n", items[ix], "</Skein>\n", NULL);
+		g_assert_true(g_file_replace_contents(file, xml, strlen(xml), NULL, FALSE,
+			G_FILE_CREATE_NONE, NULL, NULL, &err));
+		g_assert_no_error(err);
+
+		g_assert_false(i7_skein_load(skein, file, &err));
+		g_assert_error(err, I7_SKEIN_ERROR, I7_SKEIN_ERROR_BAD_FORMAT);
+		g_test_message("%s", err->message);
+		g_clear_error(&err);
+		g_assert_true(i7_skein_get_root_node(skein) == old_root);
+	}
+
+	g_object_unref(skein);
+	remove_temp_skein_file(file, tmpdir);
+}
+
+static long
+get_peak_rss_kb(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss; /* kilobytes on Linux */
+}
+
+/* Benchmark; only runs in -m perf mode. Peak RSS is a high-water mark for the
+ whole process, so run this test on its own (-p /skein/load/perf) and compare
+ the numbers against another build. */
+void
+test_skein_load_perf(void)
+{
+	if(!g_test_perf()) {
+		g_test_skip("Benchmark; run with -m perf");
+		return;
+	}
+
+	GError *err = NULL;
+	char *tmpdir;
+	g_autoptr(GFile) file = create_temp_skein_file(&tmpdir);
+	const unsigned n_knots = 50000;
+	write_synthetic_skein(file, n_knots, 4);
+
+	I7Skein *skein = i7_skein_new();
+	long rss_before = get_peak_rss_kb();
+
+	g_test_timer_start();
+	g_assert_true(i7_skein_load(skein, file, &err));
+	double elapsed = g_test_timer_elapsed();
+	g_assert_no_error(err);
+
+	long rss_after = get_peak_rss_kb();
+	g_test_minimized_result(elapsed, "Loaded %u knots in %.3f s", n_knots, elapsed);
+	g_test_message("Peak RSS grew by %ld kB while loading (%ld kB total)", rss_after - rss_before, rss_after);
+
+	g_object_unref(skein);
+	remove_temp_skein_file(file, tmpdir);
+}
+
+static void
+play_thread(I7Skein *skein, const char * const *commands)
+{
+	i7_skein_reset(skein, TRUE);
+	for(; *commands; commands++)
+		i7_skein_new_command(skein, *commands);
+}
+
+static gboolean
+record_position(GNode *gnode, GArray *positions)
+{
+	double x, y;
+	g_object_get(gnode->data, "x", &x, "y", &y, NULL);
+	g_assert_cmpfloat(x, ==, i7_node_get_x(gnode->data));
+	g_array_append_val(positions, x);
+	g_array_append_val(positions, y);
+	return FALSE; /* Don't stop the traversal */
+}
+
+static GArray *
+get_positions(I7Skein *skein)
+{
+	GArray *positions = g_array_new(FALSE, FALSE, sizeof(double));
+	g_node_traverse(i7_skein_get_root_node(skein)->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+		(GNodeTraverseFunc)record_position, positions);
+	return positions;
+}
+
+static gboolean
+invalidate_size(GNode *gnode)
+{
+	i7_node_invalidate_size(gnode->data);
+	return FALSE; /* Don't stop the traversal */
+}
+
+typedef struct {
+	I7Skein *skein;
+	GooCanvas *canvas;
+	double hspacing;
+	double vspacing;
+} LayoutCheck;
+
+/* Check that the layout obeys the rules of the original, non-cached layout
+ algorithm: an only child is directly below its parent, and otherwise the
+ children's subtrees are laid out side by side, centered under the parent */
+static gboolean
+check_layout_rules(GNode *gnode, LayoutCheck *check)
+{
+	I7Node *node = gnode->data;
+	double x = i7_node_get_x(node);
+	double y;
+	g_object_get(node, "y", &y, NULL);
+	g_assert_cmpfloat(y, ==, (g_node_depth(gnode) - 1) * check->vspacing);
+
+	if(g_node_n_children(gnode) == 1) {
+		g_assert_cmpfloat(i7_node_get_x(gnode->children->data), ==, x);
+	} else if(gnode->children) {
+		GooCanvasItemModel *model = GOO_CANVAS_ITEM_MODEL(check->skein);
+		double total = i7_node_get_tree_width(node, model, check->canvas);
+		double child_x = 0.0;
+		GNode *child;
+		for(child = gnode->children; child; child = child->next) {
+			double treewidth = i7_node_get_tree_width(child->data, model, check->canvas);
+			g_assert_cmpfloat(fabs(i7_node_get_x(child->data) - (x - total * 0.5 + child_x + treewidth * 0.5)), <, 1e-9);
+			child_x += treewidth + check->hspacing;
+		}
+	}
+	return FALSE; /* Don't stop the traversal */
+}
+
+void
+test_skein_layout(void)
+{
+	static const char * const thread1[] = { "look", "x me", "inventory", NULL };
+	static const char * const thread2[] = { "look", "north", "take lamp", "south", NULL };
+	static const char * const thread3[] = { "look", "x me", "jump", NULL };
+	static const char * const thread4[] = { "examine the extremely long wallpaper", NULL };
+	static const char * const thread5[] = { "look", "north", "wait", "wait", "wait", NULL };
+
+	I7Skein *skein = i7_skein_new();
+	GooCanvas *canvas = GOO_CANVAS(goo_canvas_new());
+	g_object_ref_sink(canvas);
+	goo_canvas_set_root_item_model(canvas, GOO_CANVAS_ITEM_MODEL(skein));
+
+	play_thread(skein, thread1);
+	play_thread(skein, thread2);
+	play_thread(skein, thread3);
+	i7_skein_draw(skein, canvas);
+
+	/* Change the skein in several ways, redoing the layout incrementally */
+	play_thread(skein, thread4);
+	i7_skein_draw(skein, canvas);
+	play_thread(skein, thread5);
+	I7Node *root = i7_skein_get_root_node(skein);
+	I7Node *look = root->gnode->children->data;
+	i7_skein_add_new(skein, look);
+	i7_skein_draw(skein, canvas);
+	i7_skein_add_new_parent(skein, look->gnode->children->data);
+	i7_node_set_command(g_node_last_child(look->gnode)->data, "a much longer command than before");
+	i7_skein_draw(skein, canvas);
+	i7_skein_remove_single(skein, look->gnode->children->data);
+	i7_skein_remove_all(skein, g_node_last_child(root->gnode)->data);
+	i7_skein_draw(skein, canvas);
+	g_autoptr(GArray) incremental = get_positions(skein);
+
+	LayoutCheck check = { skein, canvas };
+	g_object_get(skein,
+		"horizontal-spacing", &check.hspacing,
+		"vertical-spacing", &check.vspacing,
+		NULL);
+	g_node_traverse(root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+		(GNodeTraverseFunc)check_layout_rules, &check);
+
+	/* Redo the whole layout from scratch and compare */
+	g_node_traverse(root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+		(GNodeTraverseFunc)invalidate_size, NULL);
+	i7_skein_draw(skein, canvas);
+	g_autoptr(GArray) full = get_positions(skein);
+
+	g_assert_cmpuint(incremental->len, ==, full->len);
+	g_assert_cmpmem(incremental->data, incremental->len * sizeof(double),
+		full->data, full->len * sizeof(double));
+
+	g_object_unref(canvas);
+	g_object_unref(skein);
+}
+
+/* Keeps a copy of the skein's list model up to date using only the
+ items-changed signal, like a GtkListBox bound to the model would */
+static void
+on_items_changed(GListModel *model, unsigned position, unsigned removed, unsigned added, GPtrArray *mirror)
+{
+	g_assert_cmpuint(position + removed, <=, mirror->len);
+	g_ptr_array_remove_range(mirror, position, removed);
+	unsigned ix;
+	for(ix = 0; ix < added; ix++) {
+		g_autoptr(I7Node) node = g_list_model_get_item(model, position + ix);
+		g_assert_nonnull(node);
+		g_ptr_array_insert(mirror, position + ix, node);
+	}
+}
+
+/* Checks that the list model and the copy of it both contain the current
+ thread, worked out from scratch */
+static void
+check_thread(I7Skein *skein, GPtrArray *mirror)
+{
+	I7Node *bottom = i7_skein_get_thread_bottom(skein, i7_skein_get_current_node(skein));
+	unsigned n_items = g_node_depth(bottom->gnode);
+
+	g_assert_cmpuint(g_list_model_get_n_items(G_LIST_MODEL(skein)), ==, n_items);
+	g_assert_cmpuint(mirror->len, ==, n_items);
+	g_assert_null(g_list_model_get_item(G_LIST_MODEL(skein), n_items));
+
+	GNode *gnode = bottom->gnode;
+	unsigned ix;
+	for(ix = n_items; ix > 0; ix--, gnode = gnode->parent) {
+		g_autoptr(I7Node) node = g_list_model_get_item(G_LIST_MODEL(skein), ix - 1);
+		g_assert_true(node == gnode->data);
+		g_assert_true(g_ptr_array_index(mirror, ix - 1) == gnode->data);
+		g_assert_true(i7_skein_is_node_in_current_thread(skein, node));
+	}
+}
+
+void
+test_skein_thread_model(void)
+{
+	static const char * const thread1[] = { "look", "x me", "inventory", NULL };
+	static const char * const thread2[] = { "look", "north", "take lamp", "south", NULL };
+	static const char * const thread3[] = { "look", "x me", "jump", NULL };
+
+	I7Skein *skein = i7_skein_new();
+	GPtrArray *mirror = g_ptr_array_new();
+	g_ptr_array_add(mirror, i7_skein_get_root_node(skein));
+	g_signal_connect(skein, "items-changed", G_CALLBACK(on_items_changed), mirror);
+	check_thread(skein, mirror);
+
+	play_thread(skein, thread1);
+	check_thread(skein, mirror);
+	play_thread(skein, thread2);
+	check_thread(skein, mirror);
+	play_thread(skein, thread3);
+	check_thread(skein, mirror);
+
+	I7Node *root = i7_skein_get_root_node(skein);
+	I7Node *look = root->gnode->children->data;
+	I7Node *x_me = look->gnode->children->data;
+	i7_skein_set_current_node(skein, look);
+	check_thread(skein, mirror);
+	i7_skein_set_current_node(skein, g_node_last_child(look->gnode)->data);
+	check_thread(skein, mirror);
+
+	/* Changes to the tree below the current node */
+	i7_skein_set_current_node(skein, root);
+	check_thread(skein, mirror);
+	i7_skein_add_new(skein, look);
+	check_thread(skein, mirror);
+	i7_skein_add_new_parent(skein, look);
+	check_thread(skein, mirror);
+	i7_skein_remove_single(skein, root->gnode->children->data);
+	check_thread(skein, mirror);
+
+	/* Changes to the tree above the current node */
+	i7_skein_set_current_node(skein, x_me->gnode->children->data);
+	check_thread(skein, mirror);
+	i7_skein_add_new_parent(skein, x_me);
+	check_thread(skein, mirror);
+	i7_skein_remove_single(skein, x_me);
+	check_thread(skein, mirror);
+	i7_skein_remove_all(skein, look);
+	check_thread(skein, mirror);
+
+	/* Replacing the whole tree */
+	play_thread(skein, thread1);
+	i7_skein_reset(skein, TRUE);
+	check_thread(skein, mirror);
+
+	g_ptr_array_free(mirror, TRUE);
+	g_object_unref(skein);
+}
+
+void
+test_skein_commands_to_node(void)
+{
+	static const char * const thread[] = { "look", "say \"back\\\\slash\"", "x me", NULL };
+
+	I7Skein *skein = i7_skein_new();
+	play_thread(skein, thread);
+	I7Node *root = i7_skein_get_root_node(skein);
+	I7Node *look = root->gnode->children->data;
+	I7Node *bottom = i7_skein_get_thread_bottom(skein, root);
+	g_autoptr(I7SkeinCommands) buffer = i7_skein_commands_new();
+
+	GSList *commands = i7_skein_get_commands_to_node(skein, root, bottom);
+	g_assert_true(i7_skein_fill_commands_to_node(skein, root, bottom, buffer));
+	g_assert_cmpuint(g_slist_length(commands), ==, 3);
+	g_assert_cmpuint(i7_skein_commands_get_n_commands(buffer), ==, 3);
+	GSList *iter;
+	unsigned ix;
+	for(iter = commands, ix = 0; iter; iter = g_slist_next(iter), ix++) {
+		g_assert_cmpstr(iter->data, ==, thread[ix]);
+		g_assert_cmpstr(i7_skein_commands_get_command(buffer, ix), ==, thread[ix]);
+	}
+	g_slist_free_full(commands, g_free);
+
+	/* Part of a thread, reusing the buffer */
+	commands = i7_skein_get_commands_to_node(skein, look, bottom);
+	g_assert_cmpuint(g_slist_length(commands), ==, 2);
+	g_assert_cmpstr(commands->data, ==, thread[1]);
+	g_slist_free_full(commands, g_free);
+	g_assert_true(i7_skein_fill_commands_to_node(skein, look, bottom, buffer));
+	g_assert_cmpuint(i7_skein_commands_get_n_commands(buffer), ==, 2);
+	g_assert_cmpstr(i7_skein_commands_get_command(buffer, 0), ==, thread[1]);
+	g_assert_cmpstr(i7_skein_commands_get_command(buffer, 1), ==, thread[2]);
+
+	/* No commands between a knot and itself */
+	g_assert_null(i7_skein_get_commands_to_node(skein, bottom, bottom));
+	g_assert_true(i7_skein_fill_commands_to_node(skein, bottom, bottom, buffer));
+	g_assert_cmpuint(i7_skein_commands_get_n_commands(buffer), ==, 0);
+
+	/* Not an ancestor */
+	g_assert_null(i7_skein_get_commands_to_node(skein, bottom, look));
+	g_assert_false(i7_skein_fill_commands_to_node(skein, bottom, look, buffer));
+	g_assert_cmpuint(i7_skein_commands_get_n_commands(buffer), ==, 0);
+
+	g_object_unref(skein);
+}
+
+/* Benchmark; only runs in -m perf mode */
+void
+test_skein_commands_to_node_perf(void)
+{
+	if(!g_test_perf()) {
+		g_test_skip("Benchmark; run with -m perf");
+		return;
+	}
+
+	GError *err = NULL;
+	char *tmpdir;
+	g_autoptr(GFile) file = create_temp_skein_file(&tmpdir);
+	const unsigned depth = 10000, n_runs = 100;
+	write_synthetic_skein(file, depth, 1);
+
+	I7Skein *skein = i7_skein_new();
+	g_assert_true(i7_skein_load(skein, file, &err));
+	g_assert_no_error(err);
+	I7Node *root = i7_skein_get_root_node(skein);
+	I7Node *bottom = i7_skein_get_thread_bottom(skein, root);
+	unsigned run;
+
+	g_test_timer_start();
+	for(run = 0; run < n_runs; run++) {
+		GSList *commands = i7_skein_get_commands_to_node(skein, root, bottom);
+		g_assert_cmpuint(g_slist_length(commands), ==, depth - 1);
+		g_slist_free_full(commands, g_free);
+	}
+	double elapsed = g_test_timer_elapsed();
+	g_test_message("List of %u commands: %.3f ms per call", depth - 1, 1000.0 * elapsed / n_runs);
+
+	g_autoptr(I7SkeinCommands) buffer = i7_skein_commands_new();
+	g_test_timer_start();
+	for(run = 0; run < n_runs; run++) {
+		i7_skein_fill_commands_to_node(skein, root, bottom, buffer);
+		g_assert_cmpuint(i7_skein_commands_get_n_commands(buffer), ==, depth - 1);
+	}
+	elapsed = g_test_timer_elapsed();
+	g_test_minimized_result(elapsed / n_runs, "Buffer of %u commands: %.3f ms per call",
+		depth - 1, 1000.0 * elapsed / n_runs);
+
+	g_object_unref(skein);
+	remove_temp_skein_file(file, tmpdir);
+}
+
+/* Checks that i7_node_find_child() agrees with looking through the children
+ one by one */
+static void
+check_find_child(I7Node *node, const char *command)
+{
+	I7Node *expected = NULL;
+	GNode *gnode;
+	for(gnode = node->gnode->children; gnode; gnode = gnode->next) {
+		if(strcmp(i7_node_peek_command(gnode->data), command) == 0) {
+			expected = gnode->data;
+			break;
+		}
+	}
+	g_assert_true(i7_node_find_child(node, command) == expected);
+}
+
+void
+test_skein_find_child(void)
+{
+	static const char * const commands[] = { "look", "x me", "", "inventory", "north", "wait", NULL };
+	const char * const *ptr;
+
+	I7Skein *skein = i7_skein_new();
+	I7Node *root = i7_skein_get_root_node(skein);
+
+	/* Enough children to make the knot use an index */
+	unsigned ix;
+	for(ix = 0; ix < 20; ix++) {
+		g_autofree char *command = g_strdup_printf("command %u", ix);
+		i7_skein_reset(skein, TRUE);
+		i7_skein_new_command(skein, command);
+	}
+	i7_skein_reset(skein, TRUE);
+	I7Node *look = i7_skein_new_command(skein, "look");
+	g_assert_true(i7_node_find_child(root, "look") == look);
+	check_find_child(root, "command 3");
+
+	/* Duplicate commands: the first one is found */
+	I7Node *blank1 = i7_skein_add_new(skein, root);
+	I7Node *blank2 = i7_skein_add_new(skein, root);
+	g_assert_true(i7_node_find_child(root, "") == blank1);
+	g_assert_true(i7_node_find_child(root, NULL) == blank1);
+	i7_node_set_command(blank2, "look");
+	g_assert_true(i7_node_find_child(root, "look") == look);
+	i7_node_set_command(look, "x me");
+	g_assert_true(i7_node_find_child(root, "look") == blank2);
+	g_assert_true(i7_node_find_child(root, "x me") == look);
+	i7_skein_remove_single(skein, blank1);
+	for(ptr = commands; *ptr; ptr++)
+		check_find_child(root, *ptr);
+
+	/* Inserting a knot in between, and removing it again */
+	I7Node *parent = i7_skein_add_new_parent(skein, look);
+	for(ptr = commands; *ptr; ptr++)
+		check_find_child(root, *ptr);
+	i7_skein_remove_single(skein, parent);
+	for(ptr = commands; *ptr; ptr++)
+		check_find_child(root, *ptr);
+
+	i7_skein_remove_all(skein, blank2);
+	for(ptr = commands; *ptr; ptr++)
+		check_find_child(root, *ptr);
+	g_assert_null(i7_node_find_child(root, "nonexistent"));
+
+	g_object_unref(skein);
+}
+
+void
+test_skein_string_pool(void)
+{
+	g_autoptr(I7StringPool) pool = i7_string_pool_new();
+	I7StringPoolStats stats;
+
+	const char *look1 = i7_string_pool_intern(pool, "look");
+	const char *look2 = i7_string_pool_intern_take(pool, g_strdup("look"));
+	const char *wait = i7_string_pool_intern(pool, "wait");
+	g_assert_true(look1 == look2);
+	g_assert_cmpstr(look1, ==, "look");
+	g_assert_cmpstr(i7_string_pool_intern(pool, NULL), ==, "");
+	g_assert_cmpstr(i7_string_pool_intern(pool, ""), ==, "");
+
+	i7_string_pool_get_stats(pool, &stats);
+	g_assert_cmpuint(stats.n_strings, ==, 2);
+	g_assert_cmpuint(stats.n_references, ==, 3);
+	g_assert_cmpuint(stats.stored_bytes, ==, 10);
+	g_assert_cmpuint(stats.referenced_bytes, ==, 15);
+	g_assert_cmpfloat(i7_string_pool_get_dedup_ratio(pool), ==, 1.5);
+
+	i7_string_pool_release(pool, look1);
+	i7_string_pool_release(pool, wait);
+	i7_string_pool_release(pool, "");
+	i7_string_pool_get_stats(pool, &stats);
+	g_assert_cmpuint(stats.n_strings, ==, 1);
+	g_assert_cmpuint(stats.n_references, ==, 1);
+	i7_string_pool_release(pool, look2);
+	i7_string_pool_get_stats(pool, &stats);
+	g_assert_cmpuint(stats.n_strings, ==, 0);
+	g_assert_cmpuint(stats.stored_bytes, ==, 0);
+
+	/* Knots share their text through the skein's pool */
+	GError *err = NULL;
+	char *tmpdir;
+	g_autoptr(GFile) file = create_temp_skein_file(&tmpdir);
+	write_synthetic_skein(file, 1000, 4);
+	I7Skein *skein = i7_skein_new();
+	g_assert_true(i7_skein_load(skein, file, &err));
+	g_assert_no_error(err);
+
+	I7Node *root = i7_skein_get_root_node(skein);
+	I7Node *first = root->gnode->children->data; /* knot 1 */
+	I7Node *same = g_node_nth_child(root->gnode->children->next, 2)->data; /* knot 11 */
+	g_assert_cmpstr(i7_node_peek_command(first), ==, i7_node_peek_command(same));
+	g_assert_true(i7_node_peek_command(first) == i7_node_peek_command(same));
+
+	g_autoptr(I7StringPool) skein_pool = i7_string_pool_ref(i7_skein_get_string_pool(skein));
+	g_assert_cmpfloat(i7_string_pool_get_dedup_ratio(skein_pool), >, 1.0);
+	g_test_message("Deduplication ratio: %.2f", i7_string_pool_get_dedup_ratio(skein_pool));
+
+	/* Changing text gives back the old string */
+	i7_string_pool_get_stats(skein_pool, &stats);
+	unsigned n_references = stats.n_references;
+	i7_node_set_label(first, "a new label");
+	i7_node_set_label(first, "");
+	i7_string_pool_get_stats(skein_pool, &stats);
+	g_assert_cmpuint(stats.n_references, ==, n_references);
+
+	/* All the text is given back when the knots are gone */
+	g_object_unref(skein);
+	i7_string_pool_get_stats(skein_pool, &stats);
+	g_assert_cmpuint(stats.n_references, ==, 0);
+	remove_temp_skein_file(file, tmpdir);
+}
+
+void
+test_skein_match_type(void)
+{
+	static const struct {
+		const char *transcript;
+		const char *expected;
+		I7NodeMatchType match;
+	} cases[] = {
+		{ "You see a lamp.", "", I7_NODE_CANT_COMPARE },
+		{ "You see a lamp.", "You see a lamp.", I7_NODE_EXACT_MATCH },
+		{ "You see a lamp.\n", "You  see a\tlamp.", I7_NODE_NEAR_MATCH },
+		{ "\n\nYou see a lamp.", "You see a lamp.  ", I7_NODE_NEAR_MATCH },
+		{ "You see a lamp.", "You see a lamp", I7_NODE_NO_MATCH },
+		{ "You see a lamp.", "You see a lamp. It is lit.", I7_NODE_NO_MATCH },
+		{ "You see", "You seem", I7_NODE_NO_MATCH },
+		{ "", "You see a lamp.", I7_NODE_NO_MATCH },
+	};
+	I7Skein *skein = i7_skein_new();
+	unsigned ix;
+
+	for(ix = 0; ix < G_N_ELEMENTS(cases); ix++) {
+		I7Node *node = i7_node_new("look", "", cases[ix].transcript, cases[ix].expected,
+			FALSE, FALSE, FALSE, 0, GOO_CANVAS_ITEM_MODEL(skein));
+		g_assert_cmpint(i7_node_get_match_type(node), ==, cases[ix].match);
+		g_assert_true(i7_node_get_different(node) ==
+			(cases[ix].match == I7_NODE_NEAR_MATCH || cases[ix].match == I7_NODE_NO_MATCH));
+
+		/* Only real differences are marked up */
+		gboolean marked = strstr(i7_node_get_transcript_pango_string(node), "<u>") ||
+			strstr(i7_node_get_expected_pango_string(node), "<u>");
+		g_assert_true(marked == (cases[ix].match == I7_NODE_NO_MATCH));
+		goo_canvas_item_model_remove(GOO_CANVAS_ITEM_MODEL(node));
+	}
+
+	/* The match is updated, and the markup recalculated, when the text changes */
+	I7Node *node = i7_node_new("look", "", "You see a lamp.", "You see a lamp.",
+		FALSE, FALSE, FALSE, 0, GOO_CANVAS_ITEM_MODEL(skein));
+	g_assert_cmpstr(i7_node_get_transcript_pango_string(node), ==, "You see a lamp.");
+	i7_node_set_transcript_text(node, "You see a lamp & a key.");
+	g_assert_cmpint(i7_node_get_match_type(node), ==, I7_NODE_NO_MATCH);
+	g_assert_nonnull(strstr(i7_node_get_transcript_pango_string(node), "<u>&amp;</u>"));
+
+	g_object_unref(skein);
+}
+
+static gboolean
+collect_unmatched(GNode *gnode, GPtrArray *nodes)
+{
+	I7Node *node = gnode->data;
+	if(i7_node_get_match_type(node) == I7_NODE_NO_MATCH)
+		g_ptr_array_add(nodes, node);
+	return FALSE; /* Don't stop the traversal */
+}
+
+static void
+on_diffs_calculated(I7Node *node, GParamSpec *pspec, unsigned *n_notified)
+{
+	g_assert_true(i7_node_get_diffs_calculated(node));
+	(*n_notified)++;
+}
+
+static void
+check_diffs(I7Node *node)
+{
+	const char *expected = i7_node_peek_expected_text(node);
+	const char *transcript = i7_node_peek_transcript_text(node);
+	GArray *expected_diffs, *transcript_diffs;
+	word_diff(expected, transcript, &expected_diffs, &transcript_diffs);
+	g_autofree char *expected_pango = make_pango_markup_string(expected, expected_diffs);
+	g_autofree char *transcript_pango = make_pango_markup_string(transcript, transcript_diffs);
+
+	g_assert_cmpstr(i7_node_get_expected_pango_string(node), ==, expected_pango);
+	g_assert_cmpstr(i7_node_get_transcript_pango_string(node), ==, transcript_pango);
+
+	g_clear_pointer(&expected_diffs, g_array_unref);
+	g_clear_pointer(&transcript_diffs, g_array_unref);
+}
+
+void
+test_skein_background_diffs(void)
+{
+	GError *err = NULL;
+	char *tmpdir;
+	g_autoptr(GFile) file = create_temp_skein_file(&tmpdir);
+	write_synthetic_skein(file, 300, 3);
+
+	I7Skein *skein = i7_skein_new();
+	g_assert_true(i7_skein_load(skein, file, &err));
+	g_assert_no_error(err);
+
+	/* Every third knot's commentary differs from its transcript */
+	I7Node *root = i7_skein_get_root_node(skein);
+	g_autoptr(GPtrArray) unmatched = g_ptr_array_new();
+	g_node_traverse(root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)collect_unmatched, unmatched);
+	g_assert_cmpuint(unmatched->len, ==, 100);
+
+	unsigned ix, n_notified = 0;
+	for(ix = 0; ix < unmatched->len; ix++) {
+		I7Node *node = g_ptr_array_index(unmatched, ix);
+		g_assert_false(i7_node_get_diffs_calculated(node));
+		g_signal_connect(node, "notify::diffs-calculated", G_CALLBACK(on_diffs_calculated), &n_notified);
+	}
+
+	i7_skein_queue_all_diffs(skein);
+	/* Queueing again doesn't do the work twice */
+	i7_skein_queue_all_diffs(skein);
+	while(n_notified < unmatched->len)
+		g_main_context_iteration(NULL, TRUE);
+	g_assert_cmpuint(n_notified, ==, unmatched->len);
+
+	for(ix = 0; ix < unmatched->len; ix++)
+		check_diffs(g_ptr_array_index(unmatched, ix));
+
+	/* Results for text that changed in the meantime are thrown away */
+	I7Node *node = g_ptr_array_index(unmatched, 0);
+	i7_node_set_transcript_text(node, "You look around. Something happens.");
+	g_assert_false(i7_node_get_diffs_calculated(node));
+	i7_skein_queue_diffs(skein, node);
+	i7_node_set_transcript_text(node, "You look around. Something else happens.");
+	i7_skein_queue_diffs(skein, node);
+	n_notified = 0;
+	while(n_notified == 0)
+		g_main_context_iteration(NULL, TRUE);
+	check_diffs(node);
+	g_assert_nonnull(strstr(i7_node_get_transcript_pango_string(node), "<u>else</u>"));
+
+	/* Destroying the skein with work still underway is fine */
+	for(ix = 0; ix < unmatched->len; ix++)
+		g_object_set(g_ptr_array_index(unmatched, ix), "expected-text", "Nothing at all.", NULL);
+	i7_skein_queue_all_diffs(skein);
+	for(ix = 0; ix < unmatched->len; ix++)
+		g_signal_handlers_disconnect_by_func(g_ptr_array_index(unmatched, ix), on_diffs_calculated, &n_notified);
+	g_object_unref(skein);
+	while(g_main_context_iteration(NULL, FALSE));
+
+	remove_temp_skein_file(file, tmpdir);
+}
+
+static void
+on_save_finish(I7Skein *skein, GAsyncResult *res, gboolean *done)
+{
+	GError *err = NULL;
+	g_assert_true(i7_skein_save_finish(skein, res, &err));
+	g_assert_no_error(err);
+	*done = TRUE;
+}
+
+static void
+save_skein(I7Skein *skein, GFile *file)
+{
+	gboolean done = FALSE;
+	i7_skein_save_async(skein, file, G_PRIORITY_DEFAULT, NULL, (GAsyncReadyCallback)on_save_finish, &done);
+	while(!done)
+		g_main_context_iteration(NULL, TRUE);
+}
+
+static gboolean
+collect_knot(GNode *gnode, GPtrArray *knots)
+{
+	g_ptr_array_add(knots, gnode->data);
+	return FALSE; /* Don't stop the traversal */
+}
+
+static GPtrArray *
+get_knots(I7Skein *skein)
+{
+	GPtrArray *knots = g_ptr_array_new();
+	g_node_traverse(i7_skein_get_root_node(skein)->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+		(GNodeTraverseFunc)collect_knot, knots);
+	return knots;
+}
+
+void
+test_skein_save(void)
+{
+	GError *err = NULL;
+	char *tmpdir;
+	g_autoptr(GFile) file = create_temp_skein_file(&tmpdir);
+	g_autoptr(GFile) saved_file = g_file_new_build_filename(tmpdir, "Saved.skein", NULL);
+	g_autoptr(GFile) resaved_file = g_file_new_build_filename(tmpdir, "Resaved.skein", NULL);
+	write_synthetic_skein(file, 200, 3);
+
+	I7Skein *skein = i7_skein_new();
+	g_assert_true(i7_skein_load(skein, file, &err));
+	g_assert_no_error(err);
+	g_autoptr(GPtrArray) knots = get_knots(skein);
+	i7_node_set_label(g_ptr_array_index(knots, 5), "Quotes \"'\", <angle> & brackets");
+	i7_node_set_transcript_text(g_ptr_array_index(knots, 6), "Tab\tand newline\n");
+	g_assert_true(i7_skein_get_modified(skein));
+
+	save_skein(skein, saved_file);
+	g_assert_false(i7_skein_get_modified(skein));
+
+	/* Everything comes back when loading the saved file */
+	I7Skein *loaded = i7_skein_new();
+	g_assert_true(i7_skein_load(loaded, saved_file, &err));
+	g_assert_no_error(err);
+	g_autoptr(GPtrArray) loaded_knots = get_knots(loaded);
+	g_assert_cmpuint(loaded_knots->len, ==, knots->len);
+	unsigned ix;
+	for(ix = 0; ix < knots->len; ix++) {
+		I7Node *knot = g_ptr_array_index(knots, ix);
+		I7Node *loaded_knot = g_ptr_array_index(loaded_knots, ix);
+		g_assert_cmpstr(i7_node_peek_command(loaded_knot), ==, i7_node_peek_command(knot));
+		g_assert_cmpstr(i7_node_peek_label(loaded_knot), ==, i7_node_peek_label(knot));
+		g_assert_cmpstr(i7_node_peek_transcript_text(loaded_knot), ==, i7_node_peek_transcript_text(knot));
+		g_assert_cmpstr(i7_node_peek_expected_text(loaded_knot), ==, i7_node_peek_expected_text(knot));
+		g_assert_cmpint(i7_node_get_locked(loaded_knot), ==, i7_node_get_locked(knot));
+		g_assert_cmpint(i7_node_get_score(loaded_knot), ==, i7_node_get_score(knot));
+		g_assert_cmpuint(g_node_n_children(loaded_knot->gnode), ==, g_node_n_children(knot->gnode));
+	}
+
+	/* Saving is stable; the knot IDs are made up anew on loading, so save the
+	 same skein twice */
+	save_skein(skein, resaved_file);
+	g_autofree char *saved = NULL, *resaved = NULL;
+	gsize saved_len, resaved_len;
+	g_assert_true(g_file_load_contents(saved_file, NULL, &saved, &saved_len, NULL, &err));
+	g_assert_no_error(err);
+	g_assert_true(g_file_load_contents(resaved_file, NULL, &resaved, &resaved_len, NULL, &err));
+	g_assert_no_error(err);
+	g_assert_cmpmem(saved, saved_len, resaved, resaved_len);
+
+	g_object_unref(loaded);
+	g_object_unref(skein);
+	g_assert_no_errno(g_unlink(g_file_peek_path(saved_file)));
+	g_assert_no_errno(g_unlink(g_file_peek_path(resaved_file)));
+	remove_temp_skein_file(file, tmpdir);
+}
+
+/* Benchmark; only runs in -m perf mode */
+void
+test_skein_save_perf(void)
+{
+	if(!g_test_perf()) {
+		g_test_skip("Benchmark; run with -m perf");
+		return;
+	}
+
+	GError *err = NULL;
+	char *tmpdir;
+	g_autoptr(GFile) file = create_temp_skein_file(&tmpdir);
+	const unsigned n_knots = 50000;
+	write_synthetic_skein(file, n_knots, 4);
+
+	I7Skein *skein = i7_skein_new();
+	g_assert_true(i7_skein_load(skein, file, &err));
+	g_assert_no_error(err);
+
+	/* The main loop is only blocked while the snapshot is taken */
+	gboolean done = FALSE;
+	g_test_timer_start();
+	i7_skein_save_async(skein, file, G_PRIORITY_DEFAULT, NULL, (GAsyncReadyCallback)on_save_finish, &done);
+	double blocked = g_test_timer_elapsed();
+	while(!done)
+		g_main_context_iteration(NULL, TRUE);
+	double elapsed = g_test_timer_elapsed();
+
+	g_test_minimized_result(elapsed, "Saved %u knots in %.3f s", n_knots, elapsed);
+	g_test_minimized_result(blocked, "Main loop blocked for %.3f s while taking a snapshot", blocked);
+
+	g_object_unref(skein);
+	remove_temp_skein_file(file, tmpdir);
+}
+
+/* i7_skein_update_cache() doesn't report when it's done, but the cache file is
+ replaced atomically, so it's done when the file is there */
+static void
+update_cache(I7Skein *skein, GFile *file, GFile *cache_file)
+{
+	i7_skein_update_cache(skein, file);
+	while(!g_file_query_exists(cache_file, NULL)) {
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(1000);
+	}
+	while(g_main_context_iteration(NULL, FALSE));
+}
+
+void
+test_skein_cache(void)
+{
+	GError *err = NULL;
+	char *tmpdir;
+	g_autoptr(GFile) file = create_temp_skein_file(&tmpdir);
+	g_autoptr(GFile) cache_file = g_file_new_build_filename(tmpdir, "Skein.skein.cache", NULL);
+	write_synthetic_skein(file, 200, 3);
+
+	I7Skein *skein = i7_skein_new();
+	g_assert_false(i7_skein_load_cache(skein, file, &err));
+	g_assert_nonnull(err);
+	g_clear_error(&err);
+	g_assert_true(i7_skein_load(skein, file, &err));
+	g_assert_no_error(err);
+	update_cache(skein, file, cache_file);
+
+	/* Everything comes back when loading from the cache */
+	I7Skein *cached = i7_skein_new();
+	g_assert_true(i7_skein_load_cache(cached, file, &err));
+	g_assert_no_error(err);
+	g_assert_false(i7_skein_get_modified(cached));
+	g_autoptr(GPtrArray) knots = get_knots(skein);
+	g_autoptr(GPtrArray) cached_knots = get_knots(cached);
+	g_assert_cmpuint(cached_knots->len, ==, knots->len);
+	unsigned ix;
+	for(ix = 0; ix < knots->len; ix++) {
+		I7Node *knot = g_ptr_array_index(knots, ix);
+		I7Node *cached_knot = g_ptr_array_index(cached_knots, ix);
+		g_assert_cmpstr(i7_node_peek_command(cached_knot), ==, i7_node_peek_command(knot));
+		g_assert_cmpstr(i7_node_peek_label(cached_knot), ==, i7_node_peek_label(knot));
+		g_assert_cmpstr(i7_node_peek_transcript_text(cached_knot), ==, i7_node_peek_transcript_text(knot));
+		g_assert_cmpstr(i7_node_peek_expected_text(cached_knot), ==, i7_node_peek_expected_text(knot));
+		g_assert_cmpint(i7_node_get_locked(cached_knot), ==, i7_node_get_locked(knot));
+		g_assert_cmpint(i7_node_get_changed(cached_knot), ==, i7_node_get_changed(knot));
+		g_assert_cmpint(i7_node_get_score(cached_knot), ==, i7_node_get_score(knot));
+		g_assert_cmpuint(g_node_n_children(cached_knot->gnode), ==, g_node_n_children(knot->gnode));
+	}
+	g_object_unref(cached);
+
+	/* Nothing is written while there are unsaved changes */
+	g_assert_no_errno(g_unlink(g_file_peek_path(cache_file)));
+	i7_node_set_label(g_ptr_array_index(knots, 5), "Changed");
+	i7_skein_update_cache(skein, file);
+	while(g_main_context_iteration(NULL, FALSE));
+	g_assert_false(g_file_query_exists(cache_file, NULL));
+
+	/* The cache isn't used once the XML file has changed */
+	save_skein(skein, file);
+	update_cache(skein, file, cache_file);
+	write_synthetic_skein(file, 201, 3);
+	cached = i7_skein_new();
+	g_assert_false(i7_skein_load_cache(cached, file, &err));
+	g_assert_error(err, I7_SKEIN_ERROR, I7_SKEIN_ERROR_CACHE);
+	g_clear_error(&err);
+
+	/* Nor is a damaged cache */
+	g_autofree char *contents = NULL;
+	gsize length;
+	g_assert_no_errno(g_unlink(g_file_peek_path(cache_file)));
+	save_skein(skein, file);
+	update_cache(skein, file, cache_file);
+	g_assert_true(g_file_load_contents(cache_file, NULL, &contents, &length, NULL, &err));
+	g_assert_no_error(err);
+	g_assert_true(g_file_replace_contents(cache_file, contents, length - 1, NULL, FALSE,
+		G_FILE_CREATE_NONE, NULL, NULL, &err));
+	g_assert_no_error(err);
+	g_assert_false(i7_skein_load_cache(cached, file, &err));
+	g_assert_error(err, I7_SKEIN_ERROR, I7_SKEIN_ERROR_CACHE);
+	g_clear_error(&err);
+	g_object_unref(cached);
+
+	g_object_unref(skein);
+	g_assert_no_errno(g_unlink(g_file_peek_path(cache_file)));
+	remove_temp_skein_file(file, tmpdir);
+}
+
+/* Benchmark; only runs in -m perf mode */
+void
+test_skein_cache_perf(void)
+{
+	if(!g_test_perf()) {
+		g_test_skip("Benchmark; run with -m perf");
+		return;
+	}
+
+	GError *err = NULL;
+	char *tmpdir;
+	g_autoptr(GFile) file = create_temp_skein_file(&tmpdir);
+	g_autoptr(GFile) cache_file = g_file_new_build_filename(tmpdir, "Skein.skein.cache", NULL);
+	const unsigned n_knots = 50000;
+	write_synthetic_skein(file, n_knots, 4);
+
+	I7Skein *skein = i7_skein_new();
+	g_test_timer_start();
+	g_assert_true(i7_skein_load(skein, file, &err));
+	g_assert_no_error(err);
+	double xml_elapsed = g_test_timer_elapsed();
+	update_cache(skein, file, cache_file);
+
+	I7Skein *cached = i7_skein_new();
+	g_test_timer_start();
+	g_assert_true(i7_skein_load_cache(cached, file, &err));
+	g_assert_no_error(err);
+	double cache_elapsed = g_test_timer_elapsed();
+
+	g_test_minimized_result(cache_elapsed, "Loaded %u knots from the cache in %.3f s", n_knots, cache_elapsed);
+	g_test_message("Loading the XML took %.3f s", xml_elapsed);
+
+	g_object_unref(cached);
+	g_object_unref(skein);
+	g_assert_no_errno(g_unlink(g_file_peek_path(cache_file)));
+	remove_temp_skein_file(file, tmpdir);
+}
+
+void
+test_skein_replay_plan(void)
+{
+	static const char * const thread_a[] = { "look", "north", "take lamp", NULL };
+	static const char * const thread_b[] = { "look", "north", "wait", NULL };
+	static const char * const thread_c[] = { "look", "south", NULL };
+	static const char * const thread_d[] = { "inventory", NULL };
+	static const char * const unplayed[] = { "look", "x me", NULL };
+
+	I7Skein *skein = i7_skein_new();
+	I7Node *root = i7_skein_get_root_node(skein);
+	GSList *thread_ends = NULL;
+	play_thread(skein, thread_a);
+	thread_ends = g_slist_prepend(thread_ends, i7_skein_get_played_node(skein));
+	play_thread(skein, thread_b);
+	thread_ends = g_slist_prepend(thread_ends, i7_skein_get_played_node(skein));
+	play_thread(skein, thread_c);
+	thread_ends = g_slist_prepend(thread_ends, i7_skein_get_played_node(skein));
+	play_thread(skein, thread_d);
+	thread_ends = g_slist_prepend(thread_ends, i7_skein_get_played_node(skein));
+	play_thread(skein, unplayed);
+	I7Node *x_me = i7_skein_get_played_node(skein);
+	thread_ends = g_slist_reverse(thread_ends);
+
+	/* Each knot is played once, instead of once for each thread it is in */
+	g_autoptr(I7SkeinReplayPlan) plan = i7_skein_plan_replay(skein, thread_ends);
+	g_assert_cmpuint(plan->n_commands, ==, 6);
+	g_assert_cmpuint(plan->n_slots, ==, 3);
+
+	/* Follow the plan, keeping track of where the story would be */
+	g_autoptr(GHashTable) visited = g_hash_table_new(NULL, NULL);
+	I7Node **slots = g_new0(I7Node *, plan->n_slots);
+	I7Node *position = root;
+	unsigned ix;
+	for(ix = 0; ix < plan->steps->len; ix++) {
+		I7SkeinReplayStep *step = &g_array_index(plan->steps, I7SkeinReplayStep, ix);
+		switch(step->action) {
+			case I7_SKEIN_REPLAY_COMMAND:
+				g_assert_true(step->node->gnode->parent == position->gnode);
+				g_assert_true(g_hash_table_add(visited, step->node));
+				position = step->node;
+				break;
+			case I7_SKEIN_REPLAY_SAVE:
+				g_assert_cmpuint(step->slot, <, plan->n_slots);
+				g_assert_true(step->node == position);
+				slots[step->slot] = position;
+				break;
+			case I7_SKEIN_REPLAY_RESTORE:
+				g_assert_cmpuint(step->slot, <, plan->n_slots);
+				g_assert_true(slots[step->slot] == step->node);
+				position = step->node;
+				break;
+		}
+	}
+	g_free(slots);
+
+	GSList *iter;
+	for(iter = thread_ends; iter; iter = g_slist_next(iter))
+		g_assert_true(g_hash_table_contains(visited, iter->data));
+	g_assert_false(g_hash_table_contains(visited, x_me));
+
+	/* A single thread needs no saved states */
+	GSList single = { x_me, NULL };
+	g_autoptr(I7SkeinReplayPlan) single_plan = i7_skein_plan_replay(skein, &single);
+	g_assert_cmpuint(single_plan->n_commands, ==, 2);
+	g_assert_cmpuint(single_plan->n_slots, ==, 0);
+	g_assert_cmpuint(single_plan->steps->len, ==, 2);
+
+	g_slist_free(thread_ends);
+	g_object_unref(skein);
+}
+
+void
+test_skein_replay_lines(void)
+{
+	static const char * const thread_a[] = { "look", "north", NULL };
+	static const char * const thread_b[] = { "look", "south", NULL };
+
+	I7Skein *skein = i7_skein_new();
+	GSList *thread_ends = NULL;
+	play_thread(skein, thread_a);
+	I7Node *north = i7_skein_get_played_node(skein);
+	thread_ends = g_slist_append(thread_ends, north);
+	play_thread(skein, thread_b);
+	I7Node *south = i7_skein_get_played_node(skein);
+	thread_ends = g_slist_append(thread_ends, south);
+
+	g_autoptr(I7SkeinReplayPlan) plan = i7_skein_plan_replay(skein, thread_ends);
+	GArray *lines = i7_replay_lines_new(plan, "saves");
+	g_autofree char *save_file = g_build_filename("saves", "state-0", NULL);
+	const char *expected[] = { "look", "save", save_file, "north", "restore", save_file, "south" };
+	g_assert_cmpuint(lines->len, ==, G_N_ELEMENTS(expected));
+	unsigned ix;
+	for(ix = 0; ix < lines->len; ix++)
+		g_assert_cmpstr(g_array_index(lines, I7ReplayLine, ix).text, ==, expected[ix]);
+
+	/* The interpreter doesn't report the names of the saved games as
+	 commands */
+	unsigned next_line = 0;
+	I7ReplayLine *line = i7_replay_lines_match(lines, &next_line, "look");
+	g_assert_true(line->node == north->gnode->parent->data);
+	line = i7_replay_lines_match(lines, &next_line, "save");
+	g_assert_null(line->node);
+	line = i7_replay_lines_match(lines, &next_line, "north");
+	g_assert_true(line->node == north);
+	line = i7_replay_lines_match(lines, &next_line, "restore");
+	g_assert_null(line->node);
+	/* A command that isn't the next one in the plan doesn't match any knot */
+	g_assert_null(i7_replay_lines_match(lines, &next_line, "west"));
+	line = i7_replay_lines_match(lines, &next_line, "south");
+	g_assert_true(line->node == south);
+	g_assert_null(i7_replay_lines_match(lines, &next_line, "wait"));
+
+	g_array_free(lines, TRUE);
+	g_slist_free(thread_ends);
+	g_object_unref(skein);
+}
+
+static gboolean
+check_played(GNode *gnode, I7Node *played)
+{
+	gboolean in_thread = g_node_is_ancestor(gnode, played->gnode) || gnode == played->gnode;
+	g_assert_cmpint(i7_node_get_played(gnode->data), ==, in_thread);
+	return FALSE; /* Don't stop the traversal */
+}
+
+void
+test_skein_played_node(void)
+{
+	static const char * const thread_a[] = { "look", "north", "take lamp", "south", "light lamp", NULL };
+	static const char * const thread_b[] = { "look", "north", "wait", "z", "z", NULL };
+
+	I7Skein *skein = i7_skein_new();
+	I7Node *root = i7_skein_get_root_node(skein);
+	g_node_traverse(root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)check_played, root);
+
+	/* Lots of other threads, which must not be touched */
+	unsigned ix;
+	for(ix = 0; ix < 500; ix++) {
+		g_autofree char *command = g_strdup_printf("command %u", ix);
+		i7_skein_reset(skein, TRUE);
+		i7_skein_new_command(skein, command);
+		i7_skein_new_command(skein, "wait");
+	}
+
+	play_thread(skein, thread_a);
+	I7Node *end_a = i7_skein_get_played_node(skein);
+	play_thread(skein, thread_b);
+	I7Node *end_b = i7_skein_get_played_node(skein);
+	g_node_traverse(root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)check_played, end_b);
+
+	/* Only the knots after the branch change */
+	i7_skein_rewind_to_node(skein, end_a);
+	g_assert_cmpuint(i7_skein_get_played_nodes_touched(skein), ==, 6);
+	g_node_traverse(root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)check_played, end_a);
+
+	/* Going back up the same thread */
+	I7Node *look = i7_node_find_child(root, "look");
+	i7_skein_rewind_to_node(skein, look);
+	g_assert_cmpuint(i7_skein_get_played_nodes_touched(skein), ==, 4);
+	g_node_traverse(root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)check_played, look);
+
+	/* And down again */
+	i7_skein_rewind_to_node(skein, end_b);
+	g_assert_cmpuint(i7_skein_get_played_nodes_touched(skein), ==, 4);
+	g_node_traverse(root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)check_played, end_b);
+
+	/* Inserting a knot in the played thread keeps it played */
+	i7_skein_add_new_parent(skein, end_b);
+	g_node_traverse(root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)check_played, end_b);
+	i7_skein_reset(skein, TRUE);
+	g_assert_cmpuint(i7_skein_get_played_nodes_touched(skein), ==, 6);
+	g_node_traverse(root->gnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)check_played, root);
+
+	g_object_unref(skein);
+}
+
+static void
+count_emissions(I7Skein *skein, unsigned *count)
+{
+	(*count)++;
+}
+
+static void
+count_notifications(I7Skein *skein, GParamSpec *pspec, unsigned *count)
+{
+	(*count)++;
+}
+
+void
+test_skein_trim(void)
+{
+	I7Skein *skein = i7_skein_new();
+	I7Node *root = i7_skein_get_root_node(skein);
+
+	/* Root has score 0; give the knots scores 1 to 4, several of each */
+	unsigned ix;
+	for(ix = 0; ix < 40; ix++) {
+		g_autofree char *command = g_strdup_printf("command %u", ix);
+		i7_skein_reset(skein, TRUE);
+		I7Node *node = i7_skein_new_command(skein, command);
+		i7_node_set_score(node, ix % 4 + 1);
+		I7Node *child = i7_skein_new_command(skein, "wait");
+		i7_node_set_score(child, ix % 4 + 1);
+	}
+
+	/* A locked knot with a low score survives */
+	I7Node *locked = i7_node_find_child(root, "command 4");
+	g_assert_cmpint(i7_node_get_score(locked), ==, 1);
+	i7_skein_lock(skein, i7_node_find_child(locked, "wait"));
+
+	/* Played thread with a low score, which gets reset */
+	I7Node *played = i7_node_find_child(root, "command 0");
+	i7_skein_rewind_to_node(skein, i7_node_find_child(played, "wait"));
+	i7_skein_set_current_node(skein, played);
+
+	unsigned n_layouts = 0, n_modified = 0;
+	g_signal_connect(skein, "needs-layout", G_CALLBACK(count_emissions), &n_layouts);
+	g_signal_connect(skein, "modified", G_CALLBACK(count_emissions), &n_modified);
+	unsigned n_played_notify = 0, n_current_notify = 0;
+	g_signal_connect(skein, "notify::played-node", G_CALLBACK(count_notifications), &n_played_notify);
+	g_signal_connect(skein, "notify::current-node", G_CALLBACK(count_notifications), &n_current_notify);
+
+	/* Keep the two highest scores, 4 and 3 */
+	g_assert_cmpuint(i7_skein_trim(skein, root, 2), ==, 38);
+	g_assert_cmpuint(n_layouts, ==, 1);
+	g_assert_cmpuint(n_modified, ==, 1);
+	g_assert_cmpuint(n_played_notify, ==, 1);
+	g_assert_cmpuint(n_current_notify, ==, 1);
+	g_assert_cmpuint(g_node_n_children(root->gnode), ==, 21);
+	g_assert_true(i7_skein_get_current_node(skein) == root);
+	g_assert_true(i7_skein_get_played_node(skein) == root);
+	g_assert_nonnull(i7_node_find_child(root, "command 4"));
+	g_assert_null(i7_node_find_child(root, "command 0"));
+	g_assert_nonnull(i7_node_find_child(root, "command 3"));
+	g_assert_nonnull(i7_node_find_child(root, "command 2"));
+	g_assert_null(i7_node_find_child(root, "command 1"));
+
+	/* Fewer distinct scores than asked for: everything scored above 0 stays */
+	n_layouts = n_modified = 0;
+	g_assert_cmpuint(i7_skein_trim(skein, root, 10), ==, 0);
+	g_assert_cmpuint(n_layouts, ==, 0);
+	g_assert_cmpuint(n_modified, ==, 0);
+	g_assert_cmpuint(g_node_n_children(root->gnode), ==, 21);
+
+	g_object_unref(skein);
+}
+
+typedef struct {
+	unsigned position, removed, added;
+} LabelsChange;
+
+static void
+record_labels_change(I7Skein *skein, unsigned position, unsigned removed, unsigned added, LabelsChange *change)
+{
+	change->position = position;
+	change->removed = removed;
+	change->added = added;
+}
+
+static void
+assert_labels(I7Skein *skein, const char * const *expected)
+{
+	unsigned ix;
+	for(ix = 0; expected[ix]; ix++)
+		g_assert_cmpstr(i7_skein_get_label(skein, ix)->label, ==, expected[ix]);
+	g_assert_cmpuint(i7_skein_get_n_labels(skein), ==, ix);
+}
+
+void
+test_skein_labels(void)
+{
+	I7Skein *skein = i7_skein_new();
+	I7Node *root = i7_skein_get_root_node(skein);
+	g_assert_false(i7_skein_has_labels(skein));
+
+	I7Node *look = i7_skein_new_command(skein, "look");
+	I7Node *north = i7_skein_new_command(skein, "north");
+	i7_skein_reset(skein, TRUE);
+	I7Node *wait = i7_skein_new_command(skein, "wait");
+
+	LabelsChange change = { 0, 0, 0 };
+	g_signal_connect(skein, "labels-changed", G_CALLBACK(record_labels_change), &change);
+
+	i7_node_set_label(north, "Moved");
+	g_assert_true(i7_skein_has_labels(skein));
+	g_assert_cmpuint(change.position, ==, 0);
+	g_assert_cmpuint(change.added, ==, 1);
+
+	i7_node_set_label(wait, "Zzz");
+	g_assert_cmpuint(change.position, ==, 1);
+	i7_node_set_label(look, "Beginning");
+	g_assert_cmpuint(change.position, ==, 0);
+	assert_labels(skein, (const char *[]){ "Beginning", "Moved", "Zzz", NULL });
+	g_assert_true(i7_skein_get_label(skein, 1)->node == north);
+
+	/* Relabelling moves the knot in the index */
+	i7_node_set_label(wait, "Asleep");
+	g_assert_cmpuint(change.position, ==, 0);
+	g_assert_cmpuint(change.removed, ==, 0);
+	g_assert_cmpuint(change.added, ==, 1);
+	assert_labels(skein, (const char *[]){ "Asleep", "Beginning", "Moved", NULL });
+
+	/* Removing a knot takes the labels below it out of the index too */
+	i7_skein_remove_all(skein, look);
+	assert_labels(skein, (const char *[]){ "Asleep", NULL });
+
+	/* The root is never labelled */
+	i7_node_set_label(root, "Root");
+	assert_labels(skein, (const char *[]){ "Asleep", NULL });
+
+	i7_node_set_label(wait, "");
+	g_assert_cmpuint(change.position, ==, 0);
+	g_assert_cmpuint(change.removed, ==, 1);
+	g_assert_cmpuint(change.added, ==, 0);
+	g_assert_false(i7_skein_has_labels(skein));
+
+	g_object_unref(skein);
+}
+
+typedef struct {
+	unsigned n_changes;
+	unsigned position, removed, added;
+} ItemsChanged;
+
+static void
+record_items_changed(GListModel *model, unsigned position, unsigned removed, unsigned added, ItemsChanged *change)
+{
+	change->n_changes++;
+	change->position = position;
+	change->removed = removed;
+	change->added = added;
+}
+
+static void
+record_show_node(I7Skein *skein, I7SkeinShowNodeReason why, I7Node *node, I7Node **shown)
+{
+	*shown = node;
+}
+
+void
+test_skein_transaction(void)
+{
+	I7Skein *skein = i7_skein_new();
+	i7_skein_new_command(skein, "look");
+
+	unsigned n_layouts = 0, n_modified = 0;
+	ItemsChanged change = { 0, 0, 0, 0 };
+	I7Node *shown = NULL;
+	g_signal_connect(skein, "needs-layout", G_CALLBACK(count_emissions), &n_layouts);
+	g_signal_connect(skein, "modified", G_CALLBACK(count_emissions), &n_modified);
+	g_signal_connect(skein, "items-changed", G_CALLBACK(record_items_changed), &change);
+	g_signal_connect(skein, "show-node", G_CALLBACK(record_show_node), &shown);
+
+	i7_skein_begin_transaction(skein);
+	i7_skein_new_command(skein, "north");
+	i7_skein_begin_transaction(skein); /* nested */
+	i7_skein_new_command(skein, "take lamp");
+	i7_skein_end_transaction(skein);
+	I7Node *last = i7_skein_new_command(skein, "south");
+	i7_skein_bless(skein, last, TRUE);
+
+	/* The thread is up to date inside the transaction, but nothing is emitted */
+	g_assert_true(i7_skein_is_node_in_current_thread(skein, last));
+	g_assert_cmpuint(n_layouts, ==, 0);
+	g_assert_cmpuint(n_modified, ==, 0);
+	g_assert_cmpuint(change.n_changes, ==, 0);
+	g_assert_null(shown);
+
+	i7_skein_end_transaction(skein);
+	g_assert_cmpuint(n_layouts, ==, 1);
+	g_assert_cmpuint(n_modified, ==, 1);
+	g_assert_true(shown == last);
+
+	/* One change, covering only the new part of the thread */
+	g_assert_cmpuint(change.n_changes, ==, 1);
+	g_assert_cmpuint(change.position, ==, 2);
+	g_assert_cmpuint(change.removed, ==, 0);
+	g_assert_cmpuint(change.added, ==, 3);
+	g_assert_cmpuint(g_list_model_get_n_items(G_LIST_MODEL(skein)), ==, 5);
+
+	/* A transaction that changes nothing emits nothing */
+	i7_skein_begin_transaction(skein);
+	i7_skein_end_transaction(skein);
+	g_assert_cmpuint(n_layouts, ==, 1);
+	g_assert_cmpuint(n_modified, ==, 1);
+	g_assert_cmpuint(change.n_changes, ==, 1);
+
+	g_object_unref(skein);
+}
@@ -8,4 +8,27 @@
 #include <glib.h>
 #include <skein.h>
 
+void write_synthetic_skein_with_parents(GFile *file, unsigned n_knots, const unsigned *parents, GRand *rand);
+
 void test_skein_import(void);
+void test_skein_load(void);
+void test_skein_load_bad_format(void);
+void test_skein_load_perf(void);
+void test_skein_layout(void);
+void test_skein_thread_model(void);
+void test_skein_commands_to_node(void);
+void test_skein_commands_to_node_perf(void);
+void test_skein_find_child(void);
+void test_skein_string_pool(void);
+void test_skein_match_type(void);
+void test_skein_background_diffs(void);
+void test_skein_save(void);
+void test_skein_save_perf(void);
+void test_skein_cache(void);
+void test_skein_cache_perf(void);
+void test_skein_replay_plan(void);
+void test_skein_replay_lines(void);
+void test_skein_played_node(void);
+void test_skein_trim(void);
+void test_skein_labels(void);
+void test_skein_transaction(void);
@@ -7,6 +7,7 @@
 
 #include <glib.h>
 
+#include "document.h"
 #include "story.h"
 
 static gboolean
@@ -118,3 +119,166 @@ test_story_renames_materials_file(void)
 
 	g_assert(g_file_delete(materials_file, NULL, NULL));
 }
+
+static void
+dump_headings(GtkTreeModel *model, GtkTreeIter *parent, GString *dump)
+{
+	GtkTreeIter iter;
+	if(!gtk_tree_model_iter_children(model, &iter, parent))
+		return;
+	do {
+		g_autofree char *title = NULL;
+		unsigned line;
+		gtk_tree_model_get(model, &iter, I7_HEADINGS_TITLE, &title, I7_HEADINGS_LINE, &line, -1);
+		g_string_append_printf(dump, "%s:%u(", title, line);
+		dump_headings(model, &iter, dump);
+		g_string_append(dump, ")");
+	} while(gtk_tree_model_iter_next(model, &iter));
+}
+
+static char *
+get_headings_dump(I7Document *document)
+{
+	GString *dump = g_string_new("");
+	dump_headings(i7_document_get_headings(document), NULL, dump);
+	return g_string_free(dump, FALSE);
+}
+
+static void
+check_headings_match_full_reindex(I7Document *document)
+{
+	i7_document_update_headings(document);
+	g_autofree char *incremental = get_headings_dump(document);
+	i7_document_reindex_headings(document);
+	g_autofree char *full = get_headings_dump(document);
+	g_assert_cmpstr(incremental, ==, full);
+}
+
+void
+test_story_incremental_headings(void)
+{
+	g_autoptr(I7App) theapp = i7_app_new();
+
+	const char *filename = g_test_get_filename(G_TEST_DIST, "tests", "The Arrow of Time.inform", NULL);
+	g_autoptr(GFile) story_file = g_file_new_for_path(filename);
+	I7Document *document = I7_DOCUMENT(i7_story_new(theapp, story_file,
+		"The Arrow of Time", "Eduard Blutig"));
+	GtkTextBuffer *buffer = GTK_TEXT_BUFFER(i7_document_get_buffer(document));
+
+	i7_document_set_source_text(document, "\"The Arrow of Time\" by Eduard Blutig\n"
+		"\n"
+		"Part 1 - Beginning\n"
+		"\n"
+		"Chapter 1 - Setup\n"
+		"\n"
+		"The Lab is a room.\n"
+		"\n"
+		"Section 1 - Props\n"
+		"\n"
+		"Chapter 2 - Endings\n"
+		"\n"
+		"Section 2 - Credits\n"
+		"\n"
+		"Test me with \"z\".\n");
+	i7_document_reindex_headings(document);
+
+	GtkTextIter iter;
+	/* Typing in a heading only changes that row */
+	gtk_text_buffer_get_iter_at_line_offset(buffer, &iter, 8, 17);
+	gtk_text_buffer_insert(buffer, &iter, " and Scenery", -1);
+	check_headings_match_full_reindex(document);
+
+	/* Adding lines shifts the headings after them */
+	gtk_text_buffer_get_iter_at_line(buffer, &iter, 6);
+	gtk_text_buffer_insert(buffer, &iter, "The Closet is a room.\n\n", -1);
+	check_headings_match_full_reindex(document);
+
+	/* A new heading changes the parents of the ones after it */
+	gtk_text_buffer_get_iter_at_line(buffer, &iter, 2);
+	gtk_text_buffer_insert(buffer, &iter, "Volume 1 - Everything\n\n", -1);
+	gtk_text_buffer_get_iter_at_line(buffer, &iter, 12);
+	gtk_text_buffer_insert(buffer, &iter, "Book 2 - Middle\n\n", -1);
+	check_headings_match_full_reindex(document);
+
+	/* Deleting the blank line after a heading unmakes it */
+	GtkTextIter end;
+	gtk_text_buffer_get_iter_at_line(buffer, &iter, 3);
+	gtk_text_buffer_get_iter_at_line(buffer, &end, 4);
+	gtk_text_buffer_delete(buffer, &iter, &end);
+	check_headings_match_full_reindex(document);
+
+	/* Editing the title */
+	gtk_text_buffer_get_start_iter(buffer, &iter);
+	gtk_text_buffer_get_iter_at_line_offset(buffer, &end, 0, 5);
+	gtk_text_buffer_delete(buffer, &iter, &end);
+	check_headings_match_full_reindex(document);
+}
+
+static void
+place_cursor_at_line(I7Document *document, int line)
+{
+	GtkTextBuffer *buffer = GTK_TEXT_BUFFER(i7_document_get_buffer(document));
+	GtkTextIter iter;
+	gtk_text_buffer_get_iter_at_line(buffer, &iter, line);
+	gtk_text_buffer_place_cursor(buffer, &iter);
+}
+
+static void
+assert_path(GtkTreePath *path, const char *expected)
+{
+	g_autofree char *actual = gtk_tree_path_to_string(path);
+	g_assert_cmpstr(actual, ==, expected);
+	gtk_tree_path_free(path);
+}
+
+void
+test_story_heading_navigation(void)
+{
+	g_autoptr(I7App) theapp = i7_app_new();
+
+	const char *filename = g_test_get_filename(G_TEST_DIST, "tests", "The Arrow of Time.inform", NULL);
+	g_autoptr(GFile) story_file = g_file_new_for_path(filename);
+	I7Document *document = I7_DOCUMENT(i7_story_new(theapp, story_file,
+		"The Arrow of Time", "Eduard Blutig"));
+
+	i7_document_set_source_text(document, "\"The Arrow of Time\" by Eduard Blutig\n"
+		"\n"
+		"Part 1 - Beginning\n"
+		"\n"
+		"Chapter 1 - Setup\n"
+		"\n"
+		"The Lab is a room.\n"
+		"\n"
+		"Section 1 - Props\n"
+		"\n"
+		"Chapter 2 - Endings\n"
+		"\n"
+		"Section 2 - Credits\n"
+		"\n"
+		"Test me with \"z\".\n");
+	i7_document_reindex_headings(document);
+
+	place_cursor_at_line(document, 0);
+	assert_path(i7_document_get_deepest_heading(document), "0");
+	place_cursor_at_line(document, 6);
+	assert_path(i7_document_get_deepest_heading(document), "0:0:0");
+	place_cursor_at_line(document, 14);
+	assert_path(i7_document_get_deepest_heading(document), "0:0:1:0");
+
+	i7_document_show_heading(document, gtk_tree_path_new_from_string("0:0"));
+	place_cursor_at_line(document, 1);
+	assert_path(i7_document_get_deeper_heading(document), "0:0");
+	place_cursor_at_line(document, 9);
+	assert_path(i7_document_get_deeper_heading(document), "0:0:0");
+	place_cursor_at_line(document, 14);
+	assert_path(i7_document_get_deeper_heading(document), "0:0:1");
+
+	/* Headings typed since the last update count too */
+	GtkTextBuffer *buffer = GTK_TEXT_BUFFER(i7_document_get_buffer(document));
+	GtkTextIter end;
+	gtk_text_buffer_get_end_iter(buffer, &end);
+	gtk_text_buffer_insert(buffer, &end, "\nChapter 3 - Extras\n\nThe Vault is a room.\n", -1);
+	place_cursor_at_line(document, 18);
+	assert_path(i7_document_get_deeper_heading(document), "0:0:2");
+	assert_path(i7_document_get_deepest_heading(document), "0:0:2");
+}
@@ -14,3 +14,5 @@ void test_files_are_not_siblings(void);
 void test_story_materials_file(void);
 void test_story_old_materials_file(void);
 void test_story_renames_materials_file(void);
+void test_story_incremental_headings(void);
+void test_story_heading_navigation(void);
@@ -14,6 +14,9 @@
 #include "story-test.h"
 
 void add_blob_tests(void);
+void add_doc_index_tests(void);
+void add_elastic_tests(void);
+void add_skein_benchmarks(void);
 
 int
 main(int argc, char **argv)
@@ -34,14 +37,44 @@ main(int argc, char **argv)
 	g_test_add_func("/diffs/same", test_diffs_same);
 	g_test_add_func("/diffs/whitespace", test_diffs_whitespace);
 	g_test_add_func("/diffs/different", test_diffs_different);
+	g_test_add_func("/diffs/escape", test_diffs_escape);
+	g_test_add_func("/diffs/perf", test_diffs_perf);
+
+	add_doc_index_tests();
+
+	add_elastic_tests();
 
 	g_test_add_func("/skein/import", test_skein_import);
+	g_test_add_func("/skein/load", test_skein_load);
+	g_test_add_func("/skein/load/bad-format", test_skein_load_bad_format);
+	g_test_add_func("/skein/load/perf", test_skein_load_perf);
+	g_test_add_func("/skein/layout", test_skein_layout);
+	g_test_add_func("/skein/thread-model", test_skein_thread_model);
+	g_test_add_func("/skein/commands-to-node", test_skein_commands_to_node);
+	g_test_add_func("/skein/commands-to-node/perf", test_skein_commands_to_node_perf);
+	g_test_add_func("/skein/find-child", test_skein_find_child);
+	g_test_add_func("/skein/string-pool", test_skein_string_pool);
+	g_test_add_func("/skein/match-type", test_skein_match_type);
+	g_test_add_func("/skein/background-diffs", test_skein_background_diffs);
+	g_test_add_func("/skein/save", test_skein_save);
+	g_test_add_func("/skein/save/perf", test_skein_save_perf);
+	g_test_add_func("/skein/cache", test_skein_cache);
+	g_test_add_func("/skein/cache/perf", test_skein_cache_perf);
+	g_test_add_func("/skein/replay-plan", test_skein_replay_plan);
+	g_test_add_func("/skein/replay-lines", test_skein_replay_lines);
+	g_test_add_func("/skein/played-node", test_skein_played_node);
+	g_test_add_func("/skein/trim", test_skein_trim);
+	g_test_add_func("/skein/labels", test_skein_labels);
+	g_test_add_func("/skein/transaction", test_skein_transaction);
+	add_skein_benchmarks();
 
 	g_test_add_func("/story/util/files-are-siblings", test_files_are_siblings);
 	g_test_add_func("/story/util/files-are-not-siblings", test_files_are_not_siblings);
 	g_test_add_func("/story/materials-file", test_story_materials_file);
 	g_test_add_func("/story/old-materials-file", test_story_old_materials_file);
 	g_test_add_func("/story/renames-materials-file", test_story_renames_materials_file);
+	g_test_add_func("/story/incremental-headings", test_story_incremental_headings);
+	g_test_add_func("/story/heading-navigation", test_story_heading_navigation);
 
 	int retval = g_test_run();
 
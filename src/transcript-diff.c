@@ -5,129 +5,278 @@
 
 #include "config.h"
 
-#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 
 #include <glib.h>
 
-/* Prerequisites for including Gnulib's diffseq algorithm */
+/* A word in a string, as found by next_word() */
+typedef struct {
+	unsigned offset; /* Position of the word in the string */
+	unsigned length;
+	guint32 hash;
+} Word;
+
+/* Prerequisites for including Gnulib's diffseq algorithm. The elements are
+ words, compared by hash first, so most comparisons are integer compares. */
 #include <limits.h>   // IWYU pragma: keep
 #include <stdbool.h>  // IWYU pragma: keep
-#define ELEMENT char *
-#define EQUAL(a,b) (strcmp((a), (b)) == 0)
+#define XVECREF_YVECREF_EQUAL(ctxt,xoff,yoff) \
+	words_equal((ctxt)->expected, (ctxt)->expected_words + (xoff), \
+		(ctxt)->actual, (ctxt)->actual_words + (yoff))
 #define OFFSET ssize_t
 #define EXTRA_CONTEXT_FIELDS \
-	GList *expected_diffs; \
-	GList *actual_diffs;
+	const char *expected; \
+	const char *actual; \
+	const Word *expected_words; \
+	const Word *actual_words; \
+	GArray *expected_diffs; \
+	GArray *actual_diffs;
 #define NOTE_DELETE(ctxt,xoff) \
 	G_STMT_START { \
-		if(*(xv[(xoff)]) != '\0') { \
-			(ctxt)->expected_diffs = g_list_prepend((ctxt)->expected_diffs, GSIZE_TO_POINTER((xoff))); \
-		} \
+		unsigned index = (xoff); \
+		g_array_append_val((ctxt)->expected_diffs, index); \
 	} G_STMT_END
 #define NOTE_INSERT(ctxt,yoff) \
 	G_STMT_START { \
-		if(*(yv[(yoff)]) != '\0') { \
-			(ctxt)->actual_diffs = g_list_prepend((ctxt)->actual_diffs, GSIZE_TO_POINTER((yoff))); \
-		} \
+		unsigned index = (yoff); \
+		g_array_append_val((ctxt)->actual_diffs, index); \
 	} G_STMT_END
 #define USE_HEURISTIC
 #define lint /* To suppress GCC warnings */
 
+static inline bool
+words_equal(const char *string1, const Word *word1, const char *string2, const Word *word2)
+{
+	return word1->hash == word2->hash && word1->length == word2->length
+		&& memcmp(string1 + word1->offset, string2 + word2->offset, word1->length) == 0;
+}
+
 #include "diffseq.h"
 
+static inline gboolean
+is_word_separator(char c)
+{
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+/* Finds the next word in @string starting at *@pos. Returns FALSE if there are
+ no more words. Otherwise, fills in @word and moves *@pos to the end of the
+ word. Doesn't allocate anything. */
+static inline gboolean
+next_word(const char *string, size_t *pos, Word *word)
+{
+	const char *start = string + *pos;
+	while(is_word_separator(*start))
+		start++;
+	if(*start == '\0')
+		return FALSE;
+
+	/* FNV-1a hash of the word, calculated while looking for its end */
+	guint32 hash = 2166136261u;
+	const char *end;
+	for(end = start; *end != '\0' && !is_word_separator(*end); end++) {
+		hash ^= (unsigned char)*end;
+		hash *= 16777619u;
+	}
+
+	word->offset = start - string;
+	word->length = end - start;
+	word->hash = hash;
+	*pos = end - string;
+	return TRUE;
+}
+
+/* Splits @string into words, without copying them */
+static GArray *
+split_words(const char *string)
+{
+	GArray *words = g_array_sized_new(FALSE, FALSE, sizeof(Word), strlen(string) / 6 + 1);
+	size_t pos = 0;
+	Word word;
+	while(next_word(string, &pos, &word))
+		g_array_append_val(words, word);
+	return words;
+}
+
+/*
+ * same_words:
+ * Returns TRUE if @a and @b consist of the same words, only separated by
+ * different whitespace; that is, if word_diff() would find no differing words.
+ * Doesn't allocate anything.
+ */
+gboolean
+same_words(const char *a, const char *b)
+{
+	size_t pos_a = 0, pos_b = 0;
+	Word word_a, word_b;
+
+	while(TRUE) {
+		gboolean more_a = next_word(a, &pos_a, &word_a);
+		gboolean more_b = next_word(b, &pos_b, &word_b);
+		if(!more_a || !more_b)
+			return more_a == more_b;
+		if(!words_equal(a, &word_a, b, &word_b))
+			return FALSE;
+	}
+}
+
 /*
  * word_diff:
  * Compares strings @expected and @actual for approximate equality. Returns TRUE
  * if they are _exactly_ equal, FALSE if not. @expected_diffs and @actual_diffs
- * are the return locations for lists of word indices that are different in
- * @expected and @actual. The indices are stored using GSIZE_TO_POINTER().
- * If the function returns FALSE but NULL (the empty list) is returned in
- * @expected_diffs and @actual_diffs, then all the words are the same and
- * therefore the strings only differ by whitespace.
- * You should free the lists when done.
+ * are the return locations for arrays of the (unsigned) indices of the words
+ * that are different in @expected and @actual, in increasing order. A word is
+ * a run of characters other than spaces, tabs, and newlines.
+ * If the function returns FALSE but NULL is returned in @expected_diffs and
+ * @actual_diffs, then all the words are the same and therefore the strings
+ * only differ by whitespace.
+ * You should free the arrays with g_array_unref() when done.
  */
 gboolean
-word_diff(const char *expected, const char *actual, GList **expected_diffs, GList **actual_diffs)
+word_diff(const char *expected, const char *actual, GArray **expected_diffs, GArray **actual_diffs)
 {
+	*expected_diffs = NULL;
+	*actual_diffs = NULL;
+
 	/* If strings are exactly the same, we have our answer */
 	if(strcmp(expected, actual) == 0)
 		return TRUE;
 
-	char **expected_words = g_strsplit_set(expected, " \n\r\t", -1);
-	char **actual_words = g_strsplit_set(actual, " \n\r\t", -1);
-	ssize_t expected_limit = 0;
-	ssize_t actual_limit = 0;
-	ssize_t *work_buffer;
-	struct context ctxt;
-	char **iter;
-
-	/* Find lengths of word vectors */
-	for(iter = expected_words; *iter; iter++)
-		expected_limit++;
-	for(iter = actual_words; *iter; iter++)
-		actual_limit++;
+	GArray *expected_words = split_words(expected);
+	GArray *actual_words = split_words(actual);
+	ssize_t expected_limit = expected_words->len;
+	ssize_t actual_limit = actual_words->len;
 
 	/* Allocate a work buffer */
-	work_buffer = g_new0(ssize_t, 2 * (expected_limit + actual_limit + 3));
+	ssize_t *work_buffer = g_new0(ssize_t, 2 * (expected_limit + actual_limit + 3));
 
 	/* Call the Gnulib diff algorithm */
-	ctxt.xvec = expected_words; /* char * const * */
-	ctxt.yvec = actual_words;
+	struct context ctxt;
+	ctxt.expected = expected;
+	ctxt.actual = actual;
+	ctxt.expected_words = (const Word *)expected_words->data;
+	ctxt.actual_words = (const Word *)actual_words->data;
 	ctxt.fdiag = work_buffer + actual_limit + 1;
 	ctxt.bdiag = ctxt.fdiag + expected_limit + actual_limit + 3;
-	ctxt.expected_diffs = *expected_diffs;
-	ctxt.actual_diffs = *actual_diffs;
+	ctxt.expected_diffs = g_array_new(FALSE, FALSE, sizeof(unsigned));
+	ctxt.actual_diffs = g_array_new(FALSE, FALSE, sizeof(unsigned));
 	ctxt.heuristic = TRUE;
 	compareseq(0, expected_limit, 0, actual_limit, &ctxt);
 
-	g_strfreev(expected_words);
-	g_strfreev(actual_words);
+	g_array_unref(expected_words);
+	g_array_unref(actual_words);
 	g_free(work_buffer);
 
-	*expected_diffs = g_list_reverse(ctxt.expected_diffs);
-	*actual_diffs = g_list_reverse(ctxt.actual_diffs);
+	if(ctxt.expected_diffs->len > 0)
+		*expected_diffs = ctxt.expected_diffs;
+	else
+		g_array_unref(ctxt.expected_diffs);
+	if(ctxt.actual_diffs->len > 0)
+		*actual_diffs = ctxt.actual_diffs;
+	else
+		g_array_unref(ctxt.actual_diffs);
 
 	return FALSE;
 }
 
+/*
+ * append_markup_escaped:
+ * @result: string to append to
+ * @text: UTF-8 text
+ * @length: length of @text in bytes, or -1 if nul-terminated
+ *
+ * Appends @text to @result, escaped for XML or Pango markup in the same way as
+ * g_markup_escape_text(), but without allocating a new string.
+ */
+void
+append_markup_escaped(GString *result, const char *text, gssize length)
+{
+	const char *end = length < 0? text + strlen(text) : text + length;
+	const char *p, *run = text;
+
+	for(p = text; p < end; p++) {
+		unsigned char c = *p;
+		const char *entity;
+
+		switch(c) {
+			case '&':
+				entity = "&amp;";
+				break;
+			case '<':
+				entity = "&lt;";
+				break;
+			case '>':
+				entity = "&gt;";
+				break;
+			case '\'':
+				entity = "&apos;";
+				break;
+			case '"':
+				entity = "&quot;";
+				break;
+			default:
+				/* Control characters are written as character references;
+				 U+0080 to U+009F are encoded as 0xC2 followed by 0x80 to 0x9F,
+				 of which U+0085 (next line) is left alone */
+				if((c < 0x20 && c != '\t' && c != '\n' && c != '\r') || c == 0x7f) {
+					g_string_append_len(result, run, p - run);
+					g_string_append_printf(result, "&#x%x;", c);
+					run = p + 1;
+				} else if(c == 0xc2 && p + 1 < end && (unsigned char)p[1] >= 0x80 &&
+					(unsigned char)p[1] <= 0x9f && (unsigned char)p[1] != 0x85) {
+					g_string_append_len(result, run, p - run);
+					g_string_append_printf(result, "&#x%x;", (unsigned char)p[1]);
+					run = ++p + 1;
+				}
+				continue;
+		}
+
+		g_string_append_len(result, run, p - run);
+		g_string_append(result, entity);
+		run = p + 1;
+	}
+	g_string_append_len(result, run, p - run);
+}
+
+/*
+ * make_pango_markup_string:
+ * Returns @string as Pango markup, with the words whose indices are in @diffs
+ * (as returned from word_diff()) underlined. Free the result when done.
+ */
 char *
-make_pango_markup_string(const char *string, GList *diffs)
+make_pango_markup_string(const char *string, GArray *diffs)
 {
-	if(diffs == NULL)
-		return g_strdup(string);
+	GString *result = g_string_sized_new(strlen(string) + (diffs? 8 * diffs->len : 0));
+	if(diffs == NULL) {
+		append_markup_escaped(result, string, -1);
+		return g_string_free(result, FALSE);
+	}
 
-	char **words = g_strsplit_set(string, " \n\r\t", -1);
-	char **word;
-	ssize_t count;
-	GString *result = g_string_new("");
+	size_t pos = 0, copied = 0;
+	unsigned count = 0, next_diff = 0;
+	Word word;
 
-	for(word = words, count = 0; *word; word++, count++) {
+	while(next_word(string, &pos, &word)) {
 		/* Copy whitespace */
-		while(isspace(*string))
-			g_string_append_c(result, *string++);
-
-		char *escaped_word = g_markup_escape_text(*word, -1);
+		append_markup_escaped(result, string + copied, word.offset - copied);
 
-		if(diffs && count == (ssize_t)(GPOINTER_TO_SIZE(diffs->data))) {
-			diffs = g_list_next(diffs);
-			g_string_append_printf(result, "<u>%s</u>", escaped_word);
+		if(next_diff < diffs->len && count == g_array_index(diffs, unsigned, next_diff)) {
+			next_diff++;
+			g_string_append(result, "<u>");
+			append_markup_escaped(result, string + word.offset, word.length);
+			g_string_append(result, "</u>");
 		} else {
-			g_string_append(result, escaped_word);
+			append_markup_escaped(result, string + word.offset, word.length);
 		}
 
-		g_free(escaped_word);
-
-		string += strlen(*word);
+		copied = pos;
+		count++;
 	}
 
-	g_strfreev(words);
-
 	/* Copy final whitespace */
-	while(isspace(*string))
-		g_string_append_c(result, *string++);
+	append_markup_escaped(result, string + copied, -1);
 
 	return g_string_free(result, FALSE); /* return C-string */
-}
\ No newline at end of file
+}
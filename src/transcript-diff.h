@@ -9,5 +9,7 @@
 
 #include <glib.h>
 
-gboolean word_diff(const char *expected, const char *actual, GList **expected_diffs, GList **actual_diffs);
-char *make_pango_markup_string(const char *string, GList *diffs);
+gboolean same_words(const char *a, const char *b);
+gboolean word_diff(const char *expected, const char *actual, GArray **expected_diffs, GArray **actual_diffs);
+char *make_pango_markup_string(const char *string, GArray *diffs);
+void append_markup_escaped(GString *result, const char *text, gssize length);
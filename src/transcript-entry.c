@@ -31,6 +31,7 @@ struct _I7TranscriptEntry {
 	unsigned long on_skein_notify_current_node_handler;
 	unsigned long on_node_notify_transcript_text_handler;
 	unsigned long on_node_notify_expected_text_handler;
+	unsigned long on_node_notify_diffs_calculated_handler;
 };
 
 G_DEFINE_TYPE(I7TranscriptEntry, i7_transcript_entry, GTK_TYPE_GRID)
@@ -43,11 +44,19 @@ enum  {
 static void
 update_text(I7TranscriptEntry *self)
 {
-	const char *transcript = i7_node_get_transcript_pango_string(self->node);
-	gtk_label_set_markup(self->transcript_label, transcript);
+	if (i7_node_get_diffs_calculated(self->node)) {
+		const char *transcript = i7_node_get_transcript_pango_string(self->node);
+		gtk_label_set_markup(self->transcript_label, transcript);
 
-	const char *expected = i7_node_get_expected_pango_string(self->node);
-	gtk_label_set_markup(self->expected_label, expected);
+		const char *expected = i7_node_get_expected_pango_string(self->node);
+		gtk_label_set_markup(self->expected_label, expected);
+	} else {
+		/* Show the plain text until the differences arrive from the
+		 background; this is called again then */
+		gtk_label_set_text(self->transcript_label, i7_node_peek_transcript_text(self->node));
+		gtk_label_set_text(self->expected_label, i7_node_peek_expected_text(self->node));
+		i7_skein_queue_diffs(self->skein, self->node);
+	}
 
 	GtkStyleContext *style = gtk_widget_get_style_context(GTK_WIDGET(self->transcript_label));
 	if (i7_node_get_changed(self->node)) {
@@ -118,6 +127,8 @@ set_node(I7TranscriptEntry *self, I7Node *node)
 		g_signal_connect_swapped(node, "notify::transcript-text", G_CALLBACK(update_text), self);
 	self->on_node_notify_expected_text_handler =
 		g_signal_connect_swapped(node, "notify::expected-text", G_CALLBACK(update_text), self);
+	self->on_node_notify_diffs_calculated_handler =
+		g_signal_connect_swapped(node, "notify::diffs-calculated", G_CALLBACK(update_text), self);
 
 	update_text(self);
 
@@ -191,6 +202,7 @@ i7_transcript_entry_dispose(GObject *object)
 	g_clear_signal_handler(&self->on_skein_notify_current_node_handler, self->skein);
 	g_clear_signal_handler(&self->on_node_notify_transcript_text_handler, self->node);
 	g_clear_signal_handler(&self->on_node_notify_expected_text_handler, self->node);
+	g_clear_signal_handler(&self->on_node_notify_diffs_calculated_handler, self->node);
 
 	g_clear_object(&self->command_text_binding);
 	g_clear_object(&self->node);